@@ -4,24 +4,66 @@
  * A minimal JSON-based command-line database utility in C.
  * 
  * To compile (assuming cJSON is installed via "sudo apt install libcjson-dev"):
- *     gcc -Wall -o simpledb simpledb.c -I/usr/include/cjson -lcjson
+ *     gcc -Wall -pthread -o simpledb simpledb.c -I/usr/include/cjson -lcjson
  *
  * Usage:
- *     ./simpledb --db-path <PATH> list <table>
- *     ./simpledb --db-path <PATH> get <table> field=value
+ *     ./simpledb --db-path <PATH> list <table> [--id-range LO..HI] [--fields f1,f2,...]
+ *     ./simpledb --db-path <PATH> get <table> field=value [--fields f1,f2,...]
+ *     ./simpledb --db-path <PATH> get <table> <field><op><value>... (op: < <= > >= ^=)
+ *     ./simpledb --db-path <PATH> get <table> <field> between <lo> <hi>
  *     ./simpledb --db-path <PATH> save <table> field1=value1 field2=value2 ...
+ *     ./simpledb --db-path <PATH> save <table> --from-stdin < records.jsonl
+ *     ./simpledb --db-path <PATH> save <table> --reserve N
  *     ./simpledb --db-path <PATH> delete <table> field=value
+ *     ./simpledb --db-path <PATH> create <table> [--format json|compressed|paged|lsm]
+ *     ./simpledb --db-path <PATH> import <table> <file.json|file.csv>
+ *     ./simpledb --db-path <PATH> export <table> [--format json|csv]
+ *     ./simpledb --db-path <PATH> join <left> <right> <left>.<f>=<right>.<f> [--memory <SIZE>]
+ *     ./simpledb --db-path <PATH> agg <table> [--group-by <f>] [--count] [--sum|--min|--max <f>]...
+ *     ./simpledb --db-path <PATH> compact <table> --columnar|--compressed|--plain
+ *     ./simpledb --db-path <PATH> vacuum <table>
+ *     ./simpledb --db-path <PATH> checkpoint
+ *     ./simpledb --db-path <PATH> index create|drop <table> <field> [--ordered]
+ *     ./simpledb serve --db-path <PATH> --socket <SOCKET>
+ *     ./simpledb --socket <SOCKET> <command> ...
+ *
+ * Options:
+ *     --threads N        scan tables for list, get, delete and agg on N threads
+ *     --socket SOCKET    send the command to a server started with 'serve'
+ *     --stats            report cJSON allocations and peak RSS on stderr
+ *     --profile          report time, bytes and allocations per phase on stderr
+ *
+ * A record of a paged table is stored on a single page, so it can be at most
+ * 8156 bytes of JSON.
  *
  ******************************************************************************/
 
+#define _GNU_SOURCE     // F_OFD_SETLK and friends
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>     // strcasecmp
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/stat.h>   // mkdir, etc.
 #include <errno.h>
 #include <unistd.h>     // for rename, close, etc.
 #include <fcntl.h>      // for open
+#include <libgen.h>     // dirname
+#include <dirent.h>     // opendir, to find a table's index files
+#include <stddef.h>     // offsetof
+#include <sys/mman.h>   // mmap, madvise
+#include <pthread.h>    // worker threads for --threads
+#include <signal.h>     // stopping the server cleanly
+#include <sys/socket.h> // server mode over a Unix domain socket
+#include <sys/un.h>
+#include <sys/resource.h> // getrusage, for --stats
+#include <sys/wait.h>   // waitpid, for background compactions
+#include <time.h>       // clock_gettime, for --profile
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // SSE4.2/AVX2 intrinsics for the table scanner
+#endif
 #include "cJSON.h"      // cJSON library header
 
 #define MAX_COMMAND_ARGS 128
@@ -39,16 +81,146 @@ static void print_usage(const char* prog_name) {
         "Usage:\n"
         "  %s --db-path <PATH> COMMAND [ARGS...]\n\n"
         "Commands:\n"
-        "  list <table>\n"
-        "  get <table> field=value\n"
+        "  list <table> [--id-range LO..HI] [--fields <field1,field2,...>]\n"
+        "  get <table> field=value [--fields <field1,field2,...>]\n"
+        "  get <table> <field><op><value>... [--fields ...]  (op: < <= > >= ^=)\n"
+        "  get <table> <field> between <lo> <hi> [--fields ...]\n"
         "  save <table> field1=value1 [field2=value2 ...]\n"
+        "  save <table> --from-stdin\n"
+        "  save <table> --reserve <N>\n"
         "  delete <table> field=value\n"
+        "  create <table> [--format json|compressed|paged|lsm]\n"
+        "  import <table> <file.json|file.csv>\n"
+        "  export <table> [--format json|csv]\n"
+        "  join <left> <right> <left>.<field>=<right>.<field> [--memory <SIZE>]\n"
+        "  agg <table> [--group-by <field>] [--count] [--sum|--min|--max <field>]...\n"
+        "  compact <table> --columnar|--compressed|--plain\n"
+        "  vacuum <table>\n"
+        "  checkpoint\n"
+        "  index create|drop <table> <field> [--ordered]\n"
+        "  serve --db-path <PATH> --socket <SOCKET>\n"
         "\n"
         "Options:\n"
         "  --db-path <PATH>   Required. Path to the database directory.\n"
+        "  --threads <N>      Scan tables for list, get, delete and agg on N threads.\n"
+        "  --socket <SOCKET>  Send the command to a running server instead.\n"
+        "  --stats            Report cJSON allocations and peak memory on stderr.\n"
+        "  --profile          Report time, bytes and allocations per phase on stderr.\n"
+        "\n"
+        "Records of paged tables are limited to 8156 bytes of JSON each.\n"
         "\n", prog_name);
 }
 
+/* --------------------------------------------------------------------------
+ * --profile: where a command's time goes
+ *
+ * The command's thread is timed through the phases below with the
+ * monotonic clock, each phase exclusive of the ones nested in it (a scan's
+ * time leaves out parsing and printing the records it finds), together with
+ * the bytes each phase handled and the cJSON allocations made in it. Work
+ * on scan threads shows up as time the command's thread spent waiting for
+ * it, and a table scanned through a mapping is read as it is scanned, so
+ * under filter. profile_report() puts it all on stderr as one JSON line.
+ * Without --profile 'profile' is NULL, and a phase costs one test of it.
+ * -------------------------------------------------------------------------- */
+typedef enum {
+    PHASE_READ,         // table, index and log bytes off disk, decompressed
+    PHASE_PARSE,        // cJSON_Parse
+    PHASE_FILTER,       // scanning a table's records and matching them
+    PHASE_PRINT,        // cJSON_PrintUnformatted
+    PHASE_WRITE,        // table, index and log writes, with their fsyncs
+    PHASE_COUNT
+} ProfilePhase;
+
+static const char* const phase_names[PHASE_COUNT] = {
+    "read", "parse", "filter", "print", "write"
+};
+
+#define PROFILE_OFF      (-2)   // from profile_enter() when not profiling
+#define PROFILE_NO_PHASE (-1)
+
+typedef struct {
+    uint64_t ns;
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t allocations;
+} PhaseStats;
+
+typedef struct {
+    pthread_t thread;           // the command's; other threads aren't timed
+    int phase;                  // the one being timed, or PROFILE_NO_PHASE
+    uint64_t start_ns;
+    uint64_t start_allocations;
+    uint64_t since_ns;          // when 'phase' was entered or resumed
+    uint64_t since_allocations;
+    PhaseStats phases[PHASE_COUNT];
+} Profile;
+
+static Profile* profile;
+
+static uint64_t arena_thread_allocations(void);
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Charge what was spent since the last switch to the current phase, and
+// move on to 'phase'.
+static void profile_switch(int phase) {
+    uint64_t now = monotonic_ns();
+    uint64_t allocations = arena_thread_allocations();
+    if (profile->phase >= 0) {
+        PhaseStats* s = &profile->phases[profile->phase];
+        s->ns += now - profile->since_ns;
+        s->allocations += allocations - profile->since_allocations;
+    }
+    profile->phase = phase;
+    profile->since_ns = now;
+    profile->since_allocations = allocations;
+}
+
+static void profile_begin(Profile* p) {
+    memset(p, 0, sizeof(*p));
+    p->thread = pthread_self();
+    p->phase = PROFILE_NO_PHASE;
+    p->start_ns = p->since_ns = monotonic_ns();
+    p->start_allocations = p->since_allocations = arena_thread_allocations();
+    profile = p;
+}
+
+// Start timing 'phase'. The result goes to profile_leave(), which goes back
+// to the phase this one interrupted.
+static int profile_enter(ProfilePhase phase) {
+    if (!profile || !pthread_equal(pthread_self(), profile->thread)) return PROFILE_OFF;
+    int interrupted = profile->phase;
+    profile_switch((int)phase);
+    profile->phases[phase].calls++;
+    return interrupted;
+}
+
+static void profile_leave(int interrupted, uint64_t bytes) {
+    if (interrupted == PROFILE_OFF) return;
+    profile->phases[profile->phase].bytes += bytes;
+    profile_switch(interrupted);
+}
+
+// cJSON_ParseWithLength() and cJSON_PrintUnformatted(), as phases.
+static cJSON* json_parse(const char* data, size_t len) {
+    int phase = profile_enter(PHASE_PARSE);
+    cJSON* item = cJSON_ParseWithLength(data, len);
+    profile_leave(phase, len);
+    return item;
+}
+
+static char* json_print(const cJSON* item) {
+    int phase = profile_enter(PHASE_PRINT);
+    char* text = cJSON_PrintUnformatted(item);
+    profile_leave(phase, phase != PROFILE_OFF && text ? strlen(text) : 0);
+    return text;
+}
+
 /* --------------------------------------------------------------------------
  * Utility: Read entire file into a dynamically allocated buffer
  * Returns the pointer to the buffer (caller must free), or NULL on error.
@@ -73,20 +245,56 @@ static char* read_file(const char* filename) {
         return NULL;
     }
 
+    int phase = profile_enter(PHASE_READ);
     size_t read_size = fread(content, 1, file_size, fp);
+    profile_leave(phase, read_size);
     fclose(fp);
     content[read_size] = '\0';  // Null-terminate
     return content;
 }
 
+/* --------------------------------------------------------------------------
+ * Utility: write all of 'data' to 'fd', retrying short writes.
+ * -------------------------------------------------------------------------- */
+static int write_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Utility: fsync the directory containing 'path', so that a rename or file
+ * creation in it survives a crash. Returns 0 on success.
+ * -------------------------------------------------------------------------- */
+static int fsync_parent_dir(const char* path) {
+    char buffer[1024];
+    strncpy(buffer, path, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    int fd = open(dirname(buffer), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
 /* --------------------------------------------------------------------------
  * Utility: Write a temporary file, then rename it to ensure atomic updates.
  * Returns 0 on success, non-zero on error.
  * -------------------------------------------------------------------------- */
 static int write_file_atomic(const char* filename, const char* data) {
-    // Create a temp file name
+    // Create a temp file name, one per process so concurrent writers of
+    // the same file never write into each other's
     char temp_filename[1024];
-    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp.%d", filename, (int)getpid());
 
     // Write data to temp file
     FILE* fp = fopen(temp_filename, "wb");
@@ -94,395 +302,11542 @@ static int write_file_atomic(const char* filename, const char* data) {
         return -1;
     }
     size_t len = strlen(data);
-    if (fwrite(data, 1, len, fp) < len) {
-        fclose(fp);
-        return -1;
-    }
+    int phase = profile_enter(PHASE_WRITE);
+    bool ok = fwrite(data, 1, len, fp) == len;
+    // Make the data durable before it becomes visible under the real name
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
     fclose(fp);
 
     // Atomically rename the temp file to the actual file
-    if (rename(temp_filename, filename) != 0) {
-        return -1;
-    }
-    return 0;
+    ok = ok && rename(temp_filename, filename) == 0 && fsync_parent_dir(filename) == 0;
+    profile_leave(phase, len);
+    return ok ? 0 : -1;
 }
 
 /* --------------------------------------------------------------------------
- * Load the JSON array from <table>.json, or create an empty JSON array if file
- * doesn't exist. Return a cJSON pointer, or NULL on error.
+ * Utility: a small string -> uint64 hash map, used to look records up by id
+ * without rescanning the table for every record of a bulk operation.
  * -------------------------------------------------------------------------- */
-static cJSON* load_table(const char* db_path, const char* table_name) {
-    // Construct the file path: e.g., db_path/users.json
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+typedef struct {
+    char** keys;
+    uint64_t* values;
+    size_t capacity;    // always a power of two
+    size_t count;
+} IdMap;
 
-    char* content = read_file(filepath);
-    cJSON* root = NULL;
+static uint64_t hash_bytes(const char* data, size_t len) {
+    uint64_t h = 1469598103934665603ULL;   // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
 
-    if (content) {
-        // Parse the JSON
-        root = cJSON_Parse(content);
-        free(content);
+static int idmap_init(IdMap* map, size_t expected) {
+    map->capacity = 64;
+    while (map->capacity < expected * 2) {
+        map->capacity <<= 1;
+    }
+    map->count = 0;
+    map->keys = calloc(map->capacity, sizeof(char*));
+    map->values = calloc(map->capacity, sizeof(uint64_t));
+    return (map->keys && map->values) ? 0 : -1;
+}
 
-        // If parse failed or root is not an array, create a new array
-        if (!root || !cJSON_IsArray(root)) {
-            if (root) {
-                cJSON_Delete(root);
-            }
-            root = cJSON_CreateArray();
+static void idmap_free(IdMap* map) {
+    if (map->keys) {
+        for (size_t i = 0; i < map->capacity; i++) {
+            free(map->keys[i]);
         }
-    } else {
-        // File not found or not readable; let's assume it's just empty
-        root = cJSON_CreateArray();
     }
+    free(map->keys);
+    free(map->values);
+    map->keys = NULL;
+    map->values = NULL;
+}
 
-    return root;
+static size_t idmap_slot(const IdMap* map, const char* key) {
+    size_t i = hash_bytes(key, strlen(key)) & (map->capacity - 1);
+    while (map->keys[i] && strcmp(map->keys[i], key) != 0) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    return i;
+}
+
+static bool idmap_get(const IdMap* map, const char* key, uint64_t* value) {
+    size_t i = idmap_slot(map, key);
+    if (!map->keys[i]) return false;
+    if (value) *value = map->values[i];
+    return true;
+}
+
+static int idmap_put(IdMap* map, const char* key, uint64_t value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        IdMap grown;
+        if (idmap_init(&grown, map->capacity) != 0) return -1;
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i]) {
+                size_t j = idmap_slot(&grown, map->keys[i]);
+                grown.keys[j] = map->keys[i];
+                grown.values[j] = map->values[i];
+                grown.count++;
+            }
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+    size_t i = idmap_slot(map, key);
+    if (!map->keys[i]) {
+        map->keys[i] = strdup(key);
+        if (!map->keys[i]) return -1;
+        map->count++;
+    }
+    map->values[i] = value;
+    return 0;
 }
 
 /* --------------------------------------------------------------------------
- * Write the JSON array back to <table>.json (atomically).
+ * Secondary hash indexes: <table>.<field>.idx
+ *
+ * 'index create <table> <field>' builds an on-disk hash table that maps the
+ * string values of one field to the records holding them, so 'get' and
+ * 'delete' on that field read a few index entries instead of the table.
+ *
+ * Layout: a 64-byte header, an array of bucket_count u64 chain heads, then
+ * HashIndexEntry records (each followed by its key bytes) chained through
+ * 'next'. New entries are appended and linked in front of their chain;
+ * removed entries are only marked dead.
+ *
+ * A record is located by a "rowref": its byte offset in <table>.json (with
+ * 'length' holding its size) or its page/slot in <table>.db. Paged tables
+ * update their indexes on every write. A JSON table file only changes when
+ * save_table() rewrites it, which rebuilds the table's indexes and stamps
+ * them with the identity of the new file; an index whose stamp doesn't match
+ * the table file is ignored. Changes not yet checkpointed are merged in from
+ * the WAL at lookup time (see WalOverlay).
+ *
+ * 'index create <table> <field> --ordered' also keeps the entries in key
+ * order, for range and prefix queries (see "Ordered indexes" below).
+ *
+ * Values longer than INDEX_MAX_KEY bytes are left out of the index and only
+ * counted in 'skipped': a lookup of such a value, or a range over an index
+ * that skipped any, is answered by scanning the table instead.
  * -------------------------------------------------------------------------- */
-static int save_table(const char* db_path, const char* table_name, cJSON* root) {
-    if (!root) return -1;
+#define INDEX_MAGIC       "SDBHIDX1"
+#define INDEX_HEADER_SIZE 64
+#define INDEX_MIN_BUCKETS 1024
+#define INDEX_MIN_TAIL    1024
+#define INDEX_MAX_KEY     UINT16_MAX
+
+typedef struct {
+    uint64_t ino;
+    uint64_t size;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+} FileStamp;
+
+typedef struct {
+    char      magic[8];
+    uint32_t  bucket_count;     // always a power of two
+    uint32_t  skipped;          // values too long to index
+    uint64_t  entry_count;      // appended entries, dead ones included
+    FileStamp table;            // JSON tables: the table file indexed
+    uint64_t  order_offset;     // ordered indexes: their key order, 0 for none
+} HashIndexHeader;
+
+typedef struct {
+    uint64_t next;              // file offset of the next entry, 0 ends the chain
+    uint64_t rowref;
+    uint32_t length;
+    uint32_t hash;
+    uint16_t key_len;
+    uint8_t  live;
+    uint8_t  reserved[5];
+} HashIndexEntry;
+
+// At order_offset: 'count' entry offsets sorted by key, then rowref.
+typedef struct {
+    uint64_t count;
+    uint64_t covered;           // entry_count when they were written
+} IndexOrderHeader;
+
+typedef struct {
+    int fd;
+    char field[256];
+    HashIndexHeader header;
+    IndexOrderHeader order;
+} HashIndex;
+
+// Called for every live entry matching a key; a non-zero return stops.
+typedef int (*IndexHitCallback)(uint64_t rowref, uint32_t length, void* ctx);
+
+static void file_stamp_of(const struct stat* st, FileStamp* stamp) {
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime_sec = st->st_mtim.tv_sec;
+    stamp->mtime_nsec = st->st_mtim.tv_nsec;
+}
 
-    char* print_buffer = cJSON_PrintUnformatted(root);
-    if (!print_buffer) {
+static void index_path(const char* db_path, const char* table_name, const char* field,
+                       char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%s.%s.idx", db_path, table_name, field);
+}
+
+// Field names end up in file names, so keep them to something safe.
+static bool valid_index_field(const char* field) {
+    return field[0] != '\0' && strlen(field) < 256 && !strchr(field, '/') && !strchr(field, '.');
+}
+
+static int hash_index_open(const char* db_path, const char* table_name, const char* field,
+                           HashIndex* idx) {
+    char path[1024];
+    index_path(db_path, table_name, field, path, sizeof(path));
+    idx->fd = open(path, O_RDWR);
+    if (idx->fd < 0) return -1;
+    memset(&idx->order, 0, sizeof(idx->order));
+    if (pread(idx->fd, &idx->header, sizeof(idx->header), 0) != (ssize_t)sizeof(idx->header) ||
+        memcmp(idx->header.magic, INDEX_MAGIC, sizeof(idx->header.magic)) != 0 ||
+        (idx->header.order_offset != 0 &&
+         pread(idx->fd, &idx->order, sizeof(idx->order), idx->header.order_offset)
+         != (ssize_t)sizeof(idx->order))) {
+        close(idx->fd);
+        idx->fd = -1;
         return -1;
     }
+    snprintf(idx->field, sizeof(idx->field), "%s", field);
+    return 0;
+}
 
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+static void hash_index_close(HashIndex* idx) {
+    if (idx->fd >= 0) close(idx->fd);
+    idx->fd = -1;
+}
 
-    int ret = write_file_atomic(filepath, print_buffer);
-    free(print_buffer);
-    return ret;
+static bool hash_index_ordered(const HashIndex* idx) {
+    return idx->header.order_offset != 0;
+}
+
+// Whether a lookup of 'key' can be answered from the index alone.
+static bool hash_index_covers(const char* key) {
+    return strlen(key) <= INDEX_MAX_KEY;
+}
+
+// Whether ranges can be read off the index: ordered, and no value left out.
+static bool hash_index_ranges(const HashIndex* idx) {
+    return hash_index_ordered(idx) && idx->header.skipped == 0;
+}
+
+static off_t hash_index_bucket_offset(const HashIndex* idx, uint32_t hash) {
+    return INDEX_HEADER_SIZE + (off_t)(hash & (idx->header.bucket_count - 1)) * sizeof(uint64_t);
 }
 
 /* --------------------------------------------------------------------------
- * list <table>
- * Print all records in JSON lines format.
+ * Call 'fn' for every live entry whose key equals 'key'.
  * -------------------------------------------------------------------------- */
-static int command_list(const char* db_path, const char* table_name) {
-    cJSON* root = load_table(db_path, table_name);
-    if (!root) {
-        fprintf(stderr, "Error: Could not load or parse table %s\n", table_name);
-        return 1;
+static int hash_index_lookup(HashIndex* idx, const char* key, IndexHitCallback fn, void* ctx) {
+    size_t key_len = strlen(key);
+    uint32_t hash = (uint32_t)hash_bytes(key, key_len);
+    uint64_t offset;
+    if (pread(idx->fd, &offset, sizeof(offset), hash_index_bucket_offset(idx, hash))
+        != sizeof(offset)) {
+        return -1;
     }
 
-    // Print each record (object) as one line of JSON
-    int array_size = cJSON_GetArraySize(root);
-    for (int i = 0; i < array_size; i++) {
-        cJSON* item = cJSON_GetArrayItem(root, i);
-        if (cJSON_IsObject(item)) {
-            char* line = cJSON_PrintUnformatted(item);
-            if (line) {
-                printf("%s\n", line);
-                free(line);
-            }
+    char short_key[256 + 1024];
+    char* stored_key = key_len <= sizeof(short_key) ? short_key : malloc(key_len ? key_len : 1);
+    if (!stored_key) return -1;
+    int ret = 0;
+    while (offset != 0) {
+        HashIndexEntry entry;
+        if (pread(idx->fd, &entry, sizeof(entry), offset) != sizeof(entry)) {
+            ret = -1;
+            break;
+        }
+        if (entry.live && entry.hash == hash && entry.key_len == key_len &&
+            pread(idx->fd, stored_key, key_len, offset + sizeof(entry)) == (ssize_t)key_len &&
+            memcmp(stored_key, key, key_len) == 0) {
+            if (fn(entry.rowref, entry.length, ctx) != 0) break;
         }
+        offset = entry.next;
     }
+    if (stored_key != short_key) free(stored_key);
+    return ret;
+}
 
-    cJSON_Delete(root);
-    return 0;
+static int hash_index_write_header(HashIndex* idx) {
+    return pwrite(idx->fd, &idx->header, sizeof(idx->header), 0) == sizeof(idx->header) ? 0 : -1;
 }
 
 /* --------------------------------------------------------------------------
- * get <table> field=value
- * Print all records where field matches value.
+ * Key order. Keys compare as byte strings, shorter first on a tie, so
+ * ISO dates and zero-padded numbers sort as they read.
  * -------------------------------------------------------------------------- */
-static int command_get(const char* db_path, const char* table_name, 
-                       const char* field, const char* value) {
-    cJSON* root = load_table(db_path, table_name);
-    if (!root) {
-        fprintf(stderr, "Error: Could not load or parse table %s\n", table_name);
-        return 1;
-    }
+typedef struct {
+    const char* key;
+    uint64_t rowref;
+    uint64_t offset;            // of the entry in the index file
+    uint32_t length;
+    uint16_t key_len;
+} IndexKeyRef;
 
-    int array_size = cJSON_GetArraySize(root);
-    for (int i = 0; i < array_size; i++) {
-        cJSON* item = cJSON_GetArrayItem(root, i);
-        if (cJSON_IsObject(item)) {
-            cJSON* field_obj = cJSON_GetObjectItemCaseSensitive(item, field);
-            if (cJSON_IsString(field_obj) && strcmp(field_obj->valuestring, value) == 0) {
-                // Print matching record
-                char* line = cJSON_PrintUnformatted(item);
-                if (line) {
-                    printf("%s\n", line);
-                    free(line);
-                }
+static int compare_key_bytes(const char* a, size_t a_len, const char* b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int compare_key_refs(const void* a, const void* b) {
+    const IndexKeyRef* x = (const IndexKeyRef*)a;
+    const IndexKeyRef* y = (const IndexKeyRef*)b;
+    int c = compare_key_bytes(x->key, x->key_len, y->key, y->key_len);
+    if (c != 0) return c;
+    return x->rowref < y->rowref ? -1 : x->rowref > y->rowref;
+}
+
+// Sort 'refs' and write their offsets, behind an IndexOrderHeader, at 'at'.
+static int index_order_write(int fd, off_t at, IndexKeyRef* refs, size_t count,
+                             uint64_t covered) {
+    qsort(refs, count, sizeof(IndexKeyRef), compare_key_refs);
+    size_t bytes = sizeof(IndexOrderHeader) + count * sizeof(uint64_t);
+    char* region = malloc(bytes);
+    if (!region) return -1;
+    IndexOrderHeader order = { count, covered };
+    memcpy(region, &order, sizeof(order));
+    uint64_t* offsets = (uint64_t*)(region + sizeof(order));
+    for (size_t i = 0; i < count; i++) offsets[i] = refs[i].offset;
+
+    int phase = profile_enter(PHASE_WRITE);
+    int ret = pwrite(fd, region, bytes, at) == (ssize_t)bytes ? 0 : -1;
+    profile_leave(phase, bytes);
+    free(region);
+    return ret;
+}
+
+// Put every live entry back in key order: the chains are followed through a
+// copy of the file and the new order appended, so a reader still using the
+// old one (and the entries appended after it) keeps a consistent view.
+static int hash_index_reorder(HashIndex* idx) {
+    struct stat st;
+    if (fstat(idx->fd, &st) != 0) return -1;
+    size_t size = (size_t)st.st_size;
+    char* data = malloc(size ? size : 1);
+    IndexKeyRef* refs = malloc((idx->header.entry_count + 1) * sizeof(IndexKeyRef));
+    int phase = profile_enter(PHASE_READ);
+    int ret = data && refs && pread(idx->fd, data, size, 0) == (ssize_t)size ? 0 : -1;
+    profile_leave(phase, size);
+
+    size_t count = 0;
+    for (uint32_t bucket = 0; bucket < idx->header.bucket_count && ret == 0; bucket++) {
+        uint64_t offset;
+        memcpy(&offset, data + INDEX_HEADER_SIZE + (size_t)bucket * sizeof(uint64_t),
+               sizeof(offset));
+        while (offset != 0) {
+            HashIndexEntry entry;
+            if (offset + sizeof(entry) > size) { ret = -1; break; }
+            memcpy(&entry, data + offset, sizeof(entry));
+            if (offset + sizeof(entry) + entry.key_len > size ||
+                count > idx->header.entry_count) {
+                ret = -1;
+                break;
             }
+            if (entry.live) {
+                refs[count++] = (IndexKeyRef){ data + offset + sizeof(entry), entry.rowref,
+                                               offset, entry.length, entry.key_len };
+            }
+            offset = entry.next;
         }
     }
+    if (ret == 0) {
+        ret = index_order_write(idx->fd, (off_t)size, refs, count, idx->header.entry_count);
+    }
+    if (ret == 0) {
+        idx->order = (IndexOrderHeader){ count, idx->header.entry_count };
+        idx->header.order_offset = size;
+        ret = hash_index_write_header(idx);
+    }
+    free(refs);
+    free(data);
+    return ret;
+}
+
+static int hash_index_insert(HashIndex* idx, const char* key, uint64_t rowref, uint32_t length) {
+    size_t key_len = strlen(key);
+    if (key_len > INDEX_MAX_KEY) {
+        idx->header.skipped++;
+        return hash_index_write_header(idx);
+    }
+    HashIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.rowref = rowref;
+    entry.length = length;
+    entry.hash = (uint32_t)hash_bytes(key, key_len);
+    entry.key_len = (uint16_t)key_len;
+    entry.live = 1;
 
-    cJSON_Delete(root);
+    off_t bucket = hash_index_bucket_offset(idx, entry.hash);
+    off_t end = lseek(idx->fd, 0, SEEK_END);
+    if (end < 0 || pread(idx->fd, &entry.next, sizeof(entry.next), bucket) != sizeof(entry.next)) {
+        return -1;
+    }
+    uint64_t new_head = (uint64_t)end;
+    if (pwrite(idx->fd, &entry, sizeof(entry), end) != sizeof(entry) ||
+        pwrite(idx->fd, key, key_len, end + sizeof(entry)) != (ssize_t)key_len ||
+        pwrite(idx->fd, &new_head, sizeof(new_head), bucket) != sizeof(new_head)) {
+        return -1;
+    }
+    idx->header.entry_count++;
+
+    // An ordered index keeps new entries in an unsorted tail, scanned with
+    // every range, until it is worth sorting again
+    uint64_t tail = idx->header.entry_count - idx->order.covered;
+    if (idx->header.order_offset != 0 &&
+        tail > INDEX_MIN_TAIL && tail > idx->order.count / 4) {
+        return hash_index_reorder(idx);
+    }
+    return hash_index_write_header(idx);
+}
+
+static int hash_index_remove(HashIndex* idx, const char* key, uint64_t rowref) {
+    size_t key_len = strlen(key);
+    if (key_len > INDEX_MAX_KEY) return 0;
+    uint32_t hash = (uint32_t)hash_bytes(key, key_len);
+    uint64_t offset;
+    if (pread(idx->fd, &offset, sizeof(offset), hash_index_bucket_offset(idx, hash))
+        != sizeof(offset)) {
+        return -1;
+    }
+    while (offset != 0) {
+        HashIndexEntry entry;
+        if (pread(idx->fd, &entry, sizeof(entry), offset) != sizeof(entry)) return -1;
+        if (entry.live && entry.rowref == rowref && entry.hash == hash) {
+            uint8_t dead = 0;
+            return pwrite(idx->fd, &dead, 1, offset + offsetof(HashIndexEntry, live)) == 1 ? 0 : -1;
+        }
+        offset = entry.next;
+    }
     return 0;
 }
 
 /* --------------------------------------------------------------------------
- * save <table> field1=value1 [field2=value2 ...]
- *   - If a record with the specified unique id (if given) exists, update it.
- *   - If a record with the specified unique id (if given) doesn't exist, create a new one.
- *   - If no id is given, it automatically generates the id
- *
- *   Usually we assume "id" is the unique field, but let's not hardcode it:
- *   We'll check if any of the fields is "id=xxx". If found, we try to locate 
- *   that record first, then update. If not found, we append a new record.
+ * Bulk build: entries are collected in memory and written out in one go,
+ * to a temporary file that is renamed over the old index.
  * -------------------------------------------------------------------------- */
-static char* generate_new_id(cJSON* root) {
-    // This function returns a dynamically allocated string (caller must free).
-    // Strategy: find the highest numeric ID so far and add 1.
-    // If no numeric ID is found, default to "1".
-    int max_id = 0;
-    int size = cJSON_GetArraySize(root);
-    for (int i = 0; i < size; i++) {
-        cJSON* obj = cJSON_GetArrayItem(root, i);
-        if (cJSON_IsObject(obj)) {
-            cJSON* id_field = cJSON_GetObjectItemCaseSensitive(obj, "id");
-            if (cJSON_IsString(id_field)) {
-                // attempt to interpret as integer
-                int val = atoi(id_field->valuestring);
-                if (val > max_id) {
-                    max_id = val;
-                }
-            }
-        }
+typedef struct {
+    uint64_t* buckets;
+    uint32_t bucket_count;
+    char* entries;
+    size_t len;
+    size_t capacity;
+    uint64_t count;
+    uint32_t skipped;           // values too long to index
+    bool ordered;
+} IndexBuilder;
+
+static int index_builder_init(IndexBuilder* b, size_t expected, bool ordered) {
+    memset(b, 0, sizeof(*b));
+    b->ordered = ordered;
+    b->bucket_count = INDEX_MIN_BUCKETS;
+    while (b->bucket_count < expected * 2 && b->bucket_count < (1u << 31)) {
+        b->bucket_count <<= 1;
     }
-    max_id++;  // new ID is max_id + 1
+    b->buckets = calloc(b->bucket_count, sizeof(uint64_t));
+    return b->buckets ? 0 : -1;
+}
 
-    // Convert to string
-    char buffer[32];
-    snprintf(buffer, sizeof(buffer), "%d", max_id);
-    return strdup(buffer);  // Return a copy
+static void index_builder_free(IndexBuilder* b) {
+    free(b->buckets);
+    free(b->entries);
 }
 
-static int command_save(const char* db_path, const char* table_name,
-                        int argc, char** argv) 
-{
-    // Load table JSON
-    cJSON* root = load_table(db_path, table_name);
-    if (!root) {
-        fprintf(stderr, "Error: Could not load or parse table %s\n", table_name);
-        return 1;
+static int index_builder_add(IndexBuilder* b, const char* key, uint64_t rowref, uint32_t length) {
+    size_t key_len = strlen(key);
+    if (key_len > INDEX_MAX_KEY) {
+        b->skipped++;
+        return 0;
+    }
+    size_t needed = sizeof(HashIndexEntry) + key_len;
+    if (b->len + needed > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 65536;
+        while (capacity < b->len + needed) capacity *= 2;
+        char* grown = realloc(b->entries, capacity);
+        if (!grown) return -1;
+        b->entries = grown;
+        b->capacity = capacity;
     }
 
-    // --------------------------------------------------------------------
-    // 1) Parse all fields from argv into an array of FieldPair
-    //    We also check if an 'id' was provided and validate it.
-    // --------------------------------------------------------------------
-    FieldPair fields[MAX_COMMAND_ARGS];
-    int fieldCount = 0;
+    HashIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.rowref = rowref;
+    entry.length = length;
+    entry.hash = (uint32_t)hash_bytes(key, key_len);
+    entry.key_len = (uint16_t)key_len;
+    entry.live = 1;
 
-    bool userProvidedId = false;
-    long userIdValue = 0; // numeric representation if user provided 'id'
+    uint32_t bucket = entry.hash & (b->bucket_count - 1);
+    entry.next = b->buckets[bucket];
+    b->buckets[bucket] = INDEX_HEADER_SIZE + (uint64_t)b->bucket_count * sizeof(uint64_t) + b->len;
 
-    for (int i = 0; i < argc; i++) {
-        // We don't want to modify argv[i] directly in case we need it later;
-        // so let's copy it into a buffer.
-        char buffer[2048];
-        strncpy(buffer, argv[i], sizeof(buffer) - 1);
-        buffer[sizeof(buffer) - 1] = '\0';
+    memcpy(b->entries + b->len, &entry, sizeof(entry));
+    memcpy(b->entries + b->len + sizeof(entry), key, key_len);
+    b->len += needed;
+    b->count++;
+    return 0;
+}
 
-        // Split at '='
-        char* eq = strchr(buffer, '=');
-        if (!eq) {
-            fprintf(stderr, "Error: Invalid field format '%s'. Use field=value.\n", argv[i]);
-            cJSON_Delete(root);
-            return 1;
-        }
-        *eq = '\0'; 
-        const char* key = buffer;
-        const char* val = eq + 1;
+static int index_builder_write(IndexBuilder* b, const char* path, const FileStamp* stamp) {
+    char temp_path[1100];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d", path, (int)getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
 
-        // Store into fields array
-        strncpy(fields[fieldCount].key, key, sizeof(fields[fieldCount].key) - 1);
-        fields[fieldCount].key[sizeof(fields[fieldCount].key) - 1] = '\0';
-        strncpy(fields[fieldCount].val, val, sizeof(fields[fieldCount].val) - 1);
-        fields[fieldCount].val[sizeof(fields[fieldCount].val) - 1] = '\0';
-        fieldCount++;
+    char header_page[INDEX_HEADER_SIZE];
+    HashIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.bucket_count = b->bucket_count;
+    header.entry_count = b->count;
+    header.skipped = b->skipped;
+    if (stamp) header.table = *stamp;
+    size_t bucket_bytes = (size_t)b->bucket_count * sizeof(uint64_t);
+    uint64_t base = INDEX_HEADER_SIZE + bucket_bytes;
+    if (b->ordered) header.order_offset = base + b->len;
+    memset(header_page, 0, sizeof(header_page));
+    memcpy(header_page, &header, sizeof(header));
 
-        // Check if this is 'id'
-        if (strcmp(key, "id") == 0) {
-            userProvidedId = true;
+    int phase = profile_enter(PHASE_WRITE);
+    bool ok = write(fd, header_page, sizeof(header_page)) == sizeof(header_page) &&
+              write(fd, b->buckets, bucket_bytes) == (ssize_t)bucket_bytes &&
+              (b->len == 0 || write(fd, b->entries, b->len) == (ssize_t)b->len);
+    profile_leave(phase, sizeof(header_page) + bucket_bytes + b->len);
 
-            // Validate positive integer
-            char* endptr = NULL;
-            long val_long = strtol(val, &endptr, 10);
-            if (*endptr != '\0' || val_long <= 0) {
-                fprintf(stderr, "Error: 'id' must be a positive integer, got '%s'\n", val);
-                cJSON_Delete(root);
-                return 1;
-            }
-            userIdValue = val_long;
+    if (ok && b->ordered) {
+        IndexKeyRef* refs = malloc((b->count + 1) * sizeof(IndexKeyRef));
+        size_t n = 0;
+        for (size_t pos = 0; refs && pos < b->len; n++) {
+            HashIndexEntry entry;
+            memcpy(&entry, b->entries + pos, sizeof(entry));
+            refs[n] = (IndexKeyRef){ b->entries + pos + sizeof(entry), entry.rowref,
+                                     base + pos, entry.length, entry.key_len };
+            pos += sizeof(entry) + entry.key_len;
         }
+        ok = refs && index_order_write(fd, (off_t)header.order_offset, refs, n, b->count) == 0;
+        free(refs);
     }
+    phase = profile_enter(PHASE_WRITE);
+    ok = ok && fsync(fd) == 0;
+    profile_leave(phase, 0);
+    close(fd);
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
 
-    // --------------------------------------------------------------------
-    // 2) Determine final ID string (either user provided or auto-generated)
-    // --------------------------------------------------------------------
-    char autoIdBuffer[32];
-    const char* finalIdStr = NULL;
+/* --------------------------------------------------------------------------
+ * Ordered indexes
+ *
+ * An ordered index is a hash index that also holds, at header.order_offset,
+ * the offsets of its entries sorted by key. Equality still goes through
+ * the chains; a key range is found by binary search in the sorted offsets
+ * and read off them in order. Entries appended since (paged tables update
+ * their indexes in place) form a tail that every range scan sorts and
+ * merges in, until hash_index_insert() sorts the whole index again.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* lower;          // NULL: no lower bound
+    bool lower_open;            // the bound itself is excluded
+    const char* upper;          // NULL: no upper bound
+    bool upper_open;
+    const char* prefix;         // NULL: any key
+} KeyRange;
 
-    if (userProvidedId) {
-        // Reconstruct the numeric ID as a string (just to be sure)
-        snprintf(autoIdBuffer, sizeof(autoIdBuffer), "%ld", userIdValue);
-        finalIdStr = autoIdBuffer;
-    } else {
-        // Generate ID automatically
-        char* generated = generate_new_id(root);
-        if (!generated) {
-            fprintf(stderr, "Error: unable to generate new ID.\n");
-            cJSON_Delete(root);
-            return 1;
-        }
-        // We'll store this pointer in finalIdStr and later free it
-        finalIdStr = generated;
+// Called for every live entry in a range, in key order; non-zero stops.
+typedef int (*IndexRangeCallback)(const char* key, size_t key_len, uint64_t rowref,
+                                  uint32_t length, void* ctx);
+
+// True if the key sorts before the range.
+static bool key_range_below(const KeyRange* r, const char* key, size_t key_len) {
+    if (r->lower) {
+        int c = compare_key_bytes(key, key_len, r->lower, strlen(r->lower));
+        if (c < 0 || (c == 0 && r->lower_open)) return true;
     }
+    return r->prefix && compare_key_bytes(key, key_len, r->prefix, strlen(r->prefix)) < 0;
+}
 
-    // --------------------------------------------------------------------
-    // 3) Create a new cJSON object, add 'id' first,
-    //    then add all other fields in the same order they were listed
-    // --------------------------------------------------------------------
-    cJSON* new_record = cJSON_CreateObject();
-    if (!new_record) {
-        // If we auto-generated the ID string, we must free it
-        if (!userProvidedId && finalIdStr) {
-            free((void*)finalIdStr);
-        }
-        cJSON_Delete(root);
-        return 1;
+// True if the key sorts after the range. Keys with a given prefix are
+// contiguous, so the first key past it that lacks it ends the range.
+static bool key_range_past(const KeyRange* r, const char* key, size_t key_len) {
+    if (r->upper) {
+        int c = compare_key_bytes(key, key_len, r->upper, strlen(r->upper));
+        if (c > 0 || (c == 0 && r->upper_open)) return true;
+    }
+    if (r->prefix) {
+        size_t prefix_len = strlen(r->prefix);
+        return compare_key_bytes(key, key_len, r->prefix, prefix_len) > 0 &&
+               (key_len < prefix_len || memcmp(key, r->prefix, prefix_len) != 0);
     }
+    return false;
+}
 
-    // Add 'id' as the first field
-    cJSON_AddStringToObject(new_record, "id", finalIdStr);
+static bool key_range_contains(const KeyRange* r, const char* key, size_t key_len) {
+    return !key_range_below(r, key, key_len) && !key_range_past(r, key, key_len);
+}
 
-    // Add all the other fields
-    for (int i = 0; i < fieldCount; i++) {
-        if (strcmp(fields[i].key, "id") == 0) {
-            // already added as first field
+// Read the entry at 'offset' with its key into 'key' (UINT16_MAX bytes).
+static int index_read_entry(HashIndex* idx, uint64_t offset, HashIndexEntry* entry, char* key) {
+    if (pread(idx->fd, entry, sizeof(*entry), offset) != (ssize_t)sizeof(*entry)) return -1;
+    return pread(idx->fd, key, entry->key_len, offset + sizeof(*entry))
+           == (ssize_t)entry->key_len ? 0 : -1;
+}
+
+static int index_read_order(HashIndex* idx, uint64_t i, uint64_t* offset) {
+    off_t at = idx->header.order_offset + sizeof(IndexOrderHeader) + i * sizeof(uint64_t);
+    return pread(idx->fd, offset, sizeof(*offset), at) == sizeof(*offset) ? 0 : -1;
+}
+
+// The live tail entries in the range, sorted; keys point into '*data'.
+static int index_tail_in_range(HashIndex* idx, const KeyRange* r, char** data,
+                               IndexKeyRef** refs, size_t* count) {
+    *data = NULL;
+    *refs = NULL;
+    *count = 0;
+    uint64_t tail = idx->header.entry_count - idx->order.covered;
+    if (tail == 0) return 0;
+    struct stat st;
+    off_t start = idx->header.order_offset + sizeof(IndexOrderHeader) +
+                  idx->order.count * sizeof(uint64_t);
+    if (fstat(idx->fd, &st) != 0 || st.st_size < start) return -1;
+    size_t size = (size_t)(st.st_size - start);
+    *data = malloc(size ? size : 1);
+    *refs = malloc(tail * sizeof(IndexKeyRef));
+    if (!*data || !*refs || pread(idx->fd, *data, size, start) != (ssize_t)size) return -1;
+
+    size_t pos = 0;
+    for (uint64_t i = 0; i < tail; i++) {
+        HashIndexEntry entry;
+        if (pos + sizeof(entry) > size) return -1;
+        memcpy(&entry, *data + pos, sizeof(entry));
+        const char* key = *data + pos + sizeof(entry);
+        if (pos + sizeof(entry) + entry.key_len > size) return -1;
+        if (entry.live && key_range_contains(r, key, entry.key_len)) {
+            (*refs)[(*count)++] = (IndexKeyRef){ key, entry.rowref, start + pos,
+                                                 entry.length, entry.key_len };
+        }
+        pos += sizeof(entry) + entry.key_len;
+    }
+    qsort(*refs, *count, sizeof(IndexKeyRef), compare_key_refs);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Call 'fn' for every live entry of an ordered index whose key is in 'r',
+ * in key order.
+ * -------------------------------------------------------------------------- */
+static int ordered_index_scan(HashIndex* idx, const KeyRange* r, IndexRangeCallback fn,
+                              void* ctx) {
+    if (idx->header.order_offset == 0) return -1;
+    char* key = malloc(UINT16_MAX);
+    char* tail_data = NULL;
+    IndexKeyRef* tail = NULL;
+    size_t tail_count = 0, next_tail = 0;
+    uint64_t bytes = 0;
+    int phase = profile_enter(PHASE_READ);
+    int ret = key && index_tail_in_range(idx, r, &tail_data, &tail, &tail_count) == 0 ? 0 : -1;
+
+    // The first sorted entry not below the range
+    uint64_t lo = 0, hi = idx->order.count;
+    while (lo < hi && ret == 0) {
+        uint64_t mid = lo + (hi - lo) / 2, offset;
+        HashIndexEntry entry;
+        if (index_read_order(idx, mid, &offset) != 0 ||
+            index_read_entry(idx, offset, &entry, key) != 0) {
+            ret = -1;
+            break;
+        }
+        bytes += sizeof(offset) + sizeof(entry) + entry.key_len;
+        if (key_range_below(r, key, entry.key_len)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    bool stopped = false;
+    for (uint64_t i = lo; i < idx->order.count && ret == 0 && !stopped; i++) {
+        uint64_t offset;
+        HashIndexEntry entry;
+        if (index_read_order(idx, i, &offset) != 0 ||
+            index_read_entry(idx, offset, &entry, key) != 0) {
+            ret = -1;
+            break;
+        }
+        bytes += sizeof(offset) + sizeof(entry) + entry.key_len;
+        if (key_range_past(r, key, entry.key_len)) break;
+        IndexKeyRef current = { key, entry.rowref, offset, entry.length, entry.key_len };
+        while (!stopped && next_tail < tail_count &&
+               compare_key_refs(&tail[next_tail], &current) < 0) {
+            IndexKeyRef* t = &tail[next_tail++];
+            stopped = fn(t->key, t->key_len, t->rowref, t->length, ctx) != 0;
+        }
+        if (!stopped && entry.live) {
+            stopped = fn(key, entry.key_len, entry.rowref, entry.length, ctx) != 0;
+        }
+    }
+    while (ret == 0 && !stopped && next_tail < tail_count) {
+        IndexKeyRef* t = &tail[next_tail++];
+        stopped = fn(t->key, t->key_len, t->rowref, t->length, ctx) != 0;
+    }
+    profile_leave(phase, bytes);
+    free(tail);
+    free(tail_data);
+    free(key);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Primary-key B+tree: <table>.btree
+ *
+ * Every table keeps a B+tree keyed on its numeric "id", so 'save' finds the
+ * record it updates in O(log n) and 'list --id-range' walks ids in order.
+ * The header also holds the id high-water mark, from which new ids are
+ * handed out without looking at the records.
+ *
+ * Page 0 is the header; every other page is a node. Leaves hold sorted
+ * (key, rowref, length) entries and are chained in key order through 'next'.
+ * Internal nodes hold 'next' as their leftmost child, then (key, child)
+ * pairs: keys >= key go to child. Deletes only remove the leaf entry; nodes
+ * are never merged, which keeps every separator a valid bound.
+ *
+ * Paged tables update the tree on every write. JSON tables get a fresh tree
+ * from save_table(), stamped like the hash indexes above.
+ * -------------------------------------------------------------------------- */
+#define BTREE_MAGIC     "SDBBTRE1"
+#define BTREE_PAGE_SIZE 4096
+#define BTREE_LEAF      1
+#define BTREE_INTERNAL  2
+#define BTREE_MAX_DEPTH 16
+
+typedef struct {
+    char      magic[8];
+    uint32_t  page_size;
+    uint32_t  root;             // page number of the root node
+    uint32_t  page_count;
+    uint32_t  height;           // 1 while the root is a leaf
+    uint64_t  max_id;           // highest id ever stored
+    uint64_t  count;            // live entries
+    FileStamp table;            // JSON tables: the table file indexed
+} BTreeHeader;
+
+typedef struct {
+    uint16_t type;
+    uint16_t count;
+    uint32_t next;              // leaf: next leaf (0 ends); internal: leftmost child
+} BTreeNode;
+
+typedef struct {
+    uint64_t key;
+    uint64_t rowref;
+    uint32_t length;
+    uint32_t reserved;
+} BTreeLeafEntry;
+
+typedef struct {
+    uint64_t key;
+    uint32_t child;
+    uint32_t reserved;
+} BTreeBranch;
+
+#define BTREE_LEAF_MAX   ((BTREE_PAGE_SIZE - sizeof(BTreeNode)) / sizeof(BTreeLeafEntry))
+#define BTREE_BRANCH_MAX ((BTREE_PAGE_SIZE - sizeof(BTreeNode)) / sizeof(BTreeBranch))
+
+typedef struct {
+    int fd;
+    BTreeHeader header;
+} IdTree;
+
+// Called for every entry of a range scan; a non-zero return stops it.
+typedef int (*IdTreeCallback)(uint64_t key, uint64_t rowref, uint32_t length, void* ctx);
+
+static void id_tree_path(const char* db_path, const char* table_name, char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%s.btree", db_path, table_name);
+}
+
+// Ids are decimal strings; anything else simply isn't in the tree.
+static bool parse_id_key(const char* id, uint64_t* key) {
+    if (!id || *id < '0' || *id > '9') return false;
+    char* endptr = NULL;
+    errno = 0;
+    unsigned long long val = strtoull(id, &endptr, 10);
+    if (errno != 0 || *endptr != '\0' || val == 0) return false;
+    *key = val;
+    return true;
+}
+
+#define BTREE_LEAF_ENTRIES(page) ((BTreeLeafEntry*)((page) + sizeof(BTreeNode)))
+#define BTREE_BRANCHES(page)     ((BTreeBranch*)((page) + sizeof(BTreeNode)))
+
+static int id_tree_read(IdTree* tree, uint32_t pgno, char* page) {
+    off_t off = (off_t)pgno * BTREE_PAGE_SIZE;
+    int phase = profile_enter(PHASE_READ);
+    ssize_t n = pread(tree->fd, page, BTREE_PAGE_SIZE, off);
+    profile_leave(phase, BTREE_PAGE_SIZE);
+    return n == BTREE_PAGE_SIZE ? 0 : -1;
+}
+
+static int id_tree_write(IdTree* tree, uint32_t pgno, const char* page) {
+    off_t off = (off_t)pgno * BTREE_PAGE_SIZE;
+    int phase = profile_enter(PHASE_WRITE);
+    ssize_t n = pwrite(tree->fd, page, BTREE_PAGE_SIZE, off);
+    profile_leave(phase, BTREE_PAGE_SIZE);
+    return n == BTREE_PAGE_SIZE ? 0 : -1;
+}
+
+static int id_tree_write_header(IdTree* tree) {
+    char page[BTREE_PAGE_SIZE];
+    memset(page, 0, sizeof(page));
+    memcpy(page, &tree->header, sizeof(tree->header));
+    return id_tree_write(tree, 0, page);
+}
+
+static int id_tree_open(const char* db_path, const char* table_name, IdTree* tree) {
+    char path[1024];
+    id_tree_path(db_path, table_name, path, sizeof(path));
+    tree->fd = open(path, O_RDWR);
+    if (tree->fd < 0) return -1;
+    if (pread(tree->fd, &tree->header, sizeof(tree->header), 0) != (ssize_t)sizeof(tree->header) ||
+        memcmp(tree->header.magic, BTREE_MAGIC, sizeof(tree->header.magic)) != 0 ||
+        tree->header.page_size != BTREE_PAGE_SIZE) {
+        close(tree->fd);
+        tree->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void id_tree_close(IdTree* tree) {
+    if (tree->fd >= 0) close(tree->fd);
+    tree->fd = -1;
+}
+
+// Index of the first leaf entry with key >= 'key'.
+static uint16_t leaf_lower_bound(const char* page, uint64_t key) {
+    const BTreeLeafEntry* e = BTREE_LEAF_ENTRIES(page);
+    uint16_t lo = 0, hi = ((const BTreeNode*)page)->count;
+    while (lo < hi) {
+        uint16_t mid = (uint16_t)((lo + hi) / 2);
+        if (e[mid].key < key) lo = (uint16_t)(mid + 1);
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Child of an internal node that covers 'key'.
+static uint32_t branch_child(const char* page, uint64_t key) {
+    const BTreeNode* node = (const BTreeNode*)page;
+    const BTreeBranch* b = BTREE_BRANCHES(page);
+    uint16_t lo = 0, hi = node->count;
+    while (lo < hi) {
+        uint16_t mid = (uint16_t)((lo + hi) / 2);
+        if (b[mid].key <= key) lo = (uint16_t)(mid + 1);
+        else hi = mid;
+    }
+    return lo == 0 ? node->next : b[lo - 1].child;
+}
+
+/* --------------------------------------------------------------------------
+ * Walk from the root to the leaf covering 'key'. The leaf is left in 'page'
+ * and the page numbers on the way in 'path' (path[height - 1] is the leaf).
+ * -------------------------------------------------------------------------- */
+static int id_tree_descend(IdTree* tree, uint64_t key, char* page, uint32_t* path) {
+    uint32_t pgno = tree->header.root;
+    for (uint32_t level = 0; level < tree->header.height; level++) {
+        if (level >= BTREE_MAX_DEPTH || id_tree_read(tree, pgno, page) != 0) return -1;
+        path[level] = pgno;
+        const BTreeNode* node = (const BTreeNode*)page;
+        if (node->type == BTREE_LEAF) return level + 1 == tree->header.height ? 0 : -1;
+        pgno = branch_child(page, key);
+    }
+    return -1;
+}
+
+static bool id_tree_lookup(IdTree* tree, uint64_t key, uint64_t* rowref, uint32_t* length) {
+    char page[BTREE_PAGE_SIZE];
+    uint32_t path[BTREE_MAX_DEPTH];
+    if (id_tree_descend(tree, key, page, path) != 0) return false;
+    uint16_t i = leaf_lower_bound(page, key);
+    const BTreeLeafEntry* e = BTREE_LEAF_ENTRIES(page);
+    if (i >= ((BTreeNode*)page)->count || e[i].key != key) return false;
+    if (rowref) *rowref = e[i].rowref;
+    if (length) *length = e[i].length;
+    return true;
+}
+
+static uint32_t id_tree_new_page(IdTree* tree) {
+    return tree->header.page_count++;
+}
+
+// Insert (key, child) into the internal node at 'level' of 'path', splitting
+// upwards as needed.
+static int id_tree_insert_branch(IdTree* tree, uint32_t* path, int level,
+                                 uint64_t key, uint32_t child) {
+    char page[BTREE_PAGE_SIZE];
+    if (level < 0) {
+        // The root split: grow the tree by one level
+        memset(page, 0, sizeof(page));
+        BTreeNode* root = (BTreeNode*)page;
+        root->type = BTREE_INTERNAL;
+        root->count = 1;
+        root->next = tree->header.root;
+        BTREE_BRANCHES(page)[0] = (BTreeBranch){ key, child, 0 };
+        uint32_t pgno = id_tree_new_page(tree);
+        tree->header.root = pgno;
+        tree->header.height++;
+        return id_tree_write(tree, pgno, page);
+    }
+
+    if (id_tree_read(tree, path[level], page) != 0) return -1;
+    BTreeNode* node = (BTreeNode*)page;
+    BTreeBranch* b = BTREE_BRANCHES(page);
+    uint16_t pos = 0;
+    while (pos < node->count && b[pos].key <= key) pos++;
+    memmove(&b[pos + 1], &b[pos], (node->count - pos) * sizeof(BTreeBranch));
+    b[pos] = (BTreeBranch){ key, child, 0 };
+    node->count++;
+
+    if (node->count < BTREE_BRANCH_MAX) {
+        return id_tree_write(tree, path[level], page);
+    }
+
+    // Split: the middle key moves up, its child becomes the right node's
+    // leftmost child
+    char right_page[BTREE_PAGE_SIZE];
+    memset(right_page, 0, sizeof(right_page));
+    BTreeNode* right = (BTreeNode*)right_page;
+    uint16_t mid = node->count / 2;
+    right->type = BTREE_INTERNAL;
+    right->next = b[mid].child;
+    right->count = (uint16_t)(node->count - mid - 1);
+    memcpy(BTREE_BRANCHES(right_page), &b[mid + 1], right->count * sizeof(BTreeBranch));
+    uint64_t up_key = b[mid].key;
+    node->count = mid;
+
+    uint32_t right_pgno = id_tree_new_page(tree);
+    if (id_tree_write(tree, path[level], page) != 0 ||
+        id_tree_write(tree, right_pgno, right_page) != 0) {
+        return -1;
+    }
+    return id_tree_insert_branch(tree, path, level - 1, up_key, right_pgno);
+}
+
+/* --------------------------------------------------------------------------
+ * Insert or replace the entry for 'key'.
+ * -------------------------------------------------------------------------- */
+static int id_tree_put(IdTree* tree, uint64_t key, uint64_t rowref, uint32_t length) {
+    char page[BTREE_PAGE_SIZE];
+    uint32_t path[BTREE_MAX_DEPTH];
+    if (id_tree_descend(tree, key, page, path) != 0) return -1;
+
+    BTreeNode* leaf = (BTreeNode*)page;
+    BTreeLeafEntry* e = BTREE_LEAF_ENTRIES(page);
+    uint32_t leaf_pgno = path[tree->header.height - 1];
+    uint16_t i = leaf_lower_bound(page, key);
+    if (key > tree->header.max_id) tree->header.max_id = key;
+
+    if (i < leaf->count && e[i].key == key) {
+        e[i].rowref = rowref;
+        e[i].length = length;
+        if (id_tree_write(tree, leaf_pgno, page) != 0) return -1;
+        return id_tree_write_header(tree);
+    }
+
+    memmove(&e[i + 1], &e[i], (leaf->count - i) * sizeof(BTreeLeafEntry));
+    e[i] = (BTreeLeafEntry){ key, rowref, length, 0 };
+    leaf->count++;
+    tree->header.count++;
+
+    if (leaf->count < BTREE_LEAF_MAX) {
+        if (id_tree_write(tree, leaf_pgno, page) != 0) return -1;
+        return id_tree_write_header(tree);
+    }
+
+    // Split the leaf in half and link the new right half into the chain
+    char right_page[BTREE_PAGE_SIZE];
+    memset(right_page, 0, sizeof(right_page));
+    BTreeNode* right = (BTreeNode*)right_page;
+    uint16_t mid = leaf->count / 2;
+    right->type = BTREE_LEAF;
+    right->count = (uint16_t)(leaf->count - mid);
+    right->next = leaf->next;
+    memcpy(BTREE_LEAF_ENTRIES(right_page), &e[mid], right->count * sizeof(BTreeLeafEntry));
+    leaf->count = mid;
+
+    uint32_t right_pgno = id_tree_new_page(tree);
+    leaf->next = right_pgno;
+    if (id_tree_write(tree, right_pgno, right_page) != 0 ||
+        id_tree_write(tree, leaf_pgno, page) != 0 ||
+        id_tree_insert_branch(tree, path, (int)tree->header.height - 2,
+                              BTREE_LEAF_ENTRIES(right_page)[0].key, right_pgno) != 0) {
+        return -1;
+    }
+    return id_tree_write_header(tree);
+}
+
+static int id_tree_remove(IdTree* tree, uint64_t key) {
+    char page[BTREE_PAGE_SIZE];
+    uint32_t path[BTREE_MAX_DEPTH];
+    if (id_tree_descend(tree, key, page, path) != 0) return -1;
+
+    BTreeNode* leaf = (BTreeNode*)page;
+    BTreeLeafEntry* e = BTREE_LEAF_ENTRIES(page);
+    uint16_t i = leaf_lower_bound(page, key);
+    if (i >= leaf->count || e[i].key != key) return 0;
+
+    memmove(&e[i], &e[i + 1], (leaf->count - i - 1) * sizeof(BTreeLeafEntry));
+    leaf->count--;
+    tree->header.count--;
+    if (id_tree_write(tree, path[tree->header.height - 1], page) != 0) return -1;
+    return id_tree_write_header(tree);
+}
+
+/* --------------------------------------------------------------------------
+ * Call 'fn' for every entry with lo <= key <= hi, in key order.
+ * -------------------------------------------------------------------------- */
+static int id_tree_range(IdTree* tree, uint64_t lo, uint64_t hi, IdTreeCallback fn, void* ctx) {
+    char page[BTREE_PAGE_SIZE];
+    uint32_t path[BTREE_MAX_DEPTH];
+    if (id_tree_descend(tree, lo, page, path) != 0) return -1;
+
+    uint16_t i = leaf_lower_bound(page, lo);
+    for (;;) {
+        const BTreeNode* leaf = (const BTreeNode*)page;
+        const BTreeLeafEntry* e = BTREE_LEAF_ENTRIES(page);
+        for (; i < leaf->count; i++) {
+            if (e[i].key > hi) return 0;
+            if (fn(e[i].key, e[i].rowref, e[i].length, ctx) != 0) return 0;
+        }
+        if (leaf->next == 0) return 0;
+        if (id_tree_read(tree, leaf->next, page) != 0) return -1;
+        i = 0;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ * Bulk load: write a complete tree for 'entries' (sorted by key, then by
+ * rowref; only the first entry of a repeated key is kept) to a temporary
+ * file and rename it into place. Leaves are packed full.
+ * -------------------------------------------------------------------------- */
+static int compare_leaf_entries(const void* a, const void* b) {
+    const BTreeLeafEntry* x = (const BTreeLeafEntry*)a;
+    const BTreeLeafEntry* y = (const BTreeLeafEntry*)b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    if (x->rowref != y->rowref) return x->rowref < y->rowref ? -1 : 1;
+    return 0;
+}
+
+static int id_tree_build(const char* db_path, const char* table_name,
+                         BTreeLeafEntry* entries, size_t count,
+                         uint64_t max_id, const FileStamp* stamp) {
+    if (count > 0) qsort(entries, count, sizeof(BTreeLeafEntry), compare_leaf_entries);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || entries[unique - 1].key != entries[i].key) {
+            entries[unique++] = entries[i];
+        }
+    }
+
+    char path[1024], temp_path[1100];
+    id_tree_path(db_path, table_name, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d", path, (int)getpid());
+
+    IdTree tree;
+    tree.fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (tree.fd < 0) return -1;
+    memset(&tree.header, 0, sizeof(tree.header));
+    memcpy(tree.header.magic, BTREE_MAGIC, sizeof(tree.header.magic));
+    tree.header.page_size = BTREE_PAGE_SIZE;
+    tree.header.page_count = 1;
+    tree.header.height = 1;
+    tree.header.count = unique;
+    tree.header.max_id = max_id;
+    if (unique > 0 && entries[unique - 1].key > max_id) {
+        tree.header.max_id = entries[unique - 1].key;
+    }
+    if (stamp) tree.header.table = *stamp;
+
+    // Leaf level
+    size_t leaf_fill = BTREE_LEAF_MAX - 1;
+    size_t level_count = unique ? (unique + leaf_fill - 1) / leaf_fill : 1;
+    BTreeBranch* level = malloc(level_count * sizeof(BTreeBranch));
+    int ret = level ? 0 : -1;
+    char page[BTREE_PAGE_SIZE];
+    for (size_t n = 0; n < level_count && ret == 0; n++) {
+        memset(page, 0, sizeof(page));
+        BTreeNode* leaf = (BTreeNode*)page;
+        size_t first = n * leaf_fill;
+        size_t take = unique - first < leaf_fill ? unique - first : leaf_fill;
+        if (unique == 0) take = 0;
+        leaf->type = BTREE_LEAF;
+        leaf->count = (uint16_t)take;
+        uint32_t pgno = id_tree_new_page(&tree);
+        leaf->next = n + 1 < level_count ? pgno + 1 : 0;
+        if (take > 0) {
+            memcpy(BTREE_LEAF_ENTRIES(page), &entries[first], take * sizeof(BTreeLeafEntry));
+        }
+        level[n] = (BTreeBranch){ take ? entries[first].key : 0, pgno, 0 };
+        ret = id_tree_write(&tree, pgno, page);
+    }
+
+    // Internal levels, until one node is left
+    size_t branch_fill = BTREE_BRANCH_MAX - 1;
+    while (ret == 0 && level_count > 1) {
+        size_t parents = (level_count + branch_fill) / (branch_fill + 1);
+        for (size_t n = 0; n < parents && ret == 0; n++) {
+            memset(page, 0, sizeof(page));
+            BTreeNode* node = (BTreeNode*)page;
+            size_t first = n * (branch_fill + 1);
+            size_t take = level_count - first < branch_fill + 1 ? level_count - first
+                                                                 : branch_fill + 1;
+            node->type = BTREE_INTERNAL;
+            node->next = level[first].child;
+            node->count = (uint16_t)(take - 1);
+            memcpy(BTREE_BRANCHES(page), &level[first + 1], (take - 1) * sizeof(BTreeBranch));
+            uint32_t pgno = id_tree_new_page(&tree);
+            level[n] = (BTreeBranch){ level[first].key, pgno, 0 };
+            ret = id_tree_write(&tree, pgno, page);
+        }
+        level_count = parents;
+        tree.header.height++;
+    }
+    if (ret == 0) tree.header.root = level[0].child;
+    free(level);
+
+    if (ret == 0) ret = id_tree_write_header(&tree);
+    int phase = profile_enter(PHASE_WRITE);
+    if (ret == 0 && fsync(tree.fd) != 0) ret = -1;
+    profile_leave(phase, 0);
+    close(tree.fd);
+    if (ret != 0 || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Open every index of a table: its id tree (if it has one) and every
+ * <table>.<field>.idx file.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    IdTree tree;                // fd is -1 without a tree
+    HashIndex* items;
+    int count;
+} TableIndexes;
+
+static void table_indexes_close(TableIndexes* indexes) {
+    id_tree_close(&indexes->tree);
+    for (int i = 0; i < indexes->count; i++) {
+        hash_index_close(&indexes->items[i]);
+    }
+    free(indexes->items);
+    indexes->items = NULL;
+    indexes->count = 0;
+}
+
+static int table_indexes_open(const char* db_path, const char* table_name,
+                              TableIndexes* indexes) {
+    indexes->items = NULL;
+    indexes->count = 0;
+    id_tree_open(db_path, table_name, &indexes->tree);
+
+    DIR* dir = opendir(db_path);
+    if (!dir) return -1;
+
+    size_t prefix_len = strlen(table_name);
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        size_t name_len = strlen(de->d_name);
+        if (name_len <= prefix_len + 1 + 4 ||
+            strncmp(de->d_name, table_name, prefix_len) != 0 ||
+            de->d_name[prefix_len] != '.' ||
+            strcmp(de->d_name + name_len - 4, ".idx") != 0) {
+            continue;
+        }
+        char field[256];
+        size_t field_len = name_len - prefix_len - 1 - 4;
+        if (field_len >= sizeof(field)) continue;
+        memcpy(field, de->d_name + prefix_len + 1, field_len);
+        field[field_len] = '\0';
+        if (!valid_index_field(field)) continue;
+
+        HashIndex* grown = realloc(indexes->items, (indexes->count + 1) * sizeof(HashIndex));
+        if (!grown) break;
+        indexes->items = grown;
+        if (hash_index_open(db_path, table_name, field, &indexes->items[indexes->count]) == 0) {
+            indexes->count++;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static HashIndex* table_indexes_find(TableIndexes* indexes, const char* field) {
+    for (int i = 0; i < indexes->count; i++) {
+        if (strcmp(indexes->items[i].field, field) == 0) return &indexes->items[i];
+    }
+    return NULL;
+}
+
+static const char* record_string_field(const cJSON* record, const char* field) {
+    const cJSON* value = cJSON_GetObjectItemCaseSensitive(record, field);
+    return cJSON_IsString(value) ? value->valuestring : NULL;
+}
+
+// Keep the indexes in step with one record being replaced, added or removed.
+// Returns -1 if an index could not be written; the caller must not commit
+// then, so that the next writer rebuilds the indexes (see paged_recover()).
+static int table_indexes_update(TableIndexes* indexes,
+                                const cJSON* old_record, uint64_t old_rowref,
+                                const cJSON* new_record, uint64_t new_rowref) {
+    if (indexes->tree.fd >= 0) {
+        uint64_t old_key = 0, new_key = 0;
+        bool had = old_record && parse_id_key(record_string_field(old_record, "id"), &old_key);
+        bool has = new_record && parse_id_key(record_string_field(new_record, "id"), &new_key);
+        if (had && (!has || old_key != new_key) &&
+            id_tree_remove(&indexes->tree, old_key) != 0) {
+            return -1;
+        }
+        if (has && !(had && old_key == new_key && old_rowref == new_rowref) &&
+            id_tree_put(&indexes->tree, new_key, new_rowref, 0) != 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < indexes->count; i++) {
+        HashIndex* idx = &indexes->items[i];
+        const char* old_value = old_record ? record_string_field(old_record, idx->field) : NULL;
+        const char* new_value = new_record ? record_string_field(new_record, idx->field) : NULL;
+        if (old_value && new_value && old_rowref == new_rowref &&
+            strcmp(old_value, new_value) == 0) {
+            continue;
+        }
+        if ((old_value && hash_index_remove(idx, old_value, old_rowref) != 0) ||
+            (new_value && hash_index_insert(idx, new_value, new_rowref, 0) != 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Rebuild the indexes of a JSON table from the records just written to
+ * 'filepath' by save_table(); 'spans' holds each record's offset and length.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+} RecordSpan;
+
+static int rebuild_json_indexes(const char* db_path, const char* table_name,
+                                const char* filepath, cJSON* root, const RecordSpan* spans) {
+    TableIndexes indexes;
+    if (table_indexes_open(db_path, table_name, &indexes) != 0) {
+        table_indexes_close(&indexes);
+        return 0;
+    }
+
+    struct stat st;
+    FileStamp stamp;
+    int ret = stat(filepath, &st) == 0 ? 0 : -1;
+    file_stamp_of(&st, &stamp);
+
+    // The id tree, keeping the high-water mark of the old one
+    size_t count = (size_t)cJSON_GetArraySize(root);
+    BTreeLeafEntry* entries = malloc((count ? count : 1) * sizeof(BTreeLeafEntry));
+    if (ret == 0 && entries) {
+        size_t n = 0, keyed = 0;
+        cJSON* item = NULL;
+        cJSON_ArrayForEach(item, root) {
+            uint64_t key;
+            if (parse_id_key(record_string_field(item, "id"), &key)) {
+                entries[keyed++] = (BTreeLeafEntry){ key, spans[n].offset, spans[n].length, 0 };
+            }
+            n++;
+        }
+        uint64_t max_id = indexes.tree.fd >= 0 ? indexes.tree.header.max_id : 0;
+        ret = id_tree_build(db_path, table_name, entries, keyed, max_id, &stamp);
+    } else {
+        ret = -1;
+    }
+    free(entries);
+
+    for (int i = 0; i < indexes.count && ret == 0; i++) {
+        IndexBuilder b;
+        if (index_builder_init(&b, count, hash_index_ordered(&indexes.items[i])) != 0) {
+            ret = -1;
+            break;
+        }
+        size_t n = 0;
+        cJSON* item = NULL;
+        cJSON_ArrayForEach(item, root) {
+            const char* value = record_string_field(item, indexes.items[i].field);
+            if (value && index_builder_add(&b, value, spans[n].offset, spans[n].length) != 0) {
+                ret = -1;
+                break;
+            }
+            n++;
+        }
+        char path[1024];
+        index_path(db_path, table_name, indexes.items[i].field, path, sizeof(path));
+        if (ret == 0) ret = index_builder_write(&b, path, &stamp);
+        index_builder_free(&b);
+    }
+    table_indexes_close(&indexes);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Utility: Map an open file read-only, so it can be parsed or scanned in
+ * place without copying it to the heap. The kernel is told we read it front
+ * to back. Files that can't be mapped (empty ones, some file systems) are
+ * read into a heap buffer instead. Returns 0 on success.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    char* data;
+    size_t len;
+    bool mapped;
+} MappedFile;
+
+static int map_fd(int fd, MappedFile* m) {
+    struct stat st;
+    m->data = NULL;
+    m->len = 0;
+    m->mapped = false;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    m->len = (size_t)st.st_size;
+    if (m->len == 0) {
+        return 0;
+    }
+
+    void* data = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+        madvise(data, m->len, MADV_SEQUENTIAL);
+        m->data = data;
+        m->mapped = true;
+        return 0;
+    }
+
+    m->data = malloc(m->len);
+    if (!m->data) {
+        return -1;
+    }
+    int phase = profile_enter(PHASE_READ);
+    size_t total = 0;
+    while (total < m->len) {
+        ssize_t n = pread(fd, m->data + total, m->len - total, (off_t)total);
+        if (n <= 0) break;
+        total += (size_t)n;
+    }
+    profile_leave(phase, total);
+    m->len = total;
+    return 0;
+}
+
+static void unmap_file(MappedFile* m) {
+    if (m->mapped) munmap(m->data, m->len);
+    else free(m->data);
+    m->data = NULL;
+    m->len = 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Compressed table files
+ *
+ * A JSON table created with "--format compressed" (or converted by 'compact
+ * <table> --compressed') keeps the same array text in <table>.json, cut into
+ * ZTABLE_BLOCK_SIZE blocks that are compressed one by one:
+ *
+ *   header (64 bytes) | block 0 | block 1 | ... | block index
+ *
+ * Block n holds bytes [n * block_size, (n + 1) * block_size) of the text, so
+ * offsets into the table (what the indexes store) mean the same in both
+ * kinds of file, and reading a record decompresses the block(s) it is in.
+ * A block that doesn't get smaller is stored as is (packed_len == raw_len).
+ *
+ * The codec is LZ77 in the LZ4 block layout: a token byte with the literal
+ * count and match length (15 means more length bytes follow, 255 at a time),
+ * the literals, then a 16-bit offset back into the block; the last sequence
+ * has literals only. Matches are found through a hash of the next 4 bytes.
+ * -------------------------------------------------------------------------- */
+#define ZTABLE_MAGIC       "SDBZJSN1"
+#define ZTABLE_HEADER_SIZE 64
+#define ZTABLE_BLOCK_SIZE  (64 * 1024)
+#define ZTABLE_MAX_THREADS 8
+#define ZHASH_BITS         14
+#define ZMIN_MATCH         4
+
+typedef struct {
+    char magic[8];
+    uint64_t raw_size;          // length of the array text
+    uint64_t index_offset;      // where the block index starts
+    uint32_t block_size;
+    uint32_t block_count;
+    char reserved[32];
+} ZTableHeader;
+
+typedef struct {
+    uint64_t offset;            // of the packed block in the file
+    uint32_t packed_len;
+    uint32_t raw_len;
+} ZBlock;
+
+static uint32_t load_u32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static size_t zemit_length(char* dst, size_t pos, size_t n) {
+    for (; n >= 255; n -= 255) dst[pos++] = (char)255;
+    dst[pos++] = (char)n;
+    return pos;
+}
+
+// Compress 'len' bytes (at most 64K); 0 if the result wouldn't be smaller.
+static size_t zblock_compress(const char* src, size_t len, char* dst) {
+    uint32_t table[1 << ZHASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t cap = len ? len - 1 : 0, out = 0, anchor = 0, i = 0;
+    while (i + ZMIN_MATCH <= len) {
+        uint32_t seq = load_u32(src + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - ZHASH_BITS);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)i + 1;
+        if (!candidate || load_u32(src + candidate - 1) != seq) {
+            i++;
             continue;
         }
-        cJSON_AddStringToObject(new_record, fields[i].key, fields[i].val);
+        size_t from = candidate - 1, match = ZMIN_MATCH;
+        while (i + match < len && src[from + match] == src[i + match]) match++;
+
+        size_t literals = i - anchor;
+        // Worst case for this sequence: token, both lengths, literals, offset
+        if (out + 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1 > cap) return 0;
+        char* token = dst + out++;
+        *token = (char)((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15) out = zemit_length(dst, out, literals - 15);
+        memcpy(dst + out, src + anchor, literals);
+        out += literals;
+        uint16_t offset = (uint16_t)(i - from);
+        memcpy(dst + out, &offset, sizeof(offset));
+        out += sizeof(offset);
+        size_t extra = match - ZMIN_MATCH;
+        *token |= (char)(extra < 15 ? extra : 15);
+        if (extra >= 15) out = zemit_length(dst, out, extra - 15);
+        i += match;
+        anchor = i;
+        if (i >= 2 && i + ZMIN_MATCH <= len) {
+            table[(load_u32(src + i - 2) * 2654435761u) >> (32 - ZHASH_BITS)] = (uint32_t)i - 1;
+        }
+    }
+    size_t literals = len - anchor;
+    if (out + 1 + literals / 255 + 1 + literals > cap) return 0;
+    dst[out++] = (char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) out = zemit_length(dst, out, literals - 15);
+    memcpy(dst + out, src + anchor, literals);
+    return out + literals;
+}
+
+static bool zread_length(const unsigned char* src, size_t len, size_t* pos, size_t* n) {
+    unsigned char b;
+    do {
+        if (*pos >= len) return false;
+        b = src[(*pos)++];
+        *n += b;
+    } while (b == 255);
+    return true;
+}
+
+// Returns 0 if 'src' decompresses to exactly 'raw_len' bytes.
+static int zblock_decompress(const char* packed, size_t len, char* dst, size_t raw_len) {
+    const unsigned char* src = (const unsigned char*)packed;
+    size_t pos = 0, out = 0;
+    while (pos < len) {
+        unsigned char token = src[pos++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !zread_length(src, len, &pos, &literals)) return -1;
+        if (literals > len - pos || literals > raw_len - out) return -1;
+        if (literals <= 16 && len - pos >= 16 && raw_len - out >= 16) {
+            memcpy(dst + out, src + pos, 16);    // one fixed-size copy for short runs
+        } else {
+            memcpy(dst + out, src + pos, literals);
+        }
+        pos += literals;
+        out += literals;
+        if (pos == len) break;
+
+        uint16_t offset;
+        if (len - pos < sizeof(offset)) return -1;
+        memcpy(&offset, src + pos, sizeof(offset));
+        pos += sizeof(offset);
+        size_t match = token & 15;
+        if (match == 15 && !zread_length(src, len, &pos, &match)) return -1;
+        match += ZMIN_MATCH;
+        if (offset == 0 || offset > out || match > raw_len - out) return -1;
+        char* to = dst + out;
+        const char* from = to - offset;
+        if (offset >= 16 && raw_len - out >= match + 16) {
+            // 16 bytes at a time, spilling past the match into bytes that
+            // are written again later
+            for (size_t k = 0; k < match; k += 16) memcpy(to + k, from + k, 16);
+        } else if (offset >= match) {
+            memcpy(to, from, match);
+        } else if (offset == 1) {
+            memset(to, from[0], match);
+        } else {
+            // The match overlaps what it copies: byte by byte
+            for (size_t k = 0; k < match; k++) to[k] = from[k];
+        }
+        out += match;
+    }
+    return out == raw_len ? 0 : -1;
+}
+
+/* ---- Writing: a stdio stream that compresses what is written to it ----- */
+typedef struct {
+    FILE* out;
+    char* block;                // the raw block being filled
+    size_t fill;
+    char* packed;
+    ZBlock* blocks;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t offset;            // where the next block goes
+    uint64_t raw_size;
+    bool failed;
+} ZTableWriter;
+
+static int ztable_writer_flush(ZTableWriter* w) {
+    if (w->fill == 0 || w->failed) return w->failed ? -1 : 0;
+    if (w->count == w->capacity) {
+        uint32_t capacity = w->capacity ? w->capacity * 2 : 64;
+        ZBlock* grown = realloc(w->blocks, capacity * sizeof(ZBlock));
+        if (!grown) return -1;
+        w->blocks = grown;
+        w->capacity = capacity;
+    }
+    size_t packed_len = zblock_compress(w->block, w->fill, w->packed);
+    const char* data = packed_len ? w->packed : w->block;
+    if (!packed_len) packed_len = w->fill;
+    if (fwrite(data, 1, packed_len, w->out) != packed_len) return -1;
+    w->blocks[w->count++] = (ZBlock){ w->offset, (uint32_t)packed_len, (uint32_t)w->fill };
+    w->offset += packed_len;
+    w->raw_size += w->fill;
+    w->fill = 0;
+    return 0;
+}
+
+static ssize_t ztable_writer_write(void* cookie, const char* data, size_t len) {
+    ZTableWriter* w = (ZTableWriter*)cookie;
+    size_t done = 0;
+    while (done < len && !w->failed) {
+        size_t n = ZTABLE_BLOCK_SIZE - w->fill < len - done ? ZTABLE_BLOCK_SIZE - w->fill
+                                                           : len - done;
+        memcpy(w->block + w->fill, data + done, n);
+        w->fill += n;
+        done += n;
+        if (w->fill == ZTABLE_BLOCK_SIZE && ztable_writer_flush(w) != 0) w->failed = true;
+    }
+    return w->failed ? 0 : (ssize_t)len;
+}
+
+// The last block, the index and the header, then the file is synced.
+static int ztable_writer_close(void* cookie) {
+    ZTableWriter* w = (ZTableWriter*)cookie;
+    ZTableHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ZTABLE_MAGIC, sizeof(header.magic));
+    int ret = ztable_writer_flush(w);
+    header.raw_size = w->raw_size;
+    header.index_offset = w->offset;
+    header.block_size = ZTABLE_BLOCK_SIZE;
+    header.block_count = w->count;
+    if (ret == 0 && fwrite(w->blocks, sizeof(ZBlock), w->count, w->out) != w->count) ret = -1;
+    if (ret == 0 && (fseek(w->out, 0, SEEK_SET) != 0 ||
+                     fwrite(&header, sizeof(header), 1, w->out) != 1 ||
+                     fflush(w->out) != 0 || fsync(fileno(w->out)) != 0)) {
+        ret = -1;
+    }
+    if (fclose(w->out) != 0) ret = -1;
+    free(w->block);
+    free(w->packed);
+    free(w->blocks);
+    free(w);
+    return ret;
+}
+
+// A new table file at 'path' to print a table's array text into, compressed
+// if asked; table_file_finish() makes it durable and closes it.
+static FILE* table_file_create(const char* path, bool compressed) {
+    FILE* out = fopen(path, "w");
+    if (!out || !compressed) return out;
+
+    char zeros[ZTABLE_HEADER_SIZE] = { 0 };
+    ZTableWriter* w = calloc(1, sizeof(ZTableWriter));
+    if (w) {
+        w->out = out;
+        w->offset = ZTABLE_HEADER_SIZE;
+        w->block = malloc(ZTABLE_BLOCK_SIZE);
+        w->packed = malloc(ZTABLE_BLOCK_SIZE);
+    }
+    cookie_io_functions_t io = { NULL, ztable_writer_write, NULL, ztable_writer_close };
+    FILE* stream = w && w->block && w->packed &&
+                   fwrite(zeros, sizeof(zeros), 1, out) == 1 ? fopencookie(w, "w", io) : NULL;
+    if (!stream) {
+        if (w) {
+            free(w->block);
+            free(w->packed);
+        }
+        free(w);
+        fclose(out);
+        unlink(path);
+    }
+    return stream;
+}
+
+static int table_file_finish(FILE* out) {
+    int ret = 0;
+    // A compressed stream syncs the file itself as it closes
+    if (fflush(out) != 0 || (fileno(out) >= 0 && fsync(fileno(out)) != 0)) ret = -1;
+    if (fclose(out) != 0) ret = -1;
+    return ret;
+}
+
+// Like write_file_atomic(), for the array text of a table.
+static int write_table_atomic(const char* filepath, const char* data, size_t len,
+                              bool compressed) {
+    if (!compressed) return write_file_atomic(filepath, data);
+    char temp_path[1100];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d", filepath, (int)getpid());
+    FILE* out = table_file_create(temp_path, true);
+    if (!out) return -1;
+    int phase = profile_enter(PHASE_WRITE);
+    int ret = fwrite(data, 1, len, out) == len ? 0 : -1;
+    if (table_file_finish(out) != 0) ret = -1;
+    profile_leave(phase, len);
+    if (ret == 0 && rename(temp_path, filepath) != 0) ret = -1;
+    if (ret != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return fsync_parent_dir(filepath);
+}
+
+/* ---- Reading --------------------------------------------------------- */
+typedef struct {
+    int fd;
+    ZTableHeader header;
+    ZBlock* blocks;             // NULL if the file isn't compressed
+    char* cache;                // the last block read in part
+    uint32_t cached;            // its number, UINT32_MAX for none
+    char* packed;
+} ZTable;
+
+static void ztable_close(ZTable* z) {
+    free(z->blocks);
+    free(z->cache);
+    free(z->packed);
+    memset(z, 0, sizeof(*z));
+    z->fd = -1;
+}
+
+// Returns 0 for a compressed file, 1 for plain text (z->blocks stays NULL)
+// and -1 for a compressed file that is damaged. The fd stays the caller's.
+static int ztable_open(int fd, ZTable* z) {
+    memset(z, 0, sizeof(*z));
+    z->fd = fd;
+    z->cached = UINT32_MAX;
+    struct stat st;
+    if (fd < 0 || pread(fd, &z->header, sizeof(z->header), 0) != (ssize_t)sizeof(z->header) ||
+        memcmp(z->header.magic, ZTABLE_MAGIC, sizeof(z->header.magic)) != 0) {
+        return 1;
+    }
+    size_t index_len = (size_t)z->header.block_count * sizeof(ZBlock);
+    if (fstat(fd, &st) != 0 || z->header.block_size != ZTABLE_BLOCK_SIZE ||
+        z->header.index_offset + index_len != (uint64_t)st.st_size ||
+        (z->header.raw_size + ZTABLE_BLOCK_SIZE - 1) / ZTABLE_BLOCK_SIZE != z->header.block_count) {
+        return -1;
+    }
+    z->blocks = malloc(index_len ? index_len : 1);
+    z->cache = malloc(ZTABLE_BLOCK_SIZE);
+    z->packed = malloc(ZTABLE_BLOCK_SIZE);
+    if (!z->blocks || !z->cache || !z->packed ||
+        pread(fd, z->blocks, index_len, (off_t)z->header.index_offset) != (ssize_t)index_len) {
+        ztable_close(z);
+        return -1;
+    }
+    for (uint32_t i = 0; i < z->header.block_count; i++) {
+        const ZBlock* b = &z->blocks[i];
+        uint64_t expected = i + 1 < z->header.block_count
+            ? ZTABLE_BLOCK_SIZE : z->header.raw_size - (uint64_t)i * ZTABLE_BLOCK_SIZE;
+        if (b->raw_len != expected || b->packed_len > b->raw_len ||
+            b->offset + b->packed_len > z->header.index_offset) {
+            ztable_close(z);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Block 'n' into 'dst', through 'packed' (ZTABLE_BLOCK_SIZE bytes) as scratch.
+static int ztable_read_block(const ZTable* z, uint32_t n, char* packed, char* dst) {
+    const ZBlock* b = &z->blocks[n];
+    bool stored = b->packed_len == b->raw_len;
+    char* into = stored ? dst : packed;
+    if (pread(z->fd, into, b->packed_len, (off_t)b->offset) != (ssize_t)b->packed_len) return -1;
+    return stored ? 0 : zblock_decompress(packed, b->packed_len, dst, b->raw_len);
+}
+
+typedef struct {
+    const ZTable* z;
+    char* dst;                  // where block 'first' goes
+    uint32_t first;
+    uint32_t count;
+    uint32_t step;              // this worker takes every step-th block
+    char* packed;
+    int ret;
+    pthread_t thread;
+    bool started;
+} ZReadWorker;
+
+static void* ztable_read_worker(void* arg) {
+    ZReadWorker* w = (ZReadWorker*)arg;
+    w->ret = 0;
+    for (uint32_t i = 0; i < w->count && w->ret == 0; i += w->step) {
+        w->ret = ztable_read_block(w->z, w->first + i, w->packed,
+                                   w->dst + (size_t)i * ZTABLE_BLOCK_SIZE);
+    }
+    return NULL;
+}
+
+// Whole blocks [first, first + count) into 'dst', spread over threads.
+static int ztable_read_blocks(const ZTable* z, uint32_t first, uint32_t count, char* dst) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t n = cpus < 1 ? 1 : cpus > ZTABLE_MAX_THREADS ? ZTABLE_MAX_THREADS : (uint32_t)cpus;
+    if (n > count) n = count;
+    ZReadWorker workers[ZTABLE_MAX_THREADS];
+    char* scratch = malloc((size_t)n * ZTABLE_BLOCK_SIZE);
+    if (!scratch) return -1;
+    for (uint32_t i = 0; i < n; i++) {
+        workers[i] = (ZReadWorker){ z, dst + (size_t)i * ZTABLE_BLOCK_SIZE, first + i,
+                                    count - i, n, scratch + (size_t)i * ZTABLE_BLOCK_SIZE,
+                                    0, 0, false };
+        // The calling thread takes the first share
+        workers[i].started = i > 0 && pthread_create(&workers[i].thread, NULL,
+                                                     ztable_read_worker, &workers[i]) == 0;
+    }
+    int ret = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!workers[i].started) ztable_read_worker(&workers[i]);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        if (workers[i].started) pthread_join(workers[i].thread, NULL);
+        if (workers[i].ret != 0) ret = -1;
+    }
+    free(scratch);
+    return ret;
+}
+
+// Like pread() on the uncompressed text: the blocks wholly inside the range
+// are decompressed in parallel, a block read in part is kept for the next
+// call (scans and index lookups both move forward through the file).
+static ssize_t ztable_pread(ZTable* z, char* buf, size_t len, uint64_t offset) {
+    if (offset >= z->header.raw_size) return 0;
+    if (len > z->header.raw_size - offset) len = (size_t)(z->header.raw_size - offset);
+    size_t done = 0;
+    while (done < len) {
+        uint64_t at = offset + done;
+        uint32_t n = (uint32_t)(at / ZTABLE_BLOCK_SIZE);
+        size_t in_block = (size_t)(at % ZTABLE_BLOCK_SIZE);
+        uint32_t whole = in_block == 0 ? (uint32_t)((len - done) / ZTABLE_BLOCK_SIZE) : 0;
+        if (whole > 0 && (whole > 1 || n != z->cached)) {
+            if (ztable_read_blocks(z, n, whole, buf + done) != 0) {
+                errno = EIO;
+                return -1;
+            }
+            done += (size_t)whole * ZTABLE_BLOCK_SIZE;
+            continue;
+        }
+        if (n != z->cached) {
+            z->cached = UINT32_MAX;
+            if (ztable_read_block(z, n, z->packed, z->cache) != 0) {
+                errno = EIO;
+                return -1;
+            }
+            z->cached = n;
+        }
+        size_t take = z->blocks[n].raw_len - in_block;
+        if (take > len - done) take = len - done;
+        memcpy(buf + done, z->cache + in_block, take);
+        done += take;
+    }
+    return (ssize_t)len;
+}
+
+// The whole text of a compressed table file, as if mapped.
+static int ztable_map(ZTable* z, MappedFile* m) {
+    m->data = NULL;
+    m->len = 0;
+    m->mapped = false;
+    if (z->header.raw_size == 0) return 0;
+    m->data = malloc(z->header.raw_size);
+    if (!m->data) return -1;
+    int phase = profile_enter(PHASE_READ);
+    ssize_t n = ztable_pread(z, m->data, z->header.raw_size, 0);
+    profile_leave(phase, z->header.raw_size);
+    if (n != (ssize_t)z->header.raw_size) {
+        unmap_file(m);
+        return -1;
+    }
+    m->len = z->header.raw_size;
+    return 0;
+}
+
+// Whether the table file at 'filepath' is compressed.
+static bool table_file_compressed(const char* filepath) {
+    char magic[sizeof(ZTABLE_MAGIC) - 1];
+    int fd = open(filepath, O_RDONLY);
+    bool compressed = fd >= 0 && read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+                      memcmp(magic, ZTABLE_MAGIC, sizeof(magic)) == 0;
+    if (fd >= 0) close(fd);
+    return compressed;
+}
+
+/* --------------------------------------------------------------------------
+ * Parse table file content, falling back to an empty array if the content
+ * is missing, unparsable or not an array.
+ * -------------------------------------------------------------------------- */
+static cJSON* parse_table_content(const char* content, size_t len) {
+    cJSON* root = NULL;
+
+    if (content) {
+        // Parse the JSON straight from the file's bytes
+        root = json_parse(content, len);
+
+        // If parse failed or root is not an array, create a new array
+        if (!root || !cJSON_IsArray(root)) {
+            if (root) {
+                cJSON_Delete(root);
+            }
+            root = cJSON_CreateArray();
+        }
+    } else {
+        // File not found, empty or not readable; let's assume it's just empty
+        root = cJSON_CreateArray();
+    }
+
+    return root;
+}
+
+// Parse an open table file (-1 for a missing one) through a mapping, or
+// all of its blocks decompressed if it is compressed.
+static cJSON* parse_table_fd(int fd) {
+    MappedFile m = { NULL, 0, false };
+    ZTable z;
+    int compressed = ztable_open(fd, &z);
+    if (compressed == 0) {
+        ztable_map(&z, &m);
+    } else if (compressed == 1 && fd >= 0) {
+        map_fd(fd, &m);
+    }
+    ztable_close(&z);
+    cJSON* root = parse_table_content(m.data, m.len);
+    unmap_file(&m);
+    return root;
+}
+
+/* --------------------------------------------------------------------------
+ * Load the JSON array from <table>.json, or create an empty JSON array if file
+ * doesn't exist. Return a cJSON pointer, or NULL on error.
+ * This is the table file alone; load_table() adds pending WAL entries.
+ * -------------------------------------------------------------------------- */
+static cJSON* load_table_file(const char* db_path, const char* table_name) {
+    // Construct the file path: e.g., db_path/users.json
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+
+    int fd = open(filepath, O_RDONLY);
+    cJSON* root = parse_table_fd(fd);
+    if (fd >= 0) close(fd);
+    return root;
+}
+
+/* --------------------------------------------------------------------------
+ * Write the JSON array back to <table>.json (atomically) and rebuild the
+ * table's indexes. Records are printed one at a time so their offsets in
+ * the file are known; the bytes are the same as printing the whole array.
+ * save_table() keeps the file compressed or plain as it was.
+ * -------------------------------------------------------------------------- */
+static int save_table_file(const char* db_path, const char* table_name, cJSON* root,
+                           bool compressed) {
+    if (!root) return -1;
+
+    size_t count = (size_t)cJSON_GetArraySize(root);
+    RecordSpan* spans = malloc((count ? count : 1) * sizeof(RecordSpan));
+    size_t capacity = 4096, len = 0;
+    char* print_buffer = malloc(capacity);
+    if (!spans || !print_buffer) {
+        free(spans);
+        free(print_buffer);
+        return -1;
+    }
+
+    print_buffer[len++] = '[';
+    size_t n = 0;
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, root) {
+        char* text = json_print(item);
+        if (!text) {
+            free(spans);
+            free(print_buffer);
+            return -1;
+        }
+        size_t text_len = strlen(text);
+        if (len + text_len + 3 > capacity) {
+            while (len + text_len + 3 > capacity) capacity *= 2;
+            char* grown = realloc(print_buffer, capacity);
+            if (!grown) {
+                cJSON_free(text);
+                free(spans);
+                free(print_buffer);
+                return -1;
+            }
+            print_buffer = grown;
+        }
+        if (n > 0) print_buffer[len++] = ',';
+        spans[n].offset = len;
+        spans[n].length = (uint32_t)text_len;
+        memcpy(print_buffer + len, text, text_len);
+        len += text_len;
+        cJSON_free(text);
+        n++;
+    }
+    print_buffer[len++] = ']';
+    print_buffer[len] = '\0';
+
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+
+    int ret = write_table_atomic(filepath, print_buffer, len, compressed);
+    free(print_buffer);
+    if (ret == 0) {
+        ret = rebuild_json_indexes(db_path, table_name, filepath, root, spans);
+    }
+    free(spans);
+    return ret;
+}
+
+static int save_table(const char* db_path, const char* table_name, cJSON* root) {
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+    return save_table_file(db_path, table_name, root, table_file_compressed(filepath));
+}
+
+/* --------------------------------------------------------------------------
+ * Write-ahead log: <db-path>/simpledb.wal
+ *
+ * 'save' and 'delete' on JSON tables don't rewrite <table>.json. They append
+ * one entry to the WAL shared by all tables of the database, and the table
+ * files are brought up to date by a checkpoint once the log grows past
+ * WAL_CHECKPOINT_BYTES (or on an explicit 'checkpoint'). load_table() replays
+ * the entries of its table on top of the file, which is also how the changes
+ * since the last checkpoint are recovered after a crash.
+ *
+ * Each entry is a u32 payload length, a u32 CRC-32 of the payload and the
+ * payload itself, a JSON object such as
+ *     {"table":"users","op":"save","record":{"id":"1","name":"Bob"}}
+ *     {"table":"users","op":"delete","field":"id","value":"1"}
+ * A 'save' entry holds the complete record, so replaying the log is
+ * idempotent. A torn entry at the tail (crash mid-append) ends the replay.
+ *
+ * Group commit: appends are serialized by an OFD lock on byte 0 of the log,
+ * fsyncs by a lock on byte 1. The header remembers how far the last fsync
+ * reached, so a writer that waited for the fsync lock while another process
+ * was syncing usually finds its entry already durable, and all writers that
+ * queued up behind one fsync share the next one.
+ *
+ * A checkpoint never truncates the log in place. It seals it, folds it into
+ * the table files and then renames a fresh log over it. Until the rename a
+ * table file is either the old one or the old one with the log folded in, and
+ * replaying the complete sealed log gives the same records on top of both, so
+ * readers go on using a sealed log. Only writers finish a checkpoint.
+ *
+ * Optimistic writes: 'save' reads a record, merges into it and logs the
+ * result without holding any lock in between. The TableVersion it read at
+ * is checked again under the append lock; if the table file was replaced
+ * or the log has a newer entry for the same record (or a delete on the
+ * table), the append is refused with WAL_CONFLICT and the caller starts
+ * over from a fresh read. Readers never take a lock.
+ * -------------------------------------------------------------------------- */
+#define WAL_FILE_NAME        "simpledb.wal"
+#define WAL_MAGIC            "SDBWAL01"
+#define WAL_HEADER_SIZE      64
+#define WAL_CHECKPOINT_BYTES (4 * 1024 * 1024)
+
+#define WAL_LOCK_APPEND 0
+#define WAL_LOCK_SYNC   1
+
+#define WAL_CONFLICT 1
+
+typedef struct {
+    char     magic[8];
+    uint64_t synced_end;    // everything before this offset is on disk
+    uint32_t sealed;        // set while a checkpoint folds this log away
+    uint32_t reserved;
+} WalHeader;
+
+// What a JSON table looked like when a writer read it.
+typedef struct {
+    FileStamp table;        // zero if the table had no file
+    uint64_t wal_ino;       // 0 if there was no log
+    uint64_t wal_end;       // how much of the log there was
+} TableVersion;
+
+// Called for every entry of the log; a non-zero return stops the replay.
+typedef int (*WalEntryCallback)(cJSON* entry, void* ctx);
+
+static uint32_t crc32_bytes(const char* data, size_t len) {
+    static uint32_t table[256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_ready = true;
+    }
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static int wal_path(const char* db_path, char* buffer, size_t size) {
+    int n = snprintf(buffer, size, "%s/%s", db_path, WAL_FILE_NAME);
+    if (n < 0 || (size_t)n >= size) {
+        fprintf(stderr, "Error: Database path '%s' is too long\n", db_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Take (F_WRLCK) or drop (F_UNLCK) the OFD lock on one byte of 'fd'.
+static int lock_byte(int fd, off_t byte, short type, bool wait) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = byte;
+    fl.l_len = 1;
+    return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
+
+static int wal_read_header(int fd, WalHeader* header) {
+    if (pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header) ||
+        memcmp(header->magic, WAL_MAGIC, sizeof(header->magic)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int wal_write_header(int fd, const WalHeader* header) {
+    char buffer[WAL_HEADER_SIZE];
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, header, sizeof(*header));
+    return pwrite(fd, buffer, sizeof(buffer), 0) == sizeof(buffer) ? 0 : -1;
+}
+
+// Header fields are written one at a time: a checkpoint seals the log under
+// the append lock while writers record synced_end under the sync lock.
+static int wal_write_field(int fd, size_t offset, const void* value, size_t size) {
+    return pwrite(fd, value, size, (off_t)offset) == (ssize_t)size ? 0 : -1;
+}
+
+static bool wal_is_sealed(int fd) {
+    WalHeader header;
+    return wal_read_header(fd, &header) == 0 && header.sealed;
+}
+
+// True if 'path' still names the log open on 'fd'.
+static bool wal_is_current(int fd, const char* path) {
+    struct stat fd_st, path_st;
+    return fstat(fd, &fd_st) == 0 && stat(path, &path_st) == 0 &&
+           fd_st.st_ino == path_st.st_ino;
+}
+
+/* --------------------------------------------------------------------------
+ * Read the entry at 'offset' into '*payload' (grown as needed, NUL-terminated).
+ * Returns the payload length, or -1 if there is no intact entry there.
+ * -------------------------------------------------------------------------- */
+static ssize_t wal_read_frame(int fd, off_t offset, off_t file_size,
+                              char** payload, size_t* capacity) {
+    uint32_t frame[2];
+    if (offset + 8 > file_size ||
+        pread(fd, frame, sizeof(frame), offset) != sizeof(frame) ||
+        frame[0] == 0 || offset + 8 + (off_t)frame[0] > file_size) {
+        return -1;
+    }
+    if (frame[0] + 1 > *capacity) {
+        char* grown = realloc(*payload, frame[0] + 1);
+        if (!grown) return -1;
+        *payload = grown;
+        *capacity = frame[0] + 1;
+    }
+    int phase = profile_enter(PHASE_READ);
+    ssize_t n = pread(fd, *payload, frame[0], offset + 8);
+    profile_leave(phase, frame[0]);
+    if (n != (ssize_t)frame[0] || crc32_bytes(*payload, frame[0]) != frame[1]) {
+        return -1;
+    }
+    (*payload)[frame[0]] = '\0';
+    return frame[0];
+}
+
+/* --------------------------------------------------------------------------
+ * Call 'fn' for every intact entry of the log open on 'fd'.
+ * -------------------------------------------------------------------------- */
+static int wal_for_each(int fd, WalEntryCallback fn, void* ctx) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+
+    off_t offset = WAL_HEADER_SIZE;
+    char* payload = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while ((len = wal_read_frame(fd, offset, st.st_size, &payload, &capacity)) > 0) {
+        cJSON* entry = json_parse(payload, (size_t)len);
+        int stop = entry ? fn(entry, ctx) : 0;
+        cJSON_Delete(entry);
+        if (stop) break;
+        offset += 8 + len;
+    }
+    free(payload);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Cut off a torn entry left at the end of the log by a crash, so that new
+ * entries are not appended behind it. Everything before the header's
+ * synced_end is known to be intact; only the part after it is checked.
+ * Must be called with the append lock held.
+ * -------------------------------------------------------------------------- */
+static int wal_trim_torn_tail(int fd, const WalHeader* header, off_t file_size) {
+    off_t offset = (off_t)header->synced_end;
+    char* payload = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    while ((len = wal_read_frame(fd, offset, file_size, &payload, &capacity)) > 0) {
+        offset += 8 + len;
+    }
+    free(payload);
+    return offset < file_size ? ftruncate(fd, offset) : 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Apply one log entry to a loaded JSON table. 'ids' maps the id of every
+ * record of 'root' to its cJSON node (0 once the record was deleted).
+ * -------------------------------------------------------------------------- */
+static void wal_apply_entry(cJSON* root, IdMap* ids, const cJSON* entry) {
+    const cJSON* op = cJSON_GetObjectItemCaseSensitive(entry, "op");
+    if (!cJSON_IsString(op)) return;
+
+    if (strcmp(op->valuestring, "save") == 0) {
+        const cJSON* record = cJSON_GetObjectItemCaseSensitive(entry, "record");
+        const cJSON* id = cJSON_GetObjectItemCaseSensitive(record, "id");
+        if (!cJSON_IsObject(record) || !cJSON_IsString(id)) return;
+
+        cJSON* copy = cJSON_Duplicate(record, 1);
+        uint64_t existing = 0;
+        if (idmap_get(ids, id->valuestring, &existing) && existing) {
+            cJSON_ReplaceItemViaPointer(root, (cJSON*)(uintptr_t)existing, copy);
+        } else {
+            cJSON_AddItemToArray(root, copy);
+        }
+        idmap_put(ids, id->valuestring, (uintptr_t)copy);
+
+    } else if (strcmp(op->valuestring, "delete") == 0) {
+        const cJSON* field = cJSON_GetObjectItemCaseSensitive(entry, "field");
+        const cJSON* value = cJSON_GetObjectItemCaseSensitive(entry, "value");
+        if (!cJSON_IsString(field) || !cJSON_IsString(value)) return;
+
+        cJSON* item = root->child;
+        while (item) {
+            cJSON* next = item->next;
+            cJSON* field_obj = cJSON_GetObjectItemCaseSensitive(item, field->valuestring);
+            if (cJSON_IsString(field_obj) && strcmp(field_obj->valuestring, value->valuestring) == 0) {
+                cJSON* id = cJSON_GetObjectItemCaseSensitive(item, "id");
+                if (cJSON_IsString(id)) idmap_put(ids, id->valuestring, 0);
+                cJSON_Delete(cJSON_DetachItemViaPointer(root, item));
+            }
+            item = next;
+        }
+    }
+}
+
+typedef struct {
+    const char* table_name;
+    cJSON* root;
+    IdMap ids;
+} WalReplay;
+
+static int wal_replay_callback(cJSON* entry, void* ctx) {
+    WalReplay* replay = (WalReplay*)ctx;
+    const cJSON* table = cJSON_GetObjectItemCaseSensitive(entry, "table");
+    if (cJSON_IsString(table) && strcmp(table->valuestring, replay->table_name) == 0) {
+        wal_apply_entry(replay->root, &replay->ids, entry);
+    }
+    return 0;
+}
+
+// Apply the entries for 'table_name' in the log open on 'fd' to 'root'.
+static int wal_replay(int fd, const char* table_name, cJSON* root) {
+    WalReplay replay = { table_name, root, { 0 } };
+    if (idmap_init(&replay.ids, (size_t)cJSON_GetArraySize(root)) != 0) return -1;
+
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, root) {
+        cJSON* id = cJSON_GetObjectItemCaseSensitive(item, "id");
+        if (cJSON_IsString(id)) idmap_put(&replay.ids, id->valuestring, (uintptr_t)item);
+    }
+    int ret = wal_for_each(fd, wal_replay_callback, &replay);
+    idmap_free(&replay.ids);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Checkpoint: fold every entry of the log into its table file and start a
+ * new, empty log. With 'wait' unset it gives up (returning 0) if another
+ * process is appending or checkpointing. 'hook', if given, runs after the
+ * tables are up to date and before writers may append again. It runs with
+ * the new log already in place, so no reader pairs a table file the hook
+ * rewrote with the old log.
+ * -------------------------------------------------------------------------- */
+typedef int (*CheckpointHook)(void* ctx);
+
+static int wal_open_locked(const char* db_path, bool wait, int* out_fd);
+
+typedef struct {
+    IdMap tables;
+    char** names;
+    size_t count;
+} WalTableSet;
+
+static int collect_tables_callback(cJSON* entry, void* ctx) {
+    WalTableSet* set = (WalTableSet*)ctx;
+    const cJSON* table = cJSON_GetObjectItemCaseSensitive(entry, "table");
+    if (cJSON_IsString(table) && !idmap_get(&set->tables, table->valuestring, NULL)) {
+        char** grown = realloc(set->names, (set->count + 1) * sizeof(char*));
+        if (!grown) return 1;
+        set->names = grown;
+        set->names[set->count++] = strdup(table->valuestring);
+        idmap_put(&set->tables, table->valuestring, 1);
+    }
+    return 0;
+}
+
+// Rename a fresh log over the current one. With 'locked_fd' the new log is
+// returned there with its append lock taken before anyone can open it.
+static int wal_install_fresh(const char* db_path, int* locked_fd) {
+    char path[1024], temp_path[1100];
+    if (wal_path(db_path, path, sizeof(path)) != 0) return -1;
+    snprintf(temp_path, sizeof(temp_path), "%s.new", path);
+
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    WalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAL_MAGIC, sizeof(header.magic));
+    header.synced_end = WAL_HEADER_SIZE;
+    int ret = (wal_write_header(fd, &header) == 0 && fsync(fd) == 0) ? 0 : -1;
+    if (ret == 0 && locked_fd) ret = lock_byte(fd, WAL_LOCK_APPEND, F_WRLCK, true);
+    if (ret == 0 && rename(temp_path, path) != 0) ret = -1;
+    if (ret == 0) ret = fsync_parent_dir(path);
+    if (ret == 0 && locked_fd) {
+        *locked_fd = fd;
+    } else {
+        close(fd);
+    }
+    return ret;
+}
+
+// Checkpoint the log open on 'fd', which the caller holds the append lock of.
+static int wal_checkpoint_locked(const char* db_path, int fd,
+                                 CheckpointHook hook, void* ctx) {
+    WalHeader header;
+    if (wal_read_header(fd, &header) != 0) return -1;
+    if (!header.sealed) {
+        uint32_t sealed = 1;
+        if (wal_write_field(fd, offsetof(WalHeader, sealed), &sealed, sizeof(sealed)) != 0 ||
+            fdatasync(fd) != 0) {
+            return -1;
+        }
+    }
+
+    WalTableSet set = { { 0 }, NULL, 0 };
+    if (idmap_init(&set.tables, 16) != 0) return -1;
+    wal_for_each(fd, collect_tables_callback, &set);
+
+    int ret = 0;
+    for (size_t i = 0; i < set.count && ret == 0; i++) {
+        cJSON* root = load_table_file(db_path, set.names[i]);
+        if (!root || wal_replay(fd, set.names[i], root) != 0 ||
+            save_table(db_path, set.names[i], root) != 0) {
+            fprintf(stderr, "Error: Checkpoint of table %s failed\n", set.names[i]);
+            ret = -1;
+        }
+        cJSON_Delete(root);
+    }
+    for (size_t i = 0; i < set.count; i++) free(set.names[i]);
+    free(set.names);
+    idmap_free(&set.tables);
+
+    int next_fd = -1;
+    if (ret == 0) ret = wal_install_fresh(db_path, hook ? &next_fd : NULL);
+    if (ret == 0 && hook) ret = hook(ctx);
+    if (next_fd >= 0) close(next_fd);  // also drops the lock
+    return ret;
+}
+
+static int wal_checkpoint(const char* db_path, bool wait, CheckpointHook hook, void* ctx) {
+    int fd;
+    int ret = wal_open_locked(db_path, wait, &fd);
+    if (ret != 0) {
+        return wait ? ret : 0;
+    }
+    ret = wal_checkpoint_locked(db_path, fd, hook, ctx);
+    close(fd);  // also drops the lock
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Open the current log and take its append lock, creating the log if needed.
+ * A log replaced by a checkpoint while we waited for the lock is reopened; a
+ * sealed one left behind by a crashed checkpoint is finished first.
+ * -------------------------------------------------------------------------- */
+static int wal_open_locked(const char* db_path, bool wait, int* out_fd) {
+    char path[1024];
+    if (wal_path(db_path, path, sizeof(path)) != 0) return -1;
+
+    for (;;) {
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return -1;
+        if (lock_byte(fd, WAL_LOCK_APPEND, F_WRLCK, wait) != 0) {
+            close(fd);
+            return -1;
+        }
+
+        struct stat fd_st, path_st;
+        if (fstat(fd, &fd_st) != 0 || stat(path, &path_st) != 0 ||
+            fd_st.st_ino != path_st.st_ino) {
+            close(fd);
+            continue;
+        }
+
+        WalHeader header;
+        if (fd_st.st_size == 0) {
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, WAL_MAGIC, sizeof(header.magic));
+            header.synced_end = WAL_HEADER_SIZE;
+            if (wal_write_header(fd, &header) != 0) {
+                close(fd);
+                return -1;
+            }
+        } else if (wal_read_header(fd, &header) != 0) {
+            fprintf(stderr, "Error: %s is not a simpledb log\n", path);
+            close(fd);
+            return -1;
+        } else if (header.sealed) {
+            int ret = wal_checkpoint_locked(db_path, fd, NULL, NULL);
+            close(fd);
+            if (ret != 0) return -1;
+            continue;
+        } else if (wal_trim_torn_tail(fd, &header, fd_st.st_size) != 0) {
+            close(fd);
+            return -1;
+        }
+
+        *out_fd = fd;
+        return 0;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ * True if the record 'entry' saves changed after 'expected' was taken (see
+ * optimistic writes above). 'fd' is the log, with the append lock held.
+ * -------------------------------------------------------------------------- */
+static bool wal_conflicts(const char* db_path, int fd, const cJSON* entry,
+                          const TableVersion* expected) {
+    const char* table_name = record_string_field(entry, "table");
+    const char* id = record_string_field(cJSON_GetObjectItemCaseSensitive(entry, "record"), "id");
+    if (!table_name || !id) return false;
+
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+    struct stat st;
+    FileStamp current;
+    memset(&current, 0, sizeof(current));
+    if (stat(filepath, &st) == 0) file_stamp_of(&st, &current);
+    if (memcmp(&current, &expected->table, sizeof(current)) != 0) return true;
+
+    if (fstat(fd, &st) != 0) return true;
+    off_t seen = st.st_ino == expected->wal_ino ? (off_t)expected->wal_end : WAL_HEADER_SIZE;
+    if (seen >= st.st_size) return false;
+
+    // Start where the reader's view of the log ended, unless an append was
+    // under way then and that is not an entry boundary
+    char* payload = NULL;
+    size_t capacity = 0;
+    off_t offset = wal_read_frame(fd, seen, st.st_size, &payload, &capacity) > 0
+        ? seen : WAL_HEADER_SIZE;
+    bool conflict = false;
+    ssize_t len;
+    while (!conflict &&
+           (len = wal_read_frame(fd, offset, st.st_size, &payload, &capacity)) > 0) {
+        offset += 8 + len;
+        if (offset <= seen) continue;
+        cJSON* logged = json_parse(payload, (size_t)len);
+        const char* table = record_string_field(logged, "table");
+        const char* op = record_string_field(logged, "op");
+        if (table && op && strcmp(table, table_name) == 0) {
+            const cJSON* record = cJSON_GetObjectItemCaseSensitive(logged, "record");
+            const char* logged_id = record_string_field(record, "id");
+            conflict = strcmp(op, "delete") == 0 || (logged_id && strcmp(logged_id, id) == 0);
+        }
+        cJSON_Delete(logged);
+    }
+    free(payload);
+    return conflict;
+}
+
+/* --------------------------------------------------------------------------
+ * Append one entry and return once it is durable (see group commit above).
+ * With 'expected' given, a save is only logged if its record is unchanged
+ * since then; otherwise WAL_CONFLICT is returned.
+ * -------------------------------------------------------------------------- */
+static int wal_append(const char* db_path, const cJSON* entry, const TableVersion* expected) {
+    char* payload = json_print(entry);
+    if (!payload) return -1;
+    size_t len = strlen(payload);
+
+    char* frame = malloc(len + 8);
+    if (!frame) {
+        cJSON_free(payload);
+        return -1;
+    }
+    uint32_t frame_header[2] = { (uint32_t)len, crc32_bytes(payload, len) };
+    memcpy(frame, frame_header, 8);
+    memcpy(frame + 8, payload, len);
+    cJSON_free(payload);
+
+    int fd;
+    int phase = profile_enter(PHASE_WRITE);
+    if (wal_open_locked(db_path, true, &fd) != 0) {
+        profile_leave(phase, 0);
+        free(frame);
+        return -1;
+    }
+    if (expected && wal_conflicts(db_path, fd, entry, expected)) {
+        profile_leave(phase, 0);
+        free(frame);
+        close(fd);
+        return WAL_CONFLICT;
+    }
+    off_t end = lseek(fd, 0, SEEK_END);
+    bool ok = end >= 0 && pwrite(fd, frame, len + 8, end) == (ssize_t)(len + 8);
+    free(frame);
+    lock_byte(fd, WAL_LOCK_APPEND, F_UNLCK, true);
+    if (!ok) {
+        profile_leave(phase, 0);
+        close(fd);
+        return -1;
+    }
+    uint64_t my_end = (uint64_t)end + len + 8;
+
+    // Group commit: whoever holds the sync lock syncs for everybody queued.
+    int ret = 0;
+    lock_byte(fd, WAL_LOCK_SYNC, F_WRLCK, true);
+    WalHeader header;
+    if (wal_read_header(fd, &header) != 0) {
+        ret = -1;
+    } else if (header.synced_end < my_end) {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || fdatasync(fd) != 0) {
+            ret = -1;
+        } else {
+            uint64_t synced_end = (uint64_t)st.st_size;
+            ret = wal_write_field(fd, offsetof(WalHeader, synced_end), &synced_end,
+                                  sizeof(synced_end));
+        }
+    }
+    lock_byte(fd, WAL_LOCK_SYNC, F_UNLCK, true);
+
+    bool needs_checkpoint = lseek(fd, 0, SEEK_END) > WAL_CHECKPOINT_BYTES;
+    close(fd);
+    profile_leave(phase, len + 8);
+    if (ret == 0 && needs_checkpoint) {
+        wal_checkpoint(db_path, false, NULL, NULL);
+    }
+    return ret;
+}
+
+static int wal_log_save(const char* db_path, const char* table_name, const cJSON* record,
+                        const TableVersion* expected) {
+    cJSON* entry = cJSON_CreateObject();
+    if (!entry) return -1;
+    cJSON_AddStringToObject(entry, "table", table_name);
+    cJSON_AddStringToObject(entry, "op", "save");
+    cJSON_AddItemToObject(entry, "record", cJSON_Duplicate(record, 1));
+    int ret = wal_append(db_path, entry, expected);
+    cJSON_Delete(entry);
+    return ret;
+}
+
+static int wal_log_delete(const char* db_path, const char* table_name,
+                          const char* field, const char* value) {
+    cJSON* entry = cJSON_CreateObject();
+    if (!entry) return -1;
+    cJSON_AddStringToObject(entry, "table", table_name);
+    cJSON_AddStringToObject(entry, "op", "delete");
+    cJSON_AddStringToObject(entry, "field", field);
+    cJSON_AddStringToObject(entry, "value", value);
+    int ret = wal_append(db_path, entry, NULL);
+    cJSON_Delete(entry);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * A consistent view of a JSON table: the table file plus the log to replay
+ * on top of it, opened in the order the checkpoint protocol above requires.
+ * table_fd is -1 if the table has no file yet, wal_fd if there is no log.
+ * 'version' is what a writer working from the snapshot passes to wal_append.
+ * Records are read at their offsets with json_snapshot_pread(), through
+ * 'table' if the file is compressed.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    int table_fd;
+    int wal_fd;
+    TableVersion version;
+    ZTable table;
+} JsonSnapshot;
+
+static void json_snapshot_close(JsonSnapshot* snap) {
+    ztable_close(&snap->table);
+    if (snap->table_fd >= 0) close(snap->table_fd);
+    if (snap->wal_fd >= 0) close(snap->wal_fd);
+    snap->table_fd = snap->wal_fd = -1;
+}
+
+static ssize_t json_snapshot_pread(JsonSnapshot* snap, char* buf, size_t len, uint64_t offset) {
+    int phase = profile_enter(PHASE_READ);
+    ssize_t n = snap->table.blocks ? ztable_pread(&snap->table, buf, len, offset)
+                                   : pread(snap->table_fd, buf, len, (off_t)offset);
+    profile_leave(phase, n > 0 ? (uint64_t)n : 0);
+    return n;
+}
+
+static void json_snapshot_open(const char* db_path, const char* table_name,
+                               JsonSnapshot* snap) {
+    char path[1024], filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+
+    memset(&snap->table, 0, sizeof(snap->table));
+    memset(&snap->version, 0, sizeof(snap->version));
+    if (wal_path(db_path, path, sizeof(path)) != 0) {
+        // Leaves an empty snapshot, which readers take as a missing table
+        snap->wal_fd = snap->table_fd = -1;
+        return;
+    }
+    for (;;) {
+        // Open the log before the table file, see above
+        snap->wal_fd = open(path, O_RDONLY);
+        snap->table_fd = open(filepath, O_RDONLY);
+        if (snap->wal_fd >= 0 && wal_is_sealed(snap->wal_fd) &&
+            !wal_is_current(snap->wal_fd, path)) {
+            // The checkpoint has finished, and a later one may have folded
+            // newer entries into the file; the new log is in place, so
+            // start over
+            json_snapshot_close(snap);
+            continue;
+        }
+
+        struct stat st;
+        ztable_open(snap->table_fd, &snap->table);
+        memset(&snap->version, 0, sizeof(snap->version));
+        if (snap->table_fd >= 0 && fstat(snap->table_fd, &st) == 0) {
+            file_stamp_of(&st, &snap->version.table);
+        }
+        if (snap->wal_fd >= 0 && fstat(snap->wal_fd, &st) == 0) {
+            snap->version.wal_ino = (uint64_t)st.st_ino;
+            snap->version.wal_end = (uint64_t)st.st_size;
+        }
+        return;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ * Load a JSON table: the table file plus the pending WAL entries for it,
+ * and the version loaded if 'version' is given.
+ * Return a cJSON pointer, or NULL on error.
+ * -------------------------------------------------------------------------- */
+static cJSON* load_table_version(const char* db_path, const char* table_name,
+                                 TableVersion* version) {
+    JsonSnapshot snap;
+    json_snapshot_open(db_path, table_name, &snap);
+
+    cJSON* root = parse_table_fd(snap.table_fd);
+    if (root && snap.wal_fd >= 0) {
+        wal_replay(snap.wal_fd, table_name, root);
+    }
+    if (version) *version = snap.version;
+    json_snapshot_close(&snap);
+    return root;
+}
+
+static cJSON* load_table(const char* db_path, const char* table_name) {
+    return load_table_version(db_path, table_name, NULL);
+}
+
+/* --------------------------------------------------------------------------
+ * WalOverlay: the pending log entries of one table, in a form that can be
+ * applied to individual records read straight from the table file. Paths
+ * that avoid loading the whole table (such as index lookups) use it to see
+ * the same data load_table() would.
+ * -------------------------------------------------------------------------- */
+#define WAL_SAVED_AFTER_DELETE UINT64_MAX
+
+typedef struct {
+    const char* table_name;
+    cJSON* records;     // latest version of every record saved in the log
+    IdMap ids;          // id -> node in 'records', or 0 if deleted since
+    IdMap since;        // id -> deletes logged before its first save, or
+                        // WAL_SAVED_AFTER_DELETE if the log deleted it first
+    cJSON* deletes;     // every delete entry of the log
+} WalOverlay;
+
+static bool string_field_equals(const cJSON* record, const char* field, const char* value) {
+    const cJSON* field_obj = cJSON_GetObjectItemCaseSensitive(record, field);
+    return cJSON_IsString(field_obj) && strcmp(field_obj->valuestring, value) == 0;
+}
+
+static int wal_overlay_callback(cJSON* entry, void* ctx) {
+    WalOverlay* ov = (WalOverlay*)ctx;
+    const cJSON* table = cJSON_GetObjectItemCaseSensitive(entry, "table");
+    const cJSON* op = cJSON_GetObjectItemCaseSensitive(entry, "op");
+    if (!cJSON_IsString(table) || strcmp(table->valuestring, ov->table_name) != 0 ||
+        !cJSON_IsString(op)) {
+        return 0;
+    }
+
+    if (strcmp(op->valuestring, "save") == 0) {
+        const cJSON* record = cJSON_GetObjectItemCaseSensitive(entry, "record");
+        const char* id = record_string_field(record, "id");
+        if (!id) return 0;
+        cJSON* copy = cJSON_Duplicate(record, 1);
+        uint64_t node = 0;
+        bool known = idmap_get(&ov->ids, id, &node);
+        if (node) {
+            cJSON_ReplaceItemViaPointer(ov->records, (cJSON*)(uintptr_t)node, copy);
+        } else {
+            cJSON_AddItemToArray(ov->records, copy);
+            idmap_put(&ov->since, id, known ? WAL_SAVED_AFTER_DELETE
+                                            : (uint64_t)cJSON_GetArraySize(ov->deletes));
+        }
+        idmap_put(&ov->ids, id, (uintptr_t)copy);
+
+    } else if (strcmp(op->valuestring, "delete") == 0) {
+        const char* field = record_string_field(entry, "field");
+        const char* value = record_string_field(entry, "value");
+        if (!field || !value) return 0;
+        cJSON* item = ov->records->child;
+        while (item) {
+            cJSON* next = item->next;
+            if (string_field_equals(item, field, value)) {
+                idmap_put(&ov->ids, record_string_field(item, "id"), 0);
+                cJSON_Delete(cJSON_DetachItemViaPointer(ov->records, item));
+            }
+            item = next;
+        }
+        cJSON_AddItemToArray(ov->deletes, cJSON_Duplicate(entry, 1));
+    }
+    return 0;
+}
+
+static int wal_overlay_load(int wal_fd, const char* table_name, WalOverlay* ov) {
+    memset(ov, 0, sizeof(*ov));
+    ov->table_name = table_name;
+    ov->records = cJSON_CreateArray();
+    ov->deletes = cJSON_CreateArray();
+    if (!ov->records || !ov->deletes || idmap_init(&ov->ids, 64) != 0 ||
+        idmap_init(&ov->since, 64) != 0) {
+        return -1;
+    }
+    return wal_fd >= 0 ? wal_for_each(wal_fd, wal_overlay_callback, ov) : 0;
+}
+
+static void wal_overlay_free(WalOverlay* ov) {
+    cJSON_Delete(ov->records);
+    cJSON_Delete(ov->deletes);
+    idmap_free(&ov->ids);
+    idmap_free(&ov->since);
+}
+
+// True if one of the first 'count' delete entries of the log matches a
+// record read from the table file.
+static bool wal_overlay_deleted(WalOverlay* ov, const cJSON* record, uint64_t count) {
+    const cJSON* entry = ov->deletes->child;
+    for (uint64_t i = 0; entry && i < count; i++, entry = entry->next) {
+        if (string_field_equals(record, record_string_field(entry, "field"),
+                                record_string_field(entry, "value"))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// True if a record read from the table file is still current: the log
+// neither holds a newer version of it nor deleted it.
+static bool wal_overlay_keeps(WalOverlay* ov, const cJSON* record) {
+    const char* id = record_string_field(record, "id");
+    if (id && idmap_get(&ov->ids, id, NULL)) {
+        return false;
+    }
+    return !wal_overlay_deleted(ov, record, UINT64_MAX);
+}
+
+// True if the log's version of a record read from the table file took its
+// place, as load_table() replaces it, rather than being added after a
+// delete of it (and so at the end of the table).
+static bool wal_overlay_replaces(WalOverlay* ov, const cJSON* record, const char* id) {
+    uint64_t since = 0;
+    if (!idmap_get(&ov->since, id, &since) || since == WAL_SAVED_AFTER_DELETE) {
+        return false;
+    }
+    return !wal_overlay_deleted(ov, record, since);
+}
+
+/* --------------------------------------------------------------------------
+ * Table formats
+ *
+ * A table is stored either as <table>.json (one JSON array, rewritten on every
+ * change), when created with "--format paged" as <table>.db, or when created
+ * with "--format lsm" as the sorted runs listed in <table>.lsm.
+ * -------------------------------------------------------------------------- */
+typedef enum {
+    TABLE_FORMAT_JSON,
+    TABLE_FORMAT_PAGED,
+    TABLE_FORMAT_LSM
+} TableFormat;
+
+static bool file_exists(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static TableFormat table_format(const char* db_path, const char* table_name) {
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.db", db_path, table_name);
+    if (file_exists(filepath)) return TABLE_FORMAT_PAGED;
+    snprintf(filepath, sizeof(filepath), "%s/%s.lsm", db_path, table_name);
+    return file_exists(filepath) ? TABLE_FORMAT_LSM : TABLE_FORMAT_JSON;
+}
+
+/* --------------------------------------------------------------------------
+ * Paged format: <table>.db
+ *
+ * The file is a sequence of PAGE_SIZE pages. Page 0 holds the file header,
+ * every other page is a slotted page:
+ *
+ *   +------------+--------+--------+ ... free ... +-------+-------+
+ *   | PageHeader | slot 0 | slot 1 |              | rec 1 | rec 0 |
+ *   +------------+--------+--------+ ............ +-------+-------+
+ *                 directory grows ->       <- record data grows
+ *
+ * Records are stored as their unformatted JSON text, so 'list' prints exactly
+ * what the JSON format would. A record is addressed by its page and slot
+ * number (a "rowref"); updating or deleting it rewrites only that page.
+ *
+ * Versions: every write to the table (one command's worth of changes) gets
+ * the next commit sequence number. Each stored record carries the commit
+ * that wrote it and the one that replaced or deleted it, so an update adds
+ * a new version (pointing back at the old one) instead of overwriting the
+ * old one in place. A reader takes the last commit in the header as its
+ * snapshot and sees exactly the versions current at that commit, however
+ * long it runs and whatever writers do meanwhile; writers see the newest
+ * versions. Old versions are removed once no reader can see them any more
+ * (see "Snapshots" below).
+ * -------------------------------------------------------------------------- */
+#define PAGE_SIZE 8192
+#define PAGED_MAGIC "SDBPAGE2"
+
+typedef struct {
+    char     magic[8];
+    uint32_t page_size;
+    uint32_t page_count;    // including the header page
+    uint64_t max_id;        // highest numeric id ever stored in the table
+    uint64_t commit_seq;    // the last commit
+    uint64_t pending_seq;   // the commit being written, 0 if none
+    uint64_t horizon;       // versions replaced up to this commit may be gone
+} PagedFileHeader;
+
+typedef struct {
+    uint16_t slot_count;
+    uint16_t free_start;    // first byte after the slot directory
+    uint16_t free_end;      // first byte of record data
+    uint16_t reserved;
+} PageHeader;
+
+typedef struct {
+    uint16_t offset;
+    uint16_t length;        // 0 marks an unused slot
+} PageSlot;
+
+// Stored in front of every record's text.
+typedef struct {
+    uint64_t xmin;          // the commit that wrote this version
+    uint64_t xmax;          // the commit that replaced or deleted it, 0 if none
+    uint64_t prev;          // rowref of the version it replaced, 0 if none
+} RecordVersion;
+
+typedef struct {
+    int fd;
+    PagedFileHeader header;
+    int lock_fd;            // <table>.lock: the writer lock or a reader's pin
+    uint64_t snapshot;      // the commit a reader sees, PAGED_LATEST for writers
+    uint64_t horizon;       // writers: versions replaced up to here can go
+} PagedTable;
+
+#define PAGED_LATEST UINT64_MAX
+
+// A record and its version header must fit on one page (8156 bytes of
+// JSON); there are no overflow pages.
+#define MAX_PAGED_RECORD (PAGE_SIZE - sizeof(PageHeader) - sizeof(PageSlot) - \
+                          sizeof(RecordVersion))
+
+static int paged_check_size(size_t len) {
+    if (len > MAX_PAGED_RECORD) {
+        fprintf(stderr, "Error: Record of %zu bytes exceeds the paged limit of %zu bytes\n",
+                len, (size_t)MAX_PAGED_RECORD);
+        return -1;
+    }
+    return 0;
+}
+
+#define ROWREF(page, slot) (((uint64_t)(page) << 16) | (uint64_t)(slot))
+#define ROWREF_PAGE(ref)   ((uint32_t)((ref) >> 16))
+#define ROWREF_SLOT(ref)   ((uint16_t)((ref) & 0xFFFF))
+
+// Called for every live record; a non-zero return stops the scan.
+typedef int (*RecordCallback)(const char* data, size_t len, uint64_t rowref, void* ctx);
+
+static PageSlot* page_slots(char* page) {
+    return (PageSlot*)(page + sizeof(PageHeader));
+}
+
+static void page_init(char* page) {
+    memset(page, 0, PAGE_SIZE);
+    PageHeader* ph = (PageHeader*)page;
+    ph->free_start = sizeof(PageHeader);
+    ph->free_end = PAGE_SIZE;
+}
+
+// Bytes available for a new record, counting holes left by removed records.
+static size_t page_free_space(char* page) {
+    PageHeader* ph = (PageHeader*)page;
+    PageSlot* slots = page_slots(page);
+    size_t used = sizeof(PageHeader) + ph->slot_count * sizeof(PageSlot);
+    for (int i = 0; i < ph->slot_count; i++) {
+        used += slots[i].length;
+    }
+    return PAGE_SIZE - used;
+}
+
+// Move all live records to the end of the page so the free space is contiguous.
+static void page_compact(char* page) {
+    char scratch[PAGE_SIZE];
+    memcpy(scratch, page, PAGE_SIZE);
+
+    PageHeader* ph = (PageHeader*)page;
+    PageSlot* slots = page_slots(page);
+    uint16_t end = PAGE_SIZE;
+    for (int i = 0; i < ph->slot_count; i++) {
+        if (slots[i].length == 0) continue;
+        end -= slots[i].length;
+        memcpy(page + end, scratch + slots[i].offset, slots[i].length);
+        slots[i].offset = end;
+    }
+    ph->free_end = end;
+}
+
+// Store a version of a record in the page. Returns the slot number, or -1
+// if it doesn't fit.
+static int page_insert(char* page, const RecordVersion* version, const char* data, size_t len) {
+    PageHeader* ph = (PageHeader*)page;
+    PageSlot* slots = page_slots(page);
+
+    int slot = -1;
+    for (int i = 0; i < ph->slot_count; i++) {
+        if (slots[i].length == 0) {
+            slot = i;
+            break;
+        }
+    }
+    size_t needed = sizeof(*version) + len + (slot < 0 ? sizeof(PageSlot) : 0);
+    if (len == 0 || page_free_space(page) < needed) {
+        return -1;
+    }
+    if ((size_t)(ph->free_end - ph->free_start) < needed) {
+        page_compact(page);
+    }
+    if (slot < 0) {
+        slot = ph->slot_count++;
+        ph->free_start += sizeof(PageSlot);
+    }
+    ph->free_end -= sizeof(*version) + len;
+    memcpy(page + ph->free_end, version, sizeof(*version));
+    memcpy(page + ph->free_end + sizeof(*version), data, len);
+    slots[slot].offset = ph->free_end;
+    slots[slot].length = (uint16_t)(sizeof(*version) + len);
+    return slot;
+}
+
+static void page_remove(char* page, uint16_t slot) {
+    PageHeader* ph = (PageHeader*)page;
+    if (slot < ph->slot_count) {
+        page_slots(page)[slot].length = 0;
+    }
+}
+
+// The version of the record in a used slot (records aren't aligned).
+static void page_version(char* page, uint16_t slot, RecordVersion* version) {
+    memcpy(version, page + page_slots(page)[slot].offset, sizeof(*version));
+}
+
+static void page_set_xmax(char* page, uint16_t slot, uint64_t xmax) {
+    memcpy(page + page_slots(page)[slot].offset + offsetof(RecordVersion, xmax),
+           &xmax, sizeof(xmax));
+}
+
+static bool version_visible(const RecordVersion* version, uint64_t snapshot) {
+    return version->xmin <= snapshot && (version->xmax == 0 || version->xmax > snapshot);
+}
+
+// The text of the record in 'slot' if that version is visible at 'snapshot'.
+static bool page_record(char* page, uint16_t slot, uint64_t snapshot,
+                        const char** data, size_t* len) {
+    PageSlot* s = &page_slots(page)[slot];
+    if (s->length == 0) return false;
+    RecordVersion version;
+    page_version(page, slot, &version);
+    if (!version_visible(&version, snapshot)) return false;
+    *data = page + s->offset + sizeof(version);
+    *len = s->length - sizeof(version);
+    return true;
+}
+
+// Drop the versions replaced up to commit 'horizon'. Returns how many.
+static int page_prune(char* page, uint64_t horizon) {
+    PageHeader* ph = (PageHeader*)page;
+    int pruned = 0;
+    for (uint16_t i = 0; i < ph->slot_count; i++) {
+        if (page_slots(page)[i].length == 0) continue;
+        RecordVersion version;
+        page_version(page, i, &version);
+        if (version.xmax != 0 && version.xmax <= horizon) {
+            page_remove(page, i);
+            pruned++;
+        }
+    }
+    return pruned;
+}
+
+static int paged_read_page(PagedTable* pt, uint32_t pgno, char* page) {
+    int phase = profile_enter(PHASE_READ);
+    ssize_t n = pread(pt->fd, page, PAGE_SIZE, (off_t)pgno * PAGE_SIZE);
+    profile_leave(phase, PAGE_SIZE);
+    return n == PAGE_SIZE ? 0 : -1;
+}
+
+static int paged_write_page(PagedTable* pt, uint32_t pgno, const char* page) {
+    int phase = profile_enter(PHASE_WRITE);
+    ssize_t n = pwrite(pt->fd, page, PAGE_SIZE, (off_t)pgno * PAGE_SIZE);
+    profile_leave(phase, PAGE_SIZE);
+    return n == PAGE_SIZE ? 0 : -1;
+}
+
+static int paged_write_header(PagedTable* pt) {
+    char page[PAGE_SIZE];
+    memset(page, 0, sizeof(page));
+    memcpy(page, &pt->header, sizeof(pt->header));
+    return paged_write_page(pt, 0, page);
+}
+
+static int paged_read_header(PagedTable* pt) {
+    char page[PAGE_SIZE];
+    if (paged_read_page(pt, 0, page) != 0) return -1;
+    memcpy(&pt->header, page, sizeof(pt->header));
+    return 0;
+}
+
+static void table_lock_path(const char* db_path, const char* table_name,
+                            char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%s.lock", db_path, table_name);
+}
+
+/* --------------------------------------------------------------------------
+ * Snapshots: a reader pins the commit it reads at with a read lock on byte
+ * PAGED_PIN_BASE + commit of <table>.lock (byte 0 is the writer lock). A
+ * writer only drops versions replaced at or before the oldest pinned commit,
+ * and a crashed reader's pin goes away with the process.
+ *
+ * Between reading the header and pinning, a writer may already have looked
+ * for pins. So writers publish the horizon in the header before they look,
+ * and a reader that finds its commit behind it takes a newer one.
+ * -------------------------------------------------------------------------- */
+#define PAGED_PIN_BASE 1
+
+static int paged_pin_snapshot(const char* db_path, const char* table_name, PagedTable* pt) {
+    char path[1024];
+    table_lock_path(db_path, table_name, path, sizeof(path));
+    pt->lock_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (pt->lock_fd < 0) return -1;
+
+    for (;;) {
+        uint64_t snapshot = pt->header.commit_seq;
+        if (lock_byte(pt->lock_fd, PAGED_PIN_BASE + (off_t)snapshot, F_RDLCK, true) != 0 ||
+            paged_read_header(pt) != 0) {
+            return -1;
+        }
+        if (pt->header.horizon <= snapshot) {
+            pt->snapshot = snapshot;
+            return 0;
+        }
+        lock_byte(pt->lock_fd, PAGED_PIN_BASE + (off_t)snapshot, F_UNLCK, true);
+    }
+}
+
+// The oldest commit pinned by a reader, or 'limit' if none is older.
+static uint64_t paged_oldest_pin(int lock_fd, uint64_t limit) {
+    uint64_t oldest = limit;
+    while (oldest > 0) {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = PAGED_PIN_BASE;
+        fl.l_len = (off_t)oldest;
+        if (fcntl(lock_fd, F_OFD_GETLK, &fl) != 0) return 0;
+        if (fl.l_type == F_UNLCK) break;
+        oldest = (uint64_t)(fl.l_start - PAGED_PIN_BASE);
+    }
+    return oldest;
+}
+
+/* --------------------------------------------------------------------------
+ * Open <table>.db. With 'create' set, a new empty file is created and it is
+ * an error for the table to exist already. Otherwise the table is opened
+ * for reading, at a pinned snapshot. Returns 0 on success.
+ * -------------------------------------------------------------------------- */
+static int paged_open_file(const char* db_path, const char* table_name, bool create,
+                           PagedTable* pt) {
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.db", db_path, table_name);
+
+    pt->lock_fd = -1;
+    pt->snapshot = PAGED_LATEST;
+    pt->horizon = 0;
+    int flags = create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR;
+    pt->fd = open(filepath, flags, 0644);
+    if (pt->fd < 0) {
+        return -1;
+    }
+
+    if (create) {
+        memset(&pt->header, 0, sizeof(pt->header));
+        memcpy(pt->header.magic, PAGED_MAGIC, sizeof(pt->header.magic));
+        pt->header.page_size = PAGE_SIZE;
+        pt->header.page_count = 1;
+        if (paged_write_header(pt) != 0) {
+            close(pt->fd);
+            unlink(filepath);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (paged_read_header(pt) != 0) {
+        close(pt->fd);
+        return -1;
+    }
+    if (memcmp(pt->header.magic, PAGED_MAGIC, sizeof(pt->header.magic)) != 0 ||
+        pt->header.page_size != PAGE_SIZE) {
+        fprintf(stderr, "Error: %s is not a simpledb paged table\n", filepath);
+        close(pt->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void paged_close(PagedTable* pt) {
+    if (pt->fd >= 0) {
+        close(pt->fd);
+        pt->fd = -1;
+    }
+    if (pt->lock_fd >= 0) {
+        close(pt->lock_fd);     // also drops the lock or pin
+        pt->lock_fd = -1;
+    }
+}
+
+static int paged_open(const char* db_path, const char* table_name, bool create,
+                      PagedTable* pt) {
+    if (paged_open_file(db_path, table_name, create, pt) != 0) return -1;
+    if (!create && paged_pin_snapshot(db_path, table_name, pt) != 0) {
+        paged_close(pt);
+        return -1;
+    }
+    return 0;
+}
+
+// Keep the high-water mark used for automatic ids up to date.
+static void paged_note_id(PagedTable* pt, const char* id) {
+    uint64_t val = strtoull(id, NULL, 10);
+    if (val > pt->header.max_id) {
+        pt->header.max_id = val;
+    }
+}
+
+/* --------------------------------------------------------------------------
+ * Append a new version of a record (replacing the one at 'prev', if not 0):
+ * it goes to the last page if it fits, otherwise to a new page at the end
+ * of the file. Old versions on the last page are pruned on the way.
+ * -------------------------------------------------------------------------- */
+static int paged_insert(PagedTable* pt, uint64_t prev, const char* data, size_t len,
+                        uint64_t* rowref) {
+    if (paged_check_size(len) != 0) return -1;
+
+    RecordVersion version = { pt->header.pending_seq, 0, prev };
+    char page[PAGE_SIZE];
+    uint32_t pgno = pt->header.page_count - 1;
+    int slot = -1;
+    if (pgno > 0) {
+        if (paged_read_page(pt, pgno, page) != 0) return -1;
+        page_prune(page, pt->horizon);
+        slot = page_insert(page, &version, data, len);
+    }
+    if (slot < 0) {
+        pgno = pt->header.page_count++;
+        page_init(page);
+        slot = page_insert(page, &version, data, len);
+        if (paged_write_header(pt) != 0) return -1;
+    }
+    if (paged_write_page(pt, pgno, page) != 0) return -1;
+
+    if (rowref) *rowref = ROWREF(pgno, slot);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Replace the record at 'rowref' with a new version. It goes to the same
+ * page when it fits there, so a typical update is a single page write.
+ * -------------------------------------------------------------------------- */
+static int paged_update(PagedTable* pt, uint64_t rowref, const char* data, size_t len,
+                        uint64_t* new_rowref) {
+    char page[PAGE_SIZE];
+    uint32_t pgno = ROWREF_PAGE(rowref);
+    if (paged_read_page(pt, pgno, page) != 0) return -1;
+
+    page_set_xmax(page, ROWREF_SLOT(rowref), pt->header.pending_seq);
+    page_prune(page, pt->horizon);
+    RecordVersion version = { pt->header.pending_seq, 0, rowref };
+    int slot = page_insert(page, &version, data, len);
+    if (paged_write_page(pt, pgno, page) != 0) return -1;
+    if (slot >= 0) {
+        if (new_rowref) *new_rowref = ROWREF(pgno, slot);
+        return 0;
+    }
+    return paged_insert(pt, rowref, data, len, new_rowref);
+}
+
+/* --------------------------------------------------------------------------
+ * Copy the version of the record at 'rowref' the table's snapshot sees into
+ * a NUL-terminated heap buffer (caller frees); NULL if it sees none. Readers
+ * follow the record back to older versions where needed.
+ * -------------------------------------------------------------------------- */
+static char* paged_read_record(PagedTable* pt, uint64_t rowref) {
+    char page[PAGE_SIZE];
+    uint16_t slot;
+    RecordVersion version;
+    for (;;) {
+        if (paged_read_page(pt, ROWREF_PAGE(rowref), page) != 0) return NULL;
+        PageHeader* ph = (PageHeader*)page;
+        slot = ROWREF_SLOT(rowref);
+        if (slot >= ph->slot_count || page_slots(page)[slot].length == 0) return NULL;
+        page_version(page, slot, &version);
+        if (version.xmin <= pt->snapshot) break;
+        if (version.prev == 0) return NULL;
+        rowref = version.prev;
+    }
+
+    const char* data;
+    size_t len;
+    if (!page_record(page, slot, pt->snapshot, &data, &len)) return NULL;
+    char* record = malloc(len + 1);
+    if (!record) return NULL;
+    memcpy(record, data, len);
+    record[len] = '\0';
+    return record;
+}
+
+static int paged_delete_record(PagedTable* pt, uint64_t rowref) {
+    char page[PAGE_SIZE];
+    if (paged_read_page(pt, ROWREF_PAGE(rowref), page) != 0) return -1;
+    page_set_xmax(page, ROWREF_SLOT(rowref), pt->header.pending_seq);
+    return paged_write_page(pt, ROWREF_PAGE(rowref), page);
+}
+
+/* --------------------------------------------------------------------------
+ * Call 'fn' for every record the table's snapshot sees, in page order.
+ * -------------------------------------------------------------------------- */
+static int paged_scan(PagedTable* pt, RecordCallback fn, void* ctx) {
+    char page[PAGE_SIZE];
+    int phase = profile_enter(PHASE_FILTER);
+    int ret = 0;
+    uint32_t pgno;
+    for (pgno = 1; pgno < pt->header.page_count && ret == 0; pgno++) {
+        if (paged_read_page(pt, pgno, page) != 0) {
+            ret = -1;
+            break;
+        }
+        PageHeader* ph = (PageHeader*)page;
+        for (uint16_t i = 0; i < ph->slot_count; i++) {
+            const char* data;
+            size_t len;
+            if (!page_record(page, i, pt->snapshot, &data, &len)) continue;
+            if (fn(data, len, ROWREF(pgno, i), ctx) != 0) {
+                ret = 1;
+                break;
+            }
+        }
+    }
+    profile_leave(phase, (uint64_t)(pgno - 1) * PAGE_SIZE);
+    return ret < 0 ? -1 : 0;
+}
+
+typedef bool (*RecordPredicate)(const char* data, size_t len, void* ctx);
+
+/* --------------------------------------------------------------------------
+ * Streaming scan of a JSON table file
+ *
+ * Each top-level object's raw bytes are handed to a RecordCallback (rowref
+ * is the object's offset in the file), without building a tree or printing
+ * anything again. The file is scanned in place through a read-only mapping;
+ * if it can't be mapped it is read through a fixed-size buffer that only
+ * grows to hold a single record larger than it. Records containing
+ * whitespace outside strings (hand-edited or pretty-printed files) are
+ * compacted first, so every record is one line.
+ *
+ * The scan works on 64-byte blocks in two steps. First the block is
+ * classified into bitmasks of quotes, backslashes, brackets and whitespace,
+ * with AVX2 or SSE4.2 compares when the CPU has them (picked at run time;
+ * SIMPLEDB_SCANNER=scalar|sse4.2|avx2 forces one) and a byte loop
+ * otherwise. Then escapes and string interiors are resolved with bit
+ * arithmetic, and only the brackets left over are visited one by one to
+ * track nesting. The result is a tape of record boundaries, which the
+ * callers walk.
+ * -------------------------------------------------------------------------- */
+#define STREAM_BUFFER_SIZE (1 << 20)
+#define SCAN_BLOCK         64
+
+// Copy a JSON value without the whitespace outside its strings; returns
+// the new length.
+static size_t compact_json(const char* src, size_t len, char* dst) {
+    size_t n = 0;
+    bool in_string = false, escape = false;
+    for (size_t i = 0; i < len; i++) {
+        char c = src[i];
+        if (in_string) {
+            if (escape) escape = false;
+            else if (c == '\\') escape = true;
+            else if (c == '"') in_string = false;
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            continue;
+        } else if (c == '"') {
+            in_string = true;
+        }
+        dst[n++] = c;
+    }
+    return n;
+}
+
+// Bit i of each mask describes byte i of a 64-byte block.
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t bracket;       // { } [ ]
+    uint64_t space;
+} BlockMasks;
+
+typedef void (*ClassifyFn)(const char* block, BlockMasks* out);
+
+static void classify_scalar(const char* block, BlockMasks* out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < SCAN_BLOCK; i++) {
+        uint64_t bit = 1ULL << i;
+        switch (block[i]) {
+        case '"':  out->quote |= bit; break;
+        case '\\': out->backslash |= bit; break;
+        case '{': case '}': case '[': case ']': out->bracket |= bit; break;
+        case ' ': case '\t': case '\n': case '\r': out->space |= bit; break;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// '[' and ']' differ from '{' and '}' only in bit 0x20, so OR-ing it in
+// finds all four with two compares.
+__attribute__((target("avx2")))
+static void classify_avx2(const char* block, BlockMasks* out) {
+    memset(out, 0, sizeof(*out));
+    for (int half = 0; half < 2; half++) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(block + half * 32));
+        __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i quote = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+        __m256i backslash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+        __m256i bracket = _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')),
+                                          _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}')));
+        __m256i space = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        int shift = half * 32;
+        out->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(quote) << shift;
+        out->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(backslash) << shift;
+        out->bracket |= (uint64_t)(uint32_t)_mm256_movemask_epi8(bracket) << shift;
+        out->space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << shift;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void classify_sse42(const char* block, BlockMasks* out) {
+    memset(out, 0, sizeof(*out));
+    for (int quarter = 0; quarter < 4; quarter++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + quarter * 16));
+        __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i quote = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+        __m128i backslash = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+        __m128i bracket = _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                                       _mm_cmpeq_epi8(folded, _mm_set1_epi8('}')));
+        __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        int shift = quarter * 16;
+        out->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(quote) << shift;
+        out->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(backslash) << shift;
+        out->bracket |= (uint64_t)(uint16_t)_mm_movemask_epi8(bracket) << shift;
+        out->space |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << shift;
+    }
+}
+#endif
+
+// The widest kernels this CPU runs, or the ones forced through
+// SIMPLEDB_SCANNER.
+typedef enum {
+    SCAN_SCALAR,
+    SCAN_SSE42,
+    SCAN_AVX2
+} ScanLevel;
+
+static ScanLevel scan_level(void) {
+    const char* forced = getenv("SIMPLEDB_SCANNER");
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (forced) {
+        if (strcmp(forced, "avx2") == 0 && avx2) return SCAN_AVX2;
+        if (strcmp(forced, "sse4.2") == 0 && sse42) return SCAN_SSE42;
+        return SCAN_SCALAR;
+    }
+    if (avx2) return SCAN_AVX2;
+    if (sse42) return SCAN_SSE42;
+#else
+    (void)forced;
+#endif
+    return SCAN_SCALAR;
+}
+
+static ClassifyFn select_classifier(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    switch (scan_level()) {
+    case SCAN_AVX2:  return classify_avx2;
+    case SCAN_SSE42: return classify_sse42;
+    default:         break;
+    }
+#endif
+    return classify_scalar;
+}
+
+// Bit i set if an odd number of quote bits are at positions <= i.
+static uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/* --------------------------------------------------------------------------
+ * The characters escaped by a backslash: in a run of backslashes every
+ * second one is escaped, and the character after an odd-length run. Runs
+ * starting on even and odd bits are told apart with one addition (the
+ * carry runs through a whole run); 'prev' carries a run across blocks.
+ * -------------------------------------------------------------------------- */
+static uint64_t find_escaped(uint64_t backslash, uint64_t* prev) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~*prev;
+    uint64_t follows_escape = backslash << 1 | *prev;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_runs;
+    *prev = __builtin_add_overflow(odd_starts, backslash, &even_runs) ? 1 : 0;
+    uint64_t invert = even_runs << 1;
+    return (even_bits ^ invert) & follows_escape;
+}
+
+// One top-level object found by the scan.
+typedef struct {
+    uint64_t offset;        // in the file
+    uint32_t length;
+    uint32_t spaced;        // holds whitespace outside strings
+} TapeEntry;
+
+// Scanner state, carried across blocks and buffer refills.
+typedef struct {
+    ClassifyFn classify;
+    uint64_t prev_escaped;
+    uint64_t prev_in_string;    // all ones while inside a string
+    int depth;
+    bool array_root, in_object, spaced;
+    uint64_t start;             // file offset of the current object
+    TapeEntry* tape;
+    size_t tape_count;
+    size_t tape_capacity;
+    int error;
+} JsonScan;
+
+static void json_scan_init(JsonScan* st) {
+    memset(st, 0, sizeof(*st));
+    st->classify = select_classifier();
+}
+
+// Bits [from, to) of a 64-bit mask.
+static uint64_t bit_range(int from, int to) {
+    uint64_t below_to = to >= 64 ? ~0ULL : (1ULL << to) - 1;
+    return below_to & ~((1ULL << from) - 1);
+}
+
+static void json_scan_block(JsonScan* st, const char* block, uint64_t offset) {
+    BlockMasks m;
+    st->classify(block, &m);
+
+    uint64_t escaped = find_escaped(m.backslash, &st->prev_escaped);
+    uint64_t in_string = prefix_xor(m.quote & ~escaped) ^ st->prev_in_string;
+    st->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+    uint64_t brackets = m.bracket & ~in_string;
+    uint64_t space = m.space & ~in_string;
+
+    int last = 0;
+    while (brackets) {
+        int p = __builtin_ctzll(brackets);
+        brackets &= brackets - 1;
+        if (st->in_object && (space & bit_range(last, p))) st->spaced = true;
+        last = p;
+
+        char c = block[p];
+        if (c == '{' || c == '[') {
+            if (st->depth == 0) st->array_root = c == '[';
+            if (st->depth == 1 && c == '{' && st->array_root) {
+                st->start = offset + p;
+                st->in_object = true;
+                st->spaced = false;
+            }
+            st->depth++;
+            continue;
+        }
+
+        st->depth--;
+        if (st->depth != 1 || !st->in_object) continue;
+        st->in_object = false;
+        if (st->tape_count == st->tape_capacity) {
+            size_t capacity = st->tape_capacity ? st->tape_capacity * 2 : 4096;
+            TapeEntry* grown = realloc(st->tape, capacity * sizeof(TapeEntry));
+            if (!grown) {
+                st->error = -1;
+                return;
+            }
+            st->tape = grown;
+            st->tape_capacity = capacity;
+        }
+        st->tape[st->tape_count++] = (TapeEntry){
+            st->start, (uint32_t)(offset + p + 1 - st->start), st->spaced
+        };
+    }
+    if (st->in_object && (space & bit_range(last, 64))) st->spaced = true;
+}
+
+// Scan the whole blocks of buf[*pos, len), whose first byte is at file
+// offset 'base'; at the end of the file ('final') also the last partial
+// block, padded with spaces.
+static void json_scan(JsonScan* st, const char* buf, size_t len, size_t* pos, uint64_t base,
+                      bool final) {
+    size_t i = *pos;
+    for (; i + SCAN_BLOCK <= len && st->error == 0; i += SCAN_BLOCK) {
+        json_scan_block(st, buf + i, base + i);
+    }
+    if (final && i < len && st->error == 0) {
+        char block[SCAN_BLOCK];
+        memset(block, ' ', sizeof(block));
+        memcpy(block, buf + i, len - i);
+        json_scan_block(st, block, base + i);
+        i = len;
+    }
+    *pos = i;
+}
+
+typedef struct {
+    char* data;
+    size_t capacity;
+} ScratchBuffer;
+
+// The bytes of a record on the tape, compacted into 'scratch' if needed.
+// 'buf' holds the file from offset 'base'. Returns NULL if out of memory.
+static const char* tape_record(const TapeEntry* e, const char* buf, uint64_t base,
+                               ScratchBuffer* scratch, size_t* len) {
+    const char* data = buf + (e->offset - base);
+    *len = e->length;
+    if (!e->spaced) return data;
+    if (*len > scratch->capacity) {
+        char* grown = realloc(scratch->data, *len);
+        if (!grown) return NULL;
+        scratch->data = grown;
+        scratch->capacity = *len;
+    }
+    *len = compact_json(data, *len, scratch->data);
+    return scratch->data;
+}
+
+/* --------------------------------------------------------------------------
+ * Parallel scans
+ *
+ * With --threads N, the records of a table are filtered on N threads: the
+ * tape of a JSON table is cut into N runs of whole records, and a paged
+ * table into N runs of pages, one batch at a time. Each worker keeps its
+ * matches in a buffer of its own; the calling thread then hands them on in
+ * table order, so the output is the same as that of a single-threaded scan.
+ * A scan with a 'fold' hands each match to it on the worker instead, along
+ * with the worker's number, for results that are combined at the end.
+ * -------------------------------------------------------------------------- */
+#define MAX_SCAN_THREADS 256
+#define SCAN_BATCH_PAGES 2048
+
+typedef int (*RecordFold)(const char* data, size_t len, int worker, void* ctx);
+
+typedef struct {
+    int threads;                // 1 scans on the calling thread
+    RecordPredicate match;      // NULL passes every record
+    void* match_ctx;
+    RecordFold fold;            // NULL keeps matches for the calling thread
+    void* fold_ctx;
+} ScanFilter;
+
+// A record kept by a worker; its bytes follow it in the buffer.
+typedef struct {
+    uint64_t rowref;
+    uint32_t length;
+} RecordFrame;
+
+typedef struct {
+    pthread_t thread;
+    bool started;
+    int index;
+    const ScanFilter* filter;
+    const TapeEntry* entries;   // JSON: a run of the tape
+    size_t count;
+    const char* buf;
+    uint64_t base;
+    PagedTable* pt;             // paged: the pages [first_page, end_page)
+    uint32_t first_page;
+    uint32_t end_page;
+    bool remove;                // take matches out of their pages
+    ScratchBuffer scratch;
+    char* out;                  // kept records
+    size_t out_len;
+    size_t out_capacity;
+    int error;
+} ScanWorker;
+
+static bool scan_filter_passes(const ScanFilter* filter, const char* data, size_t len) {
+    return !filter || !filter->match || filter->match(data, len, filter->match_ctx);
+}
+
+static int worker_keep(ScanWorker* w, const char* data, size_t len, uint64_t rowref) {
+    size_t need = w->out_len + sizeof(RecordFrame) + len;
+    if (need > w->out_capacity) {
+        size_t capacity = w->out_capacity ? w->out_capacity : 64 * 1024;
+        while (capacity < need) capacity *= 2;
+        char* grown = realloc(w->out, capacity);
+        if (!grown) return -1;
+        w->out = grown;
+        w->out_capacity = capacity;
+    }
+    RecordFrame frame = { rowref, (uint32_t)len };
+    memcpy(w->out + w->out_len, &frame, sizeof(frame));
+    memcpy(w->out + w->out_len + sizeof(frame), data, len);
+    w->out_len = need;
+    return 0;
+}
+
+// Keep a record that passed, or fold it into the worker's share of a result.
+static int worker_take(ScanWorker* w, const char* data, size_t len, uint64_t rowref) {
+    if (w->filter->fold) return w->filter->fold(data, len, w->index, w->filter->fold_ctx);
+    return worker_keep(w, data, len, rowref);
+}
+
+static void scan_worker_tape(ScanWorker* w) {
+    for (size_t i = 0; i < w->count && w->error == 0; i++) {
+        size_t len;
+        const char* data = tape_record(&w->entries[i], w->buf, w->base, &w->scratch, &len);
+        if (!data) {
+            w->error = -1;
+        } else if (scan_filter_passes(w->filter, data, len) &&
+                   worker_take(w, data, len, w->entries[i].offset) != 0) {
+            w->error = -1;
+        }
+    }
+}
+
+static void scan_worker_pages(ScanWorker* w) {
+    char page[PAGE_SIZE];
+    for (uint32_t pgno = w->first_page; pgno < w->end_page && w->error == 0; pgno++) {
+        if (paged_read_page(w->pt, pgno, page) != 0) {
+            w->error = -1;
+            break;
+        }
+        PageHeader* ph = (PageHeader*)page;
+        bool dirty = false;
+        for (uint16_t i = 0; i < ph->slot_count && w->error == 0; i++) {
+            const char* data;
+            size_t len;
+            if (!page_record(page, i, w->pt->snapshot, &data, &len) ||
+                !scan_filter_passes(w->filter, data, len)) {
+                continue;
+            }
+            if (worker_take(w, data, len, ROWREF(pgno, i)) != 0) {
+                w->error = -1;
+            } else if (w->remove) {
+                page_set_xmax(page, i, w->pt->header.pending_seq);
+                dirty = true;
+            }
+        }
+        if (dirty && paged_write_page(w->pt, pgno, page) != 0) w->error = -1;
+    }
+}
+
+static void* scan_worker_main(void* arg) {
+    ScanWorker* w = (ScanWorker*)arg;
+    if (w->pt) {
+        scan_worker_pages(w);
+    } else {
+        scan_worker_tape(w);
+    }
+    return NULL;
+}
+
+// Run the workers, the first on the calling thread, and wait for them.
+static void scan_workers_run(ScanWorker* workers, int n) {
+    for (int i = 1; i < n; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, scan_worker_main,
+                                            &workers[i]) == 0;
+    }
+    scan_worker_main(&workers[0]);
+    for (int i = 1; i < n; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        } else {
+            scan_worker_main(&workers[i]);
+        }
+    }
+}
+
+// Hand the kept records to 'fn' in order and empty the buffers. Returns 1 if
+// 'fn' asked to stop, -1 if a worker failed.
+static int scan_workers_emit(ScanWorker* workers, int n, RecordCallback fn, void* ctx) {
+    int ret = 0;
+    for (int i = 0; i < n; i++) {
+        if (workers[i].error) ret = -1;
+    }
+    for (int i = 0; i < n && ret == 0; i++) {
+        size_t pos = 0;
+        while (pos < workers[i].out_len && ret == 0) {
+            RecordFrame frame;
+            memcpy(&frame, workers[i].out + pos, sizeof(frame));
+            pos += sizeof(frame);
+            if (fn(workers[i].out + pos, frame.length, frame.rowref, ctx) != 0) ret = 1;
+            pos += frame.length;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        workers[i].out_len = 0;
+    }
+    return ret;
+}
+
+static ScanWorker* scan_workers_new(const ScanFilter* filter) {
+    ScanWorker* workers = calloc((size_t)filter->threads, sizeof(ScanWorker));
+    for (int i = 0; workers && i < filter->threads; i++) {
+        workers[i].index = i;
+        workers[i].filter = filter;
+    }
+    return workers;
+}
+
+static void scan_workers_free(ScanWorker* workers, int n) {
+    for (int i = 0; workers && i < n; i++) {
+        free(workers[i].scratch.data);
+        free(workers[i].out);
+    }
+    free(workers);
+}
+
+/* --------------------------------------------------------------------------
+ * Scan a paged table for the records that pass 'filter'. With workers the
+ * pages are read a batch at a time, each worker taking a run of them.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const ScanFilter* filter;
+    RecordCallback fn;
+    void* ctx;
+} FilteredScan;
+
+static int filtered_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    FilteredScan* scan = (FilteredScan*)ctx;
+    if (!scan_filter_passes(scan->filter, data, len)) return 0;
+    return scan->fn(data, len, rowref, scan->ctx);
+}
+
+static int paged_scan_batches(PagedTable* pt, const ScanFilter* filter, bool remove,
+                              RecordCallback fn, void* ctx) {
+    ScanWorker* workers = scan_workers_new(filter);
+    if (!workers) return -1;
+    int n = filter->threads;
+    int ret = 0;
+    uint32_t page_count = pt->header.page_count;
+    int phase = profile_enter(PHASE_FILTER);
+    for (uint32_t batch = 1; batch < page_count && ret == 0; batch += SCAN_BATCH_PAGES) {
+        uint32_t end = page_count - batch > SCAN_BATCH_PAGES ? batch + SCAN_BATCH_PAGES : page_count;
+        uint32_t per_worker = (end - batch + (uint32_t)n - 1) / (uint32_t)n;
+        for (int i = 0; i < n; i++) {
+            uint32_t first = batch + per_worker * (uint32_t)i;
+            workers[i].pt = pt;
+            workers[i].first_page = first < end ? first : end;
+            workers[i].end_page = end - workers[i].first_page > per_worker
+                ? workers[i].first_page + per_worker : end;
+            workers[i].remove = remove;
+        }
+        scan_workers_run(workers, n);
+        ret = scan_workers_emit(workers, n, fn, ctx);
+    }
+    profile_leave(phase, (uint64_t)(page_count - 1) * PAGE_SIZE);
+    scan_workers_free(workers, n);
+    return ret < 0 ? -1 : 0;
+}
+
+static int paged_scan_where(PagedTable* pt, const ScanFilter* filter, RecordCallback fn,
+                            void* ctx) {
+    if (filter->threads > 1) {
+        return paged_scan_batches(pt, filter, false, fn, ctx);
+    }
+    FilteredScan scan = { filter, fn, ctx };
+    return paged_scan(pt, filtered_record_callback, &scan);
+}
+
+/* --------------------------------------------------------------------------
+ * Delete every record that passes 'filter', writing back only the pages
+ * that changed. 'on_delete' (if given) sees each deleted record, in table
+ * order, and fails the delete by returning non-zero. Returns the number of
+ * deleted records, or -1.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    RecordCallback on_delete;
+    void* ctx;
+    int deleted;
+} PagedRemoval;
+
+static int removed_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    PagedRemoval* removal = (PagedRemoval*)ctx;
+    if (removal->on_delete && removal->on_delete(data, len, rowref, removal->ctx) != 0) {
+        return -1;
+    }
+    removal->deleted++;
+    return 0;
+}
+
+static int paged_delete_where(PagedTable* pt, const ScanFilter* filter,
+                              RecordCallback on_delete, void* delete_ctx) {
+    if (filter->threads > 1) {
+        PagedRemoval removal = { on_delete, delete_ctx, 0 };
+        if (paged_scan_batches(pt, filter, true, removed_record_callback, &removal) != 0) {
+            return -1;
+        }
+        return removal.deleted;
+    }
+
+    char page[PAGE_SIZE];
+    int deleted = 0;
+    int phase = profile_enter(PHASE_FILTER);
+    for (uint32_t pgno = 1; pgno < pt->header.page_count && deleted >= 0; pgno++) {
+        if (paged_read_page(pt, pgno, page) != 0) {
+            deleted = -1;
+            break;
+        }
+        PageHeader* ph = (PageHeader*)page;
+        bool dirty = false;
+        for (uint16_t i = 0; i < ph->slot_count && deleted >= 0; i++) {
+            const char* data;
+            size_t len;
+            if (!page_record(page, i, pt->snapshot, &data, &len)) continue;
+            if (scan_filter_passes(filter, data, len)) {
+                if (on_delete && on_delete(data, len, ROWREF(pgno, i), delete_ctx) != 0) {
+                    deleted = -1;
+                    break;
+                }
+                page_set_xmax(page, i, pt->header.pending_seq);
+                dirty = true;
+                deleted++;
+            }
+        }
+        if (dirty && paged_write_page(pt, pgno, page) != 0) deleted = -1;
+    }
+    profile_leave(phase, (uint64_t)(pt->header.page_count - 1) * PAGE_SIZE);
+    return deleted;
+}
+
+/* --------------------------------------------------------------------------
+ * Hand the records on the tape that pass 'filter' (NULL for all) to 'fn',
+ * splitting the work over the workers if there are any, and empty the tape.
+ * 'buf' holds the file from offset 'base'. Returns 1 if 'fn' asked to stop,
+ * -1 on error.
+ * -------------------------------------------------------------------------- */
+static int tape_dispatch(JsonScan* st, const char* buf, uint64_t base, ScratchBuffer* scratch,
+                         const ScanFilter* filter, ScanWorker* workers,
+                         RecordCallback fn, void* ctx) {
+    int ret = 0;
+    if (workers) {
+        int n = filter->threads;
+        size_t per_worker = (st->tape_count + (size_t)n - 1) / (size_t)n;
+        for (int i = 0; i < n; i++) {
+            size_t first = per_worker * (size_t)i;
+            if (first > st->tape_count) first = st->tape_count;
+            size_t count = st->tape_count - first < per_worker ? st->tape_count - first : per_worker;
+            workers[i].entries = st->tape + first;
+            workers[i].count = count;
+            workers[i].buf = buf;
+            workers[i].base = base;
+        }
+        scan_workers_run(workers, n);
+        ret = scan_workers_emit(workers, n, fn, ctx);
+    }
+    for (size_t i = 0; !workers && i < st->tape_count && ret == 0; i++) {
+        size_t n;
+        const char* data = tape_record(&st->tape[i], buf, base, scratch, &n);
+        if (!data) {
+            ret = -1;
+        } else if (scan_filter_passes(filter, data, n) &&
+                   fn(data, n, st->tape[i].offset, ctx) != 0) {
+            ret = 1;
+        }
+    }
+    st->tape_count = 0;
+    return ret;
+}
+
+// Stream the records of a JSON table file that pass 'filter' (NULL for all).
+static int json_stream_records(int fd, const ScanFilter* filter, RecordCallback fn, void* ctx) {
+    JsonScan st;
+    json_scan_init(&st);
+    ScratchBuffer scratch = { NULL, 0 };
+    ScanWorker* workers = NULL;
+    if (filter && filter->threads > 1 && !(workers = scan_workers_new(filter))) {
+        return -1;
+    }
+    int ret = 0;
+
+    // Compressed files are read through the refill loop below, many blocks
+    // at a time so they decompress in parallel
+    ZTable z;
+    int compressed = ztable_open(fd, &z);
+    MappedFile m = { NULL, 0, false };
+    if (compressed < 0) {
+        scan_workers_free(workers, filter ? filter->threads : 0);
+        free(st.tape);
+        return -1;
+    }
+    if (compressed == 1 && map_fd(fd, &m) == 0 && m.mapped) {
+        // Scan in steps, dropping the pages behind the scan so the mapping
+        // doesn't keep the whole file resident
+        size_t pos = 0, dropped = 0;
+        long page_size = sysconf(_SC_PAGESIZE);
+        int phase = profile_enter(PHASE_FILTER);
+        while (pos < m.len && ret == 0) {
+            size_t end = m.len - pos > STREAM_BUFFER_SIZE * 16 ? pos + STREAM_BUFFER_SIZE * 16 : m.len;
+            json_scan(&st, m.data, end, &pos, 0, end == m.len);
+            ret = st.error ? st.error
+                           : tape_dispatch(&st, m.data, 0, &scratch, filter, workers, fn, ctx);
+            size_t done = (st.in_object ? st.start : pos) / page_size * page_size;
+            if (done > dropped) {
+                madvise(m.data + dropped, done - dropped, MADV_DONTNEED);
+                dropped = done;
+            }
+        }
+        profile_leave(phase, pos);
+        unmap_file(&m);
+        scan_workers_free(workers, filter ? filter->threads : 0);
+        free(scratch.data);
+        free(st.tape);
+        return ret < 0 ? -1 : 0;
+    }
+    unmap_file(&m);
+
+    size_t capacity = compressed == 0 ? (size_t)ZTABLE_BLOCK_SIZE * ZTABLE_MAX_THREADS * 8
+                                      : STREAM_BUFFER_SIZE;
+    char* buf = malloc(capacity);
+    if (!buf) {
+        ztable_close(&z);
+        scan_workers_free(workers, filter ? filter->threads : 0);
+        free(st.tape);
+        return -1;
+    }
+
+    uint64_t base = 0;          // file offset of buf[0]
+    size_t len = 0, pos = 0;
+    int phase = profile_enter(PHASE_FILTER);
+    while (ret == 0) {
+        // Refill, keeping the unscanned bytes and the unfinished object (if
+        // any) at the front
+        size_t keep_from = st.in_object ? (size_t)(st.start - base) : pos;
+        size_t keep = len - keep_from;
+        memmove(buf, buf + keep_from, keep);
+        base += keep_from;
+        pos -= keep_from;
+        len = keep;
+        if (len == capacity) {
+            char* grown = realloc(buf, capacity * 2);
+            if (!grown) {
+                ret = -1;
+                break;
+            }
+            buf = grown;
+            capacity *= 2;
+        }
+        int read_phase = profile_enter(PHASE_READ);
+        ssize_t n = compressed == 0 ? ztable_pread(&z, buf + len, capacity - len, base + len)
+                                    : pread(fd, buf + len, capacity - len, (off_t)(base + len));
+        profile_leave(read_phase, n > 0 ? (uint64_t)n : 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ret = -1;
+            break;
+        }
+        len += (size_t)n;
+
+        json_scan(&st, buf, len, &pos, base, n == 0);
+        ret = st.error ? st.error
+                           : tape_dispatch(&st, buf, base, &scratch, filter, workers, fn, ctx);
+        if (n == 0) break;
+    }
+    profile_leave(phase, base + pos);
+
+    ztable_close(&z);
+    scan_workers_free(workers, filter ? filter->threads : 0);
+    free(scratch.data);
+    free(st.tape);
+    free(buf);
+    return ret < 0 ? -1 : 0;
+}
+
+/* --------------------------------------------------------------------------
+ * CSV files
+ *
+ * 'import' of a .csv file and 'export --format csv' read and write CSV as
+ * in RFC 4180: a header row with the field names, then one row per record;
+ * a field holding commas, quotes or line breaks is put in double quotes,
+ * with quotes inside it doubled. CRLF line ends are accepted. Values are
+ * strings, as with 'save'; an empty unquoted field stands for a missing
+ * one, "" for an empty string.
+ *
+ * The tokenizer works like the JSON scanner: each 64-byte block becomes
+ * bitmasks of quotes, commas and newlines, the quoted stretches come out of
+ * a prefix XOR over the quotes (a doubled quote toggles twice), and only
+ * the separators outside them are visited one by one.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    uint64_t quote;
+    uint64_t comma;
+    uint64_t newline;
+} CsvMasks;
+
+typedef void (*CsvClassifyFn)(const char* block, CsvMasks* out);
+
+static void csv_classify_scalar(const char* block, CsvMasks* out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < SCAN_BLOCK; i++) {
+        uint64_t bit = 1ULL << i;
+        switch (block[i]) {
+        case '"':  out->quote |= bit; break;
+        case ',':  out->comma |= bit; break;
+        case '\n': out->newline |= bit; break;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void csv_classify_avx2(const char* block, CsvMasks* out) {
+    memset(out, 0, sizeof(*out));
+    for (int half = 0; half < 2; half++) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(block + half * 32));
+        int shift = half * 32;
+        out->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << shift;
+        out->comma |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))) << shift;
+        out->newline |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))) << shift;
+    }
+}
+
+__attribute__((target("sse4.2")))
+static void csv_classify_sse42(const char* block, CsvMasks* out) {
+    memset(out, 0, sizeof(*out));
+    for (int quarter = 0; quarter < 4; quarter++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + quarter * 16));
+        int shift = quarter * 16;
+        out->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << shift;
+        out->comma |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8(','))) << shift;
+        out->newline |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))) << shift;
+    }
+}
+#endif
+
+static CsvClassifyFn select_csv_classifier(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    switch (scan_level()) {
+    case SCAN_AVX2:  return csv_classify_avx2;
+    case SCAN_SSE42: return csv_classify_sse42;
+    default:         break;
+    }
+#endif
+    return csv_classify_scalar;
+}
+
+// One field of a row: its raw bytes, quotes included.
+typedef struct {
+    const char* data;
+    size_t len;
+} CsvField;
+
+// Called with each row; 'row' counts from 1 (the header). Returning -1
+// fails the scan, 1 stops it.
+typedef int (*CsvRowCallback)(const CsvField* fields, int count, size_t row, void* ctx);
+
+typedef struct {
+    CsvField* fields;
+    int count;
+    int capacity;
+    size_t row;
+} CsvRow;
+
+static int csv_add_field(CsvRow* r, const char* data, size_t len) {
+    if (r->count == r->capacity) {
+        int capacity = r->capacity ? r->capacity * 2 : 16;
+        CsvField* grown = realloc(r->fields, (size_t)capacity * sizeof(CsvField));
+        if (!grown) return -1;
+        r->fields = grown;
+        r->capacity = capacity;
+    }
+    r->fields[r->count++] = (CsvField){ data, len };
+    return 0;
+}
+
+static int csv_end_row(CsvRow* r, CsvRowCallback fn, void* ctx) {
+    CsvField* last = &r->fields[r->count - 1];
+    if (last->len > 0 && last->data[last->len - 1] == '\r') last->len--;
+    int ret = 0;
+    if (r->count > 1 || last->len > 0) {
+        ret = fn(r->fields, r->count, ++r->row, ctx);
+    }
+    r->count = 0;
+    return ret;
+}
+
+static int csv_scan(const char* data, size_t len, CsvRowCallback fn, void* ctx) {
+    CsvClassifyFn classify = select_csv_classifier();
+    CsvRow r = { NULL, 0, 0, 0 };
+    uint64_t prev_in_quotes = 0;
+    size_t start = 0;
+    int ret = 0;
+    for (size_t base = 0; base < len && ret == 0; base += SCAN_BLOCK) {
+        const char* block = data + base;
+        char padded[SCAN_BLOCK];
+        if (len - base < SCAN_BLOCK) {
+            memset(padded, 0, sizeof(padded));
+            memcpy(padded, block, len - base);
+            block = padded;
+        }
+        CsvMasks m;
+        classify(block, &m);
+        uint64_t in_quotes = prefix_xor(m.quote) ^ prev_in_quotes;
+        prev_in_quotes = (uint64_t)((int64_t)in_quotes >> 63);
+
+        uint64_t separators = (m.comma | m.newline) & ~in_quotes;
+        while (separators && ret == 0) {
+            int p = __builtin_ctzll(separators);
+            separators &= separators - 1;
+            size_t end = base + (size_t)p;
+            ret = csv_add_field(&r, data + start, end - start);
+            start = end + 1;
+            if (ret == 0 && (m.newline >> p & 1)) ret = csv_end_row(&r, fn, ctx);
+        }
+    }
+    // A last row without a line break
+    if (ret == 0 && (start < len || r.count > 0)) {
+        ret = csv_add_field(&r, data + start, len - start);
+        if (ret == 0) ret = csv_end_row(&r, fn, ctx);
+    }
+    free(r.fields);
+    return ret < 0 ? -1 : 0;
+}
+
+/* --------------------------------------------------------------------------
+ * A growable, NUL-terminated text buffer.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t capacity;
+} TextBuffer;
+
+// Make room for 'len' more bytes (and the NUL).
+static int text_reserve(TextBuffer* t, size_t len) {
+    if (t->len + len + 1 > t->capacity) {
+        size_t capacity = t->capacity ? t->capacity : 256;
+        while (capacity < t->len + len + 1) capacity *= 2;
+        char* grown = realloc(t->data, capacity);
+        if (!grown) return -1;
+        t->data = grown;
+        t->capacity = capacity;
+    }
+    return 0;
+}
+
+static int text_append(TextBuffer* t, const char* data, size_t len) {
+    if (text_reserve(t, len) != 0) return -1;
+    memcpy(t->data + t->len, data, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+    return 0;
+}
+
+// Append 'len' bytes as a JSON string, escaped the way cJSON prints them.
+static int text_append_json_string(TextBuffer* t, const char* s, size_t len) {
+    int ret = text_append(t, "\"", 1);
+    size_t run = 0;
+    for (size_t i = 0; i < len && ret == 0; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        ret = text_append(t, s + run, i - run);
+        char escape[8];
+        switch (c) {
+        case '"':  strcpy(escape, "\\\""); break;
+        case '\\': strcpy(escape, "\\\\"); break;
+        case '\b': strcpy(escape, "\\b"); break;
+        case '\f': strcpy(escape, "\\f"); break;
+        case '\n': strcpy(escape, "\\n"); break;
+        case '\r': strcpy(escape, "\\r"); break;
+        case '\t': strcpy(escape, "\\t"); break;
+        default:   snprintf(escape, sizeof(escape), "\\u%04x", c); break;
+        }
+        if (ret == 0) ret = text_append(t, escape, strlen(escape));
+        run = i + 1;
+    }
+    if (ret == 0) ret = text_append(t, s + run, len - run);
+    if (ret == 0) ret = text_append(t, "\"", 1);
+    return ret;
+}
+
+// Append the contents of a JSON string (without its quotes) unescaped.
+static int text_append_json_unescaped(TextBuffer* t, const char* s, size_t len) {
+    int ret = 0;
+    for (size_t i = 0; i < len && ret == 0; i++) {
+        if (s[i] != '\\' || i + 1 == len) {
+            ret = text_append(t, s + i, 1);
+            continue;
+        }
+        char c = s[++i];
+        char out[4];
+        size_t n = 1;
+        switch (c) {
+        case 'b': out[0] = '\b'; break;
+        case 'f': out[0] = '\f'; break;
+        case 'n': out[0] = '\n'; break;
+        case 'r': out[0] = '\r'; break;
+        case 't': out[0] = '\t'; break;
+        case 'u': {
+            unsigned int cp = 0;
+            if (i + 4 >= len || sscanf(s + i + 1, "%4x", &cp) != 1) {
+                out[0] = c;
+                break;
+            }
+            i += 4;
+            unsigned int low = 0;
+            if (cp >= 0xD800 && cp < 0xDC00 && i + 6 < len && s[i + 1] == '\\' &&
+                s[i + 2] == 'u' && sscanf(s + i + 3, "%4x", &low) == 1 &&
+                low >= 0xDC00 && low < 0xE000) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                i += 6;
+            }
+            if (cp < 0x80) {
+                out[0] = (char)cp;
+            } else if (cp < 0x800) {
+                out[0] = (char)(0xC0 | cp >> 6);
+                out[1] = (char)(0x80 | (cp & 0x3F));
+                n = 2;
+            } else if (cp < 0x10000) {
+                out[0] = (char)(0xE0 | cp >> 12);
+                out[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+                out[2] = (char)(0x80 | (cp & 0x3F));
+                n = 3;
+            } else {
+                out[0] = (char)(0xF0 | cp >> 18);
+                out[1] = (char)(0x80 | (cp >> 12 & 0x3F));
+                out[2] = (char)(0x80 | (cp >> 6 & 0x3F));
+                out[3] = (char)(0x80 | (cp & 0x3F));
+                n = 4;
+            }
+            break;
+        }
+        default: out[0] = c; break;     // \" \\ \/
+        }
+        ret = text_append(t, out, n);
+    }
+    return ret;
+}
+
+// The value of a CSV field, unquoted, into 't' (replacing its contents).
+// False for an empty unquoted field: a missing value.
+static bool csv_field_value(const CsvField* f, TextBuffer* t) {
+    t->len = 0;
+    text_append(t, "", 0);
+    if (f->len == 0) return false;
+    if (f->len < 2 || f->data[0] != '"' || f->data[f->len - 1] != '"') {
+        return text_append(t, f->data, f->len) == 0;
+    }
+    const char* s = f->data + 1;
+    size_t n = f->len - 2;
+    size_t run = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] == '"' && i + 1 < n && s[i + 1] == '"') {
+            text_append(t, s + run, i + 1 - run);
+            run = ++i + 1;
+        }
+    }
+    return text_append(t, s + run, n - run) == 0;
+}
+
+// Append 'len' bytes as a CSV field, quoted if 'quote' or if it needs it.
+static int text_append_csv_field(TextBuffer* t, const char* s, size_t len, bool quote) {
+    if (!quote) {
+        for (size_t i = 0; i < len && !quote; i++) {
+            quote = s[i] == ',' || s[i] == '"' || s[i] == '\n' || s[i] == '\r';
+        }
+        if (!quote) return text_append(t, s, len);
+    }
+    int ret = text_append(t, "\"", 1);
+    size_t run = 0;
+    for (size_t i = 0; i < len && ret == 0; i++) {
+        if (s[i] == '"') {
+            ret = text_append(t, s + run, i + 1 - run);
+            run = i;    // the quote goes out twice
+        }
+    }
+    if (ret == 0) ret = text_append(t, s + run, len - run);
+    if (ret == 0) ret = text_append(t, "\"", 1);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Walk the top-level members of a record's JSON text: 'fn' gets each key,
+ * unescaped, and the raw text of its value (a string with its quotes).
+ * Returns -1 if the text isn't an object, else what 'fn' last returned.
+ * -------------------------------------------------------------------------- */
+typedef int (*MemberCallback)(const char* key, const char* value, size_t value_len, void* ctx);
+
+static size_t json_skip_space(const char* s, size_t len, size_t i) {
+    while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')) i++;
+    return i;
+}
+
+// End of the JSON value starting at s[i] (one past its last byte).
+static size_t json_value_end(const char* s, size_t len, size_t i) {
+    int depth = 0;
+    bool in_string = false;
+    for (; i < len; i++) {
+        char c = s[i];
+        if (in_string) {
+            if (c == '\\') {
+                i++;
+            } else if (c == '"') {
+                in_string = false;
+                if (depth == 0) return i + 1;
+            }
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (depth == 0) return i;
+            if (--depth == 0) return i + 1;
+        } else if (depth == 0 && (c == ',' || c == ' ' || c == '\t' || c == '\n' || c == '\r')) {
+            return i;
+        }
+    }
+    return len;
+}
+
+static int record_members(const char* s, size_t len, TextBuffer* key, MemberCallback fn,
+                          void* ctx) {
+    size_t i = json_skip_space(s, len, 0);
+    if (i == len || s[i] != '{') return -1;
+    i = json_skip_space(s, len, i + 1);
+    int ret = 0;
+    while (i < len && s[i] == '"' && ret == 0) {
+        size_t key_end = json_value_end(s, len, i);
+        key->len = 0;
+        if (key_end < i + 2 || text_append_json_unescaped(key, s + i + 1, key_end - i - 2) != 0) {
+            return -1;
+        }
+        i = json_skip_space(s, len, key_end);
+        if (i == len || s[i] != ':') return -1;
+        size_t value = json_skip_space(s, len, i + 1);
+        size_t value_end = json_value_end(s, len, value);
+        ret = fn(key->data ? key->data : "", s + value, value_end - value, ctx);
+        i = json_skip_space(s, len, value_end);
+        if (i < len && s[i] == ',') i = json_skip_space(s, len, i + 1);
+    }
+    return ret;
+}
+
+// A member value's text as cJSON would print it: strings with escapes are
+// spelled out again (in 'out', through 'scratch'), so that equal strings
+// have equal text.
+static int json_value_canonical(const char** value, size_t* len, TextBuffer* scratch,
+                                TextBuffer* out) {
+    if (*len < 2 || (*value)[0] != '"' || !memchr(*value, '\\', *len)) return 0;
+    scratch->len = 0;
+    out->len = 0;
+    if (text_append_json_unescaped(scratch, *value + 1, *len - 2) != 0 ||
+        text_append_json_string(out, scratch->data, scratch->len) != 0) {
+        return -1;
+    }
+    *value = out->data;
+    *len = out->len;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * --fields a,b,...: print only some fields of each record, in the order
+ * given; fields a record doesn't have are left out. The record's text is
+ * walked member by member and the values asked for are copied as they
+ * are, so the others are skipped over without being parsed into a tree.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    char* spec;                 // the option's value, split at the commas
+    const char** names;
+    int count;
+    const char** values;        // of the current record, NULL where missing
+    size_t* lengths;
+    TextBuffer member;          // scratch for record_members()
+    TextBuffer scratch;
+    TextBuffer canonical;
+    TextBuffer line;
+    int found;
+} Projection;
+
+static void projection_free(Projection* p) {
+    free(p->spec);
+    free(p->names);
+    free(p->values);
+    free(p->lengths);
+    free(p->member.data);
+    free(p->scratch.data);
+    free(p->canonical.data);
+    free(p->line.data);
+    memset(p, 0, sizeof(*p));
+}
+
+static int projection_init(Projection* p, const char* spec) {
+    memset(p, 0, sizeof(*p));
+    p->spec = strdup(spec);
+    size_t max = 1;
+    for (const char* s = spec; *s; s++) max += *s == ',';
+    p->names = calloc(max, sizeof(char*));
+    p->values = calloc(max, sizeof(char*));
+    p->lengths = calloc(max, sizeof(size_t));
+    if (!p->spec || !p->names || !p->values || !p->lengths) {
+        projection_free(p);
+        return -1;
+    }
+    char* save = NULL;
+    for (char* name = strtok_r(p->spec, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        p->names[p->count++] = name;
+    }
+    if (p->count == 0 || (size_t)p->count != max) {
+        fprintf(stderr, "Error: Invalid --fields '%s'. Use e.g. --fields id,email.\n", spec);
+        projection_free(p);
+        return -1;
+    }
+    return 0;
+}
+
+static int projection_member_callback(const char* key, const char* value, size_t value_len,
+                                      void* ctx) {
+    Projection* p = (Projection*)ctx;
+    for (int i = 0; i < p->count; i++) {
+        if (!p->values[i] && strcmp(p->names[i], key) == 0) {
+            p->values[i] = value;
+            p->lengths[i] = value_len;
+            p->found++;
+        }
+    }
+    return p->found == p->count ? 1 : 0;   // the rest of the record isn't needed
+}
+
+// Print the fields of p->values as one JSON line.
+static int projection_print_values(Projection* p) {
+    TextBuffer* line = &p->line;
+    line->len = 0;
+    int ret = text_append(line, "{", 1);
+    bool first = true;
+    for (int i = 0; i < p->count && ret == 0; i++) {
+        const char* value = p->values[i];
+        size_t len = p->lengths[i];
+        if (!value) continue;
+        if (json_value_canonical(&value, &len, &p->scratch, &p->canonical) != 0 ||
+            (!first && text_append(line, ",", 1) != 0) ||
+            text_append_json_string(line, p->names[i], strlen(p->names[i])) != 0 ||
+            text_append(line, ":", 1) != 0 || text_append(line, value, len) != 0) {
+            ret = -1;
+        }
+        first = false;
+    }
+    if (ret == 0) ret = text_append(line, "}\n", 2);
+    if (ret == 0) fwrite(line->data, 1, line->len, stdout);
+    return ret;
+}
+
+static int projection_print(Projection* p, const char* data, size_t len) {
+    memset(p->values, 0, (size_t)p->count * sizeof(char*));
+    p->found = 0;
+    if (record_members(data, len, &p->member, projection_member_callback, p) < 0) return 0;
+    return projection_print_values(p);
+}
+
+// Take "--fields a,b,..." out of a command's arguments. *fields is left
+// NULL without the option; -1 if it is malformed.
+static int take_fields_option(int* argc, char** argv, Projection* storage,
+                              Projection** fields) {
+    *fields = NULL;
+    for (int i = 0; i < *argc; i++) {
+        if (strcmp(argv[i], "--fields") != 0) continue;
+        if (i + 1 == *argc) {
+            fprintf(stderr, "Error: --fields requires a list of fields\n");
+            return -1;
+        }
+        if (projection_init(storage, argv[i + 1]) != 0) return -1;
+        *fields = storage;
+        memmove(&argv[i], &argv[i + 2], (size_t)(*argc - i - 2) * sizeof(char*));
+        *argc -= 2;
+        return 0;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Helpers shared by the paged code paths of the commands below.
+ * -------------------------------------------------------------------------- */
+// Print a record, or the fields of it the Projection in 'ctx' (if any) asks
+// for.
+static int print_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    if (ctx) return projection_print((Projection*)ctx, data, len);
+    fwrite(data, 1, len, stdout);
+    putchar('\n');
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * A field=value filter. Records are stored compact, so a record can only
+ * match if its text holds "field":"value" verbatim, unless it has escapes
+ * (a hand-edited file may spell a character as \uXXXX). That substring
+ * search runs over the raw bytes first; only records that pass it are
+ * parsed to confirm the match, so a selective filter costs about a memmem
+ * per record instead of a parse.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* field;
+    const char* value;
+    char needle[512];       // "field":"value", empty if it can't be used
+    size_t needle_len;
+} FieldMatch;
+
+static void field_match_init(FieldMatch* m, const char* field, const char* value) {
+    m->field = field;
+    m->value = value;
+    m->needle_len = 0;
+    for (const char* p = field; *p; p++) {
+        if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20) return;
+    }
+    for (const char* p = value; *p; p++) {
+        if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20) return;
+    }
+    int n = snprintf(m->needle, sizeof(m->needle), "\"%s\":\"%s\"", field, value);
+    if (n > 0 && (size_t)n < sizeof(m->needle)) {
+        m->needle_len = (size_t)n;
+    }
+}
+
+// False only if the record text can't hold a match.
+static bool record_may_match(const char* data, size_t len, const FieldMatch* m) {
+    if (m->needle_len == 0 || memmem(data, len, m->needle, m->needle_len)) {
+        return true;
+    }
+    return memchr(data, '\\', len) != NULL;
+}
+
+// True if the stored record text has a string 'field' equal to 'value'.
+static bool record_matches(const char* data, size_t len, void* ctx) {
+    FieldMatch* m = (FieldMatch*)ctx;
+    if (!record_may_match(data, len, m)) {
+        return false;
+    }
+    cJSON* item = json_parse(data, len);
+    bool match = false;
+    if (cJSON_IsObject(item)) {
+        cJSON* field_obj = cJSON_GetObjectItemCaseSensitive(item, m->field);
+        match = cJSON_IsString(field_obj) && strcmp(field_obj->valuestring, m->value) == 0;
+    }
+    cJSON_Delete(item);
+    return match;
+}
+
+/* --------------------------------------------------------------------------
+ * A filter on a range of one field's string values, such as day>=2025-01-01
+ * or email^=alpha@; every condition given narrows the same KeyRange. A
+ * record is only parsed if its text holds "field":" (or an escape).
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* field;
+    KeyRange range;
+    char needle[260];           // "field":" , empty if it can't be used
+    size_t needle_len;
+} FieldRange;
+
+static void field_range_init(FieldRange* fr, const char* field) {
+    memset(fr, 0, sizeof(*fr));
+    fr->field = field;
+    for (const char* p = field; *p; p++) {
+        if (*p == '"' || *p == '\\' || (unsigned char)*p < 0x20) return;
+    }
+    int n = snprintf(fr->needle, sizeof(fr->needle), "\"%s\":\"", field);
+    if (n > 0 && (size_t)n < sizeof(fr->needle)) {
+        fr->needle_len = (size_t)n;
+    }
+}
+
+// Raise the lower bound to 'value' (or lower the upper one) if it is tighter.
+static void field_range_bound(const char** bound, bool* open, const char* value,
+                              bool value_open, int tighter) {
+    int c = *bound ? strcmp(value, *bound) * tighter : 1;
+    if (c > 0 || (c == 0 && value_open)) {
+        *bound = value;
+        *open = value_open;
+    }
+}
+
+// Narrow the range by one condition: op is one of = < <= > >= ^=.
+static int field_range_add(FieldRange* fr, const char* op, const char* value) {
+    KeyRange* r = &fr->range;
+    if (strcmp(op, "=") == 0) {
+        field_range_bound(&r->lower, &r->lower_open, value, false, 1);
+        field_range_bound(&r->upper, &r->upper_open, value, false, -1);
+    } else if (strcmp(op, ">") == 0 || strcmp(op, ">=") == 0) {
+        field_range_bound(&r->lower, &r->lower_open, value, op[1] == '\0', 1);
+    } else if (strcmp(op, "<") == 0 || strcmp(op, "<=") == 0) {
+        field_range_bound(&r->upper, &r->upper_open, value, op[1] == '\0', -1);
+    } else if (strcmp(op, "^=") == 0 && !r->prefix) {
+        r->prefix = value;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static bool record_field_in_range(const cJSON* record, const FieldRange* fr) {
+    const char* value = record_string_field(record, fr->field);
+    return value && key_range_contains(&fr->range, value, strlen(value));
+}
+
+static bool record_in_range(const char* data, size_t len, void* ctx) {
+    FieldRange* fr = (FieldRange*)ctx;
+    if (fr->needle_len != 0 && !memmem(data, len, fr->needle, fr->needle_len) &&
+        !memchr(data, '\\', len)) {
+        return false;
+    }
+    cJSON* item = json_parse(data, len);
+    bool match = cJSON_IsObject(item) && record_field_in_range(item, fr);
+    cJSON_Delete(item);
+    return match;
+}
+
+/* --------------------------------------------------------------------------
+ * Index lookups collect their hits first, then visit them in table order.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    uint64_t rowref;
+    uint32_t length;
+} IndexHit;
+
+typedef struct {
+    IndexHit* items;
+    size_t count;
+    size_t capacity;
+} IndexHitList;
+
+static int collect_hit_callback(uint64_t rowref, uint32_t length, void* ctx) {
+    IndexHitList* list = (IndexHitList*)ctx;
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        IndexHit* grown = realloc(list->items, capacity * sizeof(IndexHit));
+        if (!grown) return 1;
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    list->items[list->count].rowref = rowref;
+    list->items[list->count].length = length;
+    list->count++;
+    return 0;
+}
+
+static int compare_hits(const void* a, const void* b) {
+    uint64_t ra = ((const IndexHit*)a)->rowref, rb = ((const IndexHit*)b)->rowref;
+    return ra < rb ? -1 : ra > rb;
+}
+
+static void index_lookup_sorted(HashIndex* idx, const char* value, IndexHitList* hits) {
+    memset(hits, 0, sizeof(*hits));
+    hash_index_lookup(idx, value, collect_hit_callback, hits);
+    if (hits->count > 1) {
+        qsort(hits->items, hits->count, sizeof(IndexHit), compare_hits);
+    }
+}
+
+// True if the open table file is the one an index was built for.
+static bool stamp_matches(int table_fd, const FileStamp* stamp) {
+    struct stat st;
+    FileStamp current;
+    if (table_fd < 0 || fstat(table_fd, &st) != 0) return false;
+    file_stamp_of(&st, &current);
+    return memcmp(&current, stamp, sizeof(current)) == 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Find the current records of a JSON table with field == value through the
+ * index on 'field': records are read from the table file at the offsets the
+ * index gives, and pending log entries are merged in (records changed since
+ * the last checkpoint are visited after the others). A non-zero return
+ * from 'fn' stops the lookup, which then returns 0 like a finished one.
+ * Returns 1 if there is no usable index, so the caller should scan instead.
+ * -------------------------------------------------------------------------- */
+static int json_index_matches(const char* db_path, const char* table_name,
+                              const char* field, const char* value,
+                              RecordCallback fn, void* ctx) {
+    JsonSnapshot snap;
+    json_snapshot_open(db_path, table_name, &snap);
+
+    HashIndex idx;
+    if (!hash_index_covers(value) || hash_index_open(db_path, table_name, field, &idx) != 0) {
+        json_snapshot_close(&snap);
+        return 1;
+    }
+    if (!stamp_matches(snap.table_fd, &idx.header.table)) {
+        // Built for another version of the table file
+        hash_index_close(&idx);
+        json_snapshot_close(&snap);
+        return 1;
+    }
+
+    IndexHitList hits;
+    index_lookup_sorted(&idx, value, &hits);
+    hash_index_close(&idx);
+
+    WalOverlay ov;
+    wal_overlay_load(snap.wal_fd, table_name, &ov);
+
+    char* buffer = NULL;
+    size_t capacity = 0;
+    bool stopped = false;
+    for (size_t i = 0; i < hits.count && !stopped; i++) {
+        uint32_t length = hits.items[i].length;
+        if (length + 1 > capacity) {
+            char* grown = realloc(buffer, length + 1);
+            if (!grown) break;
+            buffer = grown;
+            capacity = length + 1;
+        }
+        if (json_snapshot_pread(&snap, buffer, length, hits.items[i].rowref) != (ssize_t)length) {
+            continue;
+        }
+        cJSON* record = json_parse(buffer, length);
+        if (string_field_equals(record, field, value) && wal_overlay_keeps(&ov, record)) {
+            stopped = fn(buffer, length, hits.items[i].rowref, ctx) != 0;
+        }
+        cJSON_Delete(record);
+    }
+
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, ov.records) {
+        if (stopped) break;
+        if (string_field_equals(item, field, value)) {
+            char* text = json_print(item);
+            if (text) {
+                stopped = fn(text, strlen(text), 0, ctx) != 0;
+                cJSON_free(text);
+            }
+        }
+    }
+
+    free(buffer);
+    free(hits.items);
+    wal_overlay_free(&ov);
+    json_snapshot_close(&snap);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * The id tree of a JSON table, with the snapshot of the table file it
+ * points into and the table's pending log entries.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    JsonSnapshot snap;
+    IdTree tree;
+    WalOverlay ov;
+} JsonTreeView;
+
+// Returns 1 if the table has no tree for its current file.
+static int json_tree_view_open(const char* db_path, const char* table_name,
+                               JsonTreeView* view) {
+    json_snapshot_open(db_path, table_name, &view->snap);
+    if (id_tree_open(db_path, table_name, &view->tree) != 0) {
+        json_snapshot_close(&view->snap);
+        return 1;
+    }
+    if (!stamp_matches(view->snap.table_fd, &view->tree.header.table)) {
+        id_tree_close(&view->tree);
+        json_snapshot_close(&view->snap);
+        return 1;
+    }
+    wal_overlay_load(view->snap.wal_fd, table_name, &view->ov);
+    return 0;
+}
+
+static void json_tree_view_close(JsonTreeView* view) {
+    wal_overlay_free(&view->ov);
+    id_tree_close(&view->tree);
+    json_snapshot_close(&view->snap);
+}
+
+// Read the record a tree entry points at into 'buffer' (grown as needed)
+// and parse it; NULL if it can't be read or the log replaced or deleted it.
+static cJSON* json_tree_view_record(JsonTreeView* view, uint64_t rowref, uint32_t length,
+                                    char** buffer, size_t* capacity) {
+    if (length + 1 > *capacity) {
+        char* grown = realloc(*buffer, length + 1);
+        if (!grown) return NULL;
+        *buffer = grown;
+        *capacity = length + 1;
+    }
+    if (json_snapshot_pread(&view->snap, *buffer, length, rowref) != (ssize_t)length) {
+        return NULL;
+    }
+    (*buffer)[length] = '\0';
+    cJSON* record = json_parse(*buffer, length);
+    if (record && !wal_overlay_keeps(&view->ov, record)) {
+        cJSON_Delete(record);
+        return NULL;
+    }
+    return record;
+}
+
+/* --------------------------------------------------------------------------
+ * Find the records of a paged table with field == value through the index on
+ * 'field'. Returns 1 if the table has no such index, or if a reader can't
+ * trust it: indexes only follow the newest versions, and while a commit is
+ * pending (or was left behind by a crashed writer) they may be ahead of the
+ * reader's snapshot.
+ * -------------------------------------------------------------------------- */
+static int paged_index_matches(PagedTable* pt, TableIndexes* indexes,
+                               const char* field, const char* value,
+                               RecordCallback fn, void* ctx) {
+    HashIndex* idx = table_indexes_find(indexes, field);
+    if (!idx || !hash_index_covers(value) ||
+        (pt->snapshot != PAGED_LATEST && pt->header.pending_seq != 0)) {
+        return 1;
+    }
+
+    IndexHitList hits;
+    index_lookup_sorted(idx, value, &hits);
+    for (size_t i = 0; i < hits.count; i++) {
+        char* text = paged_read_record(pt, hits.items[i].rowref);
+        if (!text) continue;
+        cJSON* record = json_parse(text, strlen(text));
+        bool match = string_field_equals(record, field, value);
+        cJSON_Delete(record);
+        if (match && fn(text, strlen(text), hits.items[i].rowref, ctx) != 0) {
+            free(text);
+            break;
+        }
+        free(text);
+    }
+    free(hits.items);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Range lookups: the records whose value of a field is in a FieldRange,
+ * read off an ordered index on the field in key order. Both return 1 if
+ * there is no usable ordered index, so the caller should scan instead.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* key;
+    cJSON* record;
+} PendingKey;
+
+static int compare_pending_keys(const void* a, const void* b) {
+    const char* x = ((const PendingKey*)a)->key;
+    const char* y = ((const PendingKey*)b)->key;
+    return strcmp(x, y);
+}
+
+// Index entries of a JSON table, merged with the records saved in the log.
+typedef struct {
+    JsonSnapshot* snap;
+    WalOverlay* ov;
+    const FieldRange* fr;
+    PendingKey* pending;
+    size_t pending_count;
+    size_t next_pending;
+    char* buffer;
+    size_t capacity;
+    RecordCallback fn;
+    void* ctx;
+    bool stopped;               // 'fn' asked to stop
+} JsonKeyMerge;
+
+static int emit_pending_record(JsonKeyMerge* m) {
+    char* text = json_print(m->pending[m->next_pending++].record);
+    int ret = text ? m->fn(text, strlen(text), 0, m->ctx) : 0;
+    cJSON_free(text);
+    m->stopped = ret != 0;
+    return ret;
+}
+
+static int json_range_entry_callback(const char* key, size_t key_len, uint64_t rowref,
+                                     uint32_t length, void* ctx) {
+    JsonKeyMerge* m = (JsonKeyMerge*)ctx;
+    while (m->next_pending < m->pending_count) {
+        const char* next = m->pending[m->next_pending].key;
+        if (compare_key_bytes(next, strlen(next), key, key_len) >= 0) break;
+        if (emit_pending_record(m) != 0) return 1;
+    }
+    if (length + 1 > m->capacity) {
+        char* grown = realloc(m->buffer, length + 1);
+        if (!grown) return 1;
+        m->buffer = grown;
+        m->capacity = length + 1;
+    }
+    if (json_snapshot_pread(m->snap, m->buffer, length, rowref) != (ssize_t)length) {
+        return 0;
+    }
+    cJSON* record = json_parse(m->buffer, length);
+    int ret = 0;
+    if (record_field_in_range(record, m->fr) && wal_overlay_keeps(m->ov, record)) {
+        ret = m->fn(m->buffer, length, rowref, m->ctx);
+        m->stopped = ret != 0;
+    }
+    cJSON_Delete(record);
+    return ret;
+}
+
+static int json_range_matches(const char* db_path, const char* table_name,
+                              const FieldRange* fr, RecordCallback fn, void* ctx) {
+    JsonSnapshot snap;
+    json_snapshot_open(db_path, table_name, &snap);
+
+    HashIndex idx;
+    if (hash_index_open(db_path, table_name, fr->field, &idx) != 0) {
+        json_snapshot_close(&snap);
+        return 1;
+    }
+    if (!hash_index_ranges(&idx) || !stamp_matches(snap.table_fd, &idx.header.table)) {
+        hash_index_close(&idx);
+        json_snapshot_close(&snap);
+        return 1;
+    }
+
+    WalOverlay ov;
+    wal_overlay_load(snap.wal_fd, table_name, &ov);
+    JsonKeyMerge m = { &snap, &ov, fr, NULL, 0, 0, NULL, 0, fn, ctx, false };
+    m.pending = malloc(((size_t)cJSON_GetArraySize(ov.records) + 1) * sizeof(PendingKey));
+    int ret = m.pending ? 0 : -1;
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, ov.records) {
+        if (m.pending && record_field_in_range(item, fr)) {
+            m.pending[m.pending_count++] =
+                (PendingKey){ record_string_field(item, fr->field), item };
+        }
+    }
+    if (ret == 0) {
+        qsort(m.pending, m.pending_count, sizeof(PendingKey), compare_pending_keys);
+        ret = ordered_index_scan(&idx, &fr->range, json_range_entry_callback, &m);
+    }
+    while (ret == 0 && !m.stopped && m.next_pending < m.pending_count) {
+        emit_pending_record(&m);
+    }
+
+    free(m.pending);
+    free(m.buffer);
+    wal_overlay_free(&ov);
+    hash_index_close(&idx);
+    json_snapshot_close(&snap);
+    return ret == 0 ? 0 : -1;
+}
+
+typedef struct {
+    PagedTable* pt;
+    const FieldRange* fr;
+    RecordCallback fn;
+    void* ctx;
+} PagedKeyScan;
+
+static int paged_range_entry_callback(const char* key, size_t key_len, uint64_t rowref,
+                                      uint32_t length, void* ctx) {
+    (void)key;
+    (void)key_len;
+    (void)length;
+    PagedKeyScan* scan = (PagedKeyScan*)ctx;
+    char* text = paged_read_record(scan->pt, rowref);
+    if (!text) return 0;
+    cJSON* record = json_parse(text, strlen(text));
+    int ret = record_field_in_range(record, scan->fr)
+        ? scan->fn(text, strlen(text), rowref, scan->ctx) : 0;
+    cJSON_Delete(record);
+    free(text);
+    return ret;
+}
+
+// Readers trust the index under the same rules as paged_index_matches().
+static int paged_range_matches(PagedTable* pt, TableIndexes* indexes, const FieldRange* fr,
+                               RecordCallback fn, void* ctx) {
+    HashIndex* idx = table_indexes_find(indexes, fr->field);
+    if (!idx || !hash_index_ranges(idx) ||
+        (pt->snapshot != PAGED_LATEST && pt->header.pending_seq != 0)) {
+        return 1;
+    }
+    PagedKeyScan scan = { pt, fr, fn, ctx };
+    return ordered_index_scan(idx, &fr->range, paged_range_entry_callback, &scan) == 0 ? 0 : -1;
+}
+
+static int open_paged_or_fail(const char* db_path, const char* table_name, PagedTable* pt) {
+    if (paged_open(db_path, table_name, false, pt) != 0) {
+        fprintf(stderr, "Error: Could not open paged table %s\n", table_name);
+        return 1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Writer lock: byte 0 of <table>.lock
+ * Writers of a paged table take turns: each one holds an OFD lock on the
+ * first byte of <table>.lock from before it reads the file header until its
+ * commit is written. Readers never wait for it. Returns the lock's fd
+ * (closing it releases the lock), or -1.
+ * -------------------------------------------------------------------------- */
+static int table_write_lock(const char* db_path, const char* table_name) {
+    char path[1024];
+    table_lock_path(db_path, table_name, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || lock_byte(fd, 0, F_WRLCK, true) != 0) {
+        fprintf(stderr, "Error: Could not lock table %s\n", table_name);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* --------------------------------------------------------------------------
+ * The id tree of a paged table that has none (tables created before the
+ * tree existed) is built by the next writer, under the writer lock and from
+ * the newest versions; readers scan until then.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    BTreeLeafEntry* items;
+    size_t count;
+    size_t capacity;
+} TreeEntries;
+
+static int collect_tree_entry_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    TreeEntries* entries = (TreeEntries*)ctx;
+    cJSON* record = json_parse(data, len);
+    uint64_t key;
+    bool keyed = parse_id_key(record_string_field(record, "id"), &key);
+    cJSON_Delete(record);
+    if (!keyed) return 0;
+
+    if (entries->count == entries->capacity) {
+        size_t capacity = entries->capacity ? entries->capacity * 2 : 1024;
+        BTreeLeafEntry* grown = realloc(entries->items, capacity * sizeof(BTreeLeafEntry));
+        if (!grown) return 1;
+        entries->items = grown;
+        entries->capacity = capacity;
+    }
+    entries->items[entries->count++] = (BTreeLeafEntry){ key, rowref, 0, 0 };
+    return 0;
+}
+
+static void paged_build_missing_tree(const char* db_path, const char* table_name,
+                                     PagedTable* pt) {
+    char path[1024];
+    id_tree_path(db_path, table_name, path, sizeof(path));
+    if (file_exists(path)) return;
+
+    TreeEntries entries = { NULL, 0, 0 };
+    if (paged_scan(pt, collect_tree_entry_callback, &entries) == 0) {
+        id_tree_build(db_path, table_name, entries.items, entries.count,
+                      pt->header.max_id, NULL);
+    }
+    free(entries.items);
+}
+
+typedef struct {
+    IndexBuilder* builder;
+    const char* field;
+} PagedIndexBuild;
+
+static int index_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    PagedIndexBuild* build = (PagedIndexBuild*)ctx;
+    cJSON* record = json_parse(data, len);
+    const char* value = record_string_field(record, build->field);
+    int ret = value ? index_builder_add(build->builder, value, rowref, 0) : 0;
+    cJSON_Delete(record);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Roll back the commit a crashed writer left pending: drop the versions it
+ * wrote, make current again the ones it replaced, and build the indexes it
+ * may have half updated again from the pages.
+ * -------------------------------------------------------------------------- */
+static int paged_recover(const char* db_path, const char* table_name, PagedTable* pt) {
+    uint64_t aborted = pt->header.pending_seq;
+    char page[PAGE_SIZE];
+    for (uint32_t pgno = 1; pgno < pt->header.page_count; pgno++) {
+        if (paged_read_page(pt, pgno, page) != 0) return -1;
+        PageHeader* ph = (PageHeader*)page;
+        bool dirty = false;
+        for (uint16_t i = 0; i < ph->slot_count; i++) {
+            if (page_slots(page)[i].length == 0) continue;
+            RecordVersion version;
+            page_version(page, i, &version);
+            if (version.xmin == aborted) {
+                page_remove(page, i);
+                dirty = true;
+            } else if (version.xmax == aborted) {
+                page_set_xmax(page, i, 0);
+                dirty = true;
+            }
+        }
+        if (dirty && paged_write_page(pt, pgno, page) != 0) return -1;
+    }
+    pt->header.pending_seq = 0;
+    if (paged_write_header(pt) != 0) return -1;
+
+    TableIndexes indexes;
+    table_indexes_open(db_path, table_name, &indexes);
+    int ret = 0;
+    for (int i = 0; i < indexes.count && ret == 0; i++) {
+        IndexBuilder b;
+        if (index_builder_init(&b, 0, hash_index_ordered(&indexes.items[i])) != 0) {
+            ret = -1;
+            break;
+        }
+        char path[1024];
+        index_path(db_path, table_name, indexes.items[i].field, path, sizeof(path));
+        PagedIndexBuild build = { &b, indexes.items[i].field };
+        if (paged_scan(pt, index_record_callback, &build) != 0 ||
+            index_builder_write(&b, path, NULL) != 0) {
+            ret = -1;
+        }
+        index_builder_free(&b);
+    }
+    TreeEntries entries = { NULL, 0, 0 };
+    if (ret == 0 && indexes.tree.fd >= 0 &&
+        (paged_scan(pt, collect_tree_entry_callback, &entries) != 0 ||
+         id_tree_build(db_path, table_name, entries.items, entries.count,
+                       pt->header.max_id, NULL) != 0)) {
+        ret = -1;
+    }
+    free(entries.items);
+    table_indexes_close(&indexes);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Open a paged table for writing: take the writer lock, roll back what a
+ * crashed writer left behind and start the next commit. Changes become
+ * visible to readers all at once with paged_commit(); closing the table
+ * without it leaves them to be rolled back by the next writer.
+ * -------------------------------------------------------------------------- */
+static int paged_open_writer(const char* db_path, const char* table_name, PagedTable* pt) {
+    int lock = table_write_lock(db_path, table_name);
+    if (lock < 0) return 1;
+    if (paged_open_file(db_path, table_name, false, pt) != 0) {
+        fprintf(stderr, "Error: Could not open paged table %s\n", table_name);
+        close(lock);
+        return 1;
+    }
+    pt->lock_fd = lock;
+    if (pt->header.pending_seq != 0 && paged_recover(db_path, table_name, pt) != 0) {
+        fprintf(stderr, "Error: Could not roll back an unfinished write to table %s\n",
+                table_name);
+        paged_close(pt);
+        return 1;
+    }
+
+    // Publish the horizon before looking for older pins (see "Snapshots")
+    pt->header.pending_seq = pt->header.commit_seq + 1;
+    pt->header.horizon = pt->header.commit_seq;
+    if (paged_write_header(pt) != 0) {
+        fprintf(stderr, "Error: Could not write to table %s\n", table_name);
+        paged_close(pt);
+        return 1;
+    }
+    pt->horizon = paged_oldest_pin(lock, pt->header.commit_seq);
+    paged_build_missing_tree(db_path, table_name, pt);
+    return 0;
+}
+
+static int paged_commit(PagedTable* pt) {
+    pt->header.commit_seq = pt->header.pending_seq;
+    pt->header.pending_seq = 0;
+    return paged_write_header(pt);
+}
+
+/* --------------------------------------------------------------------------
+ * LSM format: <table>.lsm
+ *
+ * For tables that mostly take writes. A 'save' appends the record to the
+ * table's memtable log, <table>.lsm.log, and reads nothing else, except
+ * that an update with an explicit id looks up the record it merges into.
+ * Once the log holds LSM_MEMTABLE_BYTES, the newest version of each id in it
+ * is written in id order to an immutable sorted run, <table>.lsm.<n>, and a
+ * new log is started. A delete is appended as an entry too: a tombstone that
+ * hides the older versions of its id until a compaction drops them.
+ *
+ * <table>.lsm is the manifest. It lists the live runs, newest first, and
+ * the generation of the log that belongs with them. A flush replaces the
+ * manifest by rename before it replaces the log, so a reader holding a
+ * manifest and a log of the same generation sees one consistent table. A
+ * newer log means a flush is under way, and the reader starts over.
+ *
+ * A run holds its entries in key order, a sparse index of every
+ * LSM_INDEX_INTERVAL'th key, and a Bloom filter of its keys. A get by id
+ * skips a run if the id is outside its key range or not in the filter, and
+ * reads one index interval of a run that may hold it.
+ *
+ * Runs are tiered. When LSM_FANOUT runs share a level, a background process
+ * merges them into one run at the next level, keeping only the newest
+ * version of each id. Tombstones are dropped too when nothing older remains.
+ * 'vacuum' merges all the runs into one. Writers take turns on byte 0 of
+ * <table>.lock, as paged writers do. A compaction holds byte 1 while it
+ * merges, and takes the writer lock only to swap its output into the
+ * manifest.
+ * -------------------------------------------------------------------------- */
+#define LSM_MAGIC           "SDBLSM01"
+#define LSM_LOG_MAGIC       "SDBLSML1"
+#define LSM_RUN_MAGIC       "SDBRUN01"
+#define LSM_LOG_HEADER_SIZE 64
+#define LSM_MAX_RUNS        64
+#define LSM_MEMTABLE_BYTES  (512 * 1024)
+#define LSM_FANOUT          4
+#define LSM_STALL_RUNS      16      // level-0 runs before a writer merges them itself
+#define LSM_INDEX_INTERVAL  64
+#define LSM_BLOOM_BITS      10      // per key, for about 1% false positives
+#define LSM_BLOOM_HASHES    7
+#define LSM_LOCK_COMPACT    1       // byte of <table>.lock held by a compaction
+#define LSM_OPEN_ATTEMPTS   100
+
+typedef struct {
+    uint64_t seq;               // the run is <table>.lsm.<seq>
+    uint32_t level;
+    uint32_t reserved;
+    uint64_t count;             // entries, tombstones included
+} LsmRunInfo;
+
+typedef struct {
+    char magic[8];
+    uint64_t generation;        // of the log that goes with these runs
+    uint64_t next_seq;
+    uint64_t max_id;            // the highest id flushed to a run
+    uint32_t run_count;
+    uint32_t reserved;
+    LsmRunInfo runs[LSM_MAX_RUNS];  // newest first, so by level
+} LsmManifest;
+
+typedef struct {
+    char magic[8];
+    uint64_t generation;
+    uint64_t end;               // the entries before this offset are committed
+    uint64_t max_id;            // the highest id logged
+} LsmLogHeader;
+
+// One version of a record, followed by its JSON text (empty for a
+// tombstone). The log frames it like a WAL entry; a run stores entries back
+// to back.
+typedef struct {
+    uint64_t key;
+    uint32_t length;
+    uint32_t tombstone;
+} LsmEntry;
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t index_offset;      // LsmIndexEntry[index_count]; the entries end here
+    uint64_t index_count;
+    uint64_t bloom_offset;
+    uint64_t bloom_bits;
+    uint64_t min_key;
+    uint64_t max_key;
+} LsmRunHeader;
+
+typedef struct {
+    uint64_t key;
+    uint64_t offset;
+} LsmIndexEntry;
+
+typedef struct {
+    MappedFile map;
+    const LsmRunHeader* header;
+    const LsmIndexEntry* index;
+    const uint8_t* bloom;
+} LsmRun;
+
+typedef struct {
+    LsmEntry entry;
+    char* text;                 // NUL-terminated
+} LsmMemEntry;
+
+// The entries of the log, in log order; 'ids' maps an id to the index of
+// its newest entry plus one.
+typedef struct {
+    LsmMemEntry* items;
+    size_t count;
+    size_t capacity;
+    IdMap ids;
+} LsmMemtable;
+
+typedef struct {
+    LsmManifest manifest;
+    LsmRun runs[LSM_MAX_RUNS];
+    uint32_t mapped;            // runs[0, mapped) are open
+    LsmMemtable mem;
+} LsmSnapshot;
+
+static void lsm_path(const char* db_path, const char* table_name, const char* suffix,
+                     char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%s.lsm%s", db_path, table_name, suffix);
+}
+
+static void lsm_run_path(const char* db_path, const char* table_name, uint64_t seq,
+                         char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%s.lsm.%llu", db_path, table_name, (unsigned long long)seq);
+}
+
+// Replace 'path' with 'len' bytes of 'data' by writing a temporary file and
+// renaming it.
+static int lsm_replace_file(const char* path, const void* data, size_t len) {
+    char temp_path[1100];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d", path, (int)getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int phase = profile_enter(PHASE_WRITE);
+    bool ok = write_all(fd, data, len) == 0 && fsync(fd) == 0;
+    close(fd);
+    ok = ok && rename(temp_path, path) == 0 && fsync_parent_dir(path) == 0;
+    profile_leave(phase, len);
+    if (!ok) unlink(temp_path);
+    return ok ? 0 : -1;
+}
+
+static int lsm_read_manifest(const char* db_path, const char* table_name, LsmManifest* m) {
+    char path[1024];
+    lsm_path(db_path, table_name, "", path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    int phase = profile_enter(PHASE_READ);
+    ssize_t n = pread(fd, m, sizeof(*m), 0);
+    profile_leave(phase, n > 0 ? (size_t)n : 0);
+    close(fd);
+    return n == (ssize_t)sizeof(*m) && memcmp(m->magic, LSM_MAGIC, sizeof(m->magic)) == 0 &&
+           m->run_count <= LSM_MAX_RUNS ? 0 : -1;
+}
+
+static int lsm_write_manifest(const char* db_path, const char* table_name,
+                              const LsmManifest* m) {
+    char path[1024];
+    lsm_path(db_path, table_name, "", path, sizeof(path));
+    return lsm_replace_file(path, m, sizeof(*m));
+}
+
+// Start an empty log of the given generation.
+static int lsm_new_log(const char* db_path, const char* table_name, uint64_t generation) {
+    char path[1024];
+    char page[LSM_LOG_HEADER_SIZE];
+    LsmLogHeader header;
+    memcpy(header.magic, LSM_LOG_MAGIC, sizeof(header.magic));
+    header.generation = generation;
+    header.end = LSM_LOG_HEADER_SIZE;
+    header.max_id = 0;
+    memset(page, 0, sizeof(page));
+    memcpy(page, &header, sizeof(header));
+    lsm_path(db_path, table_name, ".log", path, sizeof(path));
+    return lsm_replace_file(path, page, sizeof(page));
+}
+
+static int lsm_read_log_header(int fd, LsmLogHeader* header) {
+    return pread(fd, header, sizeof(*header), 0) == (ssize_t)sizeof(*header) &&
+           memcmp(header->magic, LSM_LOG_MAGIC, sizeof(header->magic)) == 0 ? 0 : -1;
+}
+
+// The highest id the table has stored, from its manifest and log headers.
+static int lsm_table_max_id(const char* db_path, const char* table_name, uint64_t* max_id) {
+    LsmManifest m;
+    if (lsm_read_manifest(db_path, table_name, &m) != 0) return -1;
+    *max_id = m.max_id;
+    char path[1024];
+    lsm_path(db_path, table_name, ".log", path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    LsmLogHeader header;
+    if (fd >= 0 && lsm_read_log_header(fd, &header) == 0 &&
+        header.generation == m.generation && header.max_id > *max_id) {
+        *max_id = header.max_id;
+    }
+    if (fd >= 0) close(fd);
+    return 0;
+}
+
+/* ---- Memtables ---- */
+
+static int lsm_memtable_init(LsmMemtable* mem) {
+    mem->items = NULL;
+    mem->count = 0;
+    mem->capacity = 0;
+    return idmap_init(&mem->ids, 64);
+}
+
+static void lsm_memtable_free(LsmMemtable* mem) {
+    for (size_t i = 0; i < mem->count; i++) {
+        free(mem->items[i].text);
+    }
+    free(mem->items);
+    idmap_free(&mem->ids);
+    mem->items = NULL;
+    mem->count = 0;
+    mem->capacity = 0;
+}
+
+static int lsm_memtable_add(LsmMemtable* mem, const LsmEntry* entry, const char* text) {
+    if (mem->count == mem->capacity) {
+        size_t capacity = mem->capacity ? mem->capacity * 2 : 256;
+        LsmMemEntry* grown = realloc(mem->items, capacity * sizeof(*grown));
+        if (!grown) return -1;
+        mem->items = grown;
+        mem->capacity = capacity;
+    }
+    char* copy = malloc(entry->length + 1);
+    if (!copy) return -1;
+    memcpy(copy, text, entry->length);
+    copy[entry->length] = '\0';
+    char id[32];
+    snprintf(id, sizeof(id), "%llu", (unsigned long long)entry->key);
+    if (idmap_put(&mem->ids, id, mem->count + 1) != 0) {
+        free(copy);
+        return -1;
+    }
+    mem->items[mem->count].entry = *entry;
+    mem->items[mem->count].text = copy;
+    mem->count++;
+    return 0;
+}
+
+static const LsmMemEntry* lsm_memtable_find(const LsmMemtable* mem, uint64_t key) {
+    char id[32];
+    uint64_t n;
+    snprintf(id, sizeof(id), "%llu", (unsigned long long)key);
+    return idmap_get(&mem->ids, id, &n) ? &mem->items[n - 1] : NULL;
+}
+
+// Add the committed entries of the log open on 'fd', read in one go. An
+// entry that fails its checksum ends the log, like a torn WAL frame.
+static int lsm_memtable_read(LsmMemtable* mem, int fd, uint64_t end) {
+    if (end <= LSM_LOG_HEADER_SIZE) return 0;
+    size_t len = (size_t)(end - LSM_LOG_HEADER_SIZE);
+    char* data = malloc(len);
+    if (!data) return -1;
+    int phase = profile_enter(PHASE_READ);
+    ssize_t n = pread(fd, data, len, LSM_LOG_HEADER_SIZE);
+    profile_leave(phase, n > 0 ? (size_t)n : 0);
+    if (n != (ssize_t)len) {
+        free(data);
+        return -1;
+    }
+    int ret = 0;
+    size_t offset = 0;
+    while (ret == 0 && offset + 8 <= len) {
+        uint32_t frame[2];
+        LsmEntry entry;
+        memcpy(frame, data + offset, sizeof(frame));
+        if (frame[0] < sizeof(entry) || frame[0] > len - offset - 8 ||
+            crc32_bytes(data + offset + 8, frame[0]) != frame[1]) {
+            break;
+        }
+        memcpy(&entry, data + offset + 8, sizeof(entry));
+        if (entry.length != frame[0] - sizeof(entry)) break;
+        ret = lsm_memtable_add(mem, &entry, data + offset + 8 + sizeof(entry));
+        offset += 8 + frame[0];
+    }
+    free(data);
+    return ret;
+}
+
+static int compare_mem_entries(const void* a, const void* b) {
+    uint64_t x = (*(const LsmMemEntry* const*)a)->entry.key;
+    uint64_t y = (*(const LsmMemEntry* const*)b)->entry.key;
+    return x < y ? -1 : x > y;
+}
+
+// The newest entry of every id in the memtable, in id order.
+static const LsmMemEntry** lsm_memtable_sorted(const LsmMemtable* mem, size_t* count) {
+    const LsmMemEntry** sorted = malloc((mem->count + 1) * sizeof(*sorted));
+    *count = 0;
+    if (!sorted) return NULL;
+    for (size_t i = 0; i < mem->count; i++) {
+        if (lsm_memtable_find(mem, mem->items[i].entry.key) == &mem->items[i]) {
+            sorted[(*count)++] = &mem->items[i];
+        }
+    }
+    qsort(sorted, *count, sizeof(*sorted), compare_mem_entries);
+    return sorted;
+}
+
+/* ---- Runs ---- */
+
+static int lsm_run_open(const char* db_path, const char* table_name, uint64_t seq,
+                        LsmRun* run) {
+    char path[1024];
+    lsm_run_path(db_path, table_name, seq, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    int ret = map_fd(fd, &run->map);
+    close(fd);
+    const LsmRunHeader* h = (const LsmRunHeader*)run->map.data;
+    if (ret != 0 || run->map.len < sizeof(*h) ||
+        memcmp(h->magic, LSM_RUN_MAGIC, sizeof(h->magic)) != 0 ||
+        h->index_offset < sizeof(*h) || h->index_offset % 8 != 0 ||
+        h->index_count > (run->map.len - h->index_offset) / sizeof(LsmIndexEntry) ||
+        h->bloom_offset < h->index_offset + h->index_count * sizeof(LsmIndexEntry) ||
+        h->bloom_bits == 0 || h->bloom_offset + (h->bloom_bits + 7) / 8 > run->map.len) {
+        unmap_file(&run->map);
+        return -1;
+    }
+    if (run->map.mapped) madvise(run->map.data, run->map.len, MADV_RANDOM);
+    run->header = h;
+    run->index = (const LsmIndexEntry*)(run->map.data + h->index_offset);
+    run->bloom = (const uint8_t*)(run->map.data + h->bloom_offset);
+    return 0;
+}
+
+// The Bloom filter's probes for 'key': h1 + i * h2, i < LSM_BLOOM_HASHES.
+static void lsm_bloom_hashes(uint64_t key, uint64_t* h1, uint64_t* h2) {
+    uint64_t h = hash_bytes((const char*)&key, sizeof(key));
+    *h1 = h;
+    *h2 = (h >> 32 | h << 32) | 1;
+}
+
+// False only if the run can't hold 'key'.
+static bool lsm_run_may_hold(const LsmRun* run, uint64_t key) {
+    const LsmRunHeader* h = run->header;
+    if (h->count == 0 || key < h->min_key || key > h->max_key) return false;
+    uint64_t h1, h2;
+    lsm_bloom_hashes(key, &h1, &h2);
+    for (int i = 0; i < LSM_BLOOM_HASHES; i++) {
+        uint64_t bit = (h1 + (uint64_t)i * h2) % h->bloom_bits;
+        if (!(run->bloom[bit / 8] & (1u << (bit % 8)))) return false;
+    }
+    return true;
+}
+
+/* --------------------------------------------------------------------------
+ * A cursor over a run or over the sorted entries of a memtable, and the
+ * merge of several of them. Sources are passed newest first. For a key held
+ * by more than one source, the newest version is the one passed on.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const LsmRun* run;          // NULL for a memtable
+    const LsmMemEntry** mem;
+    size_t mem_count;
+    uint64_t n;                 // the number of the current entry
+    uint64_t pos;               // a run's current entry offset
+    bool valid;
+    LsmEntry entry;
+    const char* text;
+} LsmCursor;
+
+// Called with the newest version of each key; a non-zero return stops the
+// merge.
+typedef int (*LsmEntryCallback)(const LsmEntry* entry, const char* text, void* ctx);
+
+static void lsm_cursor_load(LsmCursor* c) {
+    if (!c->run) {
+        c->valid = c->n < c->mem_count;
+        if (c->valid) {
+            c->entry = c->mem[c->n]->entry;
+            c->text = c->mem[c->n]->text;
+        }
+        return;
+    }
+    const LsmRunHeader* h = c->run->header;
+    c->valid = c->n < h->count && c->pos + sizeof(LsmEntry) <= h->index_offset;
+    if (!c->valid) return;
+    memcpy(&c->entry, c->run->map.data + c->pos, sizeof(c->entry));
+    c->text = c->run->map.data + c->pos + sizeof(LsmEntry);
+    c->valid = c->entry.length <= h->index_offset - c->pos - sizeof(LsmEntry);
+}
+
+static void lsm_cursor_next(LsmCursor* c) {
+    if (c->run) c->pos += sizeof(LsmEntry) + c->entry.length;
+    c->n++;
+    lsm_cursor_load(c);
+}
+
+// Move to the first entry with a key of at least 'lo'.
+static void lsm_cursor_seek(LsmCursor* c, uint64_t lo) {
+    c->n = 0;
+    c->pos = sizeof(LsmRunHeader);
+    if (c->run) {
+        // The last index entry at or before 'lo'
+        const LsmRunHeader* h = c->run->header;
+        size_t low = 0, high = h->index_count;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (c->run->index[mid].key <= lo) low = mid + 1;
+            else high = mid;
+        }
+        if (low > 0) {
+            c->n = (uint64_t)(low - 1) * LSM_INDEX_INTERVAL;
+            c->pos = c->run->index[low - 1].offset;
+        }
+    } else {
+        size_t low = 0, high = c->mem_count;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (c->mem[mid]->entry.key < lo) low = mid + 1;
+            else high = mid;
+        }
+        c->n = low;
+    }
+    lsm_cursor_load(c);
+    while (c->valid && c->entry.key < lo) {
+        lsm_cursor_next(c);
+    }
+}
+
+static int lsm_merge(LsmCursor* cursors, int count, uint64_t lo, uint64_t hi,
+                     LsmEntryCallback fn, void* ctx) {
+    for (int i = 0; i < count; i++) {
+        lsm_cursor_seek(&cursors[i], lo);
+    }
+    int ret = 0;
+    while (ret == 0) {
+        int newest = -1;
+        for (int i = 0; i < count; i++) {
+            if (cursors[i].valid &&
+                (newest < 0 || cursors[i].entry.key < cursors[newest].entry.key)) {
+                newest = i;
+            }
+        }
+        if (newest < 0 || cursors[newest].entry.key > hi) break;
+        uint64_t key = cursors[newest].entry.key;
+        ret = fn(&cursors[newest].entry, cursors[newest].text, ctx);
+        for (int i = 0; i < count; i++) {
+            if (cursors[i].valid && cursors[i].entry.key == key) lsm_cursor_next(&cursors[i]);
+        }
+    }
+    return ret;
+}
+
+/* ---- Snapshots ---- */
+
+static void lsm_snapshot_unmap(LsmSnapshot* snap) {
+    for (uint32_t i = 0; i < snap->mapped; i++) {
+        unmap_file(&snap->runs[i].map);
+    }
+    snap->mapped = 0;
+}
+
+static void lsm_snapshot_close(LsmSnapshot* snap) {
+    lsm_snapshot_unmap(snap);
+    lsm_memtable_free(&snap->mem);
+}
+
+// Map the runs the manifest lists; -1 if one of them is gone.
+static int lsm_snapshot_runs(const char* db_path, const char* table_name, LsmSnapshot* snap) {
+    lsm_snapshot_unmap(snap);
+    for (uint32_t i = 0; i < snap->manifest.run_count; i++) {
+        if (lsm_run_open(db_path, table_name, snap->manifest.runs[i].seq,
+                         &snap->runs[i]) != 0) {
+            lsm_snapshot_unmap(snap);
+            return -1;
+        }
+        snap->mapped = i + 1;
+    }
+    return 0;
+}
+
+// Read the log that goes with the manifest into the memtable. Returns 1 if
+// the log is newer than the manifest: a flush replaced both since.
+static int lsm_snapshot_log(const char* db_path, const char* table_name, LsmSnapshot* snap) {
+    char path[1024];
+    lsm_path(db_path, table_name, ".log", path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    LsmLogHeader header;
+    int ret = 0;
+    if (lsm_read_log_header(fd, &header) != 0) {
+        ret = -1;
+    } else if (header.generation > snap->manifest.generation) {
+        ret = 1;
+    } else if (header.generation == snap->manifest.generation) {
+        ret = lsm_memtable_read(&snap->mem, fd, header.end);
+    }
+    close(fd);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Open a consistent view of the table, without a lock: its manifest, the
+ * runs that lists and, with 'with_log', the matching log. A compaction may
+ * remove a run, and a flush may replace the log, between reading the
+ * manifest and opening them. In that case the open starts over.
+ * -------------------------------------------------------------------------- */
+static int lsm_snapshot_open(const char* db_path, const char* table_name, bool with_log,
+                             LsmSnapshot* snap) {
+    snap->mapped = 0;
+    for (int attempt = 0; attempt < LSM_OPEN_ATTEMPTS; attempt++) {
+        if (lsm_read_manifest(db_path, table_name, &snap->manifest) != 0) return -1;
+        if (lsm_memtable_init(&snap->mem) != 0) return -1;
+        if (lsm_snapshot_runs(db_path, table_name, snap) != 0) {
+            lsm_memtable_free(&snap->mem);
+            usleep(1000);
+            continue;
+        }
+        int ret = with_log ? lsm_snapshot_log(db_path, table_name, snap) : 0;
+        if (ret == 0) return 0;
+        lsm_snapshot_close(snap);
+        if (ret < 0) return -1;
+        usleep(1000);
+    }
+    return -1;
+}
+
+static int lsm_open_or_fail(const char* db_path, const char* table_name, LsmSnapshot* snap) {
+    if (lsm_snapshot_open(db_path, table_name, true, snap) != 0) {
+        fprintf(stderr, "Error: Could not open lsm table %s\n", table_name);
+        return -1;
+    }
+    return 0;
+}
+
+// The newest version of 'key', tombstone or not: 1 and the entry if the
+// table has one, 0 if not. The memtable is checked first, then each run,
+// newest first, that its key range and Bloom filter don't rule out.
+static int lsm_lookup(const LsmSnapshot* snap, uint64_t key, LsmEntry* entry,
+                      const char** text) {
+    const LsmMemEntry* e = lsm_memtable_find(&snap->mem, key);
+    if (e) {
+        *entry = e->entry;
+        *text = e->text;
+        return 1;
+    }
+    for (uint32_t i = 0; i < snap->manifest.run_count; i++) {
+        if (!lsm_run_may_hold(&snap->runs[i], key)) continue;
+        LsmCursor c;
+        memset(&c, 0, sizeof(c));
+        c.run = &snap->runs[i];
+        int phase = profile_enter(PHASE_READ);
+        lsm_cursor_seek(&c, key);
+        profile_leave(phase, 0);
+        if (c.valid && c.entry.key == key) {
+            *entry = c.entry;
+            *text = c.text;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    RecordCallback fn;
+    void* ctx;
+} LsmRecordScan;
+
+static int lsm_record_callback(const LsmEntry* entry, const char* text, void* ctx) {
+    LsmRecordScan* scan = (LsmRecordScan*)ctx;
+    if (entry->tombstone) return 0;
+    return scan->fn(text, entry->length, entry->key, scan->ctx);
+}
+
+// Call 'fn' for every record with an id from 'lo' to 'hi', in id order. The
+// rowref is the id.
+static int lsm_scan(const LsmSnapshot* snap, uint64_t lo, uint64_t hi,
+                    RecordCallback fn, void* ctx) {
+    uint32_t run_count = snap->manifest.run_count;
+    LsmCursor* cursors = calloc(run_count + 1, sizeof(*cursors));
+    size_t mem_count = 0;
+    const LsmMemEntry** sorted = lsm_memtable_sorted(&snap->mem, &mem_count);
+    if (!cursors || !sorted) {
+        free(cursors);
+        free(sorted);
+        return -1;
+    }
+    cursors[0].mem = sorted;
+    cursors[0].mem_count = mem_count;
+    for (uint32_t i = 0; i < run_count; i++) {
+        cursors[i + 1].run = &snap->runs[i];
+    }
+    LsmRecordScan scan = { fn, ctx };
+    int phase = profile_enter(PHASE_FILTER);
+    int ret = lsm_merge(cursors, (int)run_count + 1, lo, hi, lsm_record_callback, &scan);
+    profile_leave(phase, 0);
+    free(sorted);
+    free(cursors);
+    return ret;
+}
+
+static int lsm_scan_where(const LsmSnapshot* snap, const ScanFilter* filter,
+                          RecordCallback fn, void* ctx) {
+    FilteredScan scan = { filter, fn, ctx };
+    return lsm_scan(snap, 0, UINT64_MAX, filtered_record_callback, &scan);
+}
+
+/* --------------------------------------------------------------------------
+ * Writing a run: the entries go out in key order as they come, and the
+ * index and the filter after them. The header is written last. A run is
+ * only listed in a manifest once it is complete and durable.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    FILE* fp;
+    LsmRunHeader header;
+    uint64_t offset;
+    LsmIndexEntry* index;
+    size_t index_capacity;
+    uint8_t* bloom;
+} LsmRunWriter;
+
+static int lsm_run_writer_open(LsmRunWriter* w, const char* path, uint64_t expected) {
+    memset(w, 0, sizeof(*w));
+    memcpy(w->header.magic, LSM_RUN_MAGIC, sizeof(w->header.magic));
+    w->header.bloom_bits = (expected ? expected : 1) * LSM_BLOOM_BITS;
+    w->offset = sizeof(LsmRunHeader);
+    w->bloom = calloc((size_t)(w->header.bloom_bits + 7) / 8, 1);
+    if (!w->bloom) return -1;
+    w->fp = fopen(path, "wb");
+    if (!w->fp || fwrite(&w->header, sizeof(w->header), 1, w->fp) != 1) return -1;
+    return 0;
+}
+
+static int lsm_run_writer_add(LsmRunWriter* w, const LsmEntry* entry, const char* text) {
+    LsmRunHeader* h = &w->header;
+    if (h->count % LSM_INDEX_INTERVAL == 0) {
+        if (h->index_count == w->index_capacity) {
+            size_t capacity = w->index_capacity ? w->index_capacity * 2 : 64;
+            LsmIndexEntry* grown = realloc(w->index, capacity * sizeof(*grown));
+            if (!grown) return -1;
+            w->index = grown;
+            w->index_capacity = capacity;
+        }
+        w->index[h->index_count].key = entry->key;
+        w->index[h->index_count].offset = w->offset;
+        h->index_count++;
+    }
+    if (h->count == 0) h->min_key = entry->key;
+    h->max_key = entry->key;
+    h->count++;
+    uint64_t h1, h2;
+    lsm_bloom_hashes(entry->key, &h1, &h2);
+    for (int i = 0; i < LSM_BLOOM_HASHES; i++) {
+        uint64_t bit = (h1 + (uint64_t)i * h2) % h->bloom_bits;
+        w->bloom[bit / 8] |= (uint8_t)(1u << (bit % 8));
+    }
+    if (fwrite(entry, sizeof(*entry), 1, w->fp) != 1 ||
+        (entry->length > 0 && fwrite(text, entry->length, 1, w->fp) != 1)) {
+        return -1;
+    }
+    w->offset += sizeof(*entry) + entry->length;
+    return 0;
+}
+
+static int lsm_run_writer_finish(LsmRunWriter* w) {
+    static const char padding[8];
+    LsmRunHeader* h = &w->header;
+    size_t pad = (size_t)((8 - w->offset % 8) % 8);
+    size_t bloom_bytes = (size_t)(h->bloom_bits + 7) / 8;
+    h->index_offset = w->offset + pad;
+    h->bloom_offset = h->index_offset + h->index_count * sizeof(LsmIndexEntry);
+    bool ok = (pad == 0 || fwrite(padding, pad, 1, w->fp) == 1) &&
+              (h->index_count == 0 ||
+               fwrite(w->index, sizeof(*w->index), h->index_count, w->fp) == h->index_count) &&
+              fwrite(w->bloom, bloom_bytes, 1, w->fp) == 1 &&
+              fseek(w->fp, 0, SEEK_SET) == 0 &&
+              fwrite(h, sizeof(*h), 1, w->fp) == 1 &&
+              fflush(w->fp) == 0 && fsync(fileno(w->fp)) == 0;
+    return ok ? 0 : -1;
+}
+
+static void lsm_run_writer_close(LsmRunWriter* w) {
+    if (w->fp) fclose(w->fp);
+    free(w->index);
+    free(w->bloom);
+    w->fp = NULL;
+    w->index = NULL;
+    w->bloom = NULL;
+}
+
+/* --------------------------------------------------------------------------
+ * Compaction: merge runs [first, first + count) of a snapshot into a new run
+ * at 'path'. Tombstones are kept unless the merged runs include the oldest
+ * one, since they may still hide a version in an older run.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    LsmRunWriter* out;
+    bool drop_tombstones;
+} LsmCompaction;
+
+static int lsm_compact_entry_callback(const LsmEntry* entry, const char* text, void* ctx) {
+    LsmCompaction* c = (LsmCompaction*)ctx;
+    if (entry->tombstone && c->drop_tombstones) return 0;
+    return lsm_run_writer_add(c->out, entry, text);
+}
+
+static int lsm_merge_runs(const LsmSnapshot* snap, uint32_t first, uint32_t count,
+                          const char* path, uint64_t* kept) {
+    LsmCursor cursors[LSM_MAX_RUNS];
+    uint64_t expected = 0;
+    memset(cursors, 0, sizeof(cursors));
+    for (uint32_t i = 0; i < count; i++) {
+        cursors[i].run = &snap->runs[first + i];
+        expected += snap->runs[first + i].header->count;
+    }
+    LsmRunWriter out;
+    LsmCompaction c = { &out, first + count == snap->manifest.run_count };
+    int ret = lsm_run_writer_open(&out, path, expected);
+    if (ret == 0) ret = lsm_merge(cursors, (int)count, 0, UINT64_MAX,
+                                  lsm_compact_entry_callback, &c);
+    if (ret == 0) ret = lsm_run_writer_finish(&out);
+    *kept = out.header.count;
+    lsm_run_writer_close(&out);
+    if (ret != 0) unlink(path);
+    return ret;
+}
+
+// The first level, oldest first, with LSM_FANOUT runs or more. The runs of
+// a level are next to each other in the manifest.
+static bool lsm_pick_level(const LsmManifest* m, uint32_t* first, uint32_t* count) {
+    uint32_t i = m->run_count;
+    while (i > 0) {
+        uint32_t end = i;
+        uint32_t level = m->runs[i - 1].level;
+        while (i > 0 && m->runs[i - 1].level == level) i--;
+        if (end - i >= LSM_FANOUT) {
+            *first = i;
+            *count = end - i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* --------------------------------------------------------------------------
+ * Install a merged run, under the writer lock: it takes the place of the
+ * runs it was made from, if they are all still listed, and gets the next
+ * sequence number. An empty result just removes them. Returns 1, with the
+ * output removed, if another compaction got to those runs first.
+ * -------------------------------------------------------------------------- */
+static int lsm_install(const char* db_path, const char* table_name, LsmManifest* m,
+                       const LsmRunInfo* merged, uint32_t count, const char* temp_path,
+                       uint32_t level, uint64_t kept) {
+    uint32_t at = 0;
+    while (at + count <= m->run_count) {
+        uint32_t i = 0;
+        while (i < count && m->runs[at + i].seq == merged[i].seq) i++;
+        if (i == count) break;
+        at++;
+    }
+    if (at + count > m->run_count) {
+        unlink(temp_path);
+        return 1;
+    }
+    LsmManifest next = *m;
+    uint32_t added = kept > 0 ? 1 : 0;
+    if (added) {
+        char path[1024];
+        lsm_run_path(db_path, table_name, next.next_seq, path, sizeof(path));
+        if (rename(temp_path, path) != 0) {
+            unlink(temp_path);
+            return -1;
+        }
+        next.runs[at].seq = next.next_seq++;
+        next.runs[at].level = level;
+        next.runs[at].reserved = 0;
+        next.runs[at].count = kept;
+    } else {
+        unlink(temp_path);
+    }
+    memmove(&next.runs[at + added], &m->runs[at + count],
+            (m->run_count - at - count) * sizeof(LsmRunInfo));
+    next.run_count = m->run_count - count + added;
+    if (lsm_write_manifest(db_path, table_name, &next) != 0) return -1;
+    *m = next;
+    for (uint32_t i = 0; i < count; i++) {
+        char path[1024];
+        lsm_run_path(db_path, table_name, merged[i].seq, path, sizeof(path));
+        unlink(path);
+    }
+    return 0;
+}
+
+// Merge runs [first, first + count) of 'snap' into a temporary file, named
+// for this process, and the level above the highest of theirs.
+static int lsm_compact_runs(const char* db_path, const char* table_name,
+                            const LsmSnapshot* snap, uint32_t first, uint32_t count,
+                            char* temp_path, size_t size, uint32_t* level, uint64_t* kept) {
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), ".merge.%d", (int)getpid());
+    lsm_path(db_path, table_name, suffix, temp_path, size);
+    *level = 0;
+    for (uint32_t i = first; i < first + count; i++) {
+        if (snap->manifest.runs[i].level >= *level) *level = snap->manifest.runs[i].level + 1;
+    }
+    return lsm_merge_runs(snap, first, count, temp_path, kept);
+}
+
+/* --------------------------------------------------------------------------
+ * Merge runs until no level has LSM_FANOUT of them or, with 'all', merge all
+ * the runs into one. Only one compaction runs at a time: with 'all' this
+ * waits for the other, and otherwise leaves the work to it. The merging
+ * happens without the writer lock, so writers don't wait for it.
+ * -------------------------------------------------------------------------- */
+static int lsm_compact(const char* db_path, const char* table_name, bool all) {
+    char path[1024];
+    table_lock_path(db_path, table_name, path, sizeof(path));
+    int lock = open(path, O_RDWR | O_CREAT, 0644);
+    if (lock < 0) return -1;
+    if (lock_byte(lock, LSM_LOCK_COMPACT, F_WRLCK, all) != 0) {
+        close(lock);
+        return all ? -1 : 0;
+    }
+    int ret = 0;
+    while (ret == 0) {
+        LsmSnapshot snap;
+        if (lsm_snapshot_open(db_path, table_name, false, &snap) != 0) {
+            ret = -1;
+            break;
+        }
+        uint32_t first = 0, count = snap.manifest.run_count;
+        bool pick = all ? count > 0 : lsm_pick_level(&snap.manifest, &first, &count);
+        char temp_path[1024];
+        uint32_t level;
+        uint64_t kept;
+        if (pick) {
+            ret = lsm_compact_runs(db_path, table_name, &snap, first, count,
+                                   temp_path, sizeof(temp_path), &level, &kept);
+        }
+        LsmRunInfo merged[LSM_MAX_RUNS];
+        memcpy(merged, &snap.manifest.runs[first], count * sizeof(LsmRunInfo));
+        lsm_snapshot_close(&snap);
+        if (!pick || ret != 0) break;
+
+        int writer = table_write_lock(db_path, table_name);
+        LsmManifest m;
+        if (writer < 0 || lsm_read_manifest(db_path, table_name, &m) != 0) {
+            unlink(temp_path);
+            ret = -1;
+        } else {
+            ret = lsm_install(db_path, table_name, &m, merged, count, temp_path, level, kept);
+            if (ret == 1) ret = 0;
+        }
+        if (writer >= 0) close(writer);
+        if (all) break;
+    }
+    close(lock);
+    return ret;
+}
+
+// Compact in a detached process, so the writer that filled a level isn't
+// the one to wait for the merge. The process is a grandchild, left to init,
+// and holds none of the caller's output open. A writer that is still at
+// work merges its own level 0 (see lsm_writer_stall()): a compaction
+// couldn't install its output before that writer is done.
+static void lsm_compact_in_background(const char* db_path, const char* table_name) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) return;
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    if (fork() != 0) _exit(0);
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+    }
+    // Nor a server's socket or its client's connection
+    closefrom(STDERR_FILENO + 1);
+    _exit(lsm_compact(db_path, table_name, false) == 0 ? 0 : 1);
+}
+
+/* --------------------------------------------------------------------------
+ * Writers. A writer holds the writer lock while it is open. It appends
+ * entries to the log with lsm_writer_put() and makes them visible with
+ * lsm_writer_commit(). Closing without a commit drops the entries written
+ * since the last one, unless a flush already wrote them to a run. The
+ * memtable is only read from the log when something needs it, so a plain
+ * save reads nothing.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* db_path;
+    const char* table_name;
+    int lock_fd;
+    int log_fd;
+    LsmLogHeader log;           // 'max_id' includes uncommitted entries
+    uint64_t end;               // where the next entry goes
+    LsmSnapshot snap;           // the writer's runs, and the memtable if loaded
+    bool mem_loaded;
+} LsmWriter;
+
+static void lsm_writer_close(LsmWriter* w) {
+    uint32_t first, count;
+    bool compact = lsm_pick_level(&w->snap.manifest, &first, &count);
+    lsm_snapshot_close(&w->snap);
+    if (w->log_fd >= 0) close(w->log_fd);
+    if (w->lock_fd >= 0) close(w->lock_fd);
+    w->log_fd = -1;
+    w->lock_fd = -1;
+    // Only once the writer lock is released: the compaction process must
+    // not inherit it
+    if (compact) lsm_compact_in_background(w->db_path, w->table_name);
+}
+
+// Open the log that goes with the writer's manifest. A flush that crashed
+// after writing the manifest left the old log behind, and its entries are
+// all in the run that flush wrote; a new log replaces it.
+static int lsm_writer_open_log(LsmWriter* w) {
+    char path[1024];
+    lsm_path(w->db_path, w->table_name, ".log", path, sizeof(path));
+    for (int attempt = 0; attempt < 2; attempt++) {
+        w->log_fd = open(path, O_RDWR);
+        if (w->log_fd >= 0 && lsm_read_log_header(w->log_fd, &w->log) == 0 &&
+            w->log.generation == w->snap.manifest.generation) {
+            w->end = w->log.end;
+            return 0;
+        }
+        if (w->log_fd >= 0) close(w->log_fd);
+        w->log_fd = -1;
+        if (lsm_new_log(w->db_path, w->table_name, w->snap.manifest.generation) != 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static int lsm_writer_open(const char* db_path, const char* table_name, LsmWriter* w) {
+    memset(w, 0, sizeof(*w));
+    w->db_path = db_path;
+    w->table_name = table_name;
+    w->log_fd = -1;
+    w->lock_fd = table_write_lock(db_path, table_name);
+    if (w->lock_fd < 0) return 1;
+    if (lsm_memtable_init(&w->snap.mem) != 0 ||
+        lsm_read_manifest(db_path, table_name, &w->snap.manifest) != 0 ||
+        lsm_snapshot_runs(db_path, table_name, &w->snap) != 0 ||
+        lsm_writer_open_log(w) != 0) {
+        fprintf(stderr, "Error: Could not open lsm table %s\n", table_name);
+        lsm_writer_close(w);
+        return 1;
+    }
+    return 0;
+}
+
+// The floor of the table's id sequence.
+static uint64_t lsm_writer_max_id(const LsmWriter* w) {
+    return w->log.max_id > w->snap.manifest.max_id ? w->log.max_id : w->snap.manifest.max_id;
+}
+
+static int lsm_writer_memtable(LsmWriter* w) {
+    if (w->mem_loaded) return 0;
+    if (lsm_memtable_read(&w->snap.mem, w->log_fd, w->end) != 0) return -1;
+    w->mem_loaded = true;
+    return 0;
+}
+
+// The current version of the record with id 'key', as a new object: 1 if
+// there is one, 0 if not, -1 if it can't be read.
+static int lsm_writer_load(LsmWriter* w, uint64_t key, cJSON** record) {
+    LsmEntry entry;
+    const char* text;
+    *record = NULL;
+    if (lsm_writer_memtable(w) != 0) return -1;
+    if (lsm_lookup(&w->snap, key, &entry, &text) != 1 || entry.tombstone) return 0;
+    *record = json_parse(text, entry.length);
+    return *record ? 1 : -1;
+}
+
+static int lsm_writer_commit(LsmWriter* w) {
+    if (w->end == w->log.end) return 0;
+    w->log.end = w->end;
+    int phase = profile_enter(PHASE_WRITE);
+    int ret = pwrite(w->log_fd, &w->log, sizeof(w->log), 0) == (ssize_t)sizeof(w->log) &&
+              fdatasync(w->log_fd) == 0 ? 0 : -1;
+    profile_leave(phase, sizeof(w->log));
+    return ret;
+}
+
+// Merge level 0 on the writer's own time. Only done when background
+// compactions fall this far behind, so writes can't outrun them for good.
+static int lsm_writer_stall(LsmWriter* w) {
+    uint32_t count = 0;
+    while (count < w->snap.manifest.run_count && w->snap.manifest.runs[count].level == 0) {
+        count++;
+    }
+    if (count < LSM_STALL_RUNS) return 0;
+    char temp_path[1024];
+    uint32_t level;
+    uint64_t kept;
+    LsmRunInfo merged[LSM_MAX_RUNS];
+    memcpy(merged, w->snap.manifest.runs, count * sizeof(LsmRunInfo));
+    if (lsm_compact_runs(w->db_path, w->table_name, &w->snap, 0, count,
+                         temp_path, sizeof(temp_path), &level, &kept) != 0 ||
+        lsm_install(w->db_path, w->table_name, &w->snap.manifest, merged, count,
+                    temp_path, level, kept) < 0) {
+        return -1;
+    }
+    return lsm_snapshot_runs(w->db_path, w->table_name, &w->snap);
+}
+
+// Write the memtable to a new level-0 run and start the next log. The run
+// is durable before the manifest lists it, and the manifest before the new
+// log replaces the old one.
+static int lsm_flush(LsmWriter* w) {
+    if (lsm_writer_commit(w) != 0 || lsm_writer_memtable(w) != 0) return -1;
+    LsmManifest next = w->snap.manifest;
+    if (next.run_count == LSM_MAX_RUNS) return -1;
+    size_t count;
+    const LsmMemEntry** sorted = lsm_memtable_sorted(&w->snap.mem, &count);
+    if (!sorted) return -1;
+    char path[1024];
+    lsm_run_path(w->db_path, w->table_name, next.next_seq, path, sizeof(path));
+    LsmRunWriter out;
+    int phase = profile_enter(PHASE_WRITE);
+    int ret = lsm_run_writer_open(&out, path, count);
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        ret = lsm_run_writer_add(&out, &sorted[i]->entry, sorted[i]->text);
+    }
+    if (ret == 0) ret = lsm_run_writer_finish(&out);
+    profile_leave(phase, out.offset);
+    lsm_run_writer_close(&out);
+    free(sorted);
+
+    memmove(&next.runs[1], &next.runs[0], next.run_count * sizeof(LsmRunInfo));
+    next.runs[0].seq = next.next_seq++;
+    next.runs[0].level = 0;
+    next.runs[0].reserved = 0;
+    next.runs[0].count = count;
+    next.run_count++;
+    next.generation++;
+    if (w->log.max_id > next.max_id) next.max_id = w->log.max_id;
+    if (ret == 0) ret = lsm_write_manifest(w->db_path, w->table_name, &next);
+    if (ret != 0) {
+        unlink(path);
+        return -1;
+    }
+    w->snap.manifest = next;
+
+    lsm_memtable_free(&w->snap.mem);
+    close(w->log_fd);
+    w->log_fd = -1;
+    if (lsm_memtable_init(&w->snap.mem) != 0 || lsm_writer_open_log(w) != 0 ||
+        lsm_snapshot_runs(w->db_path, w->table_name, &w->snap) != 0) {
+        return -1;
+    }
+    return lsm_writer_stall(w);
+}
+
+// Append a version of record 'key', or with a NULL 'text' a tombstone. A
+// full memtable is flushed.
+static int lsm_writer_put(LsmWriter* w, uint64_t key, const char* text, size_t len) {
+    LsmEntry entry;
+    entry.key = key;
+    entry.length = text ? (uint32_t)len : 0;
+    entry.tombstone = text ? 0 : 1;
+    size_t payload_len = sizeof(entry) + entry.length;
+    char* frame = malloc(8 + payload_len);
+    if (!frame) return -1;
+    memcpy(frame + 8, &entry, sizeof(entry));
+    if (entry.length > 0) memcpy(frame + 8 + sizeof(entry), text, entry.length);
+    uint32_t header[2] = { (uint32_t)payload_len, crc32_bytes(frame + 8, payload_len) };
+    memcpy(frame, header, sizeof(header));
+    int phase = profile_enter(PHASE_WRITE);
+    bool ok = pwrite(w->log_fd, frame, 8 + payload_len, (off_t)w->end) ==
+              (ssize_t)(8 + payload_len);
+    profile_leave(phase, 8 + payload_len);
+    if (ok && w->mem_loaded) {
+        ok = lsm_memtable_add(&w->snap.mem, &entry, frame + 8 + sizeof(entry)) == 0;
+    }
+    free(frame);
+    if (!ok) return -1;
+    w->end += 8 + payload_len;
+    if (key > w->log.max_id) w->log.max_id = key;
+    return w->end - LSM_LOG_HEADER_SIZE >= LSM_MEMTABLE_BYTES ? lsm_flush(w) : 0;
+}
+
+// The bytes a table's runs and log take up.
+static off_t lsm_table_size(const char* db_path, const char* table_name) {
+    LsmManifest m;
+    if (lsm_read_manifest(db_path, table_name, &m) != 0) return 0;
+    char path[1024];
+    struct stat st;
+    off_t size = 0;
+    for (uint32_t i = 0; i < m.run_count; i++) {
+        lsm_run_path(db_path, table_name, m.runs[i].seq, path, sizeof(path));
+        if (stat(path, &st) == 0) size += st.st_size;
+    }
+    lsm_path(db_path, table_name, ".log", path, sizeof(path));
+    if (stat(path, &st) == 0) size += st.st_size;
+    return size;
+}
+
+/* --------------------------------------------------------------------------
+ * Columnar snapshots: <table>.columns and <table>.<n>.col
+ *
+ * 'compact <table> --columnar' writes a read-optimized copy of a table, one
+ * file per field, so commands that look at a few fields of every record
+ * read only those. <table>.columns lists the fields and, per row, where its
+ * record is in the table (the file offset of a JSON table's record, the
+ * rowref of a paged one's). <table>.<n>.col holds field n: a bitmap of the
+ * rows that have it, then its values as JSON text, either back to back
+ * with an end offset per row, or, when that is smaller, as a dictionary of
+ * the distinct values and a code per row.
+ *
+ * Every file carries the stamp of the table file it was made from, and a
+ * snapshot is only used while that file is unchanged and, for JSON tables,
+ * the log holds nothing for the table. Otherwise commands read the rows.
+ * -------------------------------------------------------------------------- */
+#define COLUMNS_MAGIC      "SDBCOLS1"
+#define COLUMN_MAGIC       "SDBCOLF1"
+#define COLUMN_PLAIN       0
+#define COLUMN_DICT        1
+#define MAX_COLUMNS        1024
+#define MAX_COLUMN_DICT    65536
+
+typedef struct {
+    char      magic[8];
+    uint32_t  field_count;
+    uint32_t  names_len;        // bytes of NUL-terminated names, padded to 8
+    uint64_t  row_count;
+    FileStamp table;
+} ColumnsHeader;                // then the names, then a u64 per row
+
+typedef struct {
+    char      magic[8];
+    uint32_t  encoding;
+    uint32_t  reserved;
+    uint64_t  row_count;
+    uint64_t  dict_count;       // COLUMN_DICT: distinct values
+    uint64_t  data_len;
+    FileStamp table;
+} ColumnHeader;                 // then bitmap, ends, codes (dict only), data
+
+typedef struct {
+    MappedFile file;
+    const ColumnHeader* header; // NULL for a field no row has
+    const uint64_t* present;
+    const uint64_t* ends;       // per row, or per dictionary value
+    const uint32_t* codes;
+    const char* data;
+} Column;
+
+typedef struct {
+    MappedFile file;
+    const ColumnsHeader* header;
+    const char* names;
+    const uint64_t* rows;
+    TableFormat format;
+    JsonSnapshot snap;          // JSON tables
+    PagedTable pt;              // paged tables
+} ColumnSnapshot;
+
+static void columns_path(const char* db_path, const char* table_name, char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%s.columns", db_path, table_name);
+}
+
+static void column_path(const char* db_path, const char* table_name, int n,
+                        char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%s.%d.col", db_path, table_name, n);
+}
+
+static size_t column_bitmap_words(uint64_t rows) {
+    return (size_t)((rows + 63) / 64);
+}
+
+static void column_close(Column* c) {
+    if (c->header) unmap_file(&c->file);
+    memset(c, 0, sizeof(*c));
+}
+
+// Open column 'n' of a snapshot; -1 if it is missing, damaged or doesn't
+// belong to the snapshot.
+static int column_open(const char* db_path, const char* table_name, int n,
+                       const ColumnsHeader* columns, Column* c) {
+    memset(c, 0, sizeof(*c));
+    char path[1024];
+    column_path(db_path, table_name, n, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    int ret = map_fd(fd, &c->file);
+    close(fd);
+    if (ret != 0) return -1;
+
+    const ColumnHeader* h = (const ColumnHeader*)c->file.data;
+    if (c->file.len < sizeof(*h) || memcmp(h->magic, COLUMN_MAGIC, sizeof(h->magic)) != 0 ||
+        h->row_count != columns->row_count ||
+        memcmp(&h->table, &columns->table, sizeof(h->table)) != 0) {
+        unmap_file(&c->file);
+        return -1;
+    }
+    uint64_t rows = h->row_count;
+    uint64_t ends = h->encoding == COLUMN_DICT ? h->dict_count : rows;
+    uint64_t size = sizeof(*h) + column_bitmap_words(rows) * 8 + ends * 8 +
+                    (h->encoding == COLUMN_DICT ? ((rows * 4 + 7) & ~7ULL) : 0) + h->data_len;
+    if ((h->encoding != COLUMN_PLAIN && h->encoding != COLUMN_DICT) || size > c->file.len) {
+        unmap_file(&c->file);
+        return -1;
+    }
+    c->header = h;
+    c->present = (const uint64_t*)(c->file.data + sizeof(*h));
+    c->ends = c->present + column_bitmap_words(rows);
+    if (h->encoding == COLUMN_DICT) {
+        c->codes = (const uint32_t*)(c->ends + ends);
+        c->data = (const char*)c->codes + ((rows * 4 + 7) & ~7ULL);
+    } else {
+        c->data = (const char*)(c->ends + ends);
+    }
+    return 0;
+}
+
+static bool column_has(const Column* c, uint64_t row) {
+    return c->header && (c->present[row / 64] >> (row % 64) & 1);
+}
+
+// The JSON text of a row's value; false if the row doesn't have the field.
+static bool column_value(const Column* c, uint64_t row, const char** value, size_t* len) {
+    if (!column_has(c, row)) return false;
+    uint64_t i = c->codes ? c->codes[row] : row;
+    if (c->codes && i >= c->header->dict_count) return false;
+    uint64_t start = i ? c->ends[i - 1] : 0;
+    *value = c->data + start;
+    *len = (size_t)(c->ends[i] - start);
+    return true;
+}
+
+static void column_snapshot_close(ColumnSnapshot* cs) {
+    if (cs->format == TABLE_FORMAT_PAGED) paged_close(&cs->pt);
+    else json_snapshot_close(&cs->snap);
+    unmap_file(&cs->file);
+}
+
+// Open the snapshot of a table, with the table file its rows point into.
+// Returns 1 if there is none or it is older than the table.
+static int column_snapshot_open(const char* db_path, const char* table_name,
+                                ColumnSnapshot* cs) {
+    memset(cs, 0, sizeof(*cs));
+    char path[1024];
+    columns_path(db_path, table_name, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    int ret = map_fd(fd, &cs->file);
+    close(fd);
+    if (ret != 0) return 1;
+
+    const ColumnsHeader* h = (const ColumnsHeader*)cs->file.data;
+    if (cs->file.len < sizeof(*h) || memcmp(h->magic, COLUMNS_MAGIC, sizeof(h->magic)) != 0 ||
+        sizeof(*h) + h->names_len + h->row_count * 8 > cs->file.len) {
+        unmap_file(&cs->file);
+        return 1;
+    }
+    cs->header = h;
+    cs->names = cs->file.data + sizeof(*h);
+    cs->rows = (const uint64_t*)(cs->names + h->names_len);
+
+    cs->format = table_format(db_path, table_name);
+    bool fresh;
+    if (cs->format == TABLE_FORMAT_PAGED) {
+        fresh = paged_open(db_path, table_name, false, &cs->pt) == 0;
+        if (fresh && !stamp_matches(cs->pt.fd, &h->table)) {
+            paged_close(&cs->pt);
+            fresh = false;
+        }
+    } else {
+        json_snapshot_open(db_path, table_name, &cs->snap);
+        fresh = stamp_matches(cs->snap.table_fd, &h->table);
+        if (fresh && cs->snap.wal_fd >= 0) {
+            WalOverlay ov;
+            fresh = wal_overlay_load(cs->snap.wal_fd, table_name, &ov) == 0 &&
+                    !ov.records->child && !ov.deletes->child;
+            wal_overlay_free(&ov);
+        }
+        if (!fresh) json_snapshot_close(&cs->snap);
+    }
+    if (!fresh) {
+        unmap_file(&cs->file);
+        return 1;
+    }
+    return 0;
+}
+
+// The column of 'field'; a column without values if no row has the field.
+static int column_snapshot_column(const char* db_path, const char* table_name,
+                                  const ColumnSnapshot* cs, const char* field, Column* c) {
+    memset(c, 0, sizeof(*c));
+    const char* name = cs->names;
+    for (uint32_t n = 0; n < cs->header->field_count; n++) {
+        if (strcmp(name, field) == 0) {
+            return column_open(db_path, table_name, (int)n, cs->header, c);
+        }
+        name += strlen(name) + 1;
+    }
+    return 0;
+}
+
+// The compact text of a row's record, in 'out' (or a malloc'd buffer for
+// paged tables, which the caller frees through *owned).
+static int column_snapshot_record(ColumnSnapshot* cs, uint64_t row, TextBuffer* out,
+                                  char** owned, const char** data, size_t* len) {
+    if (cs->format == TABLE_FORMAT_PAGED) {
+        *owned = paged_read_record(&cs->pt, cs->rows[row]);
+        if (!*owned) return -1;
+        *data = *owned;
+        *len = strlen(*owned);
+        return 0;
+    }
+    // The record ends where its closing brace does; read until that shows
+    out->len = 0;
+    off_t offset = (off_t)cs->rows[row];
+    size_t end = 0;
+    for (;;) {
+        if (text_reserve(out, 4096) != 0) return -1;
+        ssize_t n = json_snapshot_pread(&cs->snap, out->data + out->len, 4096,
+                                        (uint64_t)offset + out->len);
+        if (n > 0) out->len += (size_t)n;
+        end = json_value_end(out->data, out->len, 0);
+        if (end < out->len || n <= 0) break;
+    }
+    if (end == 0 || out->data[0] != '{') return -1;
+    *data = out->data;
+    *len = compact_json(out->data, end, out->data);
+    return 0;
+}
+
+// Print a row from the columns of a projection's fields.
+static int projection_print_row(Projection* p, const Column* columns, uint64_t row) {
+    for (int i = 0; i < p->count; i++) {
+        if (!column_value(&columns[i], row, &p->values[i], &p->lengths[i])) p->values[i] = NULL;
+    }
+    return projection_print_values(p);
+}
+
+static Column* projection_columns_open(const char* db_path, const char* table_name,
+                                       const ColumnSnapshot* cs, const Projection* p) {
+    Column* columns = calloc((size_t)p->count, sizeof(Column));
+    for (int i = 0; columns && i < p->count; i++) {
+        if (column_snapshot_column(db_path, table_name, cs, p->names[i], &columns[i]) != 0) {
+            for (int j = 0; j < i; j++) column_close(&columns[j]);
+            free(columns);
+            return NULL;
+        }
+    }
+    return columns;
+}
+
+static void projection_columns_close(const Projection* p, Column* columns) {
+    for (int i = 0; i < p->count; i++) column_close(&columns[i]);
+    free(columns);
+}
+
+/* --------------------------------------------------------------------------
+ * Print the records with field == value through a table's columnar
+ * snapshot, reading only that field's column, and with --fields only the
+ * columns of the fields printed. Returns 1 if the table has no fresh
+ * snapshot, so the caller should scan instead.
+ * -------------------------------------------------------------------------- */
+static int columnar_print_matches(const char* db_path, const char* table_name,
+                                  const char* field, const char* value, Projection* fields) {
+    ColumnSnapshot cs;
+    if (column_snapshot_open(db_path, table_name, &cs) != 0) return 1;
+    Column c;
+    Column* columns = NULL;
+    if (column_snapshot_column(db_path, table_name, &cs, field, &c) != 0 ||
+        (fields && !(columns = projection_columns_open(db_path, table_name, &cs, fields)))) {
+        column_close(&c);
+        column_snapshot_close(&cs);
+        return 1;
+    }
+
+    // Values are stored the way cJSON prints them, so compare text
+    TextBuffer needle = { 0 }, record = { 0 };
+    int ret = text_append_json_string(&needle, value, strlen(value));
+    uint64_t code = UINT64_MAX;
+    if (ret == 0 && c.codes) {
+        for (uint64_t i = 0; i < c.header->dict_count; i++) {
+            uint64_t start = i ? c.ends[i - 1] : 0;
+            if (c.ends[i] - start == needle.len &&
+                memcmp(c.data + start, needle.data, needle.len) == 0) {
+                code = i;
+                break;
+            }
+        }
+    }
+
+    for (uint64_t row = 0; ret == 0 && c.header && row < c.header->row_count; row++) {
+        if (c.codes) {
+            if (c.codes[row] != code || !column_has(&c, row)) continue;
+        } else {
+            const char* v;
+            size_t len;
+            if (!column_value(&c, row, &v, &len) || len != needle.len ||
+                memcmp(v, needle.data, len) != 0) {
+                continue;
+            }
+        }
+        if (columns) {
+            ret = projection_print_row(fields, columns, row);
+            continue;
+        }
+        char* owned = NULL;
+        const char* data;
+        size_t len;
+        ret = column_snapshot_record(&cs, row, &record, &owned, &data, &len);
+        if (ret == 0) ret = print_record_callback(data, len, cs.rows[row], NULL);
+        free(owned);
+    }
+
+    free(needle.data);
+    free(record.data);
+    if (columns) projection_columns_close(fields, columns);
+    column_close(&c);
+    column_snapshot_close(&cs);
+    return ret == 0 ? 0 : -1;
+}
+
+// 'list --fields' from the columns of the fields; 1 without a fresh snapshot.
+static int columnar_list(const char* db_path, const char* table_name, Projection* fields) {
+    ColumnSnapshot cs;
+    if (column_snapshot_open(db_path, table_name, &cs) != 0) return 1;
+    Column* columns = projection_columns_open(db_path, table_name, &cs, fields);
+    if (!columns) {
+        column_snapshot_close(&cs);
+        return 1;
+    }
+    int ret = 0;
+    for (uint64_t row = 0; row < cs.header->row_count && ret == 0; row++) {
+        ret = projection_print_row(fields, columns, row);
+    }
+    projection_columns_close(fields, columns);
+    column_snapshot_close(&cs);
+    return ret == 0 ? 0 : -1;
+}
+
+/* --------------------------------------------------------------------------
+ * list <table> [--fields a,b,...]
+ * Print all records in JSON lines format.
+ * -------------------------------------------------------------------------- */
+static void print_json_line(const cJSON* record, Projection* fields) {
+    char* line = json_print(record);
+    if (line) {
+        print_record_callback(line, strlen(line), 0, fields);
+        cJSON_free(line);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ * Stream the current records of a JSON table: the table file merged with
+ * the table's pending log entries, in the order load_table() would give
+ * (records saved in the log in place of the version in the file, new ones
+ * and ones saved again after a delete at the end). 'emit' sees each record
+ * matching 'filter' (NULL for all). Records from the file are handed on as
+ * raw bytes, without building a tree of the table or copying it to the heap.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    WalOverlay* ov;
+    bool pending;               // the log holds entries for this table
+    IdMap printed;              // log records already emitted in place
+    const FieldMatch* filter;
+    RecordCallback emit;
+    void* emit_ctx;
+} TableMerge;
+
+static int emit_log_record(TableMerge* m, const cJSON* record) {
+    if (m->filter && !string_field_equals(record, m->filter->field, m->filter->value)) {
+        return 0;
+    }
+    char* text = json_print(record);
+    int ret = text ? m->emit(text, strlen(text), 0, m->emit_ctx) : 0;
+    cJSON_free(text);
+    return ret;
+}
+
+static int merge_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    TableMerge* m = (TableMerge*)ctx;
+    cJSON* record = json_parse(data, len);
+    const char* id = record_string_field(record, "id");
+    uint64_t node;
+    int ret = 0;
+    if (id && idmap_get(&m->ov->ids, id, &node)) {
+        // A version saved after a delete of the record comes at the end
+        if (node && !idmap_get(&m->printed, id, NULL) &&
+            wal_overlay_replaces(m->ov, record, id)) {
+            idmap_put(&m->printed, id, 1);
+            ret = emit_log_record(m, (cJSON*)(uintptr_t)node);
+        }
+    } else if (record && wal_overlay_keeps(m->ov, record) &&
+               (!m->filter || string_field_equals(record, m->filter->field, m->filter->value))) {
+        ret = m->emit(data, len, rowref, m->emit_ctx);
+    }
+    cJSON_Delete(record);
+    return ret;
+}
+
+static int json_table_scan(const char* db_path, const char* table_name,
+                           const FieldMatch* filter, const ScanFilter* scan,
+                           RecordCallback emit, void* ctx) {
+    JsonSnapshot snap;
+    json_snapshot_open(db_path, table_name, &snap);
+    WalOverlay ov;
+    TableMerge m = { &ov, false, { NULL, NULL, 0, 0 }, filter, emit, ctx };
+    if (wal_overlay_load(snap.wal_fd, table_name, &ov) != 0 || idmap_init(&m.printed, 64) != 0) {
+        wal_overlay_free(&ov);
+        json_snapshot_close(&snap);
+        return -1;
+    }
+    m.pending = cJSON_GetArraySize(ov.records) > 0 || cJSON_GetArraySize(ov.deletes) > 0;
+
+    // Without log entries to merge, the file's records are filtered as they
+    // are, on the worker threads if asked to
+    int ret = 0;
+    if (snap.table_fd >= 0) {
+        ret = m.pending ? json_stream_records(snap.table_fd, NULL, merge_record_callback, &m)
+                        : json_stream_records(snap.table_fd, scan, emit, ctx);
+    }
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, ov.records) {
+        if (ret == 0 && !idmap_get(&m.printed, record_string_field(item, "id"), NULL) &&
+            emit_log_record(&m, item) != 0) {
+            break;
+        }
+    }
+
+    idmap_free(&m.printed);
+    wal_overlay_free(&ov);
+    json_snapshot_close(&snap);
+    return ret;
+}
+
+// The same, with the file's records filtered by 'filter' on 'threads' threads.
+static int json_table_records(const char* db_path, const char* table_name,
+                              const FieldMatch* filter, int threads,
+                              RecordCallback emit, void* ctx) {
+    ScanFilter scan = { .threads = threads,
+                        .match = filter ? record_matches : NULL,
+                        .match_ctx = (void*)filter };
+    return json_table_scan(db_path, table_name, filter, &scan, emit, ctx);
+}
+
+static int command_list(const char* db_path, const char* table_name, int threads,
+                        Projection* fields) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        LsmSnapshot snap;
+        if (lsm_open_or_fail(db_path, table_name, &snap) != 0) return 1;
+        int ret = lsm_scan(&snap, 0, UINT64_MAX, print_record_callback, fields);
+        lsm_snapshot_close(&snap);
+        return ret == 0 ? 0 : 1;
+    }
+    if (fields) {
+        int ret = columnar_list(db_path, table_name, fields);
+        if (ret != 1) {
+            if (ret != 0) fprintf(stderr, "Error: Could not read table %s\n", table_name);
+            return ret == 0 ? 0 : 1;
+        }
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (open_paged_or_fail(db_path, table_name, &pt) != 0) return 1;
+        ScanFilter all = { .threads = threads };
+        int ret = paged_scan_where(&pt, &all, print_record_callback, fields);
+        paged_close(&pt);
+        return ret == 0 ? 0 : 1;
+    }
+
+    // Stream the table file instead of loading it: memory stays bounded by
+    // the scan window and the pending log entries
+    if (json_table_records(db_path, table_name, NULL, threads, print_record_callback,
+                           fields) != 0) {
+        fprintf(stderr, "Error: Could not read table %s\n", table_name);
+        return 1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * list <table> --id-range LO..HI
+ * Print the records with LO <= id <= HI in id order, walking the id tree.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    uint64_t key;
+    cJSON* record;
+} KeyedRecord;
+
+static int compare_keyed_records(const void* a, const void* b) {
+    uint64_t x = ((const KeyedRecord*)a)->key, y = ((const KeyedRecord*)b)->key;
+    return x < y ? -1 : x > y;
+}
+
+// Collect the records of 'array' whose id is in [lo, hi], sorted by id.
+static KeyedRecord* keyed_records_in_range(cJSON* array, uint64_t lo, uint64_t hi,
+                                           size_t* count) {
+    KeyedRecord* items = malloc(((size_t)cJSON_GetArraySize(array) + 1) * sizeof(KeyedRecord));
+    *count = 0;
+    if (!items) return NULL;
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, array) {
+        uint64_t key;
+        if (parse_id_key(record_string_field(item, "id"), &key) && key >= lo && key <= hi) {
+            items[(*count)++] = (KeyedRecord){ key, item };
+        }
+    }
+    qsort(items, *count, sizeof(KeyedRecord), compare_keyed_records);
+    return items;
+}
+
+typedef struct {
+    PagedTable* pt;
+    Projection* fields;
+} PagedRangePrint;
+
+static int print_paged_entry_callback(uint64_t key, uint64_t rowref, uint32_t length, void* ctx) {
+    (void)key;
+    (void)length;
+    PagedRangePrint* p = (PagedRangePrint*)ctx;
+    char* text = paged_read_record(p->pt, rowref);
+    if (text) {
+        print_record_callback(text, strlen(text), rowref, p->fields);
+        free(text);
+    }
+    return 0;
+}
+
+// A paged table without an id tree yet: sort the ids of the whole table.
+static int paged_range_scan(PagedTable* pt, uint64_t lo, uint64_t hi, PagedRangePrint* print) {
+    TreeEntries entries = { NULL, 0, 0 };
+    int ret = paged_scan(pt, collect_tree_entry_callback, &entries);
+    size_t count = 0;
+    for (size_t i = 0; i < entries.count; i++) {
+        if (entries.items[i].key >= lo && entries.items[i].key <= hi) {
+            entries.items[count++] = entries.items[i];
+        }
+    }
+    if (count > 1) qsort(entries.items, count, sizeof(BTreeLeafEntry), compare_leaf_entries);
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        ret = print_paged_entry_callback(entries.items[i].key, entries.items[i].rowref, 0, print);
+    }
+    free(entries.items);
+    return ret;
+}
+
+// Tree entries of a JSON table, merged with the records saved in the log.
+typedef struct {
+    JsonTreeView* view;
+    KeyedRecord* pending;
+    size_t pending_count;
+    size_t next_pending;
+    char* buffer;
+    size_t capacity;
+    Projection* fields;
+} JsonRangeMerge;
+
+static int print_json_entry_callback(uint64_t key, uint64_t rowref, uint32_t length, void* ctx) {
+    JsonRangeMerge* m = (JsonRangeMerge*)ctx;
+    while (m->next_pending < m->pending_count && m->pending[m->next_pending].key < key) {
+        print_json_line(m->pending[m->next_pending++].record, m->fields);
+    }
+    cJSON* record = json_tree_view_record(m->view, rowref, length, &m->buffer, &m->capacity);
+    if (record) {
+        print_record_callback(m->buffer, length, rowref, m->fields);
+        cJSON_Delete(record);
+    }
+    return 0;
+}
+
+static int command_list_range(const char* db_path, const char* table_name,
+                              uint64_t lo, uint64_t hi, Projection* fields) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        LsmSnapshot snap;
+        if (lsm_open_or_fail(db_path, table_name, &snap) != 0) return 1;
+        int ret = lsm_scan(&snap, lo, hi, print_record_callback, fields);
+        lsm_snapshot_close(&snap);
+        return ret == 0 ? 0 : 1;
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (open_paged_or_fail(db_path, table_name, &pt) != 0) return 1;
+        TableIndexes indexes;
+        table_indexes_open(db_path, table_name, &indexes);
+        PagedRangePrint print = { &pt, fields };
+        int ret = indexes.tree.fd >= 0
+            ? id_tree_range(&indexes.tree, lo, hi, print_paged_entry_callback, &print)
+            : paged_range_scan(&pt, lo, hi, &print);
+        table_indexes_close(&indexes);
+        paged_close(&pt);
+        if (ret != 0) {
+            fprintf(stderr, "Error: Could not read the ids of %s\n", table_name);
+            return 1;
+        }
+        return 0;
+    }
+
+    JsonTreeView view;
+    if (json_tree_view_open(db_path, table_name, &view) == 0) {
+        JsonRangeMerge m = { &view, NULL, 0, 0, NULL, 0, fields };
+        m.pending = keyed_records_in_range(view.ov.records, lo, hi, &m.pending_count);
+        int ret = id_tree_range(&view.tree, lo, hi, print_json_entry_callback, &m);
+        while (m.next_pending < m.pending_count) {
+            print_json_line(m.pending[m.next_pending++].record, fields);
+        }
+        free(m.pending);
+        free(m.buffer);
+        json_tree_view_close(&view);
+        return ret == 0 ? 0 : 1;
+    }
+
+    // No tree yet: sort the whole table
+    cJSON* root = load_table(db_path, table_name);
+    if (!root) {
+        fprintf(stderr, "Error: Could not load or parse table %s\n", table_name);
+        return 1;
+    }
+    size_t count = 0;
+    KeyedRecord* items = keyed_records_in_range(root, lo, hi, &count);
+    for (size_t i = 0; i < count; i++) {
+        print_json_line(items[i].record, fields);
+    }
+    free(items);
+    cJSON_Delete(root);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * get <table> field=value
+ * Print all records where field matches value, found through an index on
+ * the field or the table's columnar snapshot if it has either. An LSM table
+ * is looked up by id, and scanned for any other field.
+ * -------------------------------------------------------------------------- */
+static int lsm_print_matches(const char* db_path, const char* table_name,
+                             const char* field, const char* value, Projection* fields) {
+    LsmSnapshot snap;
+    if (lsm_open_or_fail(db_path, table_name, &snap) != 0) return 1;
+    FieldMatch m;
+    field_match_init(&m, field, value);
+    uint64_t key;
+    int ret = 0;
+    if (strcmp(field, "id") == 0 && parse_id_key(value, &key)) {
+        LsmEntry entry;
+        const char* text;
+        if (lsm_lookup(&snap, key, &entry, &text) == 1 && !entry.tombstone &&
+            record_matches(text, entry.length, &m)) {
+            ret = print_record_callback(text, entry.length, key, fields);
+        }
+    } else {
+        ScanFilter scan = { .threads = 1, .match = record_matches, .match_ctx = &m };
+        ret = lsm_scan_where(&snap, &scan, print_record_callback, fields);
+    }
+    lsm_snapshot_close(&snap);
+    return ret == 0 ? 0 : 1;
+}
+
+static int command_get(const char* db_path, const char* table_name,
+                       const char* field, const char* value, int threads,
+                       Projection* fields) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        return lsm_print_matches(db_path, table_name, field, value, fields);
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (open_paged_or_fail(db_path, table_name, &pt) != 0) return 1;
+        TableIndexes indexes;
+        table_indexes_open(db_path, table_name, &indexes);
+        int ret = paged_index_matches(&pt, &indexes, field, value, print_record_callback, fields);
+        if (ret != 0) {
+            ret = columnar_print_matches(db_path, table_name, field, value, fields);
+        }
+        if (ret == 1) {
+            FieldMatch m;
+            field_match_init(&m, field, value);
+            ScanFilter scan = { .threads = threads, .match = record_matches, .match_ctx = &m };
+            ret = paged_scan_where(&pt, &scan, print_record_callback, fields);
+        }
+        table_indexes_close(&indexes);
+        paged_close(&pt);
+        return ret == 0 ? 0 : 1;
+    }
+
+    if (json_index_matches(db_path, table_name, field, value, print_record_callback, fields) == 0) {
+        return 0;
+    }
+    int ret = columnar_print_matches(db_path, table_name, field, value, fields);
+    if (ret != 1) {
+        if (ret != 0) fprintf(stderr, "Error: Could not read table %s\n", table_name);
+        return ret == 0 ? 0 : 1;
+    }
+
+    FieldMatch m;
+    field_match_init(&m, field, value);
+    if (json_table_records(db_path, table_name, &m, threads, print_record_callback, fields) != 0) {
+        fprintf(stderr, "Error: Could not read table %s\n", table_name);
+        return 1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * get <table> <condition>...
+ * Print the records whose value of one field is in a range, in key order
+ * through an ordered index on the field, otherwise in table order by a scan.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const FieldRange* fr;
+    Projection* fields;
+} RangePrint;
+
+// Scans of a table with pending log entries pass on every record.
+static int print_in_range_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    RangePrint* p = (RangePrint*)ctx;
+    if (!record_in_range(data, len, (void*)p->fr)) return 0;
+    return print_record_callback(data, len, rowref, p->fields);
+}
+
+static int command_get_range(const char* db_path, const char* table_name,
+                             FieldRange* fr, int threads, Projection* fields) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        LsmSnapshot snap;
+        if (lsm_open_or_fail(db_path, table_name, &snap) != 0) return 1;
+        ScanFilter scan = { .threads = 1, .match = record_in_range, .match_ctx = fr };
+        int ret = lsm_scan_where(&snap, &scan, print_record_callback, fields);
+        lsm_snapshot_close(&snap);
+        return ret == 0 ? 0 : 1;
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (open_paged_or_fail(db_path, table_name, &pt) != 0) return 1;
+        TableIndexes indexes;
+        table_indexes_open(db_path, table_name, &indexes);
+        int ret = paged_range_matches(&pt, &indexes, fr, print_record_callback, fields);
+        if (ret == 1) {
+            ScanFilter scan = { .threads = threads, .match = record_in_range, .match_ctx = fr };
+            ret = paged_scan_where(&pt, &scan, print_record_callback, fields);
+        }
+        table_indexes_close(&indexes);
+        paged_close(&pt);
+        return ret == 0 ? 0 : 1;
+    }
+
+    int ret = json_range_matches(db_path, table_name, fr, print_record_callback, fields);
+    if (ret == 1) {
+        RangePrint print = { fr, fields };
+        ScanFilter scan = { .threads = threads, .match = record_in_range, .match_ctx = fr };
+        ret = json_table_scan(db_path, table_name, NULL, &scan, print_in_range_callback, &print);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not read table %s\n", table_name);
+        return 1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Id sequences
+ *
+ * Automatic ids come from <table>.seq, which holds the highest id handed
+ * out so far, by 'save' or by 'save --reserve N'. The next id is one past
+ * that and past the table's floor, the highest id it stores: the id tree's
+ * or the paged header's high-water mark and the log's saves, so ids given
+ * explicitly and tables older than their sequence are covered without
+ * looking at every record. Whoever hands out ids holds the file's lock from
+ * reading it until it records the last id it used, so no two writers (or
+ * reservations) get the same ones; the records may be written after that,
+ * and one that isn't leaves a gap. Only reservations are fsynced: anything
+ * else that was stored is back in the floor after a crash.
+ * -------------------------------------------------------------------------- */
+#define ID_SEQUENCE_MAGIC "SDBSEQ01"
+#define MAX_ID_RESERVATION 1000000000LL
+
+typedef struct {
+    char magic[8];
+    uint64_t last;              // the highest id handed out
+} IdSequenceHeader;
+
+typedef struct {
+    int fd;                     // locked while open
+    uint64_t last;
+} IdSequence;
+
+static void id_sequence_path(const char* db_path, const char* table_name,
+                             char* buffer, size_t size) {
+    snprintf(buffer, size, "%s/%s.seq", db_path, table_name);
+}
+
+// Lock the table's sequence and read it; seq->last is at least 'floor_id'.
+static int id_sequence_open(const char* db_path, const char* table_name, uint64_t floor_id,
+                            IdSequence* seq) {
+    char path[1024];
+    id_sequence_path(db_path, table_name, path, sizeof(path));
+    seq->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (seq->fd < 0) return -1;
+    if (lock_byte(seq->fd, 0, F_WRLCK, true) != 0) {
+        close(seq->fd);
+        seq->fd = -1;
+        return -1;
+    }
+    IdSequenceHeader header;
+    seq->last = 0;
+    if (pread(seq->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        memcmp(header.magic, ID_SEQUENCE_MAGIC, sizeof(header.magic)) == 0) {
+        seq->last = header.last;
+    }
+    if (seq->last < floor_id) seq->last = floor_id;
+    return 0;
+}
+
+// Record that the ids up to 'last' are handed out, and unlock.
+static int id_sequence_close(IdSequence* seq, uint64_t last, bool durable) {
+    if (seq->fd < 0) return -1;
+    IdSequenceHeader header;
+    memcpy(header.magic, ID_SEQUENCE_MAGIC, sizeof(header.magic));
+    header.last = last > seq->last ? last : seq->last;
+    int ret = pwrite(seq->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+              (!durable || fdatasync(seq->fd) == 0) ? 0 : -1;
+    close(seq->fd);
+    seq->fd = -1;
+    return ret;
+}
+
+// Hand out 'count' consecutive ids, the first of them in '*first'.
+static int id_sequence_claim(const char* db_path, const char* table_name, uint64_t floor_id,
+                             uint64_t count, bool durable, uint64_t* first) {
+    IdSequence seq;
+    if (id_sequence_open(db_path, table_name, floor_id, &seq) != 0) return -1;
+    *first = seq.last + 1;
+    return id_sequence_close(&seq, seq.last + count, durable);
+}
+
+// The highest numeric id among the records of a loaded table.
+static uint64_t records_max_id(const cJSON* root) {
+    uint64_t max_id = 0;
+    const cJSON* item = NULL;
+    cJSON_ArrayForEach(item, root) {
+        uint64_t key;
+        if (parse_id_key(record_string_field(item, "id"), &key) && key > max_id) {
+            max_id = key;
+        }
+    }
+    return max_id;
+}
+
+// The high-water mark of the tree and of the ids in the log.
+static uint64_t json_tree_view_max_id(const JsonTreeView* view) {
+    uint64_t max_id = view->tree.header.max_id;
+    uint64_t logged = records_max_id(view->ov.records);
+    return logged > max_id ? logged : max_id;
+}
+
+// The floor of a table's sequence. Only a JSON table without a usable id
+// tree is loaded for it.
+static int table_id_floor(const char* db_path, const char* table_name, uint64_t* floor_id) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        return lsm_table_max_id(db_path, table_name, floor_id);
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (paged_open(db_path, table_name, false, &pt) != 0) return -1;
+        *floor_id = pt.header.max_id;
+        paged_close(&pt);
+        return 0;
+    }
+    JsonTreeView view;
+    if (json_tree_view_open(db_path, table_name, &view) == 0) {
+        *floor_id = json_tree_view_max_id(&view);
+        json_tree_view_close(&view);
+        return 0;
+    }
+    cJSON* root = load_table(db_path, table_name);
+    if (!root) return -1;
+    *floor_id = records_max_id(root);
+    cJSON_Delete(root);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * save <table> --reserve N
+ * Hand out N ids in one step, for a bulk loader to give its records, and
+ * print them as LO..HI. Nothing is written to the table.
+ * -------------------------------------------------------------------------- */
+static int command_reserve_ids(const char* db_path, const char* table_name,
+                               const char* count_arg) {
+    char* end = NULL;
+    long long count = strtoll(count_arg, &end, 10);
+    if (*end != '\0' || count < 1 || count > MAX_ID_RESERVATION) {
+        fprintf(stderr, "Error: --reserve requires a number from 1 to %lld\n",
+                MAX_ID_RESERVATION);
+        return 1;
+    }
+    uint64_t floor_id, first;
+    if (table_id_floor(db_path, table_name, &floor_id) != 0 ||
+        id_sequence_claim(db_path, table_name, floor_id, (uint64_t)count, true, &first) != 0) {
+        fprintf(stderr, "Error: Could not reserve ids in table %s\n", table_name);
+        return 1;
+    }
+    printf("%llu..%llu\n", (unsigned long long)first,
+           (unsigned long long)(first + (uint64_t)count - 1));
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * save <table> field1=value1 [field2=value2 ...]
+ *   - If a record with the specified unique id (if given) exists, update it.
+ *   - If a record with the specified unique id (if given) doesn't exist, create a new one.
+ *   - If no id is given, it takes the next one from the table's sequence
+ *
+ *   Usually we assume "id" is the unique field, but let's not hardcode it:
+ *   We'll check if any of the fields is "id=xxx". If found, we try to locate 
+ *   that record first, then update. If not found, we append a new record.
+ * -------------------------------------------------------------------------- */
+/* --------------------------------------------------------------------------
+ * Parse field=value arguments into 'fields'. If one of them is 'id', it must
+ * be a positive integer and is returned through 'userIdValue'.
+ * Returns 0 on success, non-zero (after printing an error) otherwise.
+ * -------------------------------------------------------------------------- */
+static int parse_field_args(int argc, char** argv, FieldPair* fields, int* fieldCount,
+                            bool* userProvidedId, long* userIdValue) {
+    *fieldCount = 0;
+    *userProvidedId = false;
+    *userIdValue = 0;
+
+    for (int i = 0; i < argc && i < MAX_COMMAND_ARGS; i++) {
+        // We don't want to modify argv[i] directly in case we need it later;
+        // so let's copy it into a buffer.
+        char buffer[2048];
+        strncpy(buffer, argv[i], sizeof(buffer) - 1);
+        buffer[sizeof(buffer) - 1] = '\0';
+
+        // Split at '='
+        char* eq = strchr(buffer, '=');
+        if (!eq) {
+            fprintf(stderr, "Error: Invalid field format '%s'. Use field=value.\n", argv[i]);
+            return 1;
+        }
+        *eq = '\0'; 
+        const char* key = buffer;
+        const char* val = eq + 1;
+
+        // Store into fields array
+        FieldPair* fp = &fields[(*fieldCount)++];
+        strncpy(fp->key, key, sizeof(fp->key) - 1);
+        fp->key[sizeof(fp->key) - 1] = '\0';
+        strncpy(fp->val, val, sizeof(fp->val) - 1);
+        fp->val[sizeof(fp->val) - 1] = '\0';
+
+        // Check if this is 'id'
+        if (strcmp(key, "id") == 0) {
+            *userProvidedId = true;
+
+            // Validate positive integer
+            char* endptr = NULL;
+            long val_long = strtol(val, &endptr, 10);
+            if (*endptr != '\0' || val_long <= 0) {
+                fprintf(stderr, "Error: 'id' must be a positive integer, got '%s'\n", val);
+                return 1;
+            }
+            *userIdValue = val_long;
+        }
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Create a new cJSON object, add 'id' first, then add all other fields in
+ * the same order they were listed.
+ * -------------------------------------------------------------------------- */
+static cJSON* build_record(const char* id, const FieldPair* fields, int fieldCount) {
+    cJSON* record = cJSON_CreateObject();
+    if (!record) {
+        return NULL;
+    }
+
+    // Add 'id' as the first field
+    cJSON_AddStringToObject(record, "id", id);
+
+    // Add all the other fields
+    for (int i = 0; i < fieldCount; i++) {
+        if (strcmp(fields[i].key, "id") == 0) {
+            // already added as first field
+            continue;
+        }
+        cJSON_AddStringToObject(record, fields[i].key, fields[i].val);
+    }
+    return record;
+}
+
+// Copy the fields of 'update' over the matching fields of 'existing'.
+static void merge_record(cJSON* existing, const cJSON* update) {
+    cJSON* field = NULL;
+    cJSON_ArrayForEach(field, update) {
+        cJSON* dup = cJSON_Duplicate(field, 1);
+        cJSON_ReplaceItemInObjectCaseSensitive(existing, field->string, dup);
+    }
+}
+
+/* --------------------------------------------------------------------------
+ * Paged variant of 'save': find the record by id through the id tree (a
+ * hash index on "id" or a page scan if the tree can't be used), then write
+ * back only the page it lives on.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    FieldMatch match;
+    uint64_t rowref;
+    bool found;
+} IdSearch;
+
+static int found_id_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)data;
+    (void)len;
+    IdSearch* search = (IdSearch*)ctx;
+    search->rowref = rowref;
+    search->found = true;
+    return 1;
+}
+
+static int scan_id_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    IdSearch* search = (IdSearch*)ctx;
+    if (record_matches(data, len, &search->match)) {
+        return found_id_callback(data, len, rowref, ctx);
+    }
+    return 0;
+}
+
+static bool paged_find_id(PagedTable* pt, TableIndexes* indexes, const char* id,
+                          uint64_t* rowref) {
+    IdSearch search;
+    field_match_init(&search.match, "id", id);
+    search.rowref = 0;
+    search.found = false;
+    uint64_t key, tree_rowref;
+    bool keyed = parse_id_key(id, &key);
+    // The table's own high-water mark covers every id it ever stored
+    if (keyed && key > pt->header.max_id) return false;
+    if (indexes->tree.fd >= 0 && keyed &&
+        id_tree_lookup(&indexes->tree, key, &tree_rowref, NULL)) {
+        char* text = paged_read_record(pt, tree_rowref);
+        if (text && record_matches(text, strlen(text), &search.match)) {
+            free(text);
+            *rowref = tree_rowref;
+            return true;
+        }
+        free(text);
+    }
+    // A miss, or a hit out of step with the table: the tree may be stale,
+    // so look the slow way
+    if (paged_index_matches(pt, indexes, "id", id, found_id_callback, &search) != 0) {
+        paged_scan(pt, scan_id_callback, &search);
+    }
+    if (search.found) *rowref = search.rowref;
+    return search.found;
+}
+
+// Read and parse the record at 'rowref'.
+static cJSON* paged_load_record(PagedTable* pt, uint64_t rowref) {
+    char* text = paged_read_record(pt, rowref);
+    cJSON* record = text ? json_parse(text, strlen(text)) : NULL;
+    free(text);
+    return record;
+}
+
+/* --------------------------------------------------------------------------
+ * Write 'record' to the paged table, replacing 'old_record' at '*rowref' if
+ * given, and bring the table's indexes up to date.
+ * -------------------------------------------------------------------------- */
+static int paged_store_record(PagedTable* pt, TableIndexes* indexes,
+                              const cJSON* old_record, const uint64_t* rowref,
+                              cJSON* record, uint64_t* new_rowref) {
+    char* text = json_print(record);
+    if (!text) return -1;
+    uint64_t stored_at = 0;
+    int ret = rowref ? paged_update(pt, *rowref, text, strlen(text), &stored_at)
+                     : paged_insert(pt, 0, text, strlen(text), &stored_at);
+    cJSON_free(text);
+    if (ret != 0) return ret;
+
+    if (table_indexes_update(indexes, old_record, rowref ? *rowref : 0, record, stored_at) != 0) {
+        return -1;
+    }
+    if (new_rowref) *new_rowref = stored_at;
+
+    cJSON* id = cJSON_GetObjectItemCaseSensitive(record, "id");
+    if (cJSON_IsString(id)) {
+        paged_note_id(pt, id->valuestring);
+        ret = paged_write_header(pt);
+    }
+    return ret;
+}
+
+static int command_save_paged(const char* db_path, const char* table_name,
+                              const FieldPair* fields, int fieldCount,
+                              bool userProvidedId, long userIdValue) {
+    PagedTable pt;
+    if (paged_open_writer(db_path, table_name, &pt) != 0) return 1;
+    TableIndexes indexes;
+    table_indexes_open(db_path, table_name, &indexes);
+
+    char idBuffer[32];
+    uint64_t id = (uint64_t)userIdValue;
+    if (!userProvidedId &&
+        id_sequence_claim(db_path, table_name, pt.header.max_id, 1, false, &id) != 0) {
+        fprintf(stderr, "Error: unable to generate new ID.\n");
+        table_indexes_close(&indexes);
+        paged_close(&pt);
+        return 1;
+    }
+    snprintf(idBuffer, sizeof(idBuffer), "%llu", (unsigned long long)id);
+
+    cJSON* record = build_record(idBuffer, fields, fieldCount);
+    if (!record) {
+        table_indexes_close(&indexes);
+        paged_close(&pt);
+        return 1;
+    }
+
+    uint64_t rowref = 0;
+    bool found = userProvidedId && paged_find_id(&pt, &indexes, idBuffer, &rowref);
+
+    cJSON* old_record = NULL;
+    cJSON* existing = NULL;
+    if (found) {
+        old_record = paged_load_record(&pt, rowref);
+        existing = cJSON_Duplicate(old_record, 1);
+        if (!existing) {
+            fprintf(stderr, "Error: Could not read record %s\n", idBuffer);
+            cJSON_Delete(old_record);
+            cJSON_Delete(record);
+            table_indexes_close(&indexes);
+            paged_close(&pt);
+            return 1;
+        }
+        merge_record(existing, record);
+    }
+
+    cJSON* toStore = existing ? existing : record;
+    int ret = paged_store_record(&pt, &indexes, old_record, found ? &rowref : NULL,
+                                 toStore, NULL);
+    if (ret == 0) ret = paged_commit(&pt);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not save table %s\n", table_name);
+    } else {
+        char* line = json_print(toStore);
+        if (line) {
+            printf("%s\n", line);
+            cJSON_free(line);
+        }
+    }
+
+    cJSON_Delete(old_record);
+    cJSON_Delete(existing);
+    cJSON_Delete(record);
+    table_indexes_close(&indexes);
+    paged_close(&pt);
+    return ret == 0 ? 0 : 1;
+}
+
+/* --------------------------------------------------------------------------
+ * save on an LSM table: the record is appended to the log. Nothing is read
+ * unless an explicit id may name a record to merge into.
+ * -------------------------------------------------------------------------- */
+static int command_save_lsm(const char* db_path, const char* table_name,
+                            const FieldPair* fields, int fieldCount,
+                            bool userProvidedId, long userIdValue) {
+    LsmWriter w;
+    if (lsm_writer_open(db_path, table_name, &w) != 0) return 1;
+
+    char idBuffer[32];
+    uint64_t id = (uint64_t)userIdValue;
+    if (!userProvidedId &&
+        id_sequence_claim(db_path, table_name, lsm_writer_max_id(&w), 1, false, &id) != 0) {
+        fprintf(stderr, "Error: unable to generate new ID.\n");
+        lsm_writer_close(&w);
+        return 1;
+    }
+    snprintf(idBuffer, sizeof(idBuffer), "%llu", (unsigned long long)id);
+
+    cJSON* record = build_record(idBuffer, fields, fieldCount);
+    if (!record) {
+        lsm_writer_close(&w);
+        return 1;
+    }
+    cJSON* existing = NULL;
+    if (userProvidedId && lsm_writer_load(&w, id, &existing) < 0) {
+        fprintf(stderr, "Error: Could not read record %s\n", idBuffer);
+        cJSON_Delete(record);
+        lsm_writer_close(&w);
+        return 1;
+    }
+    if (existing) merge_record(existing, record);
+
+    char* line = json_print(existing ? existing : record);
+    int ret = line ? lsm_writer_put(&w, id, line, strlen(line)) : -1;
+    if (ret == 0) ret = lsm_writer_commit(&w);
+    lsm_writer_close(&w);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not save table %s\n", table_name);
+    } else {
+        printf("%s\n", line);
+    }
+
+    cJSON_free(line);
+    cJSON_Delete(existing);
+    cJSON_Delete(record);
+    return ret == 0 ? 0 : 1;
+}
+
+/* --------------------------------------------------------------------------
+ * What 'save' needs to know about a JSON table, from its id tree: the next
+ * id from the sequence (written to 'id_buffer' unless 'has_id') and the
+ * current version of the record with that id (a new object in '*existing',
+ * or NULL), as of '*version'. Returns 1 if the table has no usable tree,
+ * -1 if no id could be taken.
+ * -------------------------------------------------------------------------- */
+static int json_tree_prepare_save(const char* db_path, const char* table_name, bool has_id,
+                                  char* id_buffer, size_t size, cJSON** existing,
+                                  TableVersion* version) {
+    JsonTreeView view;
+    if (json_tree_view_open(db_path, table_name, &view) != 0) return 1;
+    *existing = NULL;
+    *version = view.snap.version;
+
+    if (!has_id) {
+        uint64_t id;
+        if (id_sequence_claim(db_path, table_name, json_tree_view_max_id(&view), 1, false,
+                              &id) != 0) {
+            json_tree_view_close(&view);
+            return -1;
+        }
+        snprintf(id_buffer, size, "%llu", (unsigned long long)id);
+    }
+
+    uint64_t node, key, rowref;
+    uint32_t length;
+    if (idmap_get(&view.ov.ids, id_buffer, &node)) {
+        // Saved or deleted since the last checkpoint
+        if (node) *existing = cJSON_Duplicate((cJSON*)(uintptr_t)node, 1);
+    } else if (parse_id_key(id_buffer, &key) &&
+               id_tree_lookup(&view.tree, key, &rowref, &length)) {
+        char* buffer = NULL;
+        size_t capacity = 0;
+        *existing = json_tree_view_record(&view, rowref, length, &buffer, &capacity);
+        free(buffer);
+    }
+
+    json_tree_view_close(&view);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * One optimistic 'save' to a JSON table: read the record, merge the fields
+ * into it and log it, unless somebody else changed it in between.
+ * Returns 0 on success, WAL_CONFLICT to try again, -1 on error.
+ * -------------------------------------------------------------------------- */
+static int json_save_attempt(const char* db_path, const char* table_name,
+                             const FieldPair* fields, int fieldCount,
+                             bool userProvidedId, long userIdValue) {
+    // --------------------------------------------------------------------
+    // 1) Determine final ID string (either user provided or auto-generated)
+    //    and find the record it refers to: through the table's id tree if
+    //    it has one, otherwise by loading the whole table
+    // --------------------------------------------------------------------
+    char idBuffer[32];
+    if (userProvidedId) {
+        // Reconstruct the numeric ID as a string (just to be sure)
+        snprintf(idBuffer, sizeof(idBuffer), "%ld", userIdValue);
+    }
+
+    cJSON* root = NULL;
+    cJSON* existing_record = NULL;  // owned by root when the table is loaded
+    TableVersion version;
+    int prepared = json_tree_prepare_save(db_path, table_name, userProvidedId,
+                                          idBuffer, sizeof(idBuffer), &existing_record,
+                                          &version);
+    bool via_tree = prepared == 0;
+    if (prepared < 0) {
+        fprintf(stderr, "Error: unable to generate new ID.\n");
+        return -1;
+    }
+    if (!via_tree) {
+        root = load_table_version(db_path, table_name, &version);
+        if (!root) {
+            fprintf(stderr, "Error: Could not load or parse table %s\n", table_name);
+            return -1;
+        }
+
+        if (!userProvidedId) {
+            // Take the next id, past every id in the table
+            uint64_t id;
+            if (id_sequence_claim(db_path, table_name, records_max_id(root), 1, false,
+                                  &id) != 0) {
+                fprintf(stderr, "Error: unable to generate new ID.\n");
+                cJSON_Delete(root);
+                return -1;
+            }
+            snprintf(idBuffer, sizeof(idBuffer), "%llu", (unsigned long long)id);
+        }
+
+        cJSON* item = NULL;
+        cJSON_ArrayForEach(item, root) {
+            if (string_field_equals(item, "id", idBuffer)) {
+                existing_record = item;
+                break;
+            }
+        }
+    }
+
+    // --------------------------------------------------------------------
+    // 2) Create the new record ('id' first, then the other fields)
+    // --------------------------------------------------------------------
+    cJSON* new_record = build_record(idBuffer, fields, fieldCount);
+    if (!new_record) {
+        if (via_tree) cJSON_Delete(existing_record);
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    // --------------------------------------------------------------------
+    // 3) If there is an existing record, update it with the new fields
+    // --------------------------------------------------------------------
+    if (existing_record) {
+        merge_record(existing_record, new_record);
+    }
+
+    // --------------------------------------------------------------------
+    // 4) Log the complete record to the WAL, if the version it is based on
+    //    is still current; the table file itself is updated by the next
+    //    checkpoint
+    // --------------------------------------------------------------------
+    cJSON* recordToPrint = existing_record ? existing_record : new_record;
+    int ret = wal_log_save(db_path, table_name, recordToPrint, &version);
+    if (ret < 0) {
+        fprintf(stderr, "Error: Could not save table %s\n", table_name);
+    } else if (ret == 0) {
+        // ----------------------------------------------------------------
+        // 5) Print the record for user feedback
+        // ----------------------------------------------------------------
+        char* line = json_print(recordToPrint);
+        if (line) {
+            printf("%s\n", line);
+            cJSON_free(line);
+        }
+    }
+
+    cJSON_Delete(new_record);
+    if (via_tree) cJSON_Delete(existing_record);
+    cJSON_Delete(root);
+    return ret;
+}
+
+#define SAVE_MAX_ATTEMPTS 100
+
+static int command_save(const char* db_path, const char* table_name,
+                        int argc, char** argv) 
+{
+    // --------------------------------------------------------------------
+    // Parse all fields from argv into an array of FieldPair
+    // We also check if an 'id' was provided and validate it.
+    // --------------------------------------------------------------------
+    FieldPair fields[MAX_COMMAND_ARGS];
+    int fieldCount = 0;
+
+    bool userProvidedId = false;
+    long userIdValue = 0; // numeric representation if user provided 'id'
+
+    if (parse_field_args(argc, argv, fields, &fieldCount, &userProvidedId, &userIdValue) != 0) {
+        return 1;
+    }
+
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        return command_save_paged(db_path, table_name, fields, fieldCount,
+                                  userProvidedId, userIdValue);
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        return command_save_lsm(db_path, table_name, fields, fieldCount,
+                                userProvidedId, userIdValue);
+    }
+
+    // Lost a race with another writer: back off for a growing, per-process
+    // time and read the table again
+    unsigned int jitter = (unsigned int)getpid() * 2654435761u;
+    for (int attempt = 0; attempt < SAVE_MAX_ATTEMPTS; attempt++) {
+        int ret = json_save_attempt(db_path, table_name, fields, fieldCount,
+                                    userProvidedId, userIdValue);
+        if (ret != WAL_CONFLICT) return ret == 0 ? 0 : 1;
+        int shift = attempt < 6 ? attempt : 6;
+        usleep((100u << shift) + (jitter >> (26 - shift)));
+        jitter = jitter * 1103515245u + 12345u;
+    }
+    fprintf(stderr, "Error: Table %s kept changing; record not saved\n", table_name);
+    return 1;
+}
+
+/* --------------------------------------------------------------------------
+ * delete <table> field=value
+ * Remove all records that match `field=value`.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    PagedTable* pt;
+    TableIndexes* indexes;
+    int count;
+    bool failed;
+} PagedDeletion;
+
+// Drop a record that is about to be deleted from the table's indexes.
+static int unindex_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    cJSON* record = json_parse(data, len);
+    int ret = table_indexes_update((TableIndexes*)ctx, record, rowref, NULL, 0);
+    cJSON_Delete(record);
+    return ret;
+}
+
+static int delete_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    PagedDeletion* del = (PagedDeletion*)ctx;
+    if (unindex_record_callback(data, len, rowref, del->indexes) != 0 ||
+        paged_delete_record(del->pt, rowref) != 0) {
+        del->failed = true;
+        return 1;
+    }
+    del->count++;
+    return 0;
+}
+
+static int count_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)data;
+    (void)len;
+    (void)rowref;
+    (*(int*)ctx)++;
+    return 0;
+}
+
+static int collect_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)data;
+    return collect_hit_callback(rowref, (uint32_t)len, ctx);
+}
+
+// An LSM table gets a tombstone for every match. The matches are collected
+// first, since a flush would change the runs under the scan.
+static int lsm_delete(const char* db_path, const char* table_name,
+                      const char* field, const char* value) {
+    LsmWriter w;
+    if (lsm_writer_open(db_path, table_name, &w) != 0) return 1;
+    FieldMatch m;
+    field_match_init(&m, field, value);
+    IndexHitList hits;
+    memset(&hits, 0, sizeof(hits));
+    uint64_t key;
+    int ret = lsm_writer_memtable(&w);
+    if (ret == 0 && strcmp(field, "id") == 0 && parse_id_key(value, &key)) {
+        LsmEntry entry;
+        const char* text;
+        if (lsm_lookup(&w.snap, key, &entry, &text) == 1 && !entry.tombstone &&
+            record_matches(text, entry.length, &m)) {
+            ret = collect_hit_callback(key, entry.length, &hits);
+        }
+    } else if (ret == 0) {
+        ScanFilter scan = { .threads = 1, .match = record_matches, .match_ctx = &m };
+        ret = lsm_scan_where(&w.snap, &scan, collect_record_callback, &hits);
+    }
+    for (size_t i = 0; i < hits.count && ret == 0; i++) {
+        ret = lsm_writer_put(&w, hits.items[i].rowref, NULL, 0);
+    }
+    if (ret == 0) ret = lsm_writer_commit(&w);
+    lsm_writer_close(&w);
+    free(hits.items);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not save table %s after deletion\n", table_name);
+        return 1;
+    }
+    printf("Deleted %zu record(s)\n", hits.count);
+    return 0;
+}
+
+static int command_delete(const char* db_path, const char* table_name,
+                          const char* field, const char* value, int threads) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        return lsm_delete(db_path, table_name, field, value);
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (paged_open_writer(db_path, table_name, &pt) != 0) return 1;
+        TableIndexes indexes;
+        table_indexes_open(db_path, table_name, &indexes);
+        PagedDeletion del = { &pt, &indexes, 0, false };
+        int deleted;
+        if (paged_index_matches(&pt, &indexes, field, value, delete_record_callback, &del) == 0) {
+            deleted = del.failed ? -1 : del.count;
+        } else {
+            FieldMatch m;
+            field_match_init(&m, field, value);
+            ScanFilter scan = { .threads = threads, .match = record_matches, .match_ctx = &m };
+            deleted = paged_delete_where(&pt, &scan, unindex_record_callback, &indexes);
+        }
+        if (deleted >= 0 && paged_commit(&pt) != 0) deleted = -1;
+        table_indexes_close(&indexes);
+        paged_close(&pt);
+        if (deleted < 0) {
+            fprintf(stderr, "Error: Could not save table %s after deletion\n", table_name);
+            return 1;
+        }
+        printf("Deleted %d record(s)\n", deleted);
+        return 0;
+    }
+
+    // The log entry does the deleting; here we only count the matches,
+    // through an index on the field if there is one
+    int deleted_count = 0;
+    FieldMatch m;
+    field_match_init(&m, field, value);
+    if (json_index_matches(db_path, table_name, field, value, count_record_callback,
+                           &deleted_count) != 0 &&
+        json_table_records(db_path, table_name, &m, threads, count_record_callback,
+                           &deleted_count) != 0) {
+        fprintf(stderr, "Error: Could not read table %s\n", table_name);
+        return 1;
+    }
+
+    if (deleted_count > 0 && wal_log_delete(db_path, table_name, field, value) != 0) {
+        fprintf(stderr, "Error: Could not save table %s after deletion\n", table_name);
+        return 1;
+    }
+
+    printf("Deleted %d record(s)\n", deleted_count);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * create <table> [--format json|compressed|paged|lsm]
+ * Create an empty table in the given storage format (json by default);
+ * a compressed table is a JSON table whose file is kept in blocks.
+ * -------------------------------------------------------------------------- */
+static int command_create(const char* db_path, const char* table_name, const char* format) {
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+    if (file_exists(filepath) || table_format(db_path, table_name) != TABLE_FORMAT_JSON) {
+        fprintf(stderr, "Error: Table %s already exists\n", table_name);
+        return 1;
+    }
+
+    if (strcmp(format, "json") == 0 || strcmp(format, "compressed") == 0) {
+        cJSON* root = cJSON_CreateArray();
+        int ret = save_table_file(db_path, table_name, root, strcmp(format, "compressed") == 0);
+        cJSON_Delete(root);
+        if (ret != 0) {
+            fprintf(stderr, "Error: Could not create table %s\n", table_name);
+            return 1;
+        }
+    } else if (strcmp(format, "paged") == 0) {
+        PagedTable pt;
+        if (paged_open(db_path, table_name, true, &pt) != 0) {
+            fprintf(stderr, "Error: Could not create table %s\n", table_name);
+            return 1;
+        }
+        paged_close(&pt);
+        if (id_tree_build(db_path, table_name, NULL, 0, 0, NULL) != 0) {
+            fprintf(stderr, "Error: Could not create table %s\n", table_name);
+            return 1;
+        }
+    } else if (strcmp(format, "lsm") == 0) {
+        // The log first: the manifest is what makes it an LSM table
+        LsmManifest m;
+        memset(&m, 0, sizeof(m));
+        memcpy(m.magic, LSM_MAGIC, sizeof(m.magic));
+        m.generation = 1;
+        m.next_seq = 1;
+        if (lsm_new_log(db_path, table_name, m.generation) != 0 ||
+            lsm_write_manifest(db_path, table_name, &m) != 0) {
+            fprintf(stderr, "Error: Could not create table %s\n", table_name);
+            return 1;
+        }
+    } else {
+        fprintf(stderr, "Error: Unknown table format '%s'\n", format);
+        return 1;
+    }
+
+    printf("Created table %s (%s)\n", table_name, format);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * import <table> <file.json>
+ * Upsert every object of a JSON array (the same shape as <table>.json) into
+ * the table. Records are matched on 'id'; records without one get a new id.
+ * -------------------------------------------------------------------------- */
+
+// Make sure 'record' has a valid string id as its first field.
+static int normalize_record_id(cJSON* record, uint64_t* max_id) {
+    cJSON* id = cJSON_GetObjectItemCaseSensitive(record, "id");
+    char buffer[32];
+
+    if (!id) {
+        snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)++(*max_id));
+        // Rebuild the object so the id comes first, like 'save' does
+        cJSON* rebuilt = cJSON_CreateObject();
+        if (!rebuilt || !cJSON_AddStringToObject(rebuilt, "id", buffer)) {
+            cJSON_Delete(rebuilt);
+            return -1;
+        }
+        while (record->child) {
+            cJSON_AddItemToArray(rebuilt, cJSON_DetachItemViaPointer(record, record->child));
+        }
+        record->child = rebuilt->child;
+        rebuilt->child = NULL;
+        cJSON_Delete(rebuilt);
+        return 0;
+    }
+
+    if (cJSON_IsNumber(id)) {
+        // Only whole numbers in [1, 2^63) are ids; 1.5 must not become "2"
+        double value = id->valuedouble;
+        if (!(value >= 1.0 && value < 9223372036854775808.0) ||
+            value != (double)(long long)value) {
+            return -1;
+        }
+        snprintf(buffer, sizeof(buffer), "%lld", (long long)value);
+        cJSON_ReplaceItemInObjectCaseSensitive(record, "id", cJSON_CreateString(buffer));
+        id = cJSON_GetObjectItemCaseSensitive(record, "id");
+    }
+    if (!cJSON_IsString(id)) return -1;
+
+    char* endptr = NULL;
+    errno = 0;
+    long long val = strtoll(id->valuestring, &endptr, 10);
+    if (errno == ERANGE || endptr == id->valuestring || *endptr != '\0' || val <= 0) return -1;
+    if ((uint64_t)val > *max_id) *max_id = (uint64_t)val;
+    return 0;
+}
+
+typedef struct {
+    IdMap* ids;
+    uint64_t max_id;
+} PagedIdCollector;
+
+static int collect_ids_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    PagedIdCollector* c = (PagedIdCollector*)ctx;
+    cJSON* item = json_parse(data, len);
+    cJSON* id = cJSON_GetObjectItemCaseSensitive(item, "id");
+    if (cJSON_IsString(id)) {
+        idmap_put(c->ids, id->valuestring, rowref);
+    }
+    cJSON_Delete(item);
+    return 0;
+}
+
+// Upsert into a paged table opened for writing, committing on success.
+static int import_into_paged(const char* db_path, const char* table_name, PagedTable* pt,
+                             cJSON* records, int* imported) {
+    IdMap ids;
+    if (idmap_init(&ids, 1024) != 0) {
+        return 1;
+    }
+    PagedIdCollector collector = { &ids, pt->header.max_id };
+    paged_scan(pt, collect_ids_callback, &collector);
+
+    TableIndexes indexes;
+    table_indexes_open(db_path, table_name, &indexes);
+
+    int ret = 0, count = 0;
+    cJSON* record = NULL;
+    cJSON_ArrayForEach(record, records) {
+        cJSON* id = cJSON_GetObjectItemCaseSensitive(record, "id");
+        uint64_t rowref;
+        bool found = idmap_get(&ids, id->valuestring, &rowref);
+        cJSON* old_record = found ? paged_load_record(pt, rowref) : NULL;
+        cJSON* existing = cJSON_Duplicate(old_record, 1);
+        if (existing) merge_record(existing, record);
+        if (paged_store_record(pt, &indexes, old_record, found ? &rowref : NULL,
+                               existing ? existing : record, &rowref) != 0 ||
+            idmap_put(&ids, id->valuestring, rowref) != 0) {
+            cJSON_Delete(old_record);
+            cJSON_Delete(existing);
+            ret = 1;
+            break;
+        }
+        cJSON_Delete(old_record);
+        cJSON_Delete(existing);
+        count++;
+    }
+    if (ret == 0 && paged_commit(pt) != 0) ret = 1;
+
+    table_indexes_close(&indexes);
+    idmap_free(&ids);
+    *imported = count;
+    return ret;
+}
+
+typedef struct {
+    const char* db_path;
+    const char* table_name;
+    cJSON* records;
+    int count;
+} JsonImport;
+
+// Runs as a checkpoint hook: the WAL is folded in and writers are held off,
+// so the table file can be rewritten directly.
+static int import_into_json_hook(void* ctx) {
+    JsonImport* import = (JsonImport*)ctx;
+    const char* db_path = import->db_path;
+    const char* table_name = import->table_name;
+    cJSON* records = import->records;
+
+    cJSON* root = load_table_file(db_path, table_name);
+    if (!root) return 1;
+
+    IdMap ids;
+    if (idmap_init(&ids, (size_t)cJSON_GetArraySize(root)) != 0) {
+        cJSON_Delete(root);
+        return 1;
+    }
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, root) {
+        cJSON* id = cJSON_GetObjectItemCaseSensitive(item, "id");
+        if (cJSON_IsString(id)) idmap_put(&ids, id->valuestring, (uintptr_t)item);
+    }
+
+    // Records without an id get theirs now that the table can't change
+    IdSequence seq;
+    if (id_sequence_open(db_path, table_name, records_max_id(root), &seq) != 0) {
+        idmap_free(&ids);
+        cJSON_Delete(root);
+        return 1;
+    }
+    uint64_t max_id = seq.last;
+    int ret = 0;
+    cJSON_ArrayForEach(item, records) {
+        if (ret == 0 && normalize_record_id(item, &max_id) != 0) ret = 1;
+    }
+    if (id_sequence_close(&seq, max_id, false) != 0) ret = 1;
+    if (ret != 0) {
+        idmap_free(&ids);
+        cJSON_Delete(root);
+        return 1;
+    }
+
+    int count = 0;
+    cJSON* record = records->child;
+    while (record) {
+        cJSON* next = record->next;
+        cJSON* id = cJSON_GetObjectItemCaseSensitive(record, "id");
+        uint64_t existing;
+        if (idmap_get(&ids, id->valuestring, &existing)) {
+            merge_record((cJSON*)(uintptr_t)existing, record);
+        } else {
+            cJSON_DetachItemViaPointer(records, record);
+            cJSON_AddItemToArray(root, record);
+            idmap_put(&ids, id->valuestring, (uintptr_t)record);
+        }
+        count++;
+        record = next;
+    }
+    idmap_free(&ids);
+
+    ret = save_table(db_path, table_name, root);
+    cJSON_Delete(root);
+    import->count = count;
+    return ret == 0 ? 0 : 1;
+}
+
+static int import_into_json(const char* db_path, const char* table_name, cJSON* records,
+                            int* imported) {
+    JsonImport import = { db_path, table_name, records, 0 };
+    if (wal_checkpoint(db_path, true, import_into_json_hook, &import) != 0) return 1;
+    *imported = import.count;
+    return 0;
+}
+
+// Each record is merged into the current version of its id, if there is
+// one, and appended to the log.
+static int import_into_lsm(LsmWriter* w, cJSON* records, int* imported) {
+    int count = 0;
+    cJSON* record = NULL;
+    cJSON_ArrayForEach(record, records) {
+        uint64_t key;
+        cJSON* existing = NULL;
+        if (!parse_id_key(record_string_field(record, "id"), &key) ||
+            lsm_writer_load(w, key, &existing) < 0) {
+            return 1;
+        }
+        if (existing) merge_record(existing, record);
+        char* text = json_print(existing ? existing : record);
+        int ret = text ? lsm_writer_put(w, key, text, strlen(text)) : -1;
+        cJSON_free(text);
+        cJSON_Delete(existing);
+        if (ret != 0) return 1;
+        count++;
+    }
+    if (lsm_writer_commit(w) != 0) return 1;
+    *imported = count;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Upsert a batch of records into a table in one pass ('import' and
+ * 'save --from-stdin'). Ids are checked first, so a bad record doesn't
+ * leave half a batch behind; 'source' names the records in error messages.
+ * New ids are handed out while other writers are held off: inside the
+ * paged table's commit or the LSM writer's turn, or inside the JSON
+ * import's checkpoint.
+ * Returns 0 and the number of records on success.
+ * -------------------------------------------------------------------------- */
+static int upsert_records(const char* db_path, const char* table_name, cJSON* records,
+                          const char* source, int* count) {
+    TableFormat format = table_format(db_path, table_name);
+
+    PagedTable pt = { .fd = -1, .lock_fd = -1 };
+    LsmWriter lw;
+    IdSequence seq = { -1, 0 };
+    uint64_t max_id = 0;
+    bool lsm = format == TABLE_FORMAT_LSM;
+    if (format == TABLE_FORMAT_PAGED || lsm) {
+        if (lsm ? lsm_writer_open(db_path, table_name, &lw) != 0
+                : paged_open_writer(db_path, table_name, &pt) != 0) {
+            return 1;
+        }
+        uint64_t floor = lsm ? lsm_writer_max_id(&lw) : pt.header.max_id;
+        if (id_sequence_open(db_path, table_name, floor, &seq) != 0) {
+            fprintf(stderr, "Error: Could not open the id sequence of table %s\n", table_name);
+            if (lsm) lsm_writer_close(&lw);
+            paged_close(&pt);
+            return 1;
+        }
+        max_id = seq.last;
+    }
+    cJSON* record = NULL;
+    int index = 0;
+    cJSON_ArrayForEach(record, records) {
+        bool assign = format != TABLE_FORMAT_JSON || cJSON_HasObjectItem(record, "id");
+        if (!cJSON_IsObject(record) || (assign && normalize_record_id(record, &max_id) != 0)) {
+            fprintf(stderr, "Error: Record %d of %s is not an object with a positive "
+                            "integer 'id'\n", index + 1, source);
+            id_sequence_close(&seq, 0, false);
+            if (lsm) lsm_writer_close(&lw);
+            paged_close(&pt);
+            return 1;
+        }
+        index++;
+    }
+    if (format != TABLE_FORMAT_JSON && id_sequence_close(&seq, max_id, false) != 0) {
+        fprintf(stderr, "Error: Could not update the id sequence of table %s\n", table_name);
+        if (lsm) lsm_writer_close(&lw);
+        paged_close(&pt);
+        return 1;
+    }
+
+    int ret;
+    if (lsm) {
+        ret = import_into_lsm(&lw, records, count);
+        lsm_writer_close(&lw);
+    } else if (format == TABLE_FORMAT_PAGED) {
+        ret = import_into_paged(db_path, table_name, &pt, records, count);
+    } else {
+        ret = import_into_json(db_path, table_name, records, count);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not import into table %s\n", table_name);
+    }
+    paged_close(&pt);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * import <table> <file.csv>
+ * Upsert the rows of a CSV file without building cJSON trees for them: the
+ * mapped file is tokenized in place and each new row's JSON text is written
+ * straight to the table. Rows whose id is already in the table (or earlier
+ * in the file) are merged into that record like any other import. The whole
+ * file is checked in a first pass, so a bad row leaves the table untouched.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* source;         // the file name, for messages
+    char** columns;
+    int column_count;
+    int id_column;              // -1 without an "id" column
+    uint64_t max_id;
+    char id[32];                // the id of the current row
+    TextBuffer value;           // scratch: one field's value
+    TextBuffer text;            // the current row as a JSON object
+} CsvRecords;
+
+static void csv_records_free(CsvRecords* r) {
+    for (int i = 0; i < r->column_count; i++) free(r->columns[i]);
+    free(r->columns);
+    free(r->value.data);
+    free(r->text.data);
+}
+
+static int csv_read_header(CsvRecords* r, const CsvField* fields, int count) {
+    r->columns = calloc((size_t)count, sizeof(char*));
+    if (!r->columns) return -1;
+    r->id_column = -1;
+    for (int i = 0; i < count; i++) {
+        if (!csv_field_value(&fields[i], &r->value) || r->value.len == 0 ||
+            memchr(r->value.data, '\0', r->value.len)) {
+            fprintf(stderr, "Error: Column %d of %s has no name\n", i + 1, r->source);
+            return -1;
+        }
+        for (int j = 0; j < i; j++) {
+            if (strcmp(r->columns[j], r->value.data) == 0) {
+                fprintf(stderr, "Error: Column '%s' appears twice in %s\n",
+                        r->value.data, r->source);
+                return -1;
+            }
+        }
+        r->columns[i] = strdup(r->value.data);
+        if (!r->columns[i]) return -1;
+        r->column_count++;
+        if (strcmp(r->columns[i], "id") == 0) r->id_column = i;
+    }
+    return 0;
+}
+
+// Check a data row and set r->id, assigning the next free id to a row that
+// has none (only when 'assign' is set).
+static int csv_row_id(CsvRecords* r, const CsvField* fields, int count, size_t row,
+                      bool assign) {
+    if (count != r->column_count) {
+        fprintf(stderr, "Error: Row %zu of %s has %d field(s), expected %d\n",
+                row, r->source, count, r->column_count);
+        return -1;
+    }
+    if (r->id_column < 0 || !csv_field_value(&fields[r->id_column], &r->value)) {
+        if (assign) snprintf(r->id, sizeof(r->id), "%llu", (unsigned long long)++r->max_id);
+        return 0;
+    }
+    char* endptr = NULL;
+    long long val = strtoll(r->value.data, &endptr, 10);
+    if (*endptr != '\0' || val <= 0 || r->value.len >= sizeof(r->id)) {
+        fprintf(stderr, "Error: Row %zu of %s does not have a positive integer 'id'\n",
+                row, r->source);
+        return -1;
+    }
+    memcpy(r->id, r->value.data, r->value.len + 1);
+    if ((uint64_t)val > r->max_id) r->max_id = (uint64_t)val;
+    return 0;
+}
+
+// The current row as JSON text in r->text: the id first, as 'save' writes
+// it, then the other present fields in column order.
+static int csv_row_text(CsvRecords* r, const CsvField* fields) {
+    r->text.len = 0;
+    int ret = text_append(&r->text, "{\"id\":", 6);
+    if (ret == 0) ret = text_append_json_string(&r->text, r->id, strlen(r->id));
+    for (int i = 0; i < r->column_count && ret == 0; i++) {
+        if (i == r->id_column || !csv_field_value(&fields[i], &r->value)) continue;
+        ret = text_append(&r->text, ",", 1);
+        if (ret == 0) ret = text_append_json_string(&r->text, r->columns[i], strlen(r->columns[i]));
+        if (ret == 0) ret = text_append(&r->text, ":", 1);
+        if (ret == 0) ret = text_append_json_string(&r->text, r->value.data, r->value.len);
+    }
+    if (ret == 0) ret = text_append(&r->text, "}", 1);
+    return ret;
+}
+
+static int csv_check_row_callback(const CsvField* fields, int count, size_t row, void* ctx) {
+    CsvRecords* r = (CsvRecords*)ctx;
+    if (row == 1) return csv_read_header(r, fields, count);
+    return csv_row_id(r, fields, count, row, false);
+}
+
+// The id of a record's JSON text. Records written by simpledb start with
+// it, so it is read off the text when it can be; else the record is parsed.
+static bool record_id_text(const char* data, size_t len, char* id, size_t size) {
+    static const char prefix[] = "{\"id\":\"";
+    size_t n = sizeof(prefix) - 1;
+    if (len > n && memcmp(data, prefix, n) == 0) {
+        const char* end = memchr(data + n, '"', len - n);
+        if (end && !memchr(data + n, '\\', (size_t)(end - data) - n) &&
+            (size_t)(end - data) - n < size) {
+            memcpy(id, data + n, (size_t)(end - data) - n);
+            id[(end - data) - n] = '\0';
+            return true;
+        }
+    }
+    cJSON* record = json_parse(data, len);
+    const char* value = record_string_field(record, "id");
+    bool found = value && strlen(value) < size;
+    if (found) strcpy(id, value);
+    cJSON_Delete(record);
+    return found;
+}
+
+/* ---- JSON tables ---------------------------------------------------------
+ * New rows are spooled to <table>.json.spool as a JSON array, updates are
+ * kept as cJSON objects by id, then <table>.json is rewritten by streaming
+ * the old file and the spool through the updates. */
+typedef struct {
+    const char* db_path;
+    const char* table_name;
+    const MappedFile* csv;
+    CsvRecords* r;
+    IdMap ids;                  // ids in the table and in the spool
+    IdMap updates;              // id -> cJSON* holding the row(s) to merge
+    cJSON* update_list;
+    FILE* out;
+    bool first;
+    int count;
+} JsonCsvImport;
+
+static int collect_json_id_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    JsonCsvImport* im = (JsonCsvImport*)ctx;
+    char id[64];
+    if (!record_id_text(data, len, id, sizeof(id))) return 0;
+    uint64_t val = strtoull(id, NULL, 10);
+    if (val > im->r->max_id) im->r->max_id = val;
+    return idmap_put(&im->ids, id, 0) == 0 ? 0 : -1;
+}
+
+static int json_csv_row_callback(const CsvField* fields, int count, size_t row, void* ctx) {
+    JsonCsvImport* im = (JsonCsvImport*)ctx;
+    CsvRecords* r = im->r;
+    if (row == 1) return 0;
+    if (csv_row_id(r, fields, count, row, true) != 0 || csv_row_text(r, fields) != 0) return -1;
+    im->count++;
+
+    if (!idmap_get(&im->ids, r->id, NULL)) {
+        if (!im->first) fputc(',', im->out);
+        im->first = false;
+        fwrite(r->text.data, 1, r->text.len, im->out);
+        return idmap_put(&im->ids, r->id, 0) == 0 ? 0 : -1;
+    }
+
+    cJSON* update = json_parse(r->text.data, r->text.len);
+    if (!update) return -1;
+    uint64_t at;
+    if (!idmap_get(&im->updates, r->id, &at)) {
+        cJSON_AddItemToArray(im->update_list, update);
+        return idmap_put(&im->updates, r->id, (uintptr_t)update) == 0 ? 0 : -1;
+    }
+    // A later row for the same id wins field by field
+    cJSON* merged = (cJSON*)(uintptr_t)at;
+    while (update->child) {
+        cJSON* field = cJSON_DetachItemViaPointer(update, update->child);
+        cJSON_DeleteItemFromObjectCaseSensitive(merged, field->string);
+        cJSON_AddItemToArray(merged, field);
+    }
+    cJSON_Delete(update);
+    return 0;
+}
+
+static int write_merged_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    JsonCsvImport* im = (JsonCsvImport*)ctx;
+    char id[64];
+    uint64_t at;
+    char* text = NULL;
+    if (im->update_list->child && record_id_text(data, len, id, sizeof(id)) &&
+        idmap_get(&im->updates, id, &at)) {
+        cJSON* record = json_parse(data, len);
+        if (record) merge_record(record, (const cJSON*)(uintptr_t)at);
+        text = record ? json_print(record) : NULL;
+        cJSON_Delete(record);
+        if (!text) return -1;
+        data = text;
+        len = strlen(text);
+    }
+    if (!im->first) fputc(',', im->out);
+    im->first = false;
+    fwrite(data, 1, len, im->out);
+    cJSON_free(text);
+    return ferror(im->out) ? -1 : 0;
+}
+
+typedef struct {
+    TreeEntries tree;
+    IndexBuilder* builders;
+    TableIndexes* indexes;
+} JsonIndexRebuild;
+
+static int rebuild_index_entry_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    JsonIndexRebuild* rb = (JsonIndexRebuild*)ctx;
+    char id[64];
+    uint64_t key;
+    if (record_id_text(data, len, id, sizeof(id)) && parse_id_key(id, &key)) {
+        if (rb->tree.count == rb->tree.capacity) {
+            size_t capacity = rb->tree.capacity ? rb->tree.capacity * 2 : 1024;
+            BTreeLeafEntry* grown = realloc(rb->tree.items, capacity * sizeof(BTreeLeafEntry));
+            if (!grown) return -1;
+            rb->tree.items = grown;
+            rb->tree.capacity = capacity;
+        }
+        rb->tree.items[rb->tree.count++] = (BTreeLeafEntry){ key, rowref, (uint32_t)len, 0 };
+    }
+    if (rb->indexes->count == 0) return 0;
+
+    cJSON* record = json_parse(data, len);
+    int ret = 0;
+    for (int i = 0; i < rb->indexes->count && ret == 0; i++) {
+        const char* value = record_string_field(record, rb->indexes->items[i].field);
+        if (value) ret = index_builder_add(&rb->builders[i], value, rowref, (uint32_t)len);
+    }
+    cJSON_Delete(record);
+    return ret;
+}
+
+// Rebuild the indexes of a JSON table by streaming the file just written,
+// like rebuild_json_indexes() does from the tree save_table() wrote.
+static int rebuild_json_indexes_from_file(const char* db_path, const char* table_name,
+                                          const char* filepath) {
+    TableIndexes indexes;
+    if (table_indexes_open(db_path, table_name, &indexes) != 0) {
+        table_indexes_close(&indexes);
+        return 0;
+    }
+    JsonIndexRebuild rb = { { NULL, 0, 0 }, NULL, &indexes };
+    rb.builders = calloc((size_t)indexes.count + 1, sizeof(IndexBuilder));
+    int ret = rb.builders ? 0 : -1;
+    int ready = 0;
+    for (; ready < indexes.count && ret == 0; ready++) {
+        ret = index_builder_init(&rb.builders[ready], 0,
+                                 hash_index_ordered(&indexes.items[ready]));
+    }
+    if (ret != 0) ready--;
+
+    struct stat st;
+    FileStamp stamp;
+    int fd = ret == 0 ? open(filepath, O_RDONLY) : -1;
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        json_stream_records(fd, NULL, rebuild_index_entry_callback, &rb) != 0) {
+        ret = -1;
+    }
+    if (fd >= 0) close(fd);
+
+    if (ret == 0) {
+        file_stamp_of(&st, &stamp);
+        uint64_t max_id = indexes.tree.fd >= 0 ? indexes.tree.header.max_id : 0;
+        ret = id_tree_build(db_path, table_name, rb.tree.items, rb.tree.count, max_id, &stamp);
+    }
+    for (int i = 0; i < indexes.count && ret == 0; i++) {
+        char path[1024];
+        index_path(db_path, table_name, indexes.items[i].field, path, sizeof(path));
+        ret = index_builder_write(&rb.builders[i], path, &stamp);
+    }
+    for (int i = 0; i < ready; i++) index_builder_free(&rb.builders[i]);
+    free(rb.builders);
+    free(rb.tree.items);
+    table_indexes_close(&indexes);
+    return ret;
+}
+
+// Runs as a checkpoint hook, like import_into_json_hook().
+static int import_csv_into_json_hook(void* ctx) {
+    JsonCsvImport* im = (JsonCsvImport*)ctx;
+    char filepath[1024], spool_path[1100], temp_path[1100];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", im->db_path, im->table_name);
+    snprintf(spool_path, sizeof(spool_path), "%s.spool", filepath);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d", filepath, (int)getpid());
+
+    int table_fd = open(filepath, O_RDONLY);
+    int ret = table_fd >= 0 || errno == ENOENT ? 0 : -1;
+    if (ret == 0 && table_fd >= 0) {
+        ret = json_stream_records(table_fd, NULL, collect_json_id_callback, im);
+    }
+
+    // Rows without an id take theirs from the sequence
+    IdSequence seq = { -1, 0 };
+    if (ret == 0 && id_sequence_open(im->db_path, im->table_name, im->r->max_id, &seq) != 0) {
+        ret = -1;
+    }
+    if (ret == 0) im->r->max_id = seq.last;
+
+    // New rows to the spool, updates to memory
+    FILE* spool = ret == 0 ? fopen(spool_path, "w+") : NULL;
+    if (spool) {
+        im->out = spool;
+        im->first = true;
+        fputc('[', spool);
+        ret = csv_scan(im->csv->data, im->csv->len, json_csv_row_callback, im);
+        fputc(']', spool);
+        if (fflush(spool) != 0) ret = -1;
+    } else {
+        ret = -1;
+    }
+    if (seq.fd >= 0 && id_sequence_close(&seq, im->r->max_id, false) != 0) ret = -1;
+
+    // The old records, then the new ones, through the updates
+    FILE* out = ret == 0 ? table_file_create(temp_path, table_file_compressed(filepath)) : NULL;
+    if (out) {
+        im->out = out;
+        im->first = true;
+        fputc('[', out);
+        if (table_fd >= 0) ret = json_stream_records(table_fd, NULL, write_merged_record_callback, im);
+        if (ret == 0) ret = json_stream_records(fileno(spool), NULL, write_merged_record_callback, im);
+        fputc(']', out);
+        if (table_file_finish(out) != 0) ret = -1;
+        if (ret == 0 && rename(temp_path, filepath) != 0) ret = -1;
+        if (ret == 0) ret = fsync_parent_dir(filepath);
+        if (ret != 0) unlink(temp_path);
+    } else {
+        ret = -1;
+    }
+    if (spool) fclose(spool);
+    unlink(spool_path);
+    if (table_fd >= 0) close(table_fd);
+
+    if (ret == 0) ret = rebuild_json_indexes_from_file(im->db_path, im->table_name, filepath);
+    return ret == 0 ? 0 : 1;
+}
+
+static int import_csv_into_json(const char* db_path, const char* table_name,
+                                const MappedFile* csv, CsvRecords* r, int* imported) {
+    JsonCsvImport im = { db_path, table_name, csv, r, { 0 }, { 0 }, cJSON_CreateArray(),
+                         NULL, true, 0 };
+    int ret = im.update_list && idmap_init(&im.ids, 1024) == 0 &&
+              idmap_init(&im.updates, 64) == 0 ? 0 : 1;
+    if (ret == 0) ret = wal_checkpoint(db_path, true, import_csv_into_json_hook, &im) != 0;
+    idmap_free(&im.ids);
+    idmap_free(&im.updates);
+    cJSON_Delete(im.update_list);
+    *imported = im.count;
+    return ret;
+}
+
+/* ---- Paged tables --------------------------------------------------------
+ * New rows are appended through a copy of the last page kept in memory,
+ * which is written out when it fills up; the file header is written once at
+ * the end. A row for an id the table holds goes through paged_store_record()
+ * after the pending page is written. */
+typedef struct {
+    PagedTable* pt;
+    char page[PAGE_SIZE];
+    uint32_t pgno;              // 0 while no page is loaded
+    bool dirty;
+} PagedAppender;
+
+static int paged_append(PagedAppender* a, const char* data, size_t len, uint64_t* rowref) {
+    if (paged_check_size(len) != 0) return -1;
+    PagedTable* pt = a->pt;
+    if (a->pgno == 0 && pt->header.page_count > 1) {
+        if (paged_read_page(pt, pt->header.page_count - 1, a->page) != 0) return -1;
+        a->pgno = pt->header.page_count - 1;
+    }
+    RecordVersion version = { pt->header.pending_seq, 0, 0 };
+    int slot = a->pgno > 0 ? page_insert(a->page, &version, data, len) : -1;
+    if (slot < 0) {
+        if (a->dirty && paged_write_page(pt, a->pgno, a->page) != 0) return -1;
+        a->pgno = pt->header.page_count++;
+        page_init(a->page);
+        slot = page_insert(a->page, &version, data, len);
+    }
+    a->dirty = true;
+    *rowref = ROWREF(a->pgno, slot);
+    return 0;
+}
+
+static int paged_append_flush(PagedAppender* a) {
+    int ret = a->dirty ? paged_write_page(a->pt, a->pgno, a->page) : 0;
+    a->dirty = false;
+    a->pgno = 0;
+    return ret == 0 ? paged_write_header(a->pt) : -1;
+}
+
+typedef struct {
+    PagedTable* pt;
+    TableIndexes* indexes;
+    CsvRecords* r;
+    IdMap ids;                  // id -> rowref
+    PagedAppender appender;
+    int* index_columns;         // the column of each hash index, -1 for none
+    int count;
+} PagedCsvImport;
+
+static int paged_csv_update(PagedCsvImport* im, uint64_t rowref) {
+    CsvRecords* r = im->r;
+    // The record may be on the page not written yet
+    if (paged_append_flush(&im->appender) != 0) return -1;
+    cJSON* update = json_parse(r->text.data, r->text.len);
+    cJSON* old_record = update ? paged_load_record(im->pt, rowref) : NULL;
+    cJSON* existing = cJSON_Duplicate(old_record, 1);
+    if (existing) merge_record(existing, update);
+    int ret = update &&
+              paged_store_record(im->pt, im->indexes, old_record, old_record ? &rowref : NULL,
+                                 existing ? existing : update, &rowref) == 0 &&
+              idmap_put(&im->ids, r->id, rowref) == 0 ? 0 : -1;
+    cJSON_Delete(update);
+    cJSON_Delete(old_record);
+    cJSON_Delete(existing);
+    return ret;
+}
+
+static int paged_csv_row_callback(const CsvField* fields, int count, size_t row, void* ctx) {
+    PagedCsvImport* im = (PagedCsvImport*)ctx;
+    CsvRecords* r = im->r;
+    if (row == 1) return 0;
+    if (csv_row_id(r, fields, count, row, true) != 0 || csv_row_text(r, fields) != 0) return -1;
+    im->count++;
+
+    uint64_t rowref;
+    if (idmap_get(&im->ids, r->id, &rowref)) return paged_csv_update(im, rowref);
+
+    if (paged_append(&im->appender, r->text.data, r->text.len, &rowref) != 0 ||
+        idmap_put(&im->ids, r->id, rowref) != 0) {
+        return -1;
+    }
+    paged_note_id(im->pt, r->id);
+    uint64_t key;
+    if (im->indexes->tree.fd >= 0 && parse_id_key(r->id, &key) &&
+        id_tree_put(&im->indexes->tree, key, rowref, 0) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < im->indexes->count; i++) {
+        int column = im->index_columns[i];
+        const char* value = NULL;
+        if (strcmp(im->indexes->items[i].field, "id") == 0) {
+            value = r->id;
+        } else if (column >= 0 && csv_field_value(&fields[column], &r->value)) {
+            value = r->value.data;
+        }
+        if (value && hash_index_insert(&im->indexes->items[i], value, rowref, 0) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int import_csv_into_paged(const char* db_path, const char* table_name,
+                                 const MappedFile* csv, CsvRecords* r, int* imported) {
+    PagedTable pt;
+    if (paged_open_writer(db_path, table_name, &pt) != 0) return 1;
+
+    PagedCsvImport im = { &pt, NULL, r, { 0 }, { &pt, { 0 }, 0, false }, NULL, 0 };
+    if (idmap_init(&im.ids, 1024) != 0) {
+        paged_close(&pt);
+        return 1;
+    }
+    PagedIdCollector collector = { &im.ids, pt.header.max_id };
+    paged_scan(&pt, collect_ids_callback, &collector);
+    IdSequence seq;
+    if (id_sequence_open(db_path, table_name, pt.header.max_id, &seq) != 0) {
+        idmap_free(&im.ids);
+        paged_close(&pt);
+        return 1;
+    }
+    r->max_id = seq.last;
+
+    TableIndexes indexes;
+    table_indexes_open(db_path, table_name, &indexes);
+    im.indexes = &indexes;
+    im.index_columns = malloc(((size_t)indexes.count + 1) * sizeof(int));
+    int ret = im.index_columns ? 0 : -1;
+    for (int i = 0; i < indexes.count && ret == 0; i++) {
+        im.index_columns[i] = -1;
+        for (int c = 0; c < r->column_count; c++) {
+            if (strcmp(r->columns[c], indexes.items[i].field) == 0) im.index_columns[i] = c;
+        }
+        // Rows without an id column still get one
+        if (strcmp(indexes.items[i].field, "id") == 0) im.index_columns[i] = r->id_column;
+    }
+
+    if (ret == 0) ret = csv_scan(csv->data, csv->len, paged_csv_row_callback, &im);
+    if (id_sequence_close(&seq, r->max_id, false) != 0) ret = -1;
+    if (paged_append_flush(&im.appender) != 0) ret = -1;
+    if (ret == 0 && paged_commit(&pt) != 0) ret = -1;
+
+    free(im.index_columns);
+    table_indexes_close(&indexes);
+    idmap_free(&im.ids);
+    paged_close(&pt);
+    *imported = im.count;
+    return ret == 0 ? 0 : 1;
+}
+
+typedef struct {
+    LsmWriter* w;
+    CsvRecords* r;
+    int count;
+} LsmCsvImport;
+
+// A row is appended as it is, unless it updates a record the table (or an
+// earlier row) already has.
+static int lsm_csv_row_callback(const CsvField* fields, int count, size_t row, void* ctx) {
+    LsmCsvImport* im = (LsmCsvImport*)ctx;
+    CsvRecords* r = im->r;
+    if (row == 1) return 0;
+    if (csv_row_id(r, fields, count, row, true) != 0 || csv_row_text(r, fields) != 0) return -1;
+    im->count++;
+
+    uint64_t key;
+    cJSON* existing = NULL;
+    if (!parse_id_key(r->id, &key) || lsm_writer_load(im->w, key, &existing) < 0) return -1;
+    if (!existing) return lsm_writer_put(im->w, key, r->text.data, r->text.len);
+    cJSON* update = json_parse(r->text.data, r->text.len);
+    if (update) merge_record(existing, update);
+    char* text = update ? json_print(existing) : NULL;
+    int ret = text ? lsm_writer_put(im->w, key, text, strlen(text)) : -1;
+    cJSON_free(text);
+    cJSON_Delete(update);
+    cJSON_Delete(existing);
+    return ret;
+}
+
+static int import_csv_into_lsm(const char* db_path, const char* table_name,
+                               const MappedFile* csv, CsvRecords* r, int* imported) {
+    LsmWriter w;
+    if (lsm_writer_open(db_path, table_name, &w) != 0) return 1;
+    IdSequence seq;
+    if (id_sequence_open(db_path, table_name, lsm_writer_max_id(&w), &seq) != 0) {
+        lsm_writer_close(&w);
+        return 1;
+    }
+    r->max_id = seq.last;
+
+    LsmCsvImport im = { &w, r, 0 };
+    int ret = csv_scan(csv->data, csv->len, lsm_csv_row_callback, &im);
+    if (id_sequence_close(&seq, r->max_id, false) != 0) ret = -1;
+    if (ret == 0 && lsm_writer_commit(&w) != 0) ret = -1;
+    lsm_writer_close(&w);
+    *imported = im.count;
+    return ret == 0 ? 0 : 1;
+}
+
+static int command_import_csv(const char* db_path, const char* table_name,
+                              const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    MappedFile csv = { NULL, 0, false };
+    if (fd < 0 || map_fd(fd, &csv) != 0) {
+        fprintf(stderr, "Error: Could not read %s\n", filename);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    close(fd);
+
+    CsvRecords r;
+    memset(&r, 0, sizeof(r));
+    r.source = filename;
+    r.id_column = -1;
+    int ret = csv_scan(csv.data, csv.len, csv_check_row_callback, &r);
+    if (ret == 0 && r.column_count == 0) {
+        fprintf(stderr, "Error: %s has no header row\n", filename);
+        ret = 1;
+    }
+    r.max_id = 0;   // ids are assigned in row order, as 'import' of JSON does
+
+    int count = 0;
+    if (ret == 0) {
+        TableFormat format = table_format(db_path, table_name);
+        if (format == TABLE_FORMAT_PAGED) {
+            ret = import_csv_into_paged(db_path, table_name, &csv, &r, &count);
+        } else if (format == TABLE_FORMAT_LSM) {
+            ret = import_csv_into_lsm(db_path, table_name, &csv, &r, &count);
+        } else {
+            ret = import_csv_into_json(db_path, table_name, &csv, &r, &count);
+        }
+        if (ret != 0) fprintf(stderr, "Error: Could not import into table %s\n", table_name);
+    }
+    if (ret == 0) printf("Imported %d record(s)\n", count);
+    csv_records_free(&r);
+    unmap_file(&csv);
+    return ret == 0 ? 0 : 1;
+}
+
+static int command_import(const char* db_path, const char* table_name, const char* filename) {
+    size_t name_len = strlen(filename);
+    if (name_len > 4 && strcasecmp(filename + name_len - 4, ".csv") == 0) {
+        return command_import_csv(db_path, table_name, filename);
+    }
+    char* content = read_file(filename);
+    if (!content) {
+        fprintf(stderr, "Error: Could not read %s\n", filename);
+        return 1;
+    }
+    cJSON* records = json_parse(content, strlen(content));
+    free(content);
+    if (!cJSON_IsArray(records)) {
+        fprintf(stderr, "Error: %s does not contain a JSON array\n", filename);
+        cJSON_Delete(records);
+        return 1;
+    }
+
+    int count = 0;
+    int ret = upsert_records(db_path, table_name, records, filename, &count);
+    if (ret == 0) printf("Imported %d record(s)\n", count);
+    cJSON_Delete(records);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * save <table> --from-stdin
+ * Upsert one record per line of stdin, either a JSON object or the same
+ * field=value pairs 'save' takes (separated by spaces; a value may be put in
+ * double quotes, with \" and \\ inside). Like a single save, values given
+ * as field=value are strings and a record without an id gets a new one.
+ * -------------------------------------------------------------------------- */
+static cJSON* parse_field_line(const char* line) {
+    cJSON* record = cJSON_CreateObject();
+    size_t len = strlen(line);
+    char* token = malloc(len + 1);
+    const char* p = line;
+    while (record && token) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') break;
+
+        // key=value, the value possibly quoted
+        size_t n = 0;
+        while (*p && *p != '=' && *p != ' ' && *p != '\t') token[n++] = *p++;
+        token[n++] = '\0';
+        size_t value_start = n;
+        bool ok = *p == '=' && n > 1;
+        if (ok && *++p == '"') {
+            p++;
+            while (*p && *p != '"') {
+                if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) p++;
+                token[n++] = *p++;
+            }
+            ok = *p == '"';
+            if (ok) p++;
+        } else {
+            while (ok && *p && *p != ' ' && *p != '\t') token[n++] = *p++;
+        }
+        token[n] = '\0';
+        if (ok) cJSON_DeleteItemFromObjectCaseSensitive(record, token);
+        if (!ok || !cJSON_AddStringToObject(record, token, token + value_start)) {
+            cJSON_Delete(record);
+            record = NULL;
+        }
+    }
+    free(token);
+    if (!token) {
+        cJSON_Delete(record);
+        return NULL;
+    }
+
+    // 'id' first, as 'save' writes it
+    cJSON* id = record ? cJSON_DetachItemFromObjectCaseSensitive(record, "id") : NULL;
+    cJSON* ordered = id ? cJSON_CreateObject() : NULL;
+    if (ordered) {
+        cJSON_AddItemToArray(ordered, id);
+        while (record->child) {
+            cJSON_AddItemToArray(ordered, cJSON_DetachItemViaPointer(record, record->child));
+        }
+        cJSON_Delete(record);
+        return ordered;
+    }
+    if (id) cJSON_AddItemToArray(record, id);
+    return record;
+}
+
+static int command_save_from_stdin(const char* db_path, const char* table_name) {
+    cJSON* records = cJSON_CreateArray();
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    int line_number = 0;
+    int ret = records ? 0 : 1;
+    while (ret == 0 && (len = getline(&line, &capacity, stdin)) >= 0) {
+        line_number++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+        const char* start = line + strspn(line, " \t");
+        if (*start == '\0') continue;
+
+        cJSON* record = *start == '{' ? json_parse(start, (size_t)(line + len - start))
+                                      : parse_field_line(start);
+        if (!cJSON_IsObject(record)) {
+            fprintf(stderr, "Error: Line %d of stdin is not a JSON object or field=value "
+                            "pairs\n", line_number);
+            cJSON_Delete(record);
+            ret = 1;
+        } else {
+            cJSON_AddItemToArray(records, record);
+        }
+    }
+    free(line);
+
+    int count = 0;
+    if (ret == 0) {
+        ret = upsert_records(db_path, table_name, records, "stdin", &count);
+    }
+    if (ret == 0) printf("Saved %d record(s)\n", count);
+    cJSON_Delete(records);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * export <table> [--format json|csv]
+ * Print the whole table as one JSON array, the same content <table>.json has,
+ * or as CSV: a header row naming every top-level field in the order first
+ * seen, then one row per record. String values are always quoted; other
+ * values are written as their JSON text, and missing fields are left empty.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    bool first;
+} ExportState;
+
+static int export_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    ExportState* state = (ExportState*)ctx;
+    if (!state->first) putchar(',');
+    fwrite(data, 1, len, stdout);
+    state->first = false;
+    return 0;
+}
+
+typedef struct {
+    IdMap columns;              // name -> column number
+    char** names;               // in column order
+    size_t count;
+    TextBuffer key;
+    TextBuffer row;
+    TextBuffer value;
+    const char** values;        // the current record's values, by column
+    size_t* lengths;
+    FILE* spool;                // the records, each after its length
+} CsvExport;
+
+static int collect_column_callback(const char* key, const char* value, size_t value_len,
+                                   void* ctx) {
+    (void)value;
+    (void)value_len;
+    CsvExport* e = (CsvExport*)ctx;
+    if (idmap_get(&e->columns, key, NULL)) return 0;
+    char** grown = realloc(e->names, (e->count + 1) * sizeof(char*));
+    if (!grown) return -1;
+    e->names = grown;
+    e->names[e->count] = strdup(key);
+    if (!e->names[e->count] || idmap_put(&e->columns, key, e->count) != 0) return -1;
+    e->count++;
+    return 0;
+}
+
+// Collect the columns of a record and spool it, so that the rows come from
+// the same scan as the header.
+static int collect_columns_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    CsvExport* e = (CsvExport*)ctx;
+    if (record_members(data, len, &e->key, collect_column_callback, e) < 0) return -1;
+    return fwrite(&len, sizeof(len), 1, e->spool) == 1 &&
+           fwrite(data, 1, len, e->spool) == len ? 0 : -1;
+}
+
+static int note_value_callback(const char* key, const char* value, size_t value_len, void* ctx) {
+    CsvExport* e = (CsvExport*)ctx;
+    uint64_t column;
+    if (idmap_get(&e->columns, key, &column)) {
+        e->values[column] = value;
+        e->lengths[column] = value_len;
+    }
+    return 0;
+}
+
+static int print_csv_row_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    CsvExport* e = (CsvExport*)ctx;
+    memset(e->values, 0, e->count * sizeof(char*));
+    if (record_members(data, len, &e->key, note_value_callback, e) < 0) return -1;
+
+    e->row.len = 0;
+    int ret = 0;
+    for (size_t i = 0; i < e->count && ret == 0; i++) {
+        if (i > 0) ret = text_append(&e->row, ",", 1);
+        const char* value = e->values[i];
+        size_t value_len = e->lengths[i];
+        if (ret != 0 || !value || (value_len == 4 && memcmp(value, "null", 4) == 0)) continue;
+        if (value[0] == '"') {
+            e->value.len = 0;
+            ret = text_append_json_unescaped(&e->value, value + 1, value_len - 2);
+            if (ret == 0) ret = text_append_csv_field(&e->row, e->value.data, e->value.len, true);
+        } else {
+            ret = text_append_csv_field(&e->row, value, value_len, false);
+        }
+    }
+    if (ret == 0) ret = text_append(&e->row, "\n", 1);
+    if (ret == 0) fwrite(e->row.data, 1, e->row.len, stdout);
+    return ret;
+}
+
+// Every current record of a table: its pages, the merge of its runs and
+// memtable, or the JSON file merged with its pending log entries. Used by
+// the commands that read a whole table more than once or read two of them.
+// 'scan' may split the work over threads; records it doesn't fold go to
+// 'fn'.
+static int scan_table_where(const char* db_path, const char* table_name,
+                            const ScanFilter* scan, RecordCallback fn, void* ctx) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        LsmSnapshot snap;
+        if (lsm_open_or_fail(db_path, table_name, &snap) != 0) return 1;
+        int ret = lsm_scan_where(&snap, scan, fn, ctx);
+        lsm_snapshot_close(&snap);
+        return ret == 0 ? 0 : 1;
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (open_paged_or_fail(db_path, table_name, &pt) != 0) return 1;
+        int ret = paged_scan_where(&pt, scan, fn, ctx);
+        paged_close(&pt);
+        return ret == 0 ? 0 : 1;
+    }
+    return json_table_scan(db_path, table_name, NULL, scan, fn, ctx) == 0 ? 0 : 1;
+}
+
+static int scan_table(const char* db_path, const char* table_name, RecordCallback fn,
+                      void* ctx) {
+    ScanFilter all = { .threads = 1 };
+    return scan_table_where(db_path, table_name, &all, fn, ctx);
+}
+
+static int command_export_csv(const char* db_path, const char* table_name) {
+    CsvExport e;
+    memset(&e, 0, sizeof(e));
+    if (idmap_init(&e.columns, 64) != 0) return 1;
+
+    e.spool = tmpfile();
+    int ret = e.spool ? scan_table(db_path, table_name, collect_columns_callback, &e) : 1;
+    if (ret == 0) {
+        e.values = calloc(e.count + 1, sizeof(char*));
+        e.lengths = calloc(e.count + 1, sizeof(size_t));
+        ret = e.values && e.lengths ? 0 : 1;
+    }
+    for (size_t i = 0; i < e.count && ret == 0; i++) {
+        if (i > 0) ret = text_append(&e.row, ",", 1);
+        if (ret == 0) ret = text_append_csv_field(&e.row, e.names[i], strlen(e.names[i]), false);
+    }
+    if (ret == 0 && e.count > 0) {
+        printf("%s\n", e.row.data);
+        rewind(e.spool);
+        TextBuffer record = { NULL, 0, 0 };
+        size_t len;
+        while (ret == 0 && fread(&len, sizeof(len), 1, e.spool) == 1) {
+            record.len = 0;
+            ret = text_reserve(&record, len);
+            if (ret == 0 && fread(record.data, 1, len, e.spool) != len) ret = 1;
+            if (ret == 0) ret = print_csv_row_callback(record.data, len, 0, &e);
+        }
+        if (ret == 0 && ferror(e.spool)) ret = 1;
+        free(record.data);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not export table %s\n", table_name);
+    }
+
+    if (e.spool) fclose(e.spool);
+    for (size_t i = 0; i < e.count; i++) free(e.names[i]);
+    free(e.names);
+    free(e.values);
+    free(e.lengths);
+    free(e.key.data);
+    free(e.row.data);
+    free(e.value.data);
+    idmap_free(&e.columns);
+    return ret == 0 ? 0 : 1;
+}
+
+static int command_export(const char* db_path, const char* table_name, const char* format) {
+    if (strcmp(format, "csv") == 0) return command_export_csv(db_path, table_name);
+    if (strcmp(format, "json") != 0) {
+        fprintf(stderr, "Error: Unknown export format '%s'. Use json or csv.\n", format);
+        return 1;
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (open_paged_or_fail(db_path, table_name, &pt) != 0) return 1;
+        ExportState state = { true };
+        putchar('[');
+        int ret = paged_scan(&pt, export_record_callback, &state);
+        printf("]\n");
+        paged_close(&pt);
+        return ret == 0 ? 0 : 1;
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        LsmSnapshot snap;
+        if (lsm_open_or_fail(db_path, table_name, &snap) != 0) return 1;
+        ExportState state = { true };
+        putchar('[');
+        int ret = lsm_scan(&snap, 0, UINT64_MAX, export_record_callback, &state);
+        printf("]\n");
+        lsm_snapshot_close(&snap);
+        return ret == 0 ? 0 : 1;
+    }
+
+    cJSON* root = load_table(db_path, table_name);
+    char* text = root ? json_print(root) : NULL;
+    if (!text) {
+        fprintf(stderr, "Error: Could not load or parse table %s\n", table_name);
+        cJSON_Delete(root);
+        return 1;
+    }
+    printf("%s\n", text);
+    cJSON_free(text);
+    cJSON_Delete(root);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * join <left> <right> <left>.<field>=<right>.<field> [--memory <SIZE>]
+ * Print one JSON line per pair of records whose fields are equal: the left
+ * record's fields, then the right one's (a right field whose name the left
+ * record already has comes out as "<right>.<field>"). Values are compared
+ * as text, so "7" matches 7; records without the field, or with null in it,
+ * match nothing.
+ *
+ * The smaller table (by file size) is loaded into a hash table and the
+ * other one streamed past it, in its own order. When the loaded side grows
+ * past the memory budget (64M unless --memory says otherwise), both tables
+ * are split by a hash of the join value into JOIN_PARTITIONS files in the
+ * database directory and joined one pair of files at a time (a grace hash
+ * join); a pair still too big is split again, up to JOIN_MAX_DEPTH times.
+ * The output then comes partition by partition.
+ * -------------------------------------------------------------------------- */
+#define JOIN_DEFAULT_MEMORY (64 * 1024 * 1024)
+#define JOIN_PARTITIONS     16
+#define JOIN_MAX_DEPTH      3
+
+typedef struct {
+    uint64_t hash;
+    size_t key;                 // offsets into the arena
+    size_t record;
+    uint32_t key_len;
+    uint32_t record_len;
+    uint32_t next;              // next entry in the bucket + 1, 0 ends
+} JoinEntry;
+
+typedef struct {
+    TextBuffer arena;
+    JoinEntry* entries;
+    size_t count;
+    size_t capacity;
+    uint32_t* buckets;          // first entry + 1, 0 for an empty bucket
+    size_t bucket_count;
+} JoinTable;
+
+static size_t join_table_bytes(const JoinTable* t) {
+    return t->arena.len + t->count * sizeof(JoinEntry) + t->bucket_count * sizeof(uint32_t);
+}
+
+static void join_table_reset(JoinTable* t) {
+    t->arena.len = 0;
+    t->count = 0;
+    free(t->buckets);
+    t->buckets = NULL;
+    t->bucket_count = 0;
+}
+
+static int join_table_add(JoinTable* t, uint64_t hash, const char* key, size_t key_len,
+                          const char* record, size_t record_len) {
+    if (t->count == t->capacity) {
+        size_t capacity = t->capacity ? t->capacity * 2 : 1024;
+        JoinEntry* grown = realloc(t->entries, capacity * sizeof(JoinEntry));
+        if (!grown) return -1;
+        t->entries = grown;
+        t->capacity = capacity;
+    }
+    JoinEntry* e = &t->entries[t->count];
+    e->hash = hash;
+    e->key = t->arena.len;
+    e->key_len = (uint32_t)key_len;
+    if (text_append(&t->arena, key, key_len) != 0) return -1;
+    e->record = t->arena.len;
+    e->record_len = (uint32_t)record_len;
+    if (text_append(&t->arena, record, record_len) != 0) return -1;
+    t->count++;
+    return 0;
+}
+
+// Chain the entries into buckets, keeping equal keys in the order added.
+static int join_table_index(JoinTable* t) {
+    t->bucket_count = 64;
+    while (t->bucket_count < t->count) t->bucket_count <<= 1;
+    t->buckets = calloc(t->bucket_count, sizeof(uint32_t));
+    if (!t->buckets) return -1;
+    for (size_t i = t->count; i-- > 0;) {
+        uint32_t* head = &t->buckets[t->entries[i].hash & (t->bucket_count - 1)];
+        t->entries[i].next = *head;
+        *head = (uint32_t)(i + 1);
+    }
+    return 0;
+}
+
+// The partition files of both sides, split at 'depth' (0 for the tables).
+typedef struct {
+    FILE* files[2][JOIN_PARTITIONS];
+    int depth;
+} JoinSpill;
+
+typedef struct {
+    const char* db_path;
+    const char* names[2];       // left and right table
+    const char* fields[2];
+    int build;                  // the side in the hash table: 0 left, 1 right
+    size_t budget;
+    JoinTable table;
+    JoinSpill tables;           // the tables split up, once they don't fit
+    JoinSpill* spill;           // the split being written, NULL while they fit
+    TextBuffer key;             // the current record's join value
+    TextBuffer member;          // scratch for record_members()
+    TextBuffer out;             // the merged record
+    TextBuffer name;            // scratch for a renamed right field
+    TextBuffer left_names;      // the left record's field names, NUL-separated
+} Join;
+
+// Which partition a value goes to when the input is split at 'depth'; each
+// depth looks at different bits of the hash.
+static int join_partition_of(uint64_t hash, int depth) {
+    uint64_t x = hash + (uint64_t)depth * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return (int)((x ^ (x >> 31)) % JOIN_PARTITIONS);
+}
+
+typedef struct {
+    const char* field;
+    const char* value;
+    size_t len;
+} MemberLookup;
+
+static int lookup_member_callback(const char* key, const char* value, size_t value_len,
+                                  void* ctx) {
+    MemberLookup* lookup = (MemberLookup*)ctx;
+    if (strcmp(key, lookup->field) != 0) return 0;
+    lookup->value = value;
+    lookup->len = value_len;
+    return 1;
+}
+
+// The join value of a record in j->key: a string's contents, other values
+// as their JSON text. False if the record has no such field or null in it.
+static bool join_key(Join* j, int side, const char* data, size_t len) {
+    MemberLookup lookup = { j->fields[side], NULL, 0 };
+    record_members(data, len, &j->member, lookup_member_callback, &lookup);
+    if (!lookup.value || (lookup.len == 4 && memcmp(lookup.value, "null", 4) == 0)) {
+        return false;
+    }
+    j->key.len = 0;
+    if (lookup.value[0] == '"' && lookup.len >= 2) {
+        return text_append_json_unescaped(&j->key, lookup.value + 1, lookup.len - 2) == 0;
+    }
+    return text_append(&j->key, lookup.value, lookup.len) == 0;
+}
+
+/* ---- Output ------------------------------------------------------------ */
+static int note_left_member_callback(const char* key, const char* value, size_t value_len,
+                                     void* ctx) {
+    Join* j = (Join*)ctx;
+    int ret = text_append(&j->out, j->out.len > 1 ? "," : "", j->out.len > 1);
+    if (ret == 0) ret = text_append_json_string(&j->out, key, strlen(key));
+    if (ret == 0) ret = text_append(&j->out, ":", 1);
+    if (ret == 0) ret = text_append(&j->out, value, value_len);
+    if (ret == 0) ret = text_append(&j->left_names, key, strlen(key) + 1);
+    return ret;
+}
+
+static bool join_left_has(const Join* j, const char* key) {
+    for (size_t i = 0; i < j->left_names.len; i += strlen(j->left_names.data + i) + 1) {
+        if (strcmp(j->left_names.data + i, key) == 0) return true;
+    }
+    return false;
+}
+
+static int add_right_member_callback(const char* key, const char* value, size_t value_len,
+                                     void* ctx) {
+    Join* j = (Join*)ctx;
+    int ret = text_append(&j->out, j->out.len > 1 ? "," : "", j->out.len > 1);
+    if (ret == 0 && join_left_has(j, key)) {
+        j->name.len = 0;
+        ret = text_append(&j->name, j->names[1], strlen(j->names[1]));
+        if (ret == 0) ret = text_append(&j->name, ".", 1);
+        if (ret == 0) ret = text_append(&j->name, key, strlen(key));
+        if (ret == 0) ret = text_append_json_string(&j->out, j->name.data, j->name.len);
+    } else if (ret == 0) {
+        ret = text_append_json_string(&j->out, key, strlen(key));
+    }
+    if (ret == 0) ret = text_append(&j->out, ":", 1);
+    if (ret == 0) ret = text_append(&j->out, value, value_len);
+    return ret;
+}
+
+static int join_emit(Join* j, const char* left, size_t left_len, const char* right,
+                     size_t right_len) {
+    j->out.len = 0;
+    j->left_names.len = 0;
+    int ret = text_append(&j->out, "{", 1);
+    if (ret == 0 && record_members(left, left_len, &j->member, note_left_member_callback, j) != 0) {
+        ret = -1;
+    }
+    if (ret == 0 &&
+        record_members(right, right_len, &j->member, add_right_member_callback, j) != 0) {
+        ret = -1;
+    }
+    if (ret == 0) ret = text_append(&j->out, "}\n", 2);
+    if (ret == 0) fwrite(j->out.data, 1, j->out.len, stdout);
+    return ret;
+}
+
+// Stream one record of the probe side past the hash table.
+static int join_probe(Join* j, const char* data, size_t len, uint64_t hash) {
+    JoinTable* t = &j->table;
+    if (t->bucket_count == 0) return 0;
+    for (uint32_t n = t->buckets[hash & (t->bucket_count - 1)]; n != 0; n = t->entries[n - 1].next) {
+        const JoinEntry* e = &t->entries[n - 1];
+        if (e->hash != hash || e->key_len != j->key.len ||
+            memcmp(t->arena.data + e->key, j->key.data, j->key.len) != 0) {
+            continue;
+        }
+        const char* match = t->arena.data + e->record;
+        int ret = j->build == 0 ? join_emit(j, match, e->record_len, data, len)
+                                : join_emit(j, data, len, match, e->record_len);
+        if (ret != 0) return -1;
+    }
+    return 0;
+}
+
+/* ---- Partitions ---------------------------------------------------------
+ * A partition file holds, per record, a u32 value length, a u32 record
+ * length, the value and the record. The files are unlinked as soon as they
+ * are created, so nothing is left behind if the join stops early. */
+static FILE* join_spill_file(const char* db_path) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/.join-XXXXXX", db_path);
+    int fd = mkstemp(path);
+    if (fd < 0) return NULL;
+    unlink(path);
+    FILE* f = fdopen(fd, "w+");
+    if (!f) close(fd);
+    return f;
+}
+
+static int join_spill_write(FILE* f, const char* key, size_t key_len, const char* record,
+                            size_t record_len) {
+    uint32_t lengths[2] = { (uint32_t)key_len, (uint32_t)record_len };
+    if (fwrite(lengths, sizeof(lengths), 1, f) != 1 ||
+        fwrite(key, 1, key_len, f) != key_len ||
+        fwrite(record, 1, record_len, f) != record_len) {
+        return -1;
+    }
+    return 0;
+}
+
+typedef int (*JoinSpillCallback)(Join* j, const char* key, size_t key_len,
+                                 const char* record, size_t record_len);
+
+static int join_spill_read(Join* j, FILE* f, JoinSpillCallback fn) {
+    if (fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0) return -1;
+    TextBuffer buf = { NULL, 0, 0 };     // stays empty; only its room is used
+    uint32_t lengths[2];
+    int ret = 0;
+    while (ret == 0 && fread(lengths, sizeof(lengths), 1, f) == 1) {
+        size_t total = (size_t)lengths[0] + lengths[1];
+        if (text_reserve(&buf, total) != 0) {
+            ret = -1;
+            break;
+        }
+        if (fread(buf.data, 1, total, f) != total) {
+            ret = -1;
+            break;
+        }
+        ret = fn(j, buf.data, lengths[0], buf.data + lengths[0], lengths[1]);
+    }
+    free(buf.data);
+    return ret;
+}
+
+static void join_spill_close(JoinSpill* spill) {
+    for (int side = 0; side < 2; side++) {
+        for (int p = 0; p < JOIN_PARTITIONS; p++) {
+            if (spill->files[side][p]) fclose(spill->files[side][p]);
+            spill->files[side][p] = NULL;
+        }
+    }
+}
+
+static int join_partition_write(Join* j, int side, const char* key, size_t key_len,
+                                const char* record, size_t record_len) {
+    int p = join_partition_of(hash_bytes(key, key_len), j->spill->depth);
+    FILE** f = &j->spill->files[side][p];
+    if (!*f && !(*f = join_spill_file(j->db_path))) return -1;
+    return join_spill_write(*f, key, key_len, record, record_len);
+}
+
+// The hash table is full: from here on, both sides go to partitions.
+static int join_spill(Join* j) {
+    JoinTable* t = &j->table;
+    j->spill = &j->tables;
+    int ret = 0;
+    for (size_t i = 0; i < t->count && ret == 0; i++) {
+        const JoinEntry* e = &t->entries[i];
+        ret = join_partition_write(j, j->build, t->arena.data + e->key, e->key_len,
+                                   t->arena.data + e->record, e->record_len);
+    }
+    join_table_reset(t);
+    return ret;
+}
+
+static int build_from_spill_callback(Join* j, const char* key, size_t key_len,
+                                     const char* record, size_t record_len) {
+    return join_table_add(&j->table, hash_bytes(key, key_len), key, key_len, record, record_len);
+}
+
+static int probe_from_spill_callback(Join* j, const char* key, size_t key_len,
+                                     const char* record, size_t record_len) {
+    j->key.len = 0;
+    if (text_append(&j->key, key, key_len) != 0) return -1;
+    return join_probe(j, record, record_len, hash_bytes(key, key_len));
+}
+
+static int build_to_partition_callback(Join* j, const char* key, size_t key_len,
+                                       const char* record, size_t record_len) {
+    return join_partition_write(j, j->build, key, key_len, record, record_len);
+}
+
+static int probe_to_partition_callback(Join* j, const char* key, size_t key_len,
+                                       const char* record, size_t record_len) {
+    return join_partition_write(j, !j->build, key, key_len, record, record_len);
+}
+
+static int join_partitions(Join* j);
+
+// Join one pair of partition files, splitting them again if the build
+// side still doesn't fit.
+static int join_partition_pair(Join* j, FILE* build, FILE* probe) {
+    join_table_reset(&j->table);
+    if (!build || !probe) return 0;
+    int ret = join_spill_read(j, build, build_from_spill_callback);
+    if (ret != 0) return ret;
+
+    if (join_table_bytes(&j->table) > j->budget && j->spill->depth < JOIN_MAX_DEPTH) {
+        join_table_reset(&j->table);
+        JoinSpill* parent = j->spill;
+        JoinSpill split;
+        memset(&split, 0, sizeof(split));
+        split.depth = parent->depth + 1;
+        j->spill = &split;
+        ret = join_spill_read(j, build, build_to_partition_callback);
+        if (ret == 0) ret = join_spill_read(j, probe, probe_to_partition_callback);
+        if (ret == 0) ret = join_partitions(j);
+        join_spill_close(&split);
+        j->spill = parent;
+        return ret;
+    }
+    ret = join_table_index(&j->table);
+    if (ret == 0) ret = join_spill_read(j, probe, probe_from_spill_callback);
+    return ret;
+}
+
+static int join_partitions(Join* j) {
+    int ret = 0;
+    for (int p = 0; p < JOIN_PARTITIONS && ret == 0; p++) {
+        ret = join_partition_pair(j, j->spill->files[j->build][p],
+                                  j->spill->files[!j->build][p]);
+        // Done with this pair; free its disk space now
+        for (int side = 0; side < 2; side++) {
+            if (j->spill->files[side][p]) fclose(j->spill->files[side][p]);
+            j->spill->files[side][p] = NULL;
+        }
+    }
+    return ret;
+}
+
+/* ---- The two table scans ----------------------------------------------- */
+static int join_build_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    Join* j = (Join*)ctx;
+    if (!join_key(j, j->build, data, len)) return 0;
+    if (j->spill) {
+        return join_partition_write(j, j->build, j->key.data, j->key.len, data, len);
+    }
+    if (join_table_add(&j->table, hash_bytes(j->key.data, j->key.len), j->key.data,
+                       j->key.len, data, len) != 0) {
+        return -1;
+    }
+    return join_table_bytes(&j->table) > j->budget ? join_spill(j) : 0;
+}
+
+static int join_probe_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    Join* j = (Join*)ctx;
+    int probe = !j->build;
+    if (!join_key(j, probe, data, len)) return 0;
+    if (j->spill) {
+        return join_partition_write(j, probe, j->key.data, j->key.len, data, len);
+    }
+    return join_probe(j, data, len, hash_bytes(j->key.data, j->key.len));
+}
+
+// The size of a table's file, to pick the smaller side for the hash table.
+static off_t table_file_size(const char* db_path, const char* table_name) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        return lsm_table_size(db_path, table_name);
+    }
+    char path[1024];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s.%s", db_path, table_name,
+             table_format(db_path, table_name) == TABLE_FORMAT_PAGED ? "db" : "json");
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+// Parse <left>.<field>=<right>.<field> (either way round) into j->fields.
+static bool parse_join_condition(Join* j, char* condition) {
+    char* eq = strchr(condition, '=');
+    if (!eq) return false;
+    *eq = '\0';
+    char* sides[2] = { condition, eq + 1 };
+    for (int s = 0; s < 2; s++) {
+        // Each side names one table; its own first, so a table can be
+        // joined with itself
+        int table = -1;
+        for (int k = 0; k < 2 && table < 0; k++) {
+            int t = k == 0 ? s : !s;
+            size_t n = strlen(j->names[t]);
+            if (!j->fields[t] && strncmp(sides[s], j->names[t], n) == 0 &&
+                sides[s][n] == '.' && sides[s][n + 1] != '\0') {
+                table = t;
+            }
+        }
+        if (table < 0) return false;
+        j->fields[table] = sides[s] + strlen(j->names[table]) + 1;
+    }
+    return true;
+}
+
+// A size in bytes, with an optional K, M or G suffix.
+static bool parse_memory_size(const char* text, size_t* size) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long val = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || val == 0) return false;
+    int shift = 0;
+    switch (*end) {
+    case 'K': case 'k': shift = 10; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'G': case 'g': shift = 30; end++; break;
+    }
+    if (*end != '\0' || val > (SIZE_MAX >> shift)) return false;
+    *size = (size_t)val << shift;
+    return true;
+}
+
+static int command_join(const char* db_path, const char* left, const char* right,
+                        char* condition, size_t budget) {
+    Join j;
+    memset(&j, 0, sizeof(j));
+    j.db_path = db_path;
+    j.names[0] = left;
+    j.names[1] = right;
+    j.budget = budget;
+    if (!parse_join_condition(&j, condition)) {
+        fprintf(stderr, "Error: Invalid join condition. Use %s.<field>=%s.<field>.\n",
+                left, right);
+        return 1;
+    }
+    j.build = table_file_size(db_path, right) < table_file_size(db_path, left) ? 1 : 0;
+
+    int ret = scan_table(db_path, j.names[j.build], join_build_callback, &j);
+    if (ret == 0 && !j.spill) ret = join_table_index(&j.table) == 0 ? 0 : 1;
+    if (ret == 0) ret = scan_table(db_path, j.names[!j.build], join_probe_callback, &j);
+    if (ret == 0 && j.spill) ret = join_partitions(&j) == 0 ? 0 : 1;
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not join %s and %s\n", left, right);
+    }
+
+    join_spill_close(&j.tables);
+    free(j.table.arena.data);
+    free(j.table.entries);
+    free(j.table.buckets);
+    free(j.key.data);
+    free(j.member.data);
+    free(j.out.data);
+    free(j.name.data);
+    free(j.left_names.data);
+    return ret == 0 ? 0 : 1;
+}
+
+/* --------------------------------------------------------------------------
+ * agg <table> [--group-by <field>] [--count] [--sum|--min|--max <field>]...
+ * Aggregate a table in one pass and print one JSON line per group (one
+ * line in all without --group-by), e.g.
+ *     {"user_id":"100","count":2,"sum(price)":17.5}
+ * Numbers may be stored as JSON numbers or as the numeric strings 'save'
+ * writes ("15.00"); other values are left out of sums, minimums and
+ * maximums, which are null for a group without any numbers.
+ *
+ * Each thread of --threads folds its share of the records into a hash table
+ * of its own; the tables are merged at the end. A table with a columnar
+ * snapshot is aggregated from the columns of the fields named only. Groups
+ * are printed in the order of their values, numerically where both are
+ * numbers.
+ * -------------------------------------------------------------------------- */
+#define MAX_AGG_COLUMNS   16
+#define AGG_INITIAL_SLOTS 4096
+
+typedef enum {
+    AGG_COUNT,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX
+} AggOp;
+
+typedef struct {
+    AggOp op;
+    const char* field;
+    int input;                  // index of the field in Aggregation.fields
+} AggColumn;
+
+typedef struct {
+    double value;
+    uint64_t numbers;           // how many numeric values went into 'value'
+} AggCell;
+
+typedef struct {
+    uint64_t hash;
+    size_t key;                 // offset of the group's value in the arena
+    uint32_t key_len;
+    uint64_t count;
+    AggCell* cells;
+} AggGroup;
+
+typedef struct Aggregation Aggregation;
+
+typedef struct {
+    const Aggregation* agg;
+    TextBuffer arena;
+    AggGroup* groups;
+    size_t count;
+    size_t capacity;
+    uint32_t* slots;            // group + 1, 0 for a free slot
+    size_t slot_count;          // a power of two, at least twice 'count'
+    TextBuffer member;          // scratch for record_members()
+    TextBuffer key;             // scratch for the current group value
+    const char* values[MAX_AGG_COLUMNS + 1];
+    size_t lengths[MAX_AGG_COLUMNS + 1];
+    int error;
+} AggPartial;
+
+struct Aggregation {
+    const char* group_by;       // NULL: one group
+    AggColumn columns[MAX_AGG_COLUMNS];
+    int column_count;
+    const char* fields[MAX_AGG_COLUMNS + 1];    // the fields read, group first
+    int field_count;
+    AggPartial* partials;       // one per thread
+};
+
+static int agg_partial_init(AggPartial* p, const Aggregation* a, size_t slots) {
+    memset(p, 0, sizeof(*p));
+    p->agg = a;
+    p->slot_count = slots;
+    p->slots = calloc(slots, sizeof(uint32_t));
+    return p->slots ? 0 : -1;
+}
+
+static void agg_partial_free(AggPartial* p) {
+    for (size_t i = 0; i < p->count; i++) free(p->groups[i].cells);
+    free(p->groups);
+    free(p->slots);
+    free(p->arena.data);
+    free(p->member.data);
+    free(p->key.data);
+}
+
+static int agg_grow_slots(AggPartial* p) {
+    size_t slot_count = p->slot_count * 2;
+    uint32_t* slots = calloc(slot_count, sizeof(uint32_t));
+    if (!slots) return -1;
+    for (size_t i = 0; i < p->count; i++) {
+        size_t s = p->groups[i].hash & (slot_count - 1);
+        while (slots[s]) s = (s + 1) & (slot_count - 1);
+        slots[s] = (uint32_t)(i + 1);
+    }
+    free(p->slots);
+    p->slots = slots;
+    p->slot_count = slot_count;
+    return 0;
+}
+
+// The group for 'key', added with empty cells if it is new.
+static AggGroup* agg_group(AggPartial* p, const Aggregation* a, const char* key, size_t len,
+                           uint64_t hash) {
+    size_t s = hash & (p->slot_count - 1);
+    for (; p->slots[s]; s = (s + 1) & (p->slot_count - 1)) {
+        AggGroup* g = &p->groups[p->slots[s] - 1];
+        if (g->hash == hash && g->key_len == len && memcmp(p->arena.data + g->key, key, len) == 0) {
+            return g;
+        }
+    }
+    if ((p->count + 1) * 2 > p->slot_count) {
+        if (agg_grow_slots(p) != 0) return NULL;
+        return agg_group(p, a, key, len, hash);
+    }
+    if (p->count == p->capacity) {
+        size_t capacity = p->capacity ? p->capacity * 2 : 256;
+        AggGroup* grown = realloc(p->groups, capacity * sizeof(AggGroup));
+        if (!grown) return NULL;
+        p->groups = grown;
+        p->capacity = capacity;
+    }
+    AggGroup* g = &p->groups[p->count];
+    g->hash = hash;
+    g->key = p->arena.len;
+    g->key_len = (uint32_t)len;
+    g->count = 0;
+    g->cells = calloc((size_t)a->column_count + 1, sizeof(AggCell));
+    if (!g->cells || text_append(&p->arena, key, len) != 0) {
+        free(g->cells);
+        return NULL;
+    }
+    p->slots[s] = (uint32_t)(++p->count);
+    return g;
+}
+
+// A JSON number, or a string holding one ("15.00"), as a double.
+static bool parse_number_value(const char* value, size_t len, double* out) {
+    if (len >= 2 && value[0] == '"') {
+        value++;
+        len -= 2;
+    }
+    char buffer[64];
+    if (len == 0 || len >= sizeof(buffer)) return false;
+    memcpy(buffer, value, len);
+    buffer[len] = '\0';
+    // strtod also takes hex, "inf" and "nan", which aren't numbers here
+    if (strspn(buffer, "0123456789+-.eE") != len) return false;
+    char* end = NULL;
+    errno = 0;
+    *out = strtod(buffer, &end);
+    return *end == '\0' && errno == 0;
+}
+
+static int agg_member_callback(const char* key, const char* value, size_t value_len,
+                               void* ctx) {
+    AggPartial* p = (AggPartial*)ctx;
+    const Aggregation* a = p->agg;
+    for (int i = 0; i < a->field_count; i++) {
+        if (!p->values[i] && strcmp(a->fields[i], key) == 0) {
+            p->values[i] = value;
+            p->lengths[i] = value_len;
+        }
+    }
+    return 0;
+}
+
+// Fold one record, given as the values of a->fields in p->values (NULL
+// where the record lacks the field).
+static int agg_add_values(const Aggregation* a, AggPartial* p) {
+    // The group's value as JSON text, spelled so equal strings land in one
+    // group
+    const char* key = "null";
+    size_t key_len = 4;
+    if (a->group_by && p->values[0]) {
+        key = p->values[0];
+        key_len = p->lengths[0];
+        if (json_value_canonical(&key, &key_len, &p->member, &p->key) != 0) return -1;
+    }
+    AggGroup* g = agg_group(p, a, key, key_len, hash_bytes(key, key_len));
+    if (!g) return -1;
+    g->count++;
+    for (int i = 0; i < a->column_count; i++) {
+        const AggColumn* c = &a->columns[i];
+        double x;
+        if (c->op == AGG_COUNT || !p->values[c->input] ||
+            !parse_number_value(p->values[c->input], p->lengths[c->input], &x)) {
+            continue;
+        }
+        AggCell* cell = &g->cells[i];
+        if (cell->numbers == 0) {
+            cell->value = x;
+        } else if (c->op == AGG_SUM) {
+            cell->value += x;
+        } else if (c->op == AGG_MIN ? x < cell->value : x > cell->value) {
+            cell->value = x;
+        }
+        cell->numbers++;
+    }
+    return 0;
+}
+
+static int agg_add_record(const Aggregation* a, AggPartial* p, const char* data, size_t len) {
+    memset(p->values, 0, sizeof(p->values));
+    if (record_members(data, len, &p->member, agg_member_callback, p) < 0) return 0;
+    return agg_add_values(a, p);
+}
+
+static int agg_fold(const char* data, size_t len, int worker, void* ctx) {
+    Aggregation* a = (Aggregation*)ctx;
+    return agg_add_record(a, &a->partials[worker], data, len);
+}
+
+static int agg_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    return agg_fold(data, len, 0, ctx);
+}
+
+// Fold the groups of 'from' into 'into'.
+static int agg_merge(const Aggregation* a, AggPartial* into, const AggPartial* from) {
+    for (size_t i = 0; i < from->count; i++) {
+        const AggGroup* src = &from->groups[i];
+        AggGroup* g = agg_group(into, a, from->arena.data + src->key, src->key_len, src->hash);
+        if (!g) return -1;
+        g->count += src->count;
+        for (int c = 0; c < a->column_count; c++) {
+            const AggCell* x = &src->cells[c];
+            AggCell* cell = &g->cells[c];
+            if (x->numbers == 0) continue;
+            if (cell->numbers == 0) {
+                cell->value = x->value;
+            } else if (a->columns[c].op == AGG_SUM) {
+                cell->value += x->value;
+            } else if (a->columns[c].op == AGG_MIN ? x->value < cell->value
+                                                    : x->value > cell->value) {
+                cell->value = x->value;
+            }
+            cell->numbers += x->numbers;
+        }
+    }
+    return 0;
+}
+
+static int compare_groups(const void* x, const void* y, void* ctx) {
+    const AggPartial* p = (const AggPartial*)ctx;
+    const AggGroup* g = *(const AggGroup* const*)x;
+    const AggGroup* h = *(const AggGroup* const*)y;
+    const char* a = p->arena.data + g->key;
+    const char* b = p->arena.data + h->key;
+    double u, v;
+    if (parse_number_value(a, g->key_len, &u) && parse_number_value(b, h->key_len, &v) &&
+        u != v) {
+        return u < v ? -1 : 1;
+    }
+    size_t n = g->key_len < h->key_len ? g->key_len : h->key_len;
+    int cmp = memcmp(a, b, n);
+    return cmp ? cmp : (g->key_len > h->key_len) - (g->key_len < h->key_len);
+}
+
+static int agg_print(const Aggregation* a, const AggPartial* p) {
+    AggGroup** order = malloc((p->count + 1) * sizeof(AggGroup*));
+    if (!order) return -1;
+    for (size_t i = 0; i < p->count; i++) order[i] = &p->groups[i];
+    qsort_r(order, p->count, sizeof(AggGroup*), compare_groups, (void*)p);
+
+    TextBuffer line = { NULL, 0, 0 };
+    int ret = 0;
+    for (size_t i = 0; i < p->count && ret == 0; i++) {
+        const AggGroup* g = order[i];
+        line.len = 0;
+        ret = text_append(&line, "{", 1);
+        if (ret == 0 && a->group_by) {
+            ret = text_append_json_string(&line, a->group_by, strlen(a->group_by));
+            if (ret == 0) ret = text_append(&line, ":", 1);
+            if (ret == 0) ret = text_append(&line, p->arena.data + g->key, g->key_len);
+        }
+        for (int c = 0; c < a->column_count && ret == 0; c++) {
+            static const char* const names[] = { "count", "sum", "min", "max" };
+            const AggColumn* col = &a->columns[c];
+            char name[300], number[64];
+            if (col->op == AGG_COUNT) {
+                snprintf(name, sizeof(name), "count");
+                snprintf(number, sizeof(number), "%llu", (unsigned long long)g->count);
+            } else {
+                snprintf(name, sizeof(name), "%s(%s)", names[col->op], col->field);
+                if (g->cells[c].numbers == 0 && col->op != AGG_SUM) {
+                    strcpy(number, "null");
+                } else {
+                    snprintf(number, sizeof(number), "%.15g", g->cells[c].value);
+                }
+            }
+            if (line.len > 1) ret = text_append(&line, ",", 1);
+            if (ret == 0) ret = text_append_json_string(&line, name, strlen(name));
+            if (ret == 0) ret = text_append(&line, ":", 1);
+            if (ret == 0) ret = text_append(&line, number, strlen(number));
+        }
+        if (ret == 0) ret = text_append(&line, "}\n", 2);
+        if (ret == 0) fwrite(line.data, 1, line.len, stdout);
+    }
+    free(line.data);
+    free(order);
+    return ret;
+}
+
+// Aggregate through the table's columnar snapshot, reading only the
+// columns of a->fields; each thread folds a range of rows into its own
+// partial. Returns 1 if the table has no fresh snapshot.
+typedef struct {
+    const Aggregation* agg;
+    const Column* columns;
+    AggPartial* partial;
+    uint64_t begin;
+    uint64_t end;
+    int error;
+    pthread_t thread;
+    bool started;
+} AggColumnarWorker;
+
+static void* agg_columnar_main(void* arg) {
+    AggColumnarWorker* w = (AggColumnarWorker*)arg;
+    const Aggregation* a = w->agg;
+    AggPartial* p = w->partial;
+    for (uint64_t row = w->begin; row < w->end && w->error == 0; row++) {
+        for (int i = 0; i < a->field_count; i++) {
+            if (!column_value(&w->columns[i], row, &p->values[i], &p->lengths[i])) {
+                p->values[i] = NULL;
+            }
+        }
+        w->error = agg_add_values(a, p);
+    }
+    return NULL;
+}
+
+static int agg_columnar(const char* db_path, const char* table_name, Aggregation* a,
+                        int threads) {
+    ColumnSnapshot cs;
+    if (column_snapshot_open(db_path, table_name, &cs) != 0) return 1;
+    Column columns[MAX_AGG_COLUMNS + 1];
+    memset(columns, 0, sizeof(columns));
+    int ret = 0;
+    for (int i = 0; i < a->field_count && ret == 0; i++) {
+        if (a->fields[i][0] == '\0') continue;     // no --group-by
+        if (column_snapshot_column(db_path, table_name, &cs, a->fields[i], &columns[i]) != 0) {
+            ret = 1;
+        }
+    }
+
+    AggColumnarWorker* workers = ret == 0 ? calloc((size_t)threads, sizeof(*workers)) : NULL;
+    if (ret == 0 && !workers) ret = -1;
+    for (int i = 0; ret == 0 && i < threads; i++) {
+        uint64_t rows = cs.header->row_count;
+        workers[i].agg = a;
+        workers[i].columns = columns;
+        workers[i].partial = &a->partials[i];
+        workers[i].begin = rows * (uint64_t)i / (uint64_t)threads;
+        workers[i].end = rows * (uint64_t)(i + 1) / (uint64_t)threads;
+        if (i > 0) {
+            workers[i].started = pthread_create(&workers[i].thread, NULL, agg_columnar_main,
+                                                &workers[i]) == 0;
+        }
+    }
+    if (ret == 0) {
+        agg_columnar_main(&workers[0]);
+        for (int i = 1; i < threads; i++) {
+            if (workers[i].started) pthread_join(workers[i].thread, NULL);
+            else agg_columnar_main(&workers[i]);
+        }
+        for (int i = 0; i < threads; i++) {
+            if (workers[i].error) ret = -1;
+        }
+    }
+
+    free(workers);
+    for (int i = 0; i < a->field_count; i++) column_close(&columns[i]);
+    column_snapshot_close(&cs);
+    return ret;
+}
+
+static int command_agg(const char* db_path, const char* table_name, int argc, char** argv,
+                       int threads) {
+    Aggregation a;
+    memset(&a, 0, sizeof(a));
+    a.field_count = 1;          // fields[0] is the group-by field
+    for (int i = 0; i < argc; i++) {
+        AggOp op;
+        if (strcmp(argv[i], "--count") == 0) {
+            op = AGG_COUNT;
+        } else if (strcmp(argv[i], "--sum") == 0) {
+            op = AGG_SUM;
+        } else if (strcmp(argv[i], "--min") == 0) {
+            op = AGG_MIN;
+        } else if (strcmp(argv[i], "--max") == 0) {
+            op = AGG_MAX;
+        } else if (strcmp(argv[i], "--group-by") == 0 && i + 1 < argc && !a.group_by) {
+            a.group_by = argv[++i];
+            a.fields[0] = a.group_by;
+            continue;
+        } else {
+            fprintf(stderr, "Error: Invalid agg argument '%s'\n", argv[i]);
+            return 1;
+        }
+        if (a.column_count == MAX_AGG_COLUMNS || (op != AGG_COUNT && i + 1 == argc)) {
+            fprintf(stderr, "Error: Invalid agg argument '%s'\n", argv[i]);
+            return 1;
+        }
+        AggColumn* c = &a.columns[a.column_count++];
+        c->op = op;
+        if (op != AGG_COUNT) {
+            c->field = argv[++i];
+            c->input = a.field_count;
+            a.fields[a.field_count++] = c->field;
+        }
+    }
+    if (a.column_count == 0) {
+        fprintf(stderr, "Error: agg needs at least one of --count, --sum, --min, --max\n");
+        return 1;
+    }
+    // Without --group-by nothing matches fields[0]
+    if (!a.group_by) a.fields[0] = "";
+
+    a.partials = calloc((size_t)threads, sizeof(AggPartial));
+    int ret = a.partials ? 0 : 1;
+    for (int i = 0; i < threads && ret == 0; i++) {
+        ret = agg_partial_init(&a.partials[i], &a, a.group_by ? AGG_INITIAL_SLOTS : 64) != 0;
+    }
+    if (ret == 0) {
+        ret = agg_columnar(db_path, table_name, &a, threads);
+        if (ret == 1) {
+            ScanFilter scan = { .threads = threads,
+                                .fold = threads > 1 ? agg_fold : NULL,
+                                .fold_ctx = &a };
+            ret = scan_table_where(db_path, table_name, &scan, agg_record_callback, &a);
+        }
+        ret = ret != 0;
+    }
+    for (int i = 1; i < threads && ret == 0; i++) {
+        ret = agg_merge(&a, &a.partials[0], &a.partials[i]) != 0;
+    }
+    // Without --group-by there is always a line, even for an empty table
+    if (ret == 0 && !a.group_by && a.partials[0].count == 0) {
+        ret = agg_group(&a.partials[0], &a, "null", 4, hash_bytes("null", 4)) ? 0 : 1;
+    }
+    if (ret == 0) ret = agg_print(&a, &a.partials[0]) != 0;
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not aggregate table %s\n", table_name);
+    }
+
+    for (int i = 0; a.partials && i < threads; i++) agg_partial_free(&a.partials[i]);
+    free(a.partials);
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * compact <table> --columnar
+ * Write the table's columnar snapshot (see "Columnar snapshots" above). A
+ * JSON table is checkpointed first, and read while the log lock keeps
+ * writers out, so the snapshot starts out current.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    uint64_t rows;              // rows filled in so far
+    uint64_t present_count;
+    uint64_t* present;
+    uint64_t* ends;             // per row, into 'data'
+    uint32_t* codes;            // per row, while 'dict' is kept
+    bool no_dict;               // too many distinct values for a dictionary
+    size_t capacity;            // rows 'present', 'ends' and 'codes' hold
+    TextBuffer data;
+    IdMap dict;                 // value -> code
+    uint64_t* dict_ends;
+    TextBuffer dict_data;
+    size_t dict_count;
+    size_t dict_capacity;
+} ColumnBuilder;
+
+typedef struct {
+    const char* db_path;
+    const char* table_name;
+    ColumnBuilder* columns;
+    int column_count;
+    IdMap fields;               // name -> column
+    TextBuffer names;
+    uint64_t* rows;
+    uint64_t row_count;
+    size_t row_capacity;
+    TextBuffer member;          // scratch for record_members()
+    TextBuffer scratch;
+    TextBuffer canonical;
+    TextBuffer dict_key;
+    FileStamp stamp;
+    int error;
+} ColumnarBuild;
+
+static void column_builder_free(ColumnBuilder* b) {
+    free(b->present);
+    free(b->ends);
+    free(b->codes);
+    free(b->data.data);
+    if (b->dict.keys) idmap_free(&b->dict);
+    free(b->dict_ends);
+    free(b->dict_data.data);
+}
+
+static int column_builder_reserve(ColumnBuilder* b, uint64_t rows) {
+    if (rows <= b->capacity) return 0;
+    size_t capacity = b->capacity ? b->capacity : 1024;
+    while (capacity < rows) capacity *= 2;
+    size_t words = column_bitmap_words(capacity), old_words = column_bitmap_words(b->capacity);
+    uint64_t* present = realloc(b->present, words * sizeof(uint64_t));
+    if (present) b->present = present;
+    uint64_t* ends = realloc(b->ends, capacity * sizeof(uint64_t));
+    if (ends) b->ends = ends;
+    if (!present || !ends) return -1;
+    memset(b->present + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    if (!b->no_dict) {
+        uint32_t* codes = realloc(b->codes, capacity * sizeof(uint32_t));
+        if (!codes) return -1;
+        b->codes = codes;
+    }
+    b->capacity = capacity;
+    return 0;
+}
+
+// Fill the rows before 'row' that don't have the field.
+static int column_builder_skip_to(ColumnBuilder* b, uint64_t row) {
+    if (column_builder_reserve(b, row) != 0) return -1;
+    for (; b->rows < row; b->rows++) {
+        b->ends[b->rows] = b->data.len;
+        if (!b->no_dict) b->codes[b->rows] = 0;
+    }
+    return 0;
+}
+
+static int column_builder_add(ColumnarBuild* c, ColumnBuilder* b, uint64_t row,
+                              const char* value, size_t len) {
+    if (column_builder_skip_to(b, row) != 0 || column_builder_reserve(b, row + 1) != 0 ||
+        text_append(&b->data, value, len) != 0) {
+        return -1;
+    }
+    b->present[row / 64] |= 1ULL << (row % 64);
+    b->ends[row] = b->data.len;
+    b->present_count++;
+    b->rows = row + 1;
+    if (b->no_dict) return 0;
+
+    c->dict_key.len = 0;
+    if (text_append(&c->dict_key, value, len) != 0 || text_append(&c->dict_key, "", 1) != 0) {
+        return -1;
+    }
+    uint64_t code;
+    if (!idmap_get(&b->dict, c->dict_key.data, &code)) {
+        if (b->dict_count == MAX_COLUMN_DICT) {
+            b->no_dict = true;
+            free(b->codes);
+            b->codes = NULL;
+            idmap_free(&b->dict);
+            return 0;
+        }
+        if (b->dict_count == b->dict_capacity) {
+            size_t capacity = b->dict_capacity ? b->dict_capacity * 2 : 64;
+            uint64_t* grown = realloc(b->dict_ends, capacity * sizeof(uint64_t));
+            if (!grown) return -1;
+            b->dict_ends = grown;
+            b->dict_capacity = capacity;
+        }
+        code = b->dict_count;
+        if (idmap_put(&b->dict, c->dict_key.data, code) != 0 ||
+            text_append(&b->dict_data, value, len) != 0) {
+            return -1;
+        }
+        b->dict_ends[b->dict_count++] = b->dict_data.len;
+    }
+    b->codes[row] = (uint32_t)code;
+    return 0;
+}
+
+static int columnar_member_callback(const char* key, const char* value, size_t value_len,
+                                    void* ctx) {
+    ColumnarBuild* c = (ColumnarBuild*)ctx;
+    uint64_t n;
+    if (!idmap_get(&c->fields, key, &n)) {
+        if (c->column_count == MAX_COLUMNS) {
+            fprintf(stderr, "Error: Table %s has more than %d fields\n", c->table_name,
+                    MAX_COLUMNS);
+            c->error = -1;
+            return -1;
+        }
+        ColumnBuilder* grown = realloc(c->columns, (c->column_count + 1) * sizeof(ColumnBuilder));
+        if (!grown) {
+            c->error = -1;
+            return -1;
+        }
+        c->columns = grown;
+        ColumnBuilder* b = &c->columns[c->column_count];
+        memset(b, 0, sizeof(*b));
+        if (idmap_init(&b->dict, 64) != 0) {
+            column_builder_free(b);
+            c->error = -1;
+            return -1;
+        }
+        n = (uint64_t)c->column_count++;
+        if (idmap_put(&c->fields, key, n) != 0 ||
+            text_append(&c->names, key, strlen(key) + 1) != 0) {
+            c->error = -1;
+            return -1;
+        }
+    }
+    ColumnBuilder* b = &c->columns[n];
+    if (b->rows > c->row_count) return 0;      // a repeated key; the first one counts
+    if (json_value_canonical(&value, &value_len, &c->scratch, &c->canonical) != 0 ||
+        column_builder_add(c, b, c->row_count, value, value_len) != 0) {
+        c->error = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int columnar_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    ColumnarBuild* c = (ColumnarBuild*)ctx;
+    if (c->row_count == c->row_capacity) {
+        size_t capacity = c->row_capacity ? c->row_capacity * 2 : 1024;
+        uint64_t* grown = realloc(c->rows, capacity * sizeof(uint64_t));
+        if (!grown) return -1;
+        c->rows = grown;
+        c->row_capacity = capacity;
+    }
+    // Only objects are records, as for the commands that read the rows
+    size_t start = json_skip_space(data, len, 0);
+    if (start == len || data[start] != '{') return 0;
+    record_members(data, len, &c->member, columnar_member_callback, c);
+    if (c->error) return -1;
+    c->rows[c->row_count++] = rowref;
+    return 0;
+}
+
+// Write a file through a temporary one, so readers see the old or the new.
+static int columnar_install(const char* path, int (*fill)(int, void*), void* ctx) {
+    char temp_path[1100];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d", path, (int)getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    bool ok = fill(fd, ctx) == 0 && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(temp_path, path) != 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    ColumnarBuild* build;
+    ColumnBuilder* column;
+} ColumnWrite;
+
+static int column_fill(int fd, void* ctx) {
+    ColumnWrite* w = (ColumnWrite*)ctx;
+    ColumnBuilder* b = w->column;
+    uint64_t rows = w->build->row_count;
+    if (column_builder_skip_to(b, rows) != 0) return -1;
+
+    // A dictionary only if it comes out smaller
+    bool dict = !b->no_dict && b->dict_data.len + b->dict_count * 8 + rows * 4 < b->data.len + rows * 8;
+    ColumnHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, COLUMN_MAGIC, sizeof(h.magic));
+    h.encoding = dict ? COLUMN_DICT : COLUMN_PLAIN;
+    h.row_count = rows;
+    h.dict_count = dict ? b->dict_count : 0;
+    h.data_len = dict ? b->dict_data.len : b->data.len;
+    h.table = w->build->stamp;
+
+    static const char padding[8];
+    size_t words = column_bitmap_words(rows);
+    if (write_all(fd, &h, sizeof(h)) != 0 ||
+        write_all(fd, b->present, words * sizeof(uint64_t)) != 0) {
+        return -1;
+    }
+    if (!dict) {
+        return write_all(fd, b->ends, rows * sizeof(uint64_t)) == 0 &&
+               write_all(fd, b->data.data, b->data.len) == 0 ? 0 : -1;
+    }
+    return write_all(fd, b->dict_ends, b->dict_count * sizeof(uint64_t)) == 0 &&
+           write_all(fd, b->codes, rows * sizeof(uint32_t)) == 0 &&
+           write_all(fd, padding, (rows & 1) * 4) == 0 &&
+           write_all(fd, b->dict_data.data, b->dict_data.len) == 0 ? 0 : -1;
+}
+
+static int columns_fill(int fd, void* ctx) {
+    ColumnarBuild* c = (ColumnarBuild*)ctx;
+    static const char padding[8];
+    ColumnsHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, COLUMNS_MAGIC, sizeof(h.magic));
+    h.field_count = (uint32_t)c->column_count;
+    h.names_len = (uint32_t)((c->names.len + 7) & ~(size_t)7);
+    h.row_count = c->row_count;
+    h.table = c->stamp;
+    return write_all(fd, &h, sizeof(h)) == 0 &&
+           write_all(fd, c->names.data, c->names.len) == 0 &&
+           write_all(fd, padding, h.names_len - c->names.len) == 0 &&
+           write_all(fd, c->rows, c->row_count * sizeof(uint64_t)) == 0 ? 0 : -1;
+}
+
+// Read the table and write its column files, then <table>.columns.
+static int columnar_build(ColumnarBuild* c) {
+    const char* db_path = c->db_path;
+    const char* table_name = c->table_name;
+    int ret;
+    struct stat st;
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        if (open_paged_or_fail(db_path, table_name, &pt) != 0) return -1;
+        // Stamped before the scan: a write during it makes the snapshot stale
+        ret = fstat(pt.fd, &st);
+        if (ret == 0) {
+            file_stamp_of(&st, &c->stamp);
+            ret = paged_scan(&pt, columnar_record_callback, c);
+        }
+        paged_close(&pt);
+    } else {
+        char filepath[1024];
+        snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+        int fd = open(filepath, O_RDONLY);
+        if (fd < 0) return -1;
+        ret = fstat(fd, &st);
+        if (ret == 0) {
+            file_stamp_of(&st, &c->stamp);
+            ret = json_stream_records(fd, NULL, columnar_record_callback, c);
+        }
+        close(fd);
+    }
+    if (ret != 0) return -1;
+
+    char path[1024];
+    for (int n = 0; n < c->column_count; n++) {
+        ColumnWrite w = { c, &c->columns[n] };
+        column_path(db_path, table_name, n, path, sizeof(path));
+        if (columnar_install(path, column_fill, &w) != 0) return -1;
+    }
+    columns_path(db_path, table_name, path, sizeof(path));
+    if (columnar_install(path, columns_fill, c) != 0 || fsync_parent_dir(path) != 0) return -1;
+
+    // Columns left over from a snapshot with more fields
+    for (int n = c->column_count; ; n++) {
+        column_path(db_path, table_name, n, path, sizeof(path));
+        if (unlink(path) != 0) break;
+    }
+    return 0;
+}
+
+static int columnar_checkpoint_hook(void* ctx) {
+    return columnar_build((ColumnarBuild*)ctx);
+}
+
+/* --------------------------------------------------------------------------
+ * compact <table> --compressed|--plain
+ * Rewrite a JSON table file in blocks (see "Compressed table files") or back
+ * as plain text, from inside a checkpoint so the log is folded in first.
+ * The indexes are rebuilt for the new file; offsets in them don't change.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* db_path;
+    const char* table_name;
+    bool compressed;
+} StorageRewrite;
+
+static int storage_rewrite_hook(void* ctx) {
+    StorageRewrite* r = (StorageRewrite*)ctx;
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", r->db_path, r->table_name);
+    if (!file_exists(filepath)) return -1;
+    cJSON* root = load_table_file(r->db_path, r->table_name);
+    int ret = save_table_file(r->db_path, r->table_name, root, r->compressed);
+    cJSON_Delete(root);
+    return ret;
+}
+
+static int compact_storage(const char* db_path, const char* table_name, bool compressed) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        fprintf(stderr, "Error: Table %s is paged; only JSON tables can be compressed\n",
+                table_name);
+        return 1;
+    }
+    StorageRewrite r = { db_path, table_name, compressed };
+    if (wal_checkpoint(db_path, true, storage_rewrite_hook, &r) != 0) {
+        fprintf(stderr, "Error: Could not compact table %s\n", table_name);
+        return 1;
+    }
+
+    char filepath[1024];
+    snprintf(filepath, sizeof(filepath), "%s/%s.json", db_path, table_name);
+    int fd = open(filepath, O_RDONLY);
+    ZTable z;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    ztable_open(fd, &z);
+    uint64_t text = z.blocks ? z.header.raw_size : (uint64_t)st.st_size;
+    printf("Compacted table %s: %llu bytes of JSON in %llu bytes%s\n", table_name,
+           (unsigned long long)text, (unsigned long long)st.st_size,
+           compressed ? ", compressed" : "");
+    ztable_close(&z);
+    close(fd);
+    return 0;
+}
+
+static int command_compact(const char* db_path, const char* table_name, const char* mode) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        fprintf(stderr, "Error: Table %s is an lsm table; use vacuum to compact it\n",
+                table_name);
+        return 1;
+    }
+    if (mode && (strcmp(mode, "--compressed") == 0 || strcmp(mode, "--plain") == 0)) {
+        return compact_storage(db_path, table_name, strcmp(mode, "--compressed") == 0);
+    }
+    if (!mode || strcmp(mode, "--columnar") != 0) {
+        fprintf(stderr, "Error: compact needs --columnar, --compressed or --plain\n");
+        return 1;
+    }
+    ColumnarBuild c;
+    memset(&c, 0, sizeof(c));
+    c.db_path = db_path;
+    c.table_name = table_name;
+    if (idmap_init(&c.fields, 64) != 0) return 1;
+
+    int ret;
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        ret = columnar_build(&c);
+    } else {
+        ret = wal_checkpoint(db_path, true, columnar_checkpoint_hook, &c);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not compact table %s\n", table_name);
+    } else {
+        printf("Compacted table %s: %llu rows, %d columns\n", table_name,
+               (unsigned long long)c.row_count, c.column_count);
+    }
+
+    for (int n = 0; n < c.column_count; n++) column_builder_free(&c.columns[n]);
+    free(c.columns);
+    idmap_free(&c.fields);
+    free(c.names.data);
+    free(c.rows);
+    free(c.member.data);
+    free(c.scratch.data);
+    free(c.canonical.data);
+    free(c.dict_key.data);
+    return ret == 0 ? 0 : 1;
+}
+
+/* --------------------------------------------------------------------------
+ * checkpoint
+ * Fold the write-ahead log into the table files now instead of waiting for
+ * it to reach WAL_CHECKPOINT_BYTES.
+ * -------------------------------------------------------------------------- */
+static int command_checkpoint(const char* db_path) {
+    if (wal_checkpoint(db_path, true, NULL, NULL) != 0) {
+        fprintf(stderr, "Error: Checkpoint failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * vacuum <table>
+ * Remove the old versions of a paged table's records that no reader can
+ * see any more. Writers prune the pages they write anyway; this sweeps the
+ * rest. It takes the writer lock for a batch of pages at a time, so it can
+ * run next to ingestion and exports. An LSM table has its memtable flushed
+ * and all its runs merged into one, without the versions and tombstones
+ * they shadow.
+ * -------------------------------------------------------------------------- */
+#define VACUUM_BATCH_PAGES 64
+
+static int lsm_vacuum(const char* db_path, const char* table_name) {
+    LsmWriter w;
+    if (lsm_writer_open(db_path, table_name, &w) != 0) return 1;
+    int ret = w.end > LSM_LOG_HEADER_SIZE ? lsm_flush(&w) : 0;
+    lsm_writer_close(&w);
+    LsmManifest m;
+    if (ret == 0) ret = lsm_compact(db_path, table_name, true);
+    if (ret == 0) ret = lsm_read_manifest(db_path, table_name, &m);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not vacuum table %s\n", table_name);
+        return 1;
+    }
+    unsigned long long records = 0;
+    for (uint32_t i = 0; i < m.run_count; i++) records += m.runs[i].count;
+    printf("Vacuumed table %s: %llu record(s) in %u run(s)\n", table_name, records,
+           m.run_count);
+    return 0;
+}
+
+static int command_vacuum(const char* db_path, const char* table_name) {
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        return lsm_vacuum(db_path, table_name);
+    }
+    if (table_format(db_path, table_name) != TABLE_FORMAT_PAGED) {
+        fprintf(stderr, "Error: Table %s is not paged; only paged tables keep old versions\n",
+                table_name);
+        return 1;
+    }
+
+    unsigned long long removed = 0;
+    uint32_t pgno = 1;
+    bool done = false;
+    while (!done) {
+        PagedTable pt;
+        if (paged_open_writer(db_path, table_name, &pt) != 0) return 1;
+        uint32_t end = pt.header.page_count - pgno > VACUUM_BATCH_PAGES
+            ? pgno + VACUUM_BATCH_PAGES : pt.header.page_count;
+        int ret = 0;
+        char page[PAGE_SIZE];
+        for (; pgno < end && ret == 0; pgno++) {
+            ret = paged_read_page(&pt, pgno, page);
+            int pruned = ret == 0 ? page_prune(page, pt.horizon) : 0;
+            if (pruned > 0) ret = paged_write_page(&pt, pgno, page);
+            removed += (unsigned long long)pruned;
+        }
+        done = pgno >= pt.header.page_count;
+        if (ret == 0) ret = paged_commit(&pt);
+        paged_close(&pt);
+        if (ret != 0) {
+            fprintf(stderr, "Error: Could not vacuum table %s\n", table_name);
+            return 1;
+        }
+    }
+    printf("Vacuumed table %s: %llu old version(s) removed\n", table_name, removed);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * index create|drop <table> <field> [--ordered]
+ * Build (or remove) the hash index <table>.<field>.idx used by get/delete;
+ * with --ordered it also answers range and prefix conditions. Creating an
+ * index again rebuilds it, as ordered or not.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* db_path;
+    const char* table_name;
+} JsonIndexBuild;
+
+// Runs as a checkpoint hook: rewriting the table file fills in every index
+// it has, including the empty one just created.
+static int rebuild_table_hook(void* ctx) {
+    JsonIndexBuild* build = (JsonIndexBuild*)ctx;
+    cJSON* root = load_table_file(build->db_path, build->table_name);
+    int ret = save_table(build->db_path, build->table_name, root);
+    cJSON_Delete(root);
+    return ret == 0 ? 0 : 1;
+}
+
+static int command_index(const char* db_path, const char* action,
+                         const char* table_name, const char* field, bool ordered) {
+    if (!valid_index_field(field)) {
+        fprintf(stderr, "Error: Cannot index field '%s'\n", field);
+        return 1;
+    }
+    char path[1024];
+    index_path(db_path, table_name, field, path, sizeof(path));
+
+    if (strcmp(action, "drop") == 0) {
+        if (unlink(path) != 0) {
+            fprintf(stderr, "Error: No index on %s.%s\n", table_name, field);
+            return 1;
+        }
+        printf("Dropped index %s.%s\n", table_name, field);
+        return 0;
+    }
+    if (strcmp(action, "create") != 0) {
+        fprintf(stderr, "Error: Unknown index action '%s'\n", action);
+        return 1;
+    }
+    if (table_format(db_path, table_name) == TABLE_FORMAT_LSM) {
+        fprintf(stderr, "Error: Table %s is an lsm table; its runs are only keyed on id\n",
+                table_name);
+        return 1;
+    }
+
+    IndexBuilder b;
+    if (index_builder_init(&b, 0, ordered) != 0) return 1;
+    int ret = 0;
+    if (table_format(db_path, table_name) == TABLE_FORMAT_PAGED) {
+        // Writers are held off until the index is in place for them to update
+        int lock = table_write_lock(db_path, table_name);
+        PagedTable pt;
+        if (lock < 0 || open_paged_or_fail(db_path, table_name, &pt) != 0) {
+            if (lock >= 0) close(lock);
+            index_builder_free(&b);
+            return 1;
+        }
+        PagedIndexBuild build = { &b, field };
+        ret = paged_scan(&pt, index_record_callback, &build) != 0 ||
+              index_builder_write(&b, path, NULL) != 0;
+        paged_close(&pt);
+        close(lock);
+    } else {
+        JsonIndexBuild build = { db_path, table_name };
+        ret = index_builder_write(&b, path, NULL) != 0 ||
+              wal_checkpoint(db_path, true, rebuild_table_hook, &build) != 0;
+        if (ret != 0) unlink(path);
+    }
+    index_builder_free(&b);
+
+    if (ret != 0) {
+        fprintf(stderr, "Error: Could not build index %s.%s\n", table_name, field);
+        return 1;
+    }
+    printf("Created %sindex %s.%s\n", ordered ? "ordered " : "", table_name, field);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Server mode: serve --db-path <PATH> --socket <SOCKET>
+ *
+ * A long-running process that accepts commands on a Unix domain socket and
+ * keeps the tables it has read in memory: 'list' prints the cached records
+ * and 'get' looks them up through a hash map per field, built the first
+ * time the field is asked for. A cached table is read again when its file
+ * (or the WAL) changes, and every other command drops the cache. Commands
+ * run one at a time, with their output sent back to the client; a client
+ * that stalls for SERVER_IO_TIMEOUT_SECONDS mid-request is dropped.
+ *
+ * Any other command given with --socket is forwarded to the server instead
+ * of being run. A request is the client's working directory and arguments,
+ * each sent as a u32 length and the bytes, then a u64 length and the
+ * client's stdin (for --from-stdin, empty otherwise). The reply is a series
+ * of frames (a type byte 'o' stdout, 'e' stderr or 'x' exit status, a u32
+ * length and the data), ending with the exit status.
+ * -------------------------------------------------------------------------- */
+#define MAX_REQUEST_ARG (1 << 20)
+#define SERVER_IO_TIMEOUT_SECONDS 10
+#define MAX_CACHED_FIELDS 32
+
+// Records of one field value are chained through 'next' (index + 1, 0 ends).
+typedef struct {
+    char name[256];
+    IdMap first;
+    uint32_t* next;
+} CachedField;
+
+typedef struct {
+    char name[256];
+    FileStamp table;            // the table file and WAL the records came from
+    FileStamp wal;
+    char** records;             // compact JSON text, in table order
+    size_t count;
+    size_t capacity;
+    CachedField fields[MAX_CACHED_FIELDS];
+    int field_count;
+} CachedTable;
+
+typedef struct {
+    char db_path[PATH_MAX];
+    CachedTable* tables;
+    int count;
+} ServerCache;
+
+static int run_cli(int argc, char* argv[], ServerCache* cache);
+
+static void cached_table_free(CachedTable* t) {
+    for (size_t i = 0; i < t->count; i++) {
+        free(t->records[i]);
+    }
+    free(t->records);
+    for (int i = 0; i < t->field_count; i++) {
+        idmap_free(&t->fields[i].first);
+        free(t->fields[i].next);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+static void server_cache_clear(ServerCache* cache) {
+    for (int i = 0; i < cache->count; i++) {
+        cached_table_free(&cache->tables[i]);
+    }
+    free(cache->tables);
+    cache->tables = NULL;
+    cache->count = 0;
+}
+
+// Stamps of the files a table is read from; false if the table doesn't exist.
+static bool table_stamps(const char* db_path, const char* table_name, FileStamp* table,
+                         FileStamp* wal) {
+    char path[1024];
+    struct stat st;
+    bool paged = table_format(db_path, table_name) == TABLE_FORMAT_PAGED;
+    int n = snprintf(path, sizeof(path), "%s/%s.%s", db_path, table_name, paged ? "db" : "json");
+    if (n < 0 || (size_t)n >= sizeof(path) || stat(path, &st) != 0) return false;
+    file_stamp_of(&st, table);
+    if (wal_path(db_path, path, sizeof(path)) != 0) return false;
+    if (stat(path, &st) == 0) {
+        file_stamp_of(&st, wal);
+    } else {
+        memset(wal, 0, sizeof(*wal));
+    }
+    return true;
+}
+
+static int cache_record_callback(const char* data, size_t len, uint64_t rowref, void* ctx) {
+    (void)rowref;
+    CachedTable* t = (CachedTable*)ctx;
+    if (t->count == t->capacity) {
+        size_t capacity = t->capacity ? t->capacity * 2 : 1024;
+        char** grown = realloc(t->records, capacity * sizeof(char*));
+        if (!grown) return -1;
+        t->records = grown;
+        t->capacity = capacity;
+    }
+    char* copy = malloc(len + 1);
+    if (!copy) return -1;
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    t->records[t->count++] = copy;
+    return 0;
+}
+
+// The cached records of a table, read again if its files changed; NULL if
+// the table doesn't exist or can't be read.
+static CachedTable* server_cache_table(ServerCache* cache, const char* table_name) {
+    FileStamp table, wal;
+    if (strlen(table_name) >= sizeof(cache->tables[0].name) ||
+        !table_stamps(cache->db_path, table_name, &table, &wal)) {
+        return NULL;
+    }
+    CachedTable* t = NULL;
+    for (int i = 0; i < cache->count && !t; i++) {
+        if (strcmp(cache->tables[i].name, table_name) == 0) t = &cache->tables[i];
+    }
+    if (t && memcmp(&t->table, &table, sizeof(table)) == 0 &&
+        memcmp(&t->wal, &wal, sizeof(wal)) == 0) {
+        return t;
+    }
+    if (t) {
+        cached_table_free(t);
+    } else {
+        CachedTable* grown = realloc(cache->tables, (cache->count + 1) * sizeof(CachedTable));
+        if (!grown) return NULL;
+        cache->tables = grown;
+        t = &cache->tables[cache->count++];
+        memset(t, 0, sizeof(*t));
+    }
+
+    snprintf(t->name, sizeof(t->name), "%s", table_name);
+    t->table = table;
+    t->wal = wal;
+    int ret;
+    if (table_format(cache->db_path, table_name) == TABLE_FORMAT_PAGED) {
+        PagedTable pt;
+        ret = paged_open(cache->db_path, table_name, false, &pt);
+        if (ret == 0) {
+            ret = paged_scan(&pt, cache_record_callback, t);
+            paged_close(&pt);
+        }
+    } else {
+        ret = json_table_records(cache->db_path, table_name, NULL, 1, cache_record_callback, t);
+    }
+    if (ret != 0) {
+        // Leave an entry that can never match, so the table is read again
+        cached_table_free(t);
+        snprintf(t->name, sizeof(t->name), "%s", table_name);
+        return NULL;
+    }
+    return t;
+}
+
+static CachedField* cached_field(CachedTable* t, const char* field) {
+    for (int i = 0; i < t->field_count; i++) {
+        if (strcmp(t->fields[i].name, field) == 0) return &t->fields[i];
+    }
+    if (t->field_count == MAX_CACHED_FIELDS || strlen(field) >= sizeof(t->fields[0].name)) {
+        return NULL;
+    }
+
+    CachedField* f = &t->fields[t->field_count];
+    snprintf(f->name, sizeof(f->name), "%s", field);
+    f->next = calloc(t->count ? t->count : 1, sizeof(uint32_t));
+    if (!f->next || idmap_init(&f->first, 64) != 0) {
+        free(f->next);
+        idmap_free(&f->first);
+        return NULL;
+    }
+    // Walk backwards so each chain comes out in table order
+    for (size_t i = t->count; i-- > 0;) {
+        cJSON* record = json_parse(t->records[i], strlen(t->records[i]));
+        const char* value = record_string_field(record, field);
+        uint64_t head = 0;
+        if (value) {
+            idmap_get(&f->first, value, &head);
+            f->next[i] = (uint32_t)head;
+            idmap_put(&f->first, value, i + 1);
+        }
+        cJSON_Delete(record);
+    }
+    t->field_count++;
+    return f;
+}
+
+// 'list' and 'get' from the cache; -1 if the table can't be served from it.
+static int serve_list(ServerCache* cache, const char* table_name, Projection* fields) {
+    CachedTable* t = server_cache_table(cache, table_name);
+    if (!t) return -1;
+    for (size_t i = 0; i < t->count; i++) {
+        print_record_callback(t->records[i], strlen(t->records[i]), 0, fields);
+    }
+    return 0;
+}
+
+static int serve_get(ServerCache* cache, const char* table_name, const char* field,
+                     const char* value, Projection* fields) {
+    CachedTable* t = server_cache_table(cache, table_name);
+    CachedField* f = t ? cached_field(t, field) : NULL;
+    if (!f) return -1;
+    uint64_t i = 0;
+    idmap_get(&f->first, value, &i);
+    while (i) {
+        print_record_callback(t->records[i - 1], strlen(t->records[i - 1]), 0, fields);
+        i = f->next[i - 1];
+    }
+    return 0;
+}
+
+static int read_all(int fd, void* data, size_t len) {
+    char* p = (char*)data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, char type, const void* data, uint32_t len) {
+    char head[5];
+    head[0] = type;
+    memcpy(head + 1, &len, sizeof(len));
+    return write_all(fd, head, sizeof(head)) == 0 && write_all(fd, data, len) == 0 ? 0 : -1;
+}
+
+// stdout and stderr of a served command, written to the client as frames.
+typedef struct {
+    int fd;
+    char type;
+} FrameStream;
+
+static ssize_t frame_stream_write(void* cookie, const char* data, size_t len) {
+    FrameStream* s = (FrameStream*)cookie;
+    size_t sent = 0;
+    while (sent < len) {
+        uint32_t n = len - sent > (1u << 30) ? (1u << 30) : (uint32_t)(len - sent);
+        if (send_frame(s->fd, s->type, data + sent, n) != 0) return 0;
+        sent += n;
+    }
+    return (ssize_t)len;
+}
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static char* read_request_string(int fd) {
+    uint32_t len;
+    if (read_all(fd, &len, sizeof(len)) != 0 || len > MAX_REQUEST_ARG) return NULL;
+    char* s = malloc(len + 1);
+    if (s && read_all(fd, s, len) != 0) {
+        free(s);
+        return NULL;
+    }
+    if (s) s[len] = '\0';
+    return s;
+}
+
+static void serve_connection(ServerCache* cache, int fd, const char* prog_name) {
+    char* args[MAX_COMMAND_ARGS + 8];
+    int argc = 0;
+    uint32_t count;
+    char* cwd = read_request_string(fd);
+    if (!cwd || read_all(fd, &count, sizeof(count)) != 0 || count > MAX_COMMAND_ARGS + 4) {
+        free(cwd);
+        return;
+    }
+    args[argc++] = (char*)prog_name;
+    args[argc++] = "--db-path";
+    args[argc++] = cache->db_path;
+    bool ok = true;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        ok = (args[argc] = read_request_string(fd)) != NULL;
+        if (ok) argc++;
+    }
+    // The client's stdin, for 'save --from-stdin'
+    uint64_t input_len = 0;
+    char* input = NULL;
+    ok = ok && read_all(fd, &input_len, sizeof(input_len)) == 0 &&
+         (input = malloc(input_len ? input_len : 1)) != NULL &&
+         read_all(fd, input, input_len) == 0;
+
+    int status = 1;
+    if (ok) {
+        FrameStream out = { fd, 'o' }, err = { fd, 'e' };
+        cookie_io_functions_t io = { NULL, frame_stream_write, NULL, NULL };
+        FILE* out_file = fopencookie(&out, "w", io);
+        FILE* err_file = fopencookie(&err, "w", io);
+        FILE* in_file = input_len ? fmemopen(input, input_len, "r") : fopen("/dev/null", "r");
+        if (out_file && err_file && in_file) {
+            setvbuf(out_file, NULL, _IOFBF, 64 * 1024);
+            FILE* saved_in = stdin;
+            FILE* saved_out = stdout;
+            FILE* saved_err = stderr;
+            stdin = in_file;
+            stdout = out_file;
+            stderr = err_file;
+            // Relative paths in the command (import files) are the client's;
+            // the server goes back to its own directory afterwards
+            int home = open(".", O_RDONLY | O_DIRECTORY);
+            if (home < 0 || chdir(cwd) != 0) {
+                fprintf(stderr, "Error: Could not enter directory %s\n", cwd);
+            } else {
+                status = run_cli(argc, args, cache);
+            }
+            if (home >= 0) {
+                if (fchdir(home) != 0) {
+                    fprintf(saved_err, "Error: Could not return to the server directory\n");
+                    server_stopping = 1;
+                }
+                close(home);
+            }
+            stdin = saved_in;
+            stdout = saved_out;
+            stderr = saved_err;
+        }
+        if (in_file) fclose(in_file);
+        if (out_file) fclose(out_file);
+        if (err_file) fclose(err_file);
+
+        const char* command = argc > 3 ? args[3] : "";
+        if (strcmp(command, "list") != 0 && strcmp(command, "get") != 0) {
+            server_cache_clear(cache);
+        }
+    }
+    int32_t code = status;
+    send_frame(fd, 'x', &code, sizeof(code));
+
+    for (int i = 3; i < argc; i++) {
+        free(args[i]);
+    }
+    free(input);
+    free(cwd);
+}
+
+static void stop_server(int sig) {
+    (void)sig;
+    server_stopping = 1;
+}
+
+static int command_serve(const char* db_path, const char* socket_path, const char* prog_name) {
+    ServerCache cache;
+    memset(&cache, 0, sizeof(cache));
+    if (!realpath(db_path, cache.db_path)) {
+        fprintf(stderr, "Error: Database path '%s' does not exist.\n", db_path);
+        return 1;
+    }
+
+    // Served commands change directory, so the socket is removed by its
+    // absolute path at exit
+    struct sockaddr_un addr;
+    char cwd[PATH_MAX];
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int n = socket_path[0] == '/' || !getcwd(cwd, sizeof(cwd))
+                ? snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path)
+                : snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", cwd, socket_path);
+    if (n < 0 || (size_t)n >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+    socket_path = addr.sun_path;
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "Error: Could not listen on %s: %s\n", socket_path, strerror(errno));
+        if (listen_fd >= 0) close(listen_fd);
+        return 1;
+    }
+
+    // Stop on SIGINT/SIGTERM between requests; a client going away mid-reply
+    // must not kill the server
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_server;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "Serving %s on %s\n", cache.db_path, socket_path);
+    while (!server_stopping) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+            break;
+        }
+        // Requests are served one at a time, so a client that stops sending
+        // or reading mid-request must not hold up the others for long
+        struct timeval timeout = { SERVER_IO_TIMEOUT_SECONDS, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_connection(&cache, fd, prog_name);
+        close(fd);
     }
 
-    // If we generated the ID, free it now
-    if (!userProvidedId && finalIdStr) {
-        free((void*)finalIdStr);
-        finalIdStr = NULL;
+    close(listen_fd);
+    unlink(socket_path);
+    server_cache_clear(&cache);
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Client side of --socket: send the command line (without --socket and
+ * --db-path) to the server and replay its output. Returns the exit status.
+ * -------------------------------------------------------------------------- */
+static int send_request_string(int fd, const char* s) {
+    uint32_t len = (uint32_t)strlen(s);
+    return write_all(fd, &len, sizeof(len)) == 0 && write_all(fd, s, len) == 0 ? 0 : -1;
+}
+
+static int client_forward(const char* socket_path, int argc, char* argv[]) {
+    char cwd[4096];
+    char* args[MAX_COMMAND_ARGS + 4];
+    uint32_t count = 0;
+    bool from_stdin = false;
+    for (int i = 1; i < argc && count < MAX_COMMAND_ARGS + 4; i++) {
+        if ((strcmp(argv[i], "--socket") == 0 || strcmp(argv[i], "--db-path") == 0 ||
+             strcmp(argv[i], "-d") == 0) && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        from_stdin = from_stdin || strcmp(argv[i], "--from-stdin") == 0;
+        args[count++] = argv[i];
     }
 
-    // --------------------------------------------------------------------
-    // 4) Check if there's an existing record with this 'id'
-    // --------------------------------------------------------------------
-    cJSON* existing_record = NULL;
-    {
-        int size = cJSON_GetArraySize(root);
-        // The string we compare must be the same we used for 'id'
-        // but now it's stored in new_record->id. Let's just read from new_record.
-        cJSON* newIdField = cJSON_GetObjectItemCaseSensitive(new_record, "id");
-        if (!cJSON_IsString(newIdField)) {
-            // Shouldn't happen, but let's be safe
-            cJSON_Delete(new_record);
-            cJSON_Delete(root);
-            return 1;
-        }
-
-        for (int i = 0; i < size; i++) {
-            cJSON* item = cJSON_GetArrayItem(root, i);
-            if (cJSON_IsObject(item)) {
-                cJSON* idField = cJSON_GetObjectItemCaseSensitive(item, "id");
-                if (cJSON_IsString(idField) &&
-                    strcmp(idField->valuestring, newIdField->valuestring) == 0)
-                {
-                    existing_record = item;
-                    break;
-                }
+    // Commands reading stdin get it sent along whole. It is read before
+    // connecting: the server serves one request at a time and would wait
+    // on a slow producer otherwise.
+    char* input = NULL;
+    uint64_t input_len = 0;
+    size_t input_capacity = 0;
+    bool ok = true;
+    while (from_stdin) {
+        if (input_len == input_capacity) {
+            input_capacity = input_capacity ? input_capacity * 2 : 64 * 1024;
+            char* grown = realloc(input, input_capacity);
+            if (!grown) {
+                ok = false;
+                break;
             }
+            input = grown;
         }
+        ssize_t n = read(STDIN_FILENO, input + input_len, input_capacity - input_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) ok = false;
+        if (n <= 0) break;
+        input_len += (uint64_t)n;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: Could not read standard input: %s\n", strerror(errno));
+        free(input);
+        return 1;
     }
 
-    // --------------------------------------------------------------------
-    // 5) If found, update that record. Otherwise, append new_record
-    // --------------------------------------------------------------------
-    if (existing_record) {
-        cJSON* field = NULL;
-        cJSON_ArrayForEach(field, new_record) {
-            cJSON* dup = cJSON_Duplicate(field, 1);
-            cJSON_ReplaceItemInObjectCaseSensitive(existing_record, field->string, dup);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error: Could not connect to server at %s: %s\n", socket_path,
+                strerror(errno));
+        if (fd >= 0) close(fd);
+        free(input);
+        return 1;
+    }
+
+    ok = send_request_string(fd, getcwd(cwd, sizeof(cwd)) ? cwd : "/") == 0 &&
+         write_all(fd, &count, sizeof(count)) == 0;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        ok = send_request_string(fd, args[i]) == 0;
+    }
+    ok = ok && write_all(fd, &input_len, sizeof(input_len)) == 0 &&
+         write_all(fd, input, input_len) == 0;
+    free(input);
+
+    int status = 1;
+    bool done = false;
+    char* data = NULL;
+    while (ok && !done) {
+        char head[5];
+        uint32_t len;
+        if (read_all(fd, head, sizeof(head)) != 0) break;
+        memcpy(&len, head + 1, sizeof(len));
+        char* grown = realloc(data, len ? len : 1);
+        if (!grown || read_all(fd, grown, len) != 0) {
+            data = grown ? grown : data;
+            break;
         }
-        cJSON_Delete(new_record); 
-    } else {
-        cJSON_AddItemToArray(root, new_record);
+        data = grown;
+        if (head[0] == 'o') {
+            fwrite(data, 1, len, stdout);
+        } else if (head[0] == 'e') {
+            fwrite(data, 1, len, stderr);
+        } else if (head[0] == 'x' && len == sizeof(int32_t)) {
+            int32_t code;
+            memcpy(&code, data, sizeof(code));
+            status = code;
+            done = true;
+        }
+    }
+    free(data);
+    close(fd);
+    if (!done) {
+        fprintf(stderr, "Error: Lost connection to server at %s\n", socket_path);
     }
+    return status;
+}
 
-    // --------------------------------------------------------------------
-    // 6) Save the updated JSON array to file
-    // --------------------------------------------------------------------
-    if (save_table(db_path, table_name, root) != 0) {
-        fprintf(stderr, "Error: Could not save table %s\n", table_name);
-        cJSON_Delete(root);
-        return 1;
+/* --------------------------------------------------------------------------
+ * Per-command arena for cJSON: installed with cJSON_InitHooks while a
+ * command runs, so building a tree is a pointer bump instead of a malloc per
+ * node and string, and the whole arena goes away with one munmap afterwards.
+ *
+ * The arena is one reservation of address space cut into ARENA_BLOCK_SIZE
+ * blocks, aligned so that a pointer finds its block by masking. Each thread
+ * bumps through a block of its own; a block counts its live allocations
+ * (plus one for the thread bumping from it), and once they are all freed it
+ * is reused, so commands that parse and drop one record at a time stay
+ * small. Allocations above ARENA_MAX_ALLOC, or once the reservation runs
+ * out, go to malloc. cJSON's hooks take no context, so this is the one piece
+ * of global state in the program.
+ * -------------------------------------------------------------------------- */
+#define ARENA_RESERVE    ((size_t)64 << 30)   // address space only, with MAP_NORESERVE
+#define ARENA_BLOCK_SIZE ((size_t)1 << 20)
+#define ARENA_MAX_ALLOC  (ARENA_BLOCK_SIZE / 4)
+
+typedef struct ArenaBlock {
+    uint64_t refs;              // live allocations, plus one while a thread bumps from it
+    size_t used;                // bytes handed out, this header included
+    uint64_t allocations;       // counted by the owning thread, added to Arena on release
+    uint64_t bytes;
+    struct ArenaBlock* next_free;
+} __attribute__((aligned(16))) ArenaBlock;
+
+typedef struct {
+    char* mapping;              // what munmap gets back
+    char* base;                 // mapping rounded up to a block boundary
+    size_t carved;              // bytes of [base, base + ARENA_RESERVE) made into blocks
+    ArenaBlock* free_blocks;
+    pthread_mutex_t lock;       // free_blocks
+    uint64_t allocations;       // totals, for --stats
+    uint64_t bytes;
+    uint64_t malloc_allocations;
+} Arena;
+
+static Arena arena = { NULL, NULL, 0, NULL, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+static __thread ArenaBlock* arena_block;
+static __thread uint64_t arena_thread_counted;  // allocations not in arena_block's count
+static pthread_key_t arena_thread_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static bool arena_owns(const void* p) {
+    return arena.base && (const char*)p >= arena.base &&
+           (const char*)p < arena.base + ARENA_RESERVE;
+}
+
+static void arena_unref(ArenaBlock* b) {
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    pthread_mutex_lock(&arena.lock);
+    b->next_free = arena.free_blocks;
+    arena.free_blocks = b;
+    pthread_mutex_unlock(&arena.lock);
+}
+
+// The calling thread gives up its block: its counts go to the totals.
+static void arena_retire(ArenaBlock* b) {
+    arena_thread_counted += b->allocations;
+    __atomic_add_fetch(&arena.allocations, b->allocations, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&arena.bytes, b->bytes, __ATOMIC_RELAXED);
+    b->allocations = 0;
+    b->bytes = 0;
+    arena_unref(b);
+}
+
+static void arena_thread_exit(void* value) {
+    (void)value;
+    if (arena_block) arena_retire(arena_block);
+    arena_block = NULL;
+}
+
+static void arena_key_create(void) {
+    pthread_key_create(&arena_thread_key, arena_thread_exit);
+}
+
+static ArenaBlock* arena_block_new(void) {
+    pthread_mutex_lock(&arena.lock);
+    ArenaBlock* b = arena.free_blocks;
+    if (b) {
+        arena.free_blocks = b->next_free;
+    } else if (arena.carved + ARENA_BLOCK_SIZE <= ARENA_RESERVE) {
+        b = (ArenaBlock*)(arena.base + arena.carved);
+        arena.carved += ARENA_BLOCK_SIZE;
     }
+    pthread_mutex_unlock(&arena.lock);
+    if (!b) return NULL;
+    b->refs = 1;
+    b->used = sizeof(ArenaBlock);
+    b->allocations = 0;
+    b->bytes = 0;
+    b->next_free = NULL;
+    return b;
+}
 
-    // --------------------------------------------------------------------
-    // 7) Print the record for user feedback
-    // --------------------------------------------------------------------
-    cJSON* recordToPrint = existing_record ? existing_record : new_record;
-    char* line = cJSON_PrintUnformatted(recordToPrint);
-    if (line) {
-        printf("%s\n", line);
-        free(line);
+static void* arena_malloc(size_t size) {
+    size_t rounded = (size + 15) & ~(size_t)15;
+    ArenaBlock* b = arena_block;
+    if (b && __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1) {
+        b->used = sizeof(ArenaBlock);     // everything in it was freed: start over
+    }
+    if (rounded <= ARENA_MAX_ALLOC && (!b || b->used + rounded > ARENA_BLOCK_SIZE)) {
+        if (b) arena_retire(b);
+        b = arena_block = arena_block_new();
+        if (b) pthread_setspecific(arena_thread_key, b);  // so thread exit retires it
+    }
+    if (rounded > ARENA_MAX_ALLOC || !b) {
+        arena_thread_counted++;
+        __atomic_add_fetch(&arena.malloc_allocations, 1, __ATOMIC_RELAXED);
+        return malloc(size);
     }
+    void* p = (char*)b + b->used;
+    b->used += rounded;
+    b->allocations++;
+    b->bytes += size;
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    return p;
+}
 
-    cJSON_Delete(root);
-    return 0;
+static void arena_free(void* p) {
+    if (!p) return;
+    if (!arena_owns(p)) {
+        free(p);
+        return;
+    }
+    arena_unref((ArenaBlock*)((uintptr_t)p & ~(uintptr_t)(ARENA_BLOCK_SIZE - 1)));
+}
+
+// Reserve the arena and point cJSON at it; without the reservation cJSON
+// keeps using malloc.
+static void arena_begin(void) {
+    pthread_once(&arena_key_once, arena_key_create);
+    char* mapping = mmap(NULL, ARENA_RESERVE + ARENA_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) return;
+    arena.mapping = mapping;
+    arena.base = (char*)(((uintptr_t)mapping + ARENA_BLOCK_SIZE - 1) &
+                         ~(uintptr_t)(ARENA_BLOCK_SIZE - 1));
+    cJSON_Hooks hooks = { arena_malloc, arena_free };
+    cJSON_InitHooks(&hooks);
+}
+
+// Hand cJSON back to malloc and drop everything the command left behind.
+static void arena_end(void) {
+    if (!arena.mapping) return;
+    cJSON_InitHooks(NULL);
+    arena_block = NULL;
+    pthread_setspecific(arena_thread_key, NULL);
+    munmap(arena.mapping, ARENA_RESERVE + ARENA_BLOCK_SIZE);
+    arena.mapping = NULL;
+    arena.base = NULL;
+    arena.carved = 0;
+    arena.free_blocks = NULL;
+    arena.allocations = 0;
+    arena.bytes = 0;
+    arena.malloc_allocations = 0;
+}
+
+// --stats: cJSON allocations and memory of the command, on stderr.
+static void arena_report(void) {
+    if (arena_block) {
+        arena_thread_counted += arena_block->allocations;
+        __atomic_add_fetch(&arena.allocations, arena_block->allocations, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&arena.bytes, arena_block->bytes, __ATOMIC_RELAXED);
+        arena_block->allocations = 0;
+        arena_block->bytes = 0;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "Stats: arena_allocations=%llu arena_bytes=%llu arena_blocks=%llu "
+            "malloc_allocations=%llu peak_rss_kb=%ld\n",
+            (unsigned long long)arena.allocations, (unsigned long long)arena.bytes,
+            (unsigned long long)(arena.carved / ARENA_BLOCK_SIZE),
+            (unsigned long long)arena.malloc_allocations, usage.ru_maxrss);
+}
+
+// cJSON allocations made so far by the calling thread, arena or malloc.
+static uint64_t arena_thread_allocations(void) {
+    return arena_thread_counted + (arena_block ? arena_block->allocations : 0);
+}
+
+static double ns_to_ms(uint64_t ns) {
+    return (double)(ns / 1000) / 1000.0;
+}
+
+// --profile: the phases of the command, as one JSON line on stderr. Its
+// allocations are those of every thread, the phases' those of its own.
+static void profile_report(const char* command, const char* table_name, int status) {
+    profile_switch(PROFILE_NO_PHASE);
+    Profile* p = profile;
+    profile = NULL;
+
+    uint64_t other_ns = p->since_ns - p->start_ns;
+    uint64_t other_allocations = p->since_allocations - p->start_allocations;
+    uint64_t allocations = __atomic_load_n(&arena.allocations, __ATOMIC_RELAXED) +
+                           __atomic_load_n(&arena.malloc_allocations, __ATOMIC_RELAXED) +
+                           (arena_block ? arena_block->allocations : 0);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    cJSON* line = cJSON_CreateObject();
+    cJSON_AddStringToObject(line, "command", command);
+    cJSON_AddItemToObject(line, "table",
+                          table_name ? cJSON_CreateString(table_name) : cJSON_CreateNull());
+    cJSON_AddNumberToObject(line, "status", status);
+    cJSON_AddNumberToObject(line, "total_ms", ns_to_ms(p->since_ns - p->start_ns));
+    cJSON* phases = cJSON_CreateObject();
+    cJSON_AddItemToObject(line, "phases", phases);
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        const PhaseStats* s = &p->phases[i];
+        cJSON* phase = cJSON_CreateObject();
+        cJSON_AddItemToObject(phases, phase_names[i], phase);
+        cJSON_AddNumberToObject(phase, "ms", ns_to_ms(s->ns));
+        cJSON_AddNumberToObject(phase, "calls", (double)s->calls);
+        cJSON_AddNumberToObject(phase, "bytes", (double)s->bytes);
+        cJSON_AddNumberToObject(phase, "allocations", (double)s->allocations);
+        other_ns -= s->ns;
+        other_allocations -= s->allocations;
+    }
+    cJSON_AddNumberToObject(line, "other_ms", ns_to_ms(other_ns));
+    cJSON_AddNumberToObject(line, "other_allocations", (double)other_allocations);
+    cJSON_AddNumberToObject(line, "allocations", (double)allocations);
+    cJSON_AddNumberToObject(line, "peak_rss_kb", (double)usage.ru_maxrss);
+
+    char* text = cJSON_PrintUnformatted(line);
+    if (text) fprintf(stderr, "%s\n", text);
+    cJSON_free(text);
+    cJSON_Delete(line);
 }
 
 /* --------------------------------------------------------------------------
- * delete <table> field=value
- * Remove all records that match `field=value`.
+ * Parse arguments, decide which command to run. 'cache' is set when the
+ * command was sent to a server.
  * -------------------------------------------------------------------------- */
-static int command_delete(const char* db_path, const char* table_name,
-                          const char* field, const char* value) {
-    cJSON* root = load_table(db_path, table_name);
-    if (!root) {
-        fprintf(stderr, "Error: Could not load or parse table %s\n", table_name);
+// 'list' and 'get' once --fields is taken out of their arguments.
+static int run_list(const char* db_path, const char* table_name, int command_args_count,
+                    char** command_args, int threads, Projection* fields, ServerCache* cache,
+                    const char* prog_name) {
+    // Expects: list <table> [--id-range LO..HI] [--fields a,b,...]
+    if (command_args_count == 2 && strcmp(command_args[0], "--id-range") == 0) {
+        unsigned long long lo, hi;
+        int consumed = 0;
+        if (sscanf(command_args[1], "%llu..%llu%n", &lo, &hi, &consumed) != 2 ||
+            command_args[1][consumed] != '\0' || lo > hi) {
+            fprintf(stderr, "Error: Invalid id range '%s'. Use LO..HI.\n", command_args[1]);
+            return 1;
+        }
+        return command_list_range(db_path, table_name, lo, hi, fields);
+    }
+    if (command_args_count != 0) {
+        // 'list' expects: simpledb --db-path <path> list <table>
+        // No extra arguments after <table>
+        print_usage(prog_name);
         return 1;
     }
+    if (cache && serve_list(cache, table_name, fields) == 0) {
+        return 0;
+    }
+    return command_list(db_path, table_name, threads, fields);
+}
 
-    int i = 0;
-    int deleted_count = 0;
+// Split a get condition such as day>=2025-01-01 at its operator, which is
+// copied to 'op', and return the value; NULL if it has no field or operator.
+static char* split_condition(char* arg, char op[3]) {
+    for (char* p = arg; *p; p++) {
+        bool two = (p[0] == '<' || p[0] == '>' || p[0] == '^') && p[1] == '=';
+        if (two || p[0] == '=' || p[0] == '<' || p[0] == '>') {
+            if (p == arg) return NULL;
+            size_t len = two ? 2 : 1;
+            memcpy(op, p, len);
+            op[len] = '\0';
+            *p = '\0';
+            return p + len;
+        }
+    }
+    return NULL;
+}
 
-    // Iterate in a forward manner but be mindful that removing items changes indices
-    while (i < cJSON_GetArraySize(root)) {
-        cJSON* item = cJSON_GetArrayItem(root, i);
-        if (cJSON_IsObject(item)) {
-            cJSON* field_obj = cJSON_GetObjectItemCaseSensitive(item, field);
-            if (cJSON_IsString(field_obj) && strcmp(field_obj->valuestring, value) == 0) {
-                // Remove this item
-                cJSON_DeleteItemFromArray(root, i);
-                deleted_count++;
-                continue; // Do not increment i, because the array just shifted
+static int run_get(const char* db_path, const char* table_name, int command_args_count,
+                   char** command_args, int threads, Projection* fields, ServerCache* cache,
+                   const char* prog_name) {
+    // Expects: get <table> field=value [--fields a,b,...]
+    //     or: get <table> <field><op><value>... with op one of < <= > >= ^=
+    //     or: get <table> <field> between <lo> <hi>
+    if (command_args_count < 1) {
+        print_usage(prog_name);
+        return 1;
+    }
+    FieldRange fr;
+    if (command_args_count == 4 && strcmp(command_args[1], "between") == 0) {
+        field_range_init(&fr, command_args[0]);
+        field_range_add(&fr, ">=", command_args[2]);
+        field_range_add(&fr, "<=", command_args[3]);
+        return command_get_range(db_path, table_name, &fr, threads, fields);
+    }
+    char op[3];
+    for (int i = 0; i < command_args_count; i++) {
+        char* arg = command_args[i];
+        char* value = split_condition(arg, op);
+        if (!value) {
+            fprintf(stderr, "Error: Invalid get argument '%s'. Use field=value, or "
+                    "field<value, <=, >, >= or ^= for a range.\n", arg);
+            return 1;
+        }
+        if (command_args_count == 1 && strcmp(op, "=") == 0) {
+            if (cache && serve_get(cache, table_name, arg, value, fields) == 0) {
+                return 0;
             }
+            return command_get(db_path, table_name, arg, value, threads, fields);
+        }
+        if (i == 0) {
+            field_range_init(&fr, arg);
+        } else if (strcmp(arg, fr.field) != 0) {
+            fprintf(stderr, "Error: The conditions of a get must all be on one field\n");
+            return 1;
+        }
+        if (field_range_add(&fr, op, value) != 0) {
+            fprintf(stderr, "Error: A get takes one ^= condition\n");
+            return 1;
         }
-        i++;
     }
+    return command_get_range(db_path, table_name, &fr, threads, fields);
+}
 
-    if (save_table(db_path, table_name, root) != 0) {
-        fprintf(stderr, "Error: Could not save table %s after deletion\n", table_name);
-        cJSON_Delete(root);
+// Run a parsed command; run_cli wraps it in the cJSON arena.
+static int run_command(const char* db_path, const char* command, const char* index_action,
+                       const char* table_name, int command_args_count, char** command_args,
+                       int threads, ServerCache* cache, const char* prog_name) {
+    if (strcmp(command, "list") == 0 || strcmp(command, "get") == 0) {
+        Projection storage;
+        Projection* fields;
+        if (take_fields_option(&command_args_count, command_args, &storage, &fields) != 0) {
+            return 1;
+        }
+        int ret = strcmp(command, "list") == 0
+            ? run_list(db_path, table_name, command_args_count, command_args, threads, fields,
+                       cache, prog_name)
+            : run_get(db_path, table_name, command_args_count, command_args, threads, fields,
+                      cache, prog_name);
+        if (fields) projection_free(fields);
+        return ret;
+
+    } else if (strcmp(command, "save") == 0) {
+        // Expects: save <table> field1=value1 [field2=value2 ...]
+        //     or: save <table> --from-stdin
+        //     or: save <table> --reserve N
+        if (command_args_count < 1) {
+            print_usage(prog_name);
+            return 1;
+        }
+        if (command_args_count == 1 && strcmp(command_args[0], "--from-stdin") == 0) {
+            return command_save_from_stdin(db_path, table_name);
+        }
+        if (command_args_count == 2 && strcmp(command_args[0], "--reserve") == 0) {
+            return command_reserve_ids(db_path, table_name, command_args[1]);
+        }
+        return command_save(db_path, table_name, command_args_count, command_args);
+
+    } else if (strcmp(command, "delete") == 0) {
+        // Expects: delete <table> field=value
+        if (command_args_count != 1) {
+            print_usage(prog_name);
+            return 1;
+        }
+        char* eq = strchr(command_args[0], '=');
+        if (!eq) {
+            fprintf(stderr, "Error: Invalid delete argument '%s'. Use field=value.\n", command_args[0]);
+            return 1;
+        }
+        *eq = '\0';
+        const char* field = command_args[0];
+        const char* value = eq + 1;
+        return command_delete(db_path, table_name, field, value, threads);
+
+    } else if (strcmp(command, "checkpoint") == 0) {
+        // Expects: checkpoint
+        if (command_args_count != 0) {
+            print_usage(prog_name);
+            return 1;
+        }
+        return command_checkpoint(db_path);
+
+    } else if (strcmp(command, "create") == 0) {
+        // Expects: create <table> [--format json|compressed|paged|lsm]
+        const char* format = "json";
+        if (command_args_count == 2 && strcmp(command_args[0], "--format") == 0) {
+            format = command_args[1];
+        } else if (command_args_count != 0) {
+            print_usage(prog_name);
+            return 1;
+        }
+        return command_create(db_path, table_name, format);
+
+    } else if (strcmp(command, "import") == 0) {
+        // Expects: import <table> <file.json|file.csv>
+        if (command_args_count != 1) {
+            print_usage(prog_name);
+            return 1;
+        }
+        return command_import(db_path, table_name, command_args[0]);
+
+    } else if (strcmp(command, "export") == 0) {
+        // Expects: export <table> [--format json|csv]
+        const char* format = "json";
+        if (command_args_count == 2 && strcmp(command_args[0], "--format") == 0) {
+            format = command_args[1];
+        } else if (command_args_count != 0) {
+            print_usage(prog_name);
+            return 1;
+        }
+        return command_export(db_path, table_name, format);
+
+    } else if (strcmp(command, "join") == 0) {
+        // Expects: join <left> <right> <left>.<field>=<right>.<field> [--memory <SIZE>]
+        size_t budget = JOIN_DEFAULT_MEMORY;
+        if (command_args_count == 4 && strcmp(command_args[2], "--memory") == 0) {
+            if (!parse_memory_size(command_args[3], &budget)) {
+                fprintf(stderr, "Error: Invalid memory size '%s'. Use e.g. 512K or 64M.\n",
+                        command_args[3]);
+                return 1;
+            }
+        } else if (command_args_count != 2) {
+            print_usage(prog_name);
+            return 1;
+        }
+        return command_join(db_path, table_name, command_args[0], command_args[1], budget);
+
+    } else if (strcmp(command, "agg") == 0) {
+        // Expects: agg <table> [--group-by <field>] [--count] [--sum|--min|--max <field>]...
+        return command_agg(db_path, table_name, command_args_count, command_args, threads);
+
+    } else if (strcmp(command, "compact") == 0) {
+        // Expects: compact <table> --columnar|--compressed|--plain
+        if (command_args_count != 1) {
+            print_usage(prog_name);
+            return 1;
+        }
+        return command_compact(db_path, table_name, command_args[0]);
+
+    } else if (strcmp(command, "vacuum") == 0) {
+        // Expects: vacuum <table>
+        if (command_args_count != 0) {
+            print_usage(prog_name);
+            return 1;
+        }
+        return command_vacuum(db_path, table_name);
+
+    } else if (strcmp(command, "index") == 0) {
+        // Expects: index create|drop <table> <field> [--ordered]
+        bool ordered = command_args_count == 2 && strcmp(command_args[1], "--ordered") == 0;
+        if (command_args_count != 1 && !ordered) {
+            print_usage(prog_name);
+            return 1;
+        }
+        return command_index(db_path, index_action, table_name, command_args[0], ordered);
+
+    } else {
+        fprintf(stderr, "Error: Unknown command '%s'\n", command);
+        print_usage(prog_name);
         return 1;
     }
-
-    cJSON_Delete(root);
-    printf("Deleted %d record(s)\n", deleted_count);
-    return 0;
 }
 
-/* --------------------------------------------------------------------------
- * main
- * Parse arguments, decide which command to run.
- * -------------------------------------------------------------------------- */
-int main(int argc, char* argv[]) {
+static int run_cli(int argc, char* argv[], ServerCache* cache) {
     // Minimal argument parsing:
     // Expect at least: ./simpledb --db-path <PATH> command ...
     if (argc < 4) {
@@ -493,6 +11848,10 @@ int main(int argc, char* argv[]) {
     const char* db_path = NULL;
     const char* command = NULL;
     const char* table_name = NULL;
+    const char* socket_path = NULL;
+    int threads = 1;
+    bool stats = false;
+    bool profiling = false;
 
     // We'll collect any extra arguments in an array for "save" command
     char* command_args[MAX_COMMAND_ARGS];
@@ -511,6 +11870,26 @@ int main(int argc, char* argv[]) {
                 fprintf(stderr, "Error: --db-path requires an argument\n");
                 return 1;
             }
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            char* end = NULL;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (!end || *end != '\0' || n < 1 || n > MAX_SCAN_THREADS) {
+                fprintf(stderr, "Error: --threads requires a number from 1 to %d\n",
+                        MAX_SCAN_THREADS);
+                return 1;
+            }
+            threads = (int)n;
+            i++;
+            continue;
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+            continue;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+            continue;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profiling = true;
+            continue;
         } else {
             // This is likely the command
             command = argv[i];
@@ -519,16 +11898,46 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // 'serve' takes its options after the command as well
+    if (command && strcmp(command, "serve") == 0) {
+        for (; i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--db-path") == 0 || strcmp(argv[i], "-d") == 0) {
+                db_path = argv[i + 1];
+            } else if (strcmp(argv[i], "--socket") == 0) {
+                socket_path = argv[i + 1];
+            } else {
+                break;
+            }
+        }
+        if (!db_path || !socket_path || i != argc || cache) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        return command_serve(db_path, socket_path, argv[0]);
+    }
+
+    // With --socket, the command is run by the server listening there
+    if (socket_path && command && !cache) {
+        return client_forward(socket_path, argc, argv);
+    }
+
     if (!db_path || !command) {
         print_usage(argv[0]);
         return 1;
     }
 
+    // 'index' takes its action (create|drop) before the table
+    const char* index_action = NULL;
+    if (strcmp(command, "index") == 0 && i < argc) {
+        index_action = argv[i++];
+    }
+
     // Now, the next argument should be <table> at least for most commands
-    if (i < argc) {
+    bool needs_table = strcmp(command, "checkpoint") != 0;
+    if (i < argc && needs_table) {
         table_name = argv[i];
         i++;
-    } else {
+    } else if (needs_table) {
         print_usage(argv[0]);
         return 1;
     }
@@ -550,60 +11959,20 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Dispatch commands
-    if (strcmp(command, "list") == 0) {
-        if (command_args_count != 0) {
-            // 'list' expects: simpledb --db-path <path> list <table>
-            // No extra arguments after <table>
-            print_usage(argv[0]);
-            return 1;
-        }
-        return command_list(db_path, table_name);
-
-    } else if (strcmp(command, "get") == 0) {
-        // Expects: get <table> field=value
-        if (command_args_count != 1) {
-            print_usage(argv[0]);
-            return 1;
-        }
-        char* eq = strchr(command_args[0], '=');
-        if (!eq) {
-            fprintf(stderr, "Error: Invalid get argument '%s'. Use field=value.\n", command_args[0]);
-            return 1;
-        }
-        *eq = '\0';
-        const char* field = command_args[0];
-        const char* value = eq + 1;
-        return command_get(db_path, table_name, field, value);
-
-    } else if (strcmp(command, "save") == 0) {
-        // Expects: save <table> field1=value1 [field2=value2 ...]
-        if (command_args_count < 1) {
-            print_usage(argv[0]);
-            return 1;
-        }
-        return command_save(db_path, table_name, command_args_count, command_args);
-
-    } else if (strcmp(command, "delete") == 0) {
-        // Expects: delete <table> field=value
-        if (command_args_count != 1) {
-            print_usage(argv[0]);
-            return 1;
-        }
-        char* eq = strchr(command_args[0], '=');
-        if (!eq) {
-            fprintf(stderr, "Error: Invalid delete argument '%s'. Use field=value.\n", command_args[0]);
-            return 1;
-        }
-        *eq = '\0';
-        const char* field = command_args[0];
-        const char* value = eq + 1;
-        return command_delete(db_path, table_name, field, value);
-
-    } else {
-        fprintf(stderr, "Error: Unknown command '%s'\n", command);
-        print_usage(argv[0]);
-        return 1;
-    }
+    Profile command_profile;
+    if (profiling) profile_begin(&command_profile);
+    arena_begin();
+    int ret = run_command(db_path, command, index_action, table_name, command_args_count,
+                          command_args, threads, cache, argv[0]);
+    if (profiling) profile_report(command, table_name, ret);
+    if (stats) arena_report();
+    arena_end();
+    return ret;
 }
 
+/* --------------------------------------------------------------------------
+ * main
+ * -------------------------------------------------------------------------- */
+int main(int argc, char* argv[]) {
+    return run_cli(argc, argv, NULL);
+}
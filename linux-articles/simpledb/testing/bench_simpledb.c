@@ -0,0 +1,605 @@
+/******************************************************************************
+ * bench_simpledb.c
+ *
+ * Benchmark harness for the 'simpledb' command-line utility. It generates a
+ * synthetic table, loads it, then times the commands against it, each run
+ * as its own process the way a user (or script) would run them.
+ *
+ * To compile:
+ *     gcc -Wall -O2 -o bench_simpledb bench_simpledb.c -lm
+ *
+ * Usage:
+ *     ./bench_simpledb [--simpledb PATH] [--dir DIR]
+ *                      [--format json|compressed|paged|lsm]
+ *                      [--rows N] [--fields N] [--value-size N] [--keys N]
+ *                      [--skew S] [--ops N] [--repeat N] [--threads N] [--seed N]
+ *
+ * Options:
+ *     --simpledb PATH    the binary to benchmark (./simpledb)
+ *     --dir DIR          scratch directory, emptied first (bench_db)
+ *     --format F         storage format of the table (json); lsm tables have
+ *                        no secondary indexes, so they time a vacuum of the
+ *                        loaded runs instead of index_create and get_indexed
+ *     --rows N           rows in the table, up to 50M (10000)
+ *     --fields N         fields per row besides "id" and "key" (4)
+ *     --value-size N     bytes per generated field value (16)
+ *     --keys N           distinct values of "key" (rows / 10)
+ *     --skew S           Zipf exponent for the keys and ids operations pick;
+ *                        0 picks uniformly (0.99)
+ *     --ops N            timed runs of each single-record operation (200)
+ *     --repeat N         timed runs of each whole-table operation (3)
+ *     --threads N        passed on to simpledb as --threads (1)
+ *     --seed N           seed of the generator, for repeatable runs (1)
+ *
+ * The report is one JSON object on stdout: the configuration, then one
+ * result per operation with the number of runs, rows per second, mean, p50
+ * and p99 latency in milliseconds, the peak RSS of any run and the bytes
+ * the runs wrote (to files, not counting their output) per run.
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_ARGS     32
+#define MAX_RESULTS  16
+#define MAX_ROWS     50000000ULL
+#define MAX_FIELDS   64
+#define MAX_VALUE    4096
+
+typedef enum {
+    FORMAT_JSON,
+    FORMAT_COMPRESSED,
+    FORMAT_PAGED,
+    FORMAT_LSM,
+    FORMAT_COUNT
+} BenchFormat;
+
+static const char* const format_names[FORMAT_COUNT] = { "json", "compressed", "paged", "lsm" };
+
+typedef struct {
+    const char* simpledb;
+    const char* dir;
+    BenchFormat format;
+    uint64_t rows;
+    int fields;
+    int value_size;
+    uint64_t keys;
+    double skew;
+    int ops;
+    int repeat;
+    int threads;
+    uint64_t seed;
+} BenchConfig;
+
+/* --------------------------------------------------------------------------
+ * Random numbers: xorshift64*, and Zipf-like ranks (rank 1 the most
+ * frequent) from inverting the integral of x^-skew over [1, n + 1), which
+ * needs no table even for 50M ids.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    uint64_t state;
+} Rng;
+
+static uint64_t rng_next(Rng* r) {
+    r->state ^= r->state >> 12;
+    r->state ^= r->state << 25;
+    r->state ^= r->state >> 27;
+    return r->state * 2685821657736338717ULL;
+}
+
+static double rng_unit(Rng* r) {
+    return (double)(rng_next(r) >> 11) / (double)(1ULL << 53);
+}
+
+typedef struct {
+    uint64_t n;
+    double skew;
+} Zipf;
+
+// A rank from 1 to n; skew 0 is uniform.
+static uint64_t zipf_draw(const Zipf* z, Rng* r) {
+    double u = rng_unit(r), x;
+    if (fabs(z->skew - 1.0) < 1e-9) {
+        x = pow((double)z->n + 1, u);
+    } else {
+        double e = 1.0 - z->skew;
+        x = pow(1.0 + u * (pow((double)z->n + 1, e) - 1.0), 1.0 / e);
+    }
+    uint64_t rank = (uint64_t)x;
+    return rank < 1 ? 1 : rank > z->n ? z->n : rank;
+}
+
+// Ranks are spread over the ids, so the hot records aren't all at the front.
+static uint64_t id_of_rank(uint64_t rank, uint64_t rows) {
+    return (rank - 1) * 2654435761ULL % rows + 1;
+}
+
+static void random_value(Rng* r, char* out, int len) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    for (int i = 0; i < len; i++) out[i] = alphabet[rng_next(r) % (sizeof(alphabet) - 1)];
+    out[len] = '\0';
+}
+
+/* --------------------------------------------------------------------------
+ * The synthetic table, as JSON lines for 'save --from-stdin':
+ * {"id":"1","key":"k17","f1":"...","f2":"...",...}
+ * -------------------------------------------------------------------------- */
+static int generate_rows(const BenchConfig* c, const Zipf* keys, const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Could not create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    Rng r = { c->seed * 0x9E3779B97F4A7C15ULL + 1 };
+    char value[MAX_VALUE + 1];
+    for (uint64_t id = 1; id <= c->rows; id++) {
+        fprintf(out, "{\"id\":\"%llu\",\"key\":\"k%llu\"", (unsigned long long)id,
+                (unsigned long long)zipf_draw(keys, &r));
+        for (int f = 1; f <= c->fields; f++) {
+            random_value(&r, value, c->value_size);
+            fprintf(out, ",\"f%d\":\"%s\"", f, value);
+        }
+        fputs("}\n", out);
+    }
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: Could not write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Running one command: a child process with stdin from 'input' (or
+ * /dev/null) and its output drained and counted. wait4() gives the child's
+ * peak RSS; the bytes it wrote come from this process's /proc/self/io,
+ * which takes in the I/O of children once they are waited for.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    double seconds;
+    long max_rss_kb;
+    int64_t bytes_written;      // -1 if /proc/self/io can't be read
+    uint64_t output_bytes;
+    int status;
+} RunResult;
+
+static int64_t io_written_so_far(void) {
+    FILE* f = fopen("/proc/self/io", "r");
+    if (!f) return -1;
+    char line[128];
+    long long wchar = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "wchar: %lld", &wchar) == 1) break;
+    }
+    fclose(f);
+    return wchar;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int run_command(char* const argv[], const char* input, RunResult* res) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) return -1;
+    int64_t written_before = io_written_so_far();
+    double start = now_seconds();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        int in = open(input ? input : "/dev/null", O_RDONLY);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (in < 0 || null_fd < 0) _exit(127);
+        dup2(in, STDIN_FILENO);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    close(pipe_fds[1]);
+    char buffer[65536];
+    uint64_t output = 0;
+    for (;;) {
+        ssize_t n = read(pipe_fds[0], buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        output += (uint64_t)n;
+    }
+    close(pipe_fds[0]);
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    res->seconds = now_seconds() - start;
+    res->max_rss_kb = usage.ru_maxrss;
+    res->output_bytes = output;
+    int64_t written_after = io_written_so_far();
+    // The child's writes to the pipe count too; they aren't writes to files
+    res->bytes_written = written_before >= 0 && written_after >= 0
+        ? written_after - written_before - (int64_t)output : -1;
+    res->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Results: every run of an operation is kept so the percentiles are exact.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const char* op;
+    uint64_t rows_per_run;      // rows each run handles, for rows per second
+    double* seconds;
+    int runs;
+    int failures;
+    long max_rss_kb;
+    int64_t bytes_written;      // -1 if unknown
+} OpResult;
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted values.
+static double percentile(const double* sorted, int n, double p) {
+    int rank = (int)ceil(p / 100.0 * n);
+    return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+static void op_result_add(OpResult* r, const RunResult* run) {
+    r->seconds[r->runs++] = run->seconds;
+    if (run->status != 0) r->failures++;
+    if (run->max_rss_kb > r->max_rss_kb) r->max_rss_kb = run->max_rss_kb;
+    if (run->bytes_written < 0 || r->bytes_written < 0) {
+        r->bytes_written = -1;
+    } else {
+        r->bytes_written += run->bytes_written;
+    }
+}
+
+static void print_result(const OpResult* r, bool last) {
+    double total = 0;
+    for (int i = 0; i < r->runs; i++) total += r->seconds[i];
+    qsort(r->seconds, (size_t)r->runs, sizeof(double), compare_doubles);
+    printf("    {\"op\":\"%s\",\"runs\":%d,\"failures\":%d,\"rows_per_run\":%llu,"
+           "\"rows_per_sec\":%.1f,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+           "\"peak_rss_kb\":%ld,",
+           r->op, r->runs, r->failures, (unsigned long long)r->rows_per_run,
+           total > 0 ? (double)r->rows_per_run * r->runs / total : 0.0,
+           r->runs ? total / r->runs * 1000 : 0.0,
+           r->runs ? percentile(r->seconds, r->runs, 50) * 1000 : 0.0,
+           r->runs ? percentile(r->seconds, r->runs, 99) * 1000 : 0.0,
+           r->max_rss_kb);
+    if (r->bytes_written >= 0 && r->runs > 0) {
+        printf("\"bytes_written_per_run\":%.0f}", (double)r->bytes_written / r->runs);
+    } else {
+        printf("\"bytes_written_per_run\":null}");
+    }
+    printf("%s\n", last ? "" : ",");
+}
+
+/* --------------------------------------------------------------------------
+ * The benchmark: load, then whole-table and single-record operations.
+ * -------------------------------------------------------------------------- */
+typedef struct {
+    const BenchConfig* c;
+    const Zipf* keys;
+    const Zipf* ids;
+    Rng rng;
+    char threads[16];
+    OpResult results[MAX_RESULTS];
+    int count;
+} Bench;
+
+// The simpledb command line: the binary, --db-path, --threads, then 'args'.
+static void command_line(Bench* b, char** argv, const char* const* args) {
+    int n = 0;
+    argv[n++] = (char*)b->c->simpledb;
+    argv[n++] = "--db-path";
+    argv[n++] = (char*)b->c->dir;
+    argv[n++] = "--threads";
+    argv[n++] = b->threads;
+    for (int i = 0; args[i] && n < MAX_ARGS - 1; i++) argv[n++] = (char*)args[i];
+    argv[n] = NULL;
+}
+
+static OpResult* bench_op(Bench* b, const char* op, uint64_t rows_per_run, int runs) {
+    OpResult* r = &b->results[b->count++];
+    memset(r, 0, sizeof(*r));
+    r->op = op;
+    r->rows_per_run = rows_per_run;
+    r->seconds = calloc((size_t)(runs > 0 ? runs : 1), sizeof(double));
+    if (!r->seconds) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    return r;
+}
+
+static int bench_run(Bench* b, OpResult* r, const char* const* args, const char* input) {
+    char* argv[MAX_ARGS];
+    RunResult run;
+    command_line(b, argv, args);
+    if (run_command(argv, input, &run) != 0) {
+        fprintf(stderr, "Error: Could not run %s: %s\n", argv[0], strerror(errno));
+        return -1;
+    }
+    op_result_add(r, &run);
+    return 0;
+}
+
+// The same command 'runs' times.
+static int bench_repeat(Bench* b, const char* op, uint64_t rows, int runs,
+                        const char* const* args, const char* input) {
+    OpResult* r = bench_op(b, op, rows, runs);
+    for (int i = 0; i < runs; i++) {
+        if (bench_run(b, r, args, input) != 0) return -1;
+    }
+    return 0;
+}
+
+// 'get <table> key=kN' for keys drawn from the skewed distribution.
+static int bench_get_keys(Bench* b, const char* op) {
+    OpResult* r = bench_op(b, op, 1, b->c->ops);
+    char arg[64];
+    const char* args[] = { "get", "bench", arg, NULL };
+    for (int i = 0; i < b->c->ops; i++) {
+        snprintf(arg, sizeof(arg), "key=k%llu",
+                 (unsigned long long)zipf_draw(b->keys, &b->rng));
+        if (bench_run(b, r, args, NULL) != 0) return -1;
+    }
+    return 0;
+}
+
+static int bench_get_ids(Bench* b) {
+    OpResult* r = bench_op(b, "get_id", 1, b->c->ops);
+    char arg[64];
+    const char* args[] = { "get", "bench", arg, NULL };
+    for (int i = 0; i < b->c->ops; i++) {
+        uint64_t id = id_of_rank(zipf_draw(b->ids, &b->rng), b->c->rows);
+        snprintf(arg, sizeof(arg), "id=%llu", (unsigned long long)id);
+        if (bench_run(b, r, args, NULL) != 0) return -1;
+    }
+    return 0;
+}
+
+// Updates of skewed ids, or inserts of new records.
+static int bench_saves(Bench* b, bool update) {
+    OpResult* r = bench_op(b, update ? "save_update" : "save_insert", 1, b->c->ops);
+    char id_arg[64], key_arg[64], value_arg[MAX_VALUE + 8], value[MAX_VALUE + 1];
+    const char* update_args[] = { "save", "bench", id_arg, value_arg, NULL };
+    const char* insert_args[] = { "save", "bench", key_arg, value_arg, NULL };
+    for (int i = 0; i < b->c->ops; i++) {
+        uint64_t id = id_of_rank(zipf_draw(b->ids, &b->rng), b->c->rows);
+        snprintf(id_arg, sizeof(id_arg), "id=%llu", (unsigned long long)id);
+        snprintf(key_arg, sizeof(key_arg), "key=k%llu",
+                 (unsigned long long)zipf_draw(b->keys, &b->rng));
+        random_value(&b->rng, value, b->c->value_size);
+        snprintf(value_arg, sizeof(value_arg), "f1=%s", value);
+        if (bench_run(b, r, update ? update_args : insert_args, NULL) != 0) return -1;
+    }
+    return 0;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Deletes of distinct ids, walking the table with a stride coprime to it.
+static int bench_deletes(Bench* b) {
+    int runs = (uint64_t)b->c->ops < b->c->rows ? b->c->ops : (int)b->c->rows;
+    OpResult* r = bench_op(b, "delete", 1, runs);
+    char arg[64];
+    const char* args[] = { "delete", "bench", arg, NULL };
+    uint64_t stride = 2654435761ULL % b->c->rows;
+    while (b->c->rows > 1 && gcd(stride, b->c->rows) != 1) stride++;
+    for (int i = 0; i < runs; i++) {
+        uint64_t id = (uint64_t)i * stride % b->c->rows + 1;
+        snprintf(arg, sizeof(arg), "id=%llu", (unsigned long long)id);
+        if (bench_run(b, r, args, NULL) != 0) return -1;
+    }
+    return 0;
+}
+
+static int run_bench(Bench* b, const char* rows_path) {
+    const BenchConfig* c = b->c;
+    const char* create[] = { "create", "bench", "--format", format_names[c->format], NULL };
+    const char* load[] = { "save", "bench", "--from-stdin", NULL };
+    const char* list[] = { "list", "bench", NULL };
+    const char* export[] = { "export", "bench", NULL };
+    const char* agg[] = { "agg", "bench", "--group-by", "key", "--count", NULL };
+    const char* index_create[] = { "index", "create", "bench", "key", NULL };
+    const char* checkpoint[] = { "checkpoint", NULL };
+    const char* vacuum[] = { "vacuum", "bench", NULL };
+
+    // What settles the load before the reads: JSON tables fold the log
+    // into the file, lsm tables merge the runs it left; paged tables are
+    // written in place
+    const char* settle_name = NULL;
+    const char** settle = NULL;
+    bool indexed = true;
+    switch (c->format) {
+    case FORMAT_JSON:
+    case FORMAT_COMPRESSED:
+        settle_name = "checkpoint";
+        settle = checkpoint;
+        break;
+    case FORMAT_LSM:
+        settle_name = "vacuum";
+        settle = vacuum;
+        indexed = false;
+        break;
+    default:
+        break;
+    }
+
+    if (bench_repeat(b, "create", 0, 1, create, NULL) != 0 ||
+        b->results[b->count - 1].failures) {
+        fprintf(stderr, "Error: Could not create the table (format %s)\n",
+                format_names[c->format]);
+        return -1;
+    }
+    if (bench_repeat(b, "bulk_save", c->rows, 1, load, rows_path) != 0) return -1;
+    if (settle && bench_repeat(b, settle_name, c->rows, 1, settle, NULL) != 0) return -1;
+    if (bench_repeat(b, "list", c->rows, c->repeat, list, NULL) != 0) return -1;
+    if (bench_repeat(b, "export", c->rows, c->repeat, export, NULL) != 0) return -1;
+    if (bench_repeat(b, "agg", c->rows, c->repeat, agg, NULL) != 0) return -1;
+    if (bench_get_keys(b, "get_scan") != 0) return -1;
+    if (bench_get_ids(b) != 0) return -1;
+    if (indexed) {
+        if (bench_repeat(b, "index_create", c->rows, 1, index_create, NULL) != 0) return -1;
+        if (bench_get_keys(b, "get_indexed") != 0) return -1;
+    }
+    if (bench_saves(b, true) != 0 || bench_saves(b, false) != 0) return -1;
+    if (bench_deletes(b) != 0) return -1;
+    return 0;
+}
+
+/* --------------------------------------------------------------------------
+ * Options and main
+ * -------------------------------------------------------------------------- */
+static void print_usage(const char* prog_name) {
+    fprintf(stderr,
+        "Usage:\n"
+        "  %s [--simpledb PATH] [--dir DIR] [--format json|compressed|paged|lsm]\n"
+        "     [--rows N] [--fields N] [--value-size N] [--keys N] [--skew S]\n"
+        "     [--ops N] [--repeat N] [--threads N] [--seed N]\n", prog_name);
+}
+
+static bool parse_count(const char* text, uint64_t min, uint64_t max, uint64_t* out) {
+    char* end = NULL;
+    errno = 0;
+    unsigned long long n = strtoull(text, &end, 10);
+    if (errno != 0 || !end || *end != '\0' || text[0] == '-' || n < min || n > max) return false;
+    *out = n;
+    return true;
+}
+
+static int parse_options(int argc, char* argv[], BenchConfig* c) {
+    uint64_t n;
+    for (int i = 1; i < argc; i++) {
+        const char* opt = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        i++;
+        bool ok = true;
+        if (strcmp(opt, "--simpledb") == 0) {
+            c->simpledb = value;
+        } else if (strcmp(opt, "--dir") == 0) {
+            c->dir = value;
+        } else if (strcmp(opt, "--format") == 0) {
+            int f = 0;
+            while (f < FORMAT_COUNT && strcmp(value, format_names[f]) != 0) f++;
+            ok = f < FORMAT_COUNT;
+            if (ok) c->format = (BenchFormat)f;
+        } else if (strcmp(opt, "--rows") == 0) {
+            ok = parse_count(value, 1, MAX_ROWS, &c->rows);
+        } else if (strcmp(opt, "--fields") == 0) {
+            ok = parse_count(value, 0, MAX_FIELDS, &n);
+            c->fields = (int)n;
+        } else if (strcmp(opt, "--value-size") == 0) {
+            ok = parse_count(value, 1, MAX_VALUE, &n);
+            c->value_size = (int)n;
+        } else if (strcmp(opt, "--keys") == 0) {
+            ok = parse_count(value, 1, MAX_ROWS, &c->keys);
+        } else if (strcmp(opt, "--skew") == 0) {
+            char* end = NULL;
+            c->skew = strtod(value, &end);
+            ok = end && *end == '\0' && c->skew >= 0 && c->skew <= 10;
+        } else if (strcmp(opt, "--ops") == 0) {
+            ok = parse_count(value, 1, 1000000, &n);
+            c->ops = (int)n;
+        } else if (strcmp(opt, "--repeat") == 0) {
+            ok = parse_count(value, 1, 1000, &n);
+            c->repeat = (int)n;
+        } else if (strcmp(opt, "--threads") == 0) {
+            ok = parse_count(value, 1, 256, &n);
+            c->threads = (int)n;
+        } else if (strcmp(opt, "--seed") == 0) {
+            ok = parse_count(value, 0, UINT64_MAX, &c->seed);
+        } else {
+            print_usage(argv[0]);
+            return -1;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error: Invalid value '%s' for %s\n", value, opt);
+            return -1;
+        }
+    }
+    if (c->keys == 0) c->keys = c->rows / 10 ? c->rows / 10 : 1;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig c = { "./simpledb", "bench_db", FORMAT_JSON, 10000, 4, 16, 0, 0.99, 200, 3, 1, 1 };
+    if (parse_options(argc, argv, &c) != 0) return 1;
+    if (access(c.simpledb, X_OK) != 0) {
+        fprintf(stderr, "Error: '%s' is not an executable simpledb binary\n", c.simpledb);
+        return 1;
+    }
+
+    // A fresh scratch directory, holding the database and the generated rows
+    char command[2048], rows_path[1100];
+    snprintf(command, sizeof(command), "rm -rf '%s' && mkdir -p '%s'", c.dir, c.dir);
+    if (strchr(c.dir, '\'') || system(command) != 0) {
+        fprintf(stderr, "Error: Could not set up directory '%s'\n", c.dir);
+        return 1;
+    }
+    snprintf(rows_path, sizeof(rows_path), "%s/rows.jsonl", c.dir);
+
+    Zipf keys = { c.keys, c.skew }, ids = { c.rows, c.skew };
+    if (generate_rows(&c, &keys, rows_path) != 0) return 1;
+
+    Bench b;
+    memset(&b, 0, sizeof(b));
+    b.c = &c;
+    b.keys = &keys;
+    b.ids = &ids;
+    b.rng.state = c.seed * 0xD1B54A32D192ED03ULL + 7;
+    snprintf(b.threads, sizeof(b.threads), "%d", c.threads);
+    int ret = run_bench(&b, rows_path);
+
+    printf("{\n  \"config\":{\"format\":\"%s\",\"rows\":%llu,\"fields\":%d,\"value_size\":%d,"
+           "\"keys\":%llu,\"skew\":%.3f,\"ops\":%d,\"repeat\":%d,\"threads\":%d,\"seed\":%llu},\n"
+           "  \"results\":[\n",
+           format_names[c.format], (unsigned long long)c.rows, c.fields, c.value_size,
+           (unsigned long long)c.keys, c.skew, c.ops, c.repeat, c.threads,
+           (unsigned long long)c.seed);
+    for (int i = 0; i < b.count; i++) {
+        print_result(&b.results[i], i + 1 == b.count);
+        free(b.results[i].seconds);
+    }
+    printf("  ]\n}\n");
+    return ret == 0 ? 0 : 1;
+}
@@ -26,8 +26,14 @@ DB1="testdb1"
 DB2="testdb2"
 DB3="testdb3"
 
-# Clean up any old directories from previous tests
+# Scratch files of the later sections, removed again at the end
+SCRATCH_FILES="people_export.json metrics.json people.csv people_export.csv people_update.csv
+  people_bad.csv columnar_get_rows.txt columnar_agg_rows.txt snapshot.out clicks.jsonl
+  clicks.before tickets.csv ordered.csv counted.out odd_ids.json"
+
+# Clean up any old directories and files from previous tests
 rm -rf "$DB1" "$DB2" "$DB3"
+rm -f $SCRATCH_FILES
 
 # Create fresh directories
 mkdir -p "$DB1"
@@ -286,15 +292,566 @@ echo ""
 echo "### 10) End of tests for $DB3."
 
 ################################################################################
-# 11) Final Checks
+# 11) Paged tables and JSON import/export
+################################################################################
+
+echo ""
+echo "### 11) Paged tables in $DB3..."
+
+echo "- Creating a paged 'events' table:"
+$SIMPLEDB --db-path "$DB3" create events --format paged
+
+echo "- Trying to create it again (expect error):"
+$SIMPLEDB --db-path "$DB3" create events --format paged 2>&1 || true
+
+echo "- Saving, updating and deleting records in place:"
+$SIMPLEDB --db-path "$DB3" save events kind=login user=bob
+$SIMPLEDB --db-path "$DB3" save events kind=logout user=bob
+$SIMPLEDB --db-path "$DB3" save events id=1 user=alice
+$SIMPLEDB --db-path "$DB3" delete events kind=logout
+
+echo "- Listing 'events' (same JSON lines output as a JSON table):"
+$SIMPLEDB --db-path "$DB3" list events
+
+echo "- Exporting 'people' and importing it into a new paged table:"
+$SIMPLEDB --db-path "$DB3" export people > people_export.json
+$SIMPLEDB --db-path "$DB3" create people_paged --format paged
+$SIMPLEDB --db-path "$DB3" import people_paged people_export.json
+$SIMPLEDB --db-path "$DB3" get people_paged name=Charlie
+
+echo "- Exports of both tables should be identical:"
+diff <($SIMPLEDB --db-path "$DB3" export people) <($SIMPLEDB --db-path "$DB3" export people_paged) \
+  && echo "identical"
+
+echo "- Importing ids that are not positive integers (expect errors, nothing imported):"
+for id in 1.5 0 1e19; do
+  echo "[{\"id\":$id,\"name\":\"Odd\"}]" > odd_ids.json
+  $SIMPLEDB --db-path "$DB3" import people_paged odd_ids.json 2>&1 || true
+done
+$SIMPLEDB --db-path "$DB3" get people_paged name=Odd 2>&1 || true
+
+################################################################################
+# 12) Write-ahead log and checkpoints
+################################################################################
+
+echo ""
+echo "### 12) Write-ahead log in $DB2..."
+
+echo "- Saves and deletes are appended to $DB2/simpledb.wal, not to users.json:"
+$SIMPLEDB --db-path "$DB2" save users id=1000 name="Wal Writer"
+$SIMPLEDB --db-path "$DB2" delete users id=999
+ls "$DB2"
+
+echo "- Reads replay the log on top of the table file:"
+$SIMPLEDB --db-path "$DB2" list users
+
+echo "- Running concurrent saves (they share fsyncs through group commit):"
+for n in 1 2 3 4 5; do
+  $SIMPLEDB --db-path "$DB2" save users id=200$n name="Writer $n" > /dev/null &
+done
+wait
+$SIMPLEDB --db-path "$DB2" list users | wc -l
+
+echo "- Checkpointing folds the log into users.json:"
+$SIMPLEDB --db-path "$DB2" checkpoint
+$SIMPLEDB --db-path "$DB2" get users id=1000
+
+################################################################################
+# 13) Secondary hash indexes
+################################################################################
+
+echo ""
+echo "### 13) Secondary hash indexes..."
+
+echo "- Indexing users.email in $DB2 and the paged events.user in $DB3:"
+$SIMPLEDB --db-path "$DB2" index create users email
+$SIMPLEDB --db-path "$DB3" index create events user
+ls "$DB2" "$DB3" | grep '\.idx$'
+
+echo "- get and delete look the value up in the index instead of scanning:"
+$SIMPLEDB --db-path "$DB2" save users id=3000 name="Indexed" email="indexed@example.com"
+$SIMPLEDB --db-path "$DB2" get users email=indexed@example.com
+$SIMPLEDB --db-path "$DB3" save events id=5 kind="login" user="carol"
+$SIMPLEDB --db-path "$DB3" get events user=carol
+$SIMPLEDB --db-path "$DB3" delete events user=carol
+$SIMPLEDB --db-path "$DB3" get events user=carol
+
+echo "- The index stays up to date across checkpoints:"
+$SIMPLEDB --db-path "$DB2" checkpoint
+$SIMPLEDB --db-path "$DB2" get users email=indexed@example.com
+$SIMPLEDB --db-path "$DB2" index drop users email
+
+################################################################################
+# 14) Primary-key B+tree and id ranges
+################################################################################
+
+echo ""
+echo "### 14) Id ranges through the primary-key B+tree..."
+
+echo "- Every table keeps a B+tree on 'id' next to it once written:"
+$SIMPLEDB --db-path "$DB3" checkpoint
+ls "$DB3" | grep '\.btree$'
+
+echo "- Listing people with 2 <= id <= 10 (in id order):"
+$SIMPLEDB --db-path "$DB3" list people --id-range 2..10
+
+echo "- New ids come from the stored high-water mark, even after deletes:"
+$SIMPLEDB --db-path "$DB3" save events id=40 kind="login" user="dave"
+$SIMPLEDB --db-path "$DB3" delete events id=40
+$SIMPLEDB --db-path "$DB3" save events kind="logout" user="dave"
+$SIMPLEDB --db-path "$DB3" list events --id-range 1..100
+
+################################################################################
+# 15) Streaming list
+################################################################################
+
+echo ""
+echo "### 15) 'list' streams the table file instead of loading it..."
+
+echo "- A hand-edited, pretty-printed table still lists as one record per line:"
+cat > "$DB3/notes.json" <<'JSON'
+[
+  { "id": "1", "text": "first note" },
+  { "id": "2", "text": "second note", "tags": [ "a", "b" ] }
+]
+JSON
+$SIMPLEDB --db-path "$DB3" list notes
+
+echo "- Pending log entries are merged in while streaming:"
+$SIMPLEDB --db-path "$DB3" save notes id=1 text="edited note"
+$SIMPLEDB --db-path "$DB3" save notes text="third note"
+$SIMPLEDB --db-path "$DB3" list notes
+
+echo ""
+echo "### 16) The block scanner skips brackets and quotes inside strings..."
+cat > "$DB3/quotes.json" <<'JSON'
+[{"id":"1","text":"a } and a ] inside"},{"id":"2","text":"escaped \\\" quote { ["},
+ {"id":"3","text":"trailing backslash \\\\"},{"id":"4","nested":{"a":["}"]}}]
+JSON
+echo "- All kernels (scalar, SSE4.2, AVX2) give the same records:"
+for scanner in scalar sse4.2 avx2; do
+    echo "  $scanner:"
+    SIMPLEDB_SCANNER=$scanner $SIMPLEDB --db-path "$DB3" list quotes
+done
+
+echo ""
+echo "### 17) 'get' checks the raw record bytes before parsing..."
+cat > "$DB3/names.json" <<'JSON'
+[{"id":"1","name":"\u0041nn"},{"id":"2","name":"Ann"},{"id":"3","name" : "Ann"},
+ {"id":"4","owner":{"name":"Ann"}},{"id":"5","name":"Anna"}]
+JSON
+echo "- name=Ann matches escaped and spaced spellings, not nested fields or prefixes:"
+$SIMPLEDB --db-path "$DB3" get names name=Ann
+
+echo ""
+echo "### 18) Parallel scans with --threads..."
+$SIMPLEDB --db-path "$DB3" create metrics --format paged
+for n in $(seq 1 1500); do
+    printf '{"id":"%d","host":"h%d","load":"%d"}\n' "$n" $((n % 7)) $((n % 100))
+done | jq -s . > metrics.json
+$SIMPLEDB --db-path "$DB3" import metrics metrics.json
+cp metrics.json "$DB3/metrics_json.json"
+for table in metrics metrics_json; do
+    echo "- $table: list and get give the same output on 1 and 4 threads:"
+    diff <($SIMPLEDB --db-path "$DB3" list $table) \
+         <($SIMPLEDB --threads 4 --db-path "$DB3" list $table) && echo "  list: same"
+    diff <($SIMPLEDB --db-path "$DB3" get $table host=h3) \
+         <($SIMPLEDB --threads 4 --db-path "$DB3" get $table host=h3) && echo "  get: same"
+    echo "- Deleting host=h5 on 4 threads:"
+    $SIMPLEDB --threads 4 --db-path "$DB3" delete $table host=h5
+    $SIMPLEDB --db-path "$DB3" list $table | grep -c '"host":"h5"' || true
+done
+echo "- --threads needs a positive count (expect error):"
+$SIMPLEDB --threads 0 --db-path "$DB3" list metrics 2>&1 || true
+
+echo ""
+echo "### 19) Server mode over a Unix domain socket..."
+SOCKET="simpledb_test.sock"
+$SIMPLEDB serve --db-path "$DB3" --socket "$SOCKET" 2>/dev/null &
+SERVER_PID=$!
+for _ in $(seq 1 50); do [ -S "$SOCKET" ] && break; sleep 0.1; done
+echo "- list and get through the server:"
+$SIMPLEDB --socket "$SOCKET" get people name=Bob
+$SIMPLEDB --socket "$SOCKET" list notes
+echo "- A save through the server shows up in the next get:"
+$SIMPLEDB --socket "$SOCKET" save notes id=2 text="second note, edited"
+$SIMPLEDB --socket "$SOCKET" get notes id=2
+echo "- A save made without the server is picked up too:"
+$SIMPLEDB --db-path "$DB3" save notes id=2 text="edited directly"
+$SIMPLEDB --socket "$SOCKET" get notes id=2
+echo "- Errors and exit codes come back from the server:"
+$SIMPLEDB --socket "$SOCKET" unknowncmd notes 2>&1 | head -1
+kill "$SERVER_PID"
+wait "$SERVER_PID" 2>/dev/null
+echo "- With the server stopped (expect error):"
+$SIMPLEDB --socket "$SOCKET" list notes 2>&1 || true
+
+echo ""
+echo "### 20) Bulk upserts with save --from-stdin..."
+echo "- JSON lines and field=value lines, new records and updates, in one pass:"
+$SIMPLEDB --db-path "$DB3" save contacts --from-stdin <<'LINES'
+{"id":"1","name":"Ann","phone":"555-0101"}
+name="Bob Stone" phone=555-0102
+
+id=1 phone=555-0199
+name="Quote \"Q\" Smith" phone=555-0103
+LINES
+$SIMPLEDB --db-path "$DB3" list contacts
+echo "- The same into a paged table:"
+$SIMPLEDB --db-path "$DB3" create contacts_paged --format paged
+$SIMPLEDB --db-path "$DB3" export contacts | jq -c '.[]' | \
+    $SIMPLEDB --db-path "$DB3" save contacts_paged --from-stdin
+$SIMPLEDB --db-path "$DB3" list contacts_paged
+echo "- A bad line rejects the whole batch (expect error, nothing saved):"
+printf 'name=Dan\nnot a record\n' | $SIMPLEDB --db-path "$DB3" save contacts --from-stdin 2>&1 || true
+$SIMPLEDB --db-path "$DB3" get contacts name=Dan
+
+echo ""
+echo "### 21) CSV import and export..."
+printf 'id,name,note\r\n1,Ann,"likes a, b and c"\r\n,Bob,"says ""hi"""\r\n3,,"two\nlines"\r\n' > people.csv
+echo "- Quoted commas, quotes and line breaks; a row without an id gets one:"
+$SIMPLEDB --db-path "$DB3" import people_csv people.csv
+$SIMPLEDB --db-path "$DB3" list people_csv
+echo "- Exported as CSV and imported into a paged table, it comes back the same:"
+$SIMPLEDB --db-path "$DB3" export people_csv --format csv > people_export.csv
+cat people_export.csv
+$SIMPLEDB --db-path "$DB3" create people_csv_paged --format paged
+$SIMPLEDB --db-path "$DB3" import people_csv_paged people_export.csv
+diff people_export.csv <($SIMPLEDB --db-path "$DB3" export people_csv_paged --format csv) && echo "  same"
+echo "- Rows for existing ids update those records:"
+printf 'id,name\n1,Anne\n4,Dan\n' > people_update.csv
+for table in people_csv people_csv_paged; do
+    $SIMPLEDB --db-path "$DB3" import $table people_update.csv
+    $SIMPLEDB --db-path "$DB3" get $table name=Anne
+done
+echo "- A row with the wrong number of fields (expect error, nothing imported):"
+printf 'id,name\n5,Eve\n6,Fay,extra\n' > people_bad.csv
+$SIMPLEDB --db-path "$DB3" import people_csv people_bad.csv 2>&1 || true
+$SIMPLEDB --db-path "$DB3" get people_csv name=Eve
+
+echo ""
+echo "### 22) Native hash join..."
+echo "- users.id=orders.user_id in $DB1, the same pairs as 9d:"
+$SIMPLEDB --db-path "$DB1" join users orders users.id=orders.user_id
+echo "- With a 1K memory budget the tables are split into partitions first:"
+for n in $(seq 1 300); do
+    printf '{"id":"%d","user_id":"%d","amount":"%d"}\n' "$n" $((n % 40)) "$n"
+done | $SIMPLEDB --db-path "$DB3" save payments --from-stdin
+diff <($SIMPLEDB --db-path "$DB3" join metrics payments metrics.load=payments.user_id | sort) \
+     <($SIMPLEDB --db-path "$DB3" join metrics payments metrics.load=payments.user_id \
+           --memory 1K | sort) && echo "  same pairs"
+$SIMPLEDB --db-path "$DB3" join metrics payments metrics.load=payments.user_id | wc -l
+echo "- A condition naming another table (expect error):"
+$SIMPLEDB --db-path "$DB1" join users orders users.id=payments.user_id 2>&1 || true
+
+echo ""
+echo "### 23) Aggregation with agg..."
+echo "- Order count and total per user; prices are stored as strings like \"15.00\":"
+$SIMPLEDB --db-path "$DB1" agg orders --group-by user_id --count --sum price
+echo "- Over the whole table:"
+$SIMPLEDB --db-path "$DB1" agg orders --count --min price --max price
+echo "- The same groups on 1 and 4 threads, paged and JSON:"
+for table in metrics metrics_json; do
+    diff <($SIMPLEDB --db-path "$DB3" agg $table --group-by host --count --sum load --max load) \
+         <($SIMPLEDB --threads 4 --db-path "$DB3" agg $table --group-by host --count --sum load \
+               --max load) && echo "  $table: same"
+done
+$SIMPLEDB --db-path "$DB3" agg metrics --group-by host --count --sum load --max load
+echo "- Without anything to compute (expect error):"
+$SIMPLEDB --db-path "$DB3" agg metrics --group-by host 2>&1 || true
+
+echo ""
+echo "### 24) Columnar snapshots..."
+for table in metrics metrics_json; do
+    $SIMPLEDB --db-path "$DB3" get $table host=h3 > columnar_get_rows.txt
+    $SIMPLEDB --db-path "$DB3" agg $table --group-by host --count --sum load > columnar_agg_rows.txt
+    $SIMPLEDB --db-path "$DB3" compact $table --columnar
+    echo "- $table: get and agg read the columns and give the same results:"
+    wc -l < columnar_get_rows.txt
+    diff columnar_get_rows.txt <($SIMPLEDB --db-path "$DB3" get $table host=h3) && echo "  same"
+    diff columnar_agg_rows.txt <($SIMPLEDB --threads 4 --db-path "$DB3" agg $table \
+                                     --group-by host --count --sum load) && echo "  same"
+done
+ls "$DB3" | grep -c '^metrics\.[0-9]*\.col$'
+echo "- After a save the snapshot is stale and the rows are read again:"
+$SIMPLEDB --db-path "$DB3" save metrics_json host=h3 load=1
+$SIMPLEDB --db-path "$DB3" get metrics_json host=h3 | wc -l
+echo "- Compacting needs --columnar (expect error):"
+$SIMPLEDB --db-path "$DB3" compact metrics 2>&1 || true
+
+echo ""
+echo "### 25) Projections with --fields..."
+echo "- Only id and email of every user, in that order:"
+$SIMPLEDB --db-path "$DB1" list users --fields email,id
+echo "- get, and fields a record doesn't have are left out:"
+$SIMPLEDB --db-path "$DB1" get orders user_id=100 --fields order_id,price,nope
+echo "- The same from the rows and from the columnar snapshot of metrics:"
+$SIMPLEDB --db-path "$DB3" compact metrics --columnar
+diff <($SIMPLEDB --db-path "$DB3" list metrics --fields load,id) \
+     <($SIMPLEDB --db-path "$DB3" list metrics | jq -c '{load, id}') && echo "  same"
+$SIMPLEDB --db-path "$DB3" list metrics --id-range 5..6 --fields host
+echo "- An empty field list (expect error):"
+$SIMPLEDB --db-path "$DB1" list users --fields , 2>&1 || true
+
+echo ""
+echo "### 26) Concurrent writers..."
+$SIMPLEDB --db-path "$DB3" create tally
+$SIMPLEDB --db-path "$DB3" create tally_paged --format paged
+for t in tally tally_paged; do
+  $SIMPLEDB --db-path "$DB3" save "$t" id=1 w1=0 w2=0 w3=0 w4=0 > /dev/null
+done
+echo "- Four writers at once, each adding records and updating its own field of record 1:"
+for w in 1 2 3 4; do
+  (
+    for k in 1 2 3 4 5 6 7 8 9 10; do
+      for t in tally tally_paged; do
+        $SIMPLEDB --db-path "$DB3" save "$t" writer=$w > /dev/null
+        $SIMPLEDB --db-path "$DB3" save "$t" id=1 w$w=$k > /dev/null
+      done
+    done
+    printf '{"writer":"%s"}\n{"writer":"%s"}\n' $w $w | $SIMPLEDB --db-path "$DB3" save tally --from-stdin > /dev/null
+  ) &
+done
+wait
+for t in tally tally_paged; do
+  echo "  $t: $($SIMPLEDB --db-path "$DB3" list "$t" | wc -l) records," \
+       "$($SIMPLEDB --db-path "$DB3" list "$t" | jq -r .id | sort -u | wc -l) distinct ids"
+  $SIMPLEDB --db-path "$DB3" get "$t" id=1
+done
+
+echo ""
+echo "### 27) Snapshot reads and vacuum..."
+$SIMPLEDB --db-path "$DB3" create ledger --format paged
+for i in $(seq 1 2000); do
+  printf '{"id":"%d","balance":"10","memo":"opening balance for account %d"}\n' $i $i
+done | $SIMPLEDB --db-path "$DB3" save ledger --from-stdin
+echo "- A slow export keeps reading the table as it was when it started:"
+$SIMPLEDB --db-path "$DB3" export ledger \
+  | { sleep 3; jq -c '{records: length, total: (map(.balance | tonumber) | add)}'; } > snapshot.out &
+sleep 1
+for i in $(seq 1 2000); do
+  printf '{"id":"%d","balance":"20"}\n' $i
+done | $SIMPLEDB --db-path "$DB3" save ledger --from-stdin
+$SIMPLEDB --db-path "$DB3" delete ledger id=7
+echo "- Vacuum keeps what the export still needs:"
+$SIMPLEDB --db-path "$DB3" vacuum ledger
+wait
+cat snapshot.out
+echo "- The table now, and vacuum once the export is done:"
+$SIMPLEDB --db-path "$DB3" list ledger | jq -s -c '{records: length, total: (map(.balance | tonumber) | add)}'
+$SIMPLEDB --db-path "$DB3" vacuum ledger
+echo "- Vacuum on a JSON table (expect error):"
+$SIMPLEDB --db-path "$DB1" vacuum users 2>&1 || true
+
+echo ""
+echo "### 28) Arena allocation and --stats..."
+echo "- Same output with the report on, which goes to stderr:"
+for args in "$DB3 list ledger" "$DB3 export ledger" "$DB3 agg ledger --group-by balance --count" \
+            "$DB1 get orders user_id=100"; do
+  set -- $args
+  db=$1; shift
+  diff <($SIMPLEDB --db-path "$db" "$@") \
+       <($SIMPLEDB --stats --threads 4 --db-path "$db" "$@" 2>/dev/null) && echo "  $*: same"
+done
+echo "- The report names its counters:"
+$SIMPLEDB --stats --db-path "$DB3" export ledger 2>&1 > /dev/null | sed 's/=[0-9]*/=N/g'
+echo "- Records allocated through the arena are all there after a bulk save:"
+$SIMPLEDB --db-path "$DB3" create arena_check
+for i in $(seq 1 500); do
+  printf '{"id":"%d","note":"arena record %d"}\n' $i $i
+done | $SIMPLEDB --stats --db-path "$DB3" save arena_check --from-stdin 2>/dev/null
+$SIMPLEDB --db-path "$DB3" list arena_check | jq -s -c '{records: length, last: .[-1].note}'
+
+echo ""
+echo "### 29) Compressed tables..."
+$SIMPLEDB --db-path "$DB3" create clicks --format compressed
+$SIMPLEDB --db-path "$DB3" create clicks_plain
+for i in $(seq 1 3000); do
+  printf '{"id":"%d","kind":"click","page":"/products/%d","user":"u%d"}\n' $i $((i % 40)) $((i % 7))
+done > clicks.jsonl
+for t in clicks clicks_plain; do
+  $SIMPLEDB --db-path "$DB3" save "$t" --from-stdin < clicks.jsonl
+done
+$SIMPLEDB --db-path "$DB3" checkpoint
+echo "- The file is kept in blocks, and reads the same as the plain table:"
+head -c 8 "$DB3/clicks.json"; echo
+[ "$(stat -c %s "$DB3/clicks.json")" -lt "$(stat -c %s "$DB3/clicks_plain.json")" ] && echo "  smaller"
+diff <($SIMPLEDB --db-path "$DB3" list clicks) <($SIMPLEDB --db-path "$DB3" list clicks_plain) && echo "  same"
+echo "- Point reads through the id tree and an index:"
+$SIMPLEDB --db-path "$DB3" index create clicks page > /dev/null
+$SIMPLEDB --db-path "$DB3" list clicks --id-range 2999..3000
+$SIMPLEDB --db-path "$DB3" get clicks page=/products/39 | wc -l
+$SIMPLEDB --db-path "$DB3" agg clicks --group-by user --count | head -3
+echo "- Saves and deletes go through the log and stay compressed after a checkpoint:"
+$SIMPLEDB --db-path "$DB3" save clicks id=5 kind=purchase
+$SIMPLEDB --db-path "$DB3" delete clicks id=6
+$SIMPLEDB --db-path "$DB3" checkpoint
+head -c 8 "$DB3/clicks.json"; echo
+$SIMPLEDB --db-path "$DB3" list clicks --id-range 5..7
+echo "- A CSV import into it:"
+$SIMPLEDB --db-path "$DB3" import clicks users.csv
+$SIMPLEDB --db-path "$DB3" list clicks | wc -l
+echo "- Back to plain text and compressed again, without changing a record:"
+$SIMPLEDB --db-path "$DB3" export clicks > clicks.before
+$SIMPLEDB --db-path "$DB3" compact clicks --plain | sed 's/[0-9]* bytes/N bytes/g'
+head -c 1 "$DB3/clicks.json"; echo
+$SIMPLEDB --db-path "$DB3" compact clicks --compressed | sed 's/[0-9]* bytes/N bytes/g'
+$SIMPLEDB --db-path "$DB3" export clicks | cmp - clicks.before && echo "  same"
+echo "- Paged tables can't be compressed (expect error):"
+$SIMPLEDB --db-path "$DB3" compact ledger --compressed 2>&1 || true
+
+echo ""
+echo "### 30) Per-phase --profile..."
+echo "- Same output with the profile on, which goes to stderr:"
+for args in "$DB3 list clicks" "$DB3 get ledger balance=20" "$DB1 export users"; do
+  set -- $args
+  db=$1; shift
+  diff <($SIMPLEDB --db-path "$db" "$@") \
+       <($SIMPLEDB --profile --db-path "$db" "$@" 2>/dev/null) && echo "  $*: same"
+done
+echo "- One JSON line, with the phases that ran:"
+$SIMPLEDB --profile --db-path "$DB3" get clicks user=u3 2>&1 > /dev/null \
+  | jq -c '{command, table, status, phases: (.phases | keys_unsorted),
+            ran: [.phases | to_entries[] | select(.value.calls > 0) | .key]}'
+$SIMPLEDB --profile --db-path "$DB3" save clicks id=7 kind=view 2>&1 > /dev/null \
+  | jq -c '{command, wrote: (.phases.write.bytes > 0), printed: (.phases.print.calls > 0)}'
+$SIMPLEDB --profile --db-path "$DB3" checkpoint 2>&1 > /dev/null | jq -c '{command, table}'
+
+echo ""
+echo "### 31) Id sequences and --reserve..."
+for t in tickets tickets_paged; do
+  if [ "$t" = tickets_paged ]; then
+    $SIMPLEDB --db-path "$DB3" create "$t" --format paged
+  fi
+  echo "- $t: automatic ids, a reserved range, and ids after it:"
+  $SIMPLEDB --db-path "$DB3" save "$t" title=first | jq -r .id
+  $SIMPLEDB --db-path "$DB3" save "$t" id=40 title=explicit > /dev/null
+  $SIMPLEDB --db-path "$DB3" save "$t" --reserve 10
+  $SIMPLEDB --db-path "$DB3" save "$t" title=after | jq -r .id
+  printf '{"title":"bulk one"}\n{"title":"bulk two"}\n' \
+    | $SIMPLEDB --db-path "$DB3" save "$t" --from-stdin > /dev/null
+  printf 'title\ncsv row\n' > tickets.csv
+  $SIMPLEDB --db-path "$DB3" import "$t" tickets.csv > /dev/null
+  $SIMPLEDB --db-path "$DB3" list "$t" | jq -r .id | tr '\n' ' '; echo
+  echo "- An id deleted from the end is not handed out again:"
+  $SIMPLEDB --db-path "$DB3" delete "$t" title="csv row" > /dev/null
+  $SIMPLEDB --db-path "$DB3" save "$t" title=last | jq -r .id
+done
+echo "- Concurrent saves each get an id of their own:"
+for i in $(seq 1 8); do
+  $SIMPLEDB --db-path "$DB3" save tickets title="racer $i" > /dev/null &
+done
+wait
+$SIMPLEDB --db-path "$DB3" list tickets | jq -r .id | sort -n | uniq -d | wc -l
+echo "- Bad reservations (expect errors):"
+$SIMPLEDB --db-path "$DB3" save tickets --reserve 0 2>&1 || true
+$SIMPLEDB --db-path "$DB3" save tickets --reserve lots 2>&1 || true
+
+echo ""
+echo "### 32) Range and prefix queries through ordered indexes..."
+for t in shifts shifts_paged; do
+  if [ "$t" = shifts_paged ]; then
+    $SIMPLEDB --db-path "$DB3" create "$t" --format paged
+  fi
+  for d in 2025-01-07 2025-01-02 2025-02-01 2025-01-15 2024-12-31; do
+    $SIMPLEDB --db-path "$DB3" save "$t" day=$d who="w$d" > /dev/null
+  done
+  echo "- $t: January by a scan, in table order:"
+  $SIMPLEDB --db-path "$DB3" get "$t" 'day>=2025-01-01' 'day<2025-02-01' --fields day
+  $SIMPLEDB --db-path "$DB3" index create "$t" day --ordered
+  echo "- The same through the index, in key order, with a later save merged in:"
+  $SIMPLEDB --db-path "$DB3" save "$t" day=2025-01-10 who=late > /dev/null
+  $SIMPLEDB --db-path "$DB3" get "$t" 'day>=2025-01-01' 'day<2025-02-01' --fields day
+  echo "- between, prefix, open bounds and equality:"
+  $SIMPLEDB --db-path "$DB3" get "$t" day between 2025-01-02 2025-01-10 --fields day | tr '\n' ' '; echo
+  $SIMPLEDB --db-path "$DB3" get "$t" 'day^=2024' --fields day
+  $SIMPLEDB --db-path "$DB3" get "$t" 'day>2025-01-15' --fields day
+  $SIMPLEDB --db-path "$DB3" get "$t" day=2025-01-07 --fields who
+  echo "- A deleted record leaves the range, also after a checkpoint:"
+  $SIMPLEDB --db-path "$DB3" delete "$t" day=2025-01-02 > /dev/null
+  $SIMPLEDB --db-path "$DB3" checkpoint > /dev/null
+  $SIMPLEDB --db-path "$DB3" get "$t" 'day<=2025-01-07' --fields day | tr '\n' ' '; echo
+done
+echo "- Many paged inserts stay in key order as the index is sorted again:"
+seq 3000 -1 1 | awk 'BEGIN { print "n" } { printf "%05d\n", $1 }' > ordered.csv
+$SIMPLEDB --db-path "$DB3" create counted --format paged
+$SIMPLEDB --db-path "$DB3" index create counted n --ordered
+$SIMPLEDB --db-path "$DB3" import counted ordered.csv
+$SIMPLEDB --db-path "$DB3" get counted 'n>00100' 'n<=02900' | jq -r .n > counted.out
+wc -l < counted.out
+sort -c counted.out && echo "  sorted"
+echo "- Conditions on two fields (expect error):"
+$SIMPLEDB --db-path "$DB3" get shifts 'day>a' 'who<b' 2>&1 || true
+
+echo ""
+echo "### 33) LSM tables: appends, tombstones, sorted runs and compaction..."
+$SIMPLEDB --db-path "$DB3" create stream --format lsm
+$SIMPLEDB --db-path "$DB3" save stream kind=click page=home
+$SIMPLEDB --db-path "$DB3" save stream kind=view page=about
+$SIMPLEDB --db-path "$DB3" save stream id=1 page=pricing
+$SIMPLEDB --db-path "$DB3" get stream id=1
+$SIMPLEDB --db-path "$DB3" delete stream id=2
+$SIMPLEDB --db-path "$DB3" get stream id=2
+$SIMPLEDB --db-path "$DB3" list stream
+echo "- Batches big enough to flush the memtable to runs, more than a level holds:"
+for b in 1 2 3 4 5; do
+  seq 1 6000 | awk -v b=$b '{ printf "{\"kind\":\"k%d\",\"batch\":\"%d\",\"pad\":\"%040d\"}\n", $1 % 7, b, $1 }' \
+    | $SIMPLEDB --db-path "$DB3" save stream --from-stdin
+done
+$SIMPLEDB --db-path "$DB3" delete stream kind=k3
+$SIMPLEDB --db-path "$DB3" get stream id=12345 --fields id,batch,kind
+$SIMPLEDB --db-path "$DB3" list stream --id-range 29998..30003 --fields id,batch
+$SIMPLEDB --db-path "$DB3" list stream | wc -l
+$SIMPLEDB --db-path "$DB3" agg stream --group-by kind --count | tr '\n' ' '; echo
+echo "- vacuum waits for a background compaction, then merges every run into one:"
+$SIMPLEDB --db-path "$DB3" vacuum stream
+ls "$DB3" | grep -c '^stream\.lsm\.[0-9]'
+$SIMPLEDB --db-path "$DB3" list stream | wc -l
+$SIMPLEDB --db-path "$DB3" get stream id=1
+echo "- compact and index create don't apply (expect errors):"
+$SIMPLEDB --db-path "$DB3" compact stream --columnar 2>&1 || true
+$SIMPLEDB --db-path "$DB3" index create stream kind 2>&1 || true
+
+echo ""
+echo "### 34) A record deleted and saved again before a checkpoint moves to the end..."
+$SIMPLEDB --db-path "$DB3" create redo
+for i in 1 2 3; do $SIMPLEDB --db-path "$DB3" save redo id=$i kind=k$i > /dev/null; done
+$SIMPLEDB --db-path "$DB3" checkpoint > /dev/null
+$SIMPLEDB --db-path "$DB3" delete redo id=1
+$SIMPLEDB --db-path "$DB3" save redo id=1 kind=again > /dev/null
+$SIMPLEDB --db-path "$DB3" delete redo kind=k2
+$SIMPLEDB --db-path "$DB3" save redo id=2 kind=again > /dev/null
+$SIMPLEDB --db-path "$DB3" save redo id=3 kind=updated > /dev/null
+echo "- Before the checkpoint:"
+$SIMPLEDB --db-path "$DB3" list redo
+$SIMPLEDB --db-path "$DB3" get redo kind=again
+echo "- After it, the same order:"
+$SIMPLEDB --db-path "$DB3" checkpoint > /dev/null
+$SIMPLEDB --db-path "$DB3" list redo
+
+echo ""
+echo "### 35) A paged table without an id tree is scanned by readers, rebuilt by writers..."
+$SIMPLEDB --db-path "$DB3" create notree --format paged
+for i in 3 1 2; do $SIMPLEDB --db-path "$DB3" save notree id=$i > /dev/null; done
+rm "$DB3/notree.btree"
+$SIMPLEDB --db-path "$DB3" list notree --id-range 1..2
+ls "$DB3" | grep -c '^notree\.btree$' || true
+$SIMPLEDB --db-path "$DB3" save notree id=4 > /dev/null
+ls "$DB3" | grep '^notree\.btree$'
+$SIMPLEDB --db-path "$DB3" list notree --id-range 2..9
+
+################################################################################
+# Final Checks
 ################################################################################
 
 echo ""
-echo "### 11) Final checks and cleanup hints..."
+echo "### Final checks and cleanup hints..."
 
 echo "- Database directories currently exist at $DB1, $DB2 and $DB3"
 echo "- If you want to remove them, run: rm -rf $DB1 $DB2 $DB3"
-echo "- CSV and JSON files (users.csv, orders.csv, etc.) are also in the current directory."
+echo "- The CSV files of the join example (users.csv, orders.csv, etc.) are also in the current directory."
+rm -f $SCRATCH_FILES
+echo "- Removed the other scratch files of the tests"
 
 
 echo ""